@@ -0,0 +1,216 @@
+//! Throughput benchmarks for the hot paths of cart encoding and decoding.
+//!
+//! Run with `cargo bench --features bench`, results are reported in bytes per second.
+//! Inputs are 1 KB, 64 KB, and 10 MB by default, set `CART_BENCH_LARGE=1` to also run
+//! the 1 GB inputs. Each size is run with compressible text and with random bytes,
+//! which don't compress and so push the most data through the cipher.
+
+use std::hint::black_box;
+use std::io::{Read, Write};
+
+use criterion::{criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+use rc4::KeyInit;
+
+use cart::cart::{pack_stream, unpack_stream, unpack_stream_digested};
+use cart::cipher::{CipherPassthroughIn, CipherPassthroughOut, Rc4, DEFAULT_RC4_KEY};
+use cart::digesters::{default_digesters, Digester};
+use cart::digesters::{LengthDigest, MD5Digest, SHA1Digest, SHA256Digest, SHA512Digest};
+use cart::{cart_free_pack_result, cart_free_unpack_result, cart_pack_data_default, cart_unpack_data};
+
+const KB: usize = 1024;
+const MB: usize = 1024 * KB;
+const GB: usize = 1024 * MB;
+const CUSTOM_KEY: &[u8; 16] = b"0123456789abcdef";
+
+
+/// The input sizes to run, along with a label for each.
+fn sizes() -> Vec<(usize, &'static str)> {
+    let mut sizes = vec![(KB, "1KB"), (64 * KB, "64KB"), (10 * MB, "10MB")];
+    if std::env::var_os("CART_BENCH_LARGE").is_some() {
+        sizes.push((GB, "1GB"));
+    }
+    sizes
+}
+
+/// Text that compresses about as well as source code or logs.
+fn compressible(size: usize) -> Vec<u8> {
+    let source = include_bytes!("../src/cart.rs");
+    source.iter().copied().cycle().take(size).collect()
+}
+
+/// Bytes that deflate can't compress, from a fixed seed so every run sees the same input.
+fn random(size: usize) -> Vec<u8> {
+    let mut state: u64 = 0x9e3779b97f4a7c15;
+    let mut data = Vec::with_capacity(size + 8);
+    while data.len() < size {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        data.extend_from_slice(&state.wrapping_mul(0x2545f4914f6cdd1d).to_le_bytes());
+    }
+    data.truncate(size);
+    data
+}
+
+/// Every input to run, labeled by kind and size.
+fn inputs() -> Vec<(String, Vec<u8>)> {
+    let mut inputs = vec![];
+    for (size, label) in sizes() {
+        inputs.push((format!("compressible/{label}"), compressible(size)));
+        inputs.push((format!("random/{label}"), random(size)));
+    }
+    inputs
+}
+
+/// Fewer samples for the larger inputs, so a full run finishes in reasonable time.
+fn sample_size(size: usize) -> usize {
+    if size >= 10 * MB { 10 } else { 50 }
+}
+
+fn key(custom: bool) -> Option<Vec<u8>> {
+    if custom { Some(CUSTOM_KEY.to_vec()) } else { None }
+}
+
+fn digesters(digests: bool) -> Vec<Box<dyn Digester>> {
+    if digests { default_digesters() } else { vec![] }
+}
+
+fn pack(data: &[u8], digests: bool, custom_key: bool) -> Vec<u8> {
+    let mut output = Vec::with_capacity(data.len() + KB);
+    pack_stream(data, &mut output, None, None, digesters(digests), key(custom_key)).unwrap();
+    output
+}
+
+fn bench_pack(c: &mut Criterion) {
+    let mut group = c.benchmark_group("pack_stream");
+    for (label, data) in inputs() {
+        group.throughput(Throughput::Bytes(data.len() as u64));
+        group.sample_size(sample_size(data.len()));
+        for digests in [false, true] {
+            for custom_key in [false, true] {
+                let name = format!("{}/{}", if digests { "digests" } else { "no_digests" },
+                    if custom_key { "custom_key" } else { "default_key" });
+                group.bench_with_input(BenchmarkId::new(name, &label), &data, |b, data| {
+                    b.iter(|| black_box(pack(data, digests, custom_key)))
+                });
+            }
+        }
+    }
+    group.finish();
+}
+
+fn bench_unpack(c: &mut Criterion) {
+    let mut group = c.benchmark_group("unpack_stream");
+    for (label, data) in inputs() {
+        // Throughput is measured against the decoded size, as it is for packing
+        group.throughput(Throughput::Bytes(data.len() as u64));
+        group.sample_size(sample_size(data.len()));
+        for custom_key in [false, true] {
+            let packed = pack(&data, true, custom_key);
+            let key_name = if custom_key { "custom_key" } else { "default_key" };
+
+            group.bench_with_input(BenchmarkId::new(format!("no_digests/{key_name}"), &label), &packed, |b, packed| {
+                b.iter(|| {
+                    let mut output = Vec::with_capacity(data.len());
+                    unpack_stream(packed.as_slice(), &mut output, key(custom_key)).unwrap();
+                    black_box(output)
+                })
+            });
+            group.bench_with_input(BenchmarkId::new(format!("digests/{key_name}"), &label), &packed, |b, packed| {
+                b.iter(|| {
+                    let mut output = Vec::with_capacity(data.len());
+                    let results = unpack_stream_digested(packed.as_slice(), &mut output, default_digesters(),
+                        key(custom_key)).unwrap();
+                    black_box((output, results))
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+fn bench_cipher(c: &mut Criterion) {
+    let mut group = c.benchmark_group("cipher");
+    for (size, label) in sizes() {
+        let data = random(size);
+        group.throughput(Throughput::Bytes(size as u64));
+        group.sample_size(sample_size(size));
+
+        group.bench_with_input(BenchmarkId::new("passthrough_in", label), &data, |b, data| {
+            let mut buffer = vec![0u8; 64 * KB];
+            b.iter(|| {
+                let cipher = Rc4::new_from_slice(&DEFAULT_RC4_KEY).unwrap();
+                let mut reader = CipherPassthroughIn::new(data.as_slice(), cipher);
+                while reader.read(&mut buffer).unwrap() > 0 {}
+                black_box(&buffer);
+            })
+        });
+        group.bench_with_input(BenchmarkId::new("passthrough_out", label), &data, |b, data| {
+            let key = DEFAULT_RC4_KEY.to_vec();
+            b.iter_batched_ref(|| Vec::with_capacity(data.len()), |output| {
+                let mut writer = CipherPassthroughOut::new(output, &key).unwrap();
+                for block in data.chunks(64 * KB) {
+                    writer.write_all(block).unwrap();
+                }
+            }, BatchSize::LargeInput)
+        });
+    }
+    group.finish();
+}
+
+fn bench_digests(c: &mut Criterion) {
+    let digests: [(&str, fn() -> Box<dyn Digester>); 5] = [
+        ("md5", || Box::new(MD5Digest::new())),
+        ("sha1", || Box::new(SHA1Digest::new())),
+        ("sha256", || Box::new(SHA256Digest::new())),
+        ("sha512", || Box::new(SHA512Digest::new())),
+        ("length", || Box::new(LengthDigest::new())),
+    ];
+
+    let mut group = c.benchmark_group("digest");
+    for (size, label) in sizes() {
+        let data = random(size);
+        group.throughput(Throughput::Bytes(size as u64));
+        group.sample_size(sample_size(size));
+        for (name, new_digest) in digests {
+            group.bench_with_input(BenchmarkId::new(name, label), &data, |b, data| {
+                b.iter(|| {
+                    let mut digest = new_digest();
+                    for block in data.chunks(64 * KB) {
+                        digest.update(block).unwrap();
+                    }
+                    black_box(digest.finish())
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+fn bench_c_api(c: &mut Criterion) {
+    let mut group = c.benchmark_group("c_api");
+    for (label, data) in inputs() {
+        group.throughput(Throughput::Bytes(data.len() as u64));
+        group.sample_size(sample_size(data.len()));
+
+        group.bench_with_input(BenchmarkId::new("cart_pack_data_default", &label), &data, |b, data| {
+            b.iter(|| {
+                let packed = cart_pack_data_default(data.as_ptr() as *const std::ffi::c_char, data.len(), std::ptr::null());
+                cart_free_pack_result(black_box(packed));
+            })
+        });
+
+        let packed = pack(&data, true, false);
+        group.bench_with_input(BenchmarkId::new("cart_unpack_data", &label), &packed, |b, packed| {
+            b.iter(|| {
+                let unpacked = cart_unpack_data(packed.as_ptr() as *const std::ffi::c_char, packed.len());
+                cart_free_unpack_result(black_box(unpacked));
+            })
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_pack, bench_unpack, bench_cipher, bench_digests, bench_c_api);
+criterion_main!(benches);
@@ -0,0 +1,140 @@
+//! Encoding and decoding for tokio's asynchronous streams.
+//!
+//! These work like [pack_stream](crate::cart::pack_stream) and [unpack_stream](crate::cart::unpack_stream),
+//! awaiting the streams a block at a time instead of blocking a thread on them.
+//! Each block is compressed or decompressed on the task polling the future, they are
+//! small enough that this doesn't hold up the executor for long. Decoding writes out at
+//! most a block of output at a time however much the data expands. They are built on
+//! the incremental [CartEncoder] and [CartDecoder].
+//! These functions are only available when the `async` feature is enabled.
+
+use anyhow::Context;
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+use crate::cart::{JsonMap, PackOptions, UnpackOptions, BLOCK_SIZE};
+use crate::digesters::Digester;
+use crate::push::{CartDecoder, CartEncoder};
+
+
+/// Encoding function for cart format reading from and writing to asynchronous streams.
+pub async fn pack_stream_async<IN, OUT>(mut istream: IN, mut ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+where
+    IN: AsyncRead + Unpin,
+    OUT: AsyncWrite + Unpin,
+{
+    let mut encoder = CartEncoder::new(optional_header, digesters, rc4_key_override, &PackOptions::default())?;
+    let mut buffer = vec![0u8; BLOCK_SIZE];
+    loop {
+        ostream.write_all(encoder.output()).await?;
+        encoder.consume(encoder.output().len());
+
+        let bytes_read = istream.read(&mut buffer).await?;
+        if bytes_read == 0 {
+            break
+        }
+        encoder.write(&buffer[0..bytes_read])?;
+    }
+
+    encoder.finish(optional_footer)?;
+    ostream.write_all(encoder.output()).await?;
+    ostream.flush().await?;
+    return Ok(())
+}
+
+/// Decode function for cart formatted data reading from and writing to asynchronous streams.
+pub async fn unpack_stream_async<IN, OUT>(istream: IN, ostream: OUT,
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+where
+    IN: AsyncRead + Unpin,
+    OUT: AsyncWrite + Unpin,
+{
+    unpack_stream_async_ex(istream, ostream, rc4_key_override, &UnpackOptions::default()).await
+}
+
+/// Decode function for asynchronous streams that stops when the output grows past the given limits.
+pub async fn unpack_stream_async_ex<IN, OUT>(mut istream: IN, mut ostream: OUT,
+    rc4_key_override: Option<Vec<u8>>, options: &UnpackOptions) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+where
+    IN: AsyncRead + Unpin,
+    OUT: AsyncWrite + Unpin,
+{
+    let mut decoder = CartDecoder::new(rc4_key_override).with_limits(options);
+    let mut buffer = vec![0u8; BLOCK_SIZE];
+    loop {
+        let size = istream.read(&mut buffer).await.context("reading from compressed stream")?;
+        if size == 0 {
+            break
+        }
+        decoder.feed(&buffer[0..size])?;
+        while !decoder.output().is_empty() {
+            ostream.write_all(decoder.output()).await.context("writing output")?;
+            decoder.consume(decoder.output().len());
+        }
+    }
+
+    let optional_footer = decoder.finish()?;
+    ostream.flush().await?;
+    let optional_header = decoder.header().cloned().unwrap_or_default();
+    return Ok((optional_header, optional_footer))
+}
+
+
+#[cfg(test)]
+mod tests {
+    use crate::cart::{JsonMap, UnpackOptions, OutputLimitExceeded, BLOCK_SIZE, pack_stream, unpack_stream};
+    use crate::digesters::default_digesters;
+
+    use super::{pack_stream_async, unpack_stream_async, unpack_stream_async_ex};
+
+    fn block_on<F: std::future::Future>(future: F) -> F::Output {
+        tokio::runtime::Builder::new_current_thread().build().unwrap().block_on(future)
+    }
+
+    #[test]
+    fn round_trip() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+
+        for data in [&raw_data[..], &raw_data[0..10], &[]] {
+            // Output should match the blocking encoder
+            let mut expected = vec![];
+            pack_stream(data, &mut expected, Some(original_header.clone()), None, default_digesters(), None).unwrap();
+            let mut packed = vec![];
+            block_on(pack_stream_async(data, &mut packed, Some(original_header.clone()), None,
+                default_digesters(), None)).unwrap();
+            assert_eq!(packed, expected);
+
+            let mut expected_output = vec![];
+            let expected_meta = unpack_stream(packed.as_slice(), &mut expected_output, None).unwrap();
+            let mut output = vec![];
+            let meta = block_on(unpack_stream_async(packed.as_slice(), &mut output, None)).unwrap();
+            assert_eq!(output, data);
+            assert_eq!(meta, expected_meta);
+
+            // Cut short data should fail
+            let mut output = vec![];
+            assert!(block_on(unpack_stream_async(&packed[0..packed.len() - 1], &mut output, None)).is_err());
+            assert!(block_on(unpack_stream_async(&packed[0..20], &mut output, None)).is_err());
+        }
+    }
+
+    #[test]
+    fn output_limit() {
+        let raw_data = vec![0u8; 16 * BLOCK_SIZE];
+        let mut packed = vec![];
+        pack_stream(raw_data.as_slice(), &mut packed, None, None, default_digesters(), None).unwrap();
+
+        let mut output = vec![];
+        block_on(unpack_stream_async(packed.as_slice(), &mut output, None)).unwrap();
+        assert!(output == raw_data);
+
+        let options = UnpackOptions { max_output_size: 2 * BLOCK_SIZE as u64, ..Default::default() };
+        let mut output = vec![];
+        let err = block_on(unpack_stream_async_ex(packed.as_slice(), &mut output, None, &options)).unwrap_err();
+        assert!(err.downcast_ref::<OutputLimitExceeded>().is_some());
+        assert!(output.len() <= 2 * BLOCK_SIZE);
+    }
+}
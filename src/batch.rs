@@ -0,0 +1,121 @@
+//! A bounded pool of worker threads for processing batches of independent items.
+//!
+//! Workers take the next unclaimed item from a shared counter as they finish each one,
+//! so a few large items don't hold up the rest of the batch. Each worker keeps its own
+//! [CartContext] so per file setup is only paid once per thread.
+
+use std::panic::AssertUnwindSafe;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use crate::context::CartContext;
+
+
+/// Run a job over every item using up to the given number of threads, zero uses all available cores.
+///
+/// The results are returned in the same order as the items. An item's result is
+/// None if the job panicked while processing it.
+pub (crate) fn run_batch<T, R, F>(items: &[T], threads: usize, job: F) -> Vec<Option<R>>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&mut CartContext, &T) -> R + Sync,
+{
+    let threads = if threads == 0 {
+        std::thread::available_parallelism().map(|count| count.get()).unwrap_or(1)
+    } else {
+        threads
+    };
+    let threads = threads.min(items.len()).max(1);
+
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<Option<R>> = items.iter().map(|_| None).collect();
+
+    std::thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads).map(|_| scope.spawn(|| {
+            let mut context = CartContext::new();
+            let mut finished = vec![];
+            loop {
+                let index = next.fetch_add(1, Ordering::Relaxed);
+                if index >= items.len() {
+                    return finished
+                }
+                let result = std::panic::catch_unwind(AssertUnwindSafe(|| job(&mut context, &items[index])));
+                if result.is_err() {
+                    // Don't trust a context left part way through a call
+                    context = CartContext::new();
+                }
+                finished.push((index, result.ok()));
+            }
+        })).collect();
+
+        for worker in workers {
+            if let Ok(finished) = worker.join() {
+                for (index, result) in finished {
+                    results[index] = result;
+                }
+            }
+        }
+    });
+
+    return results
+}
+
+/// Run a job over groups of up to `group_size` items, for work that is faster done several items at a time.
+///
+/// The job returns a result for each item in the group it is given. The results are
+/// returned in the same order as the items. Every result of a group is None if the job
+/// panicked while processing it.
+pub (crate) fn run_batch_grouped<T, R, F>(items: &[T], group_size: usize, threads: usize, job: F) -> Vec<Option<R>>
+where
+    T: Sync,
+    R: Send,
+    F: Fn(&mut CartContext, &[T]) -> Vec<R> + Sync,
+{
+    let groups: Vec<&[T]> = items.chunks(group_size.max(1)).collect();
+    let outcomes = run_batch(&groups, threads, |context, group| job(context, group));
+
+    let mut results = Vec::with_capacity(items.len());
+    for (group, outcome) in groups.iter().zip(outcomes) {
+        match outcome {
+            Some(outcome) if outcome.len() == group.len() => results.extend(outcome.into_iter().map(Some)),
+            _ => results.extend(group.iter().map(|_| None)),
+        }
+    }
+    return results
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::{run_batch, run_batch_grouped};
+
+    #[test]
+    fn ordering() {
+        let items: Vec<usize> = (0..1000).collect();
+        for threads in [0, 1, 3, 2000] {
+            let results = run_batch(&items, threads, |_, item| item * 2);
+            let results: Vec<usize> = results.into_iter().map(Option::unwrap).collect();
+            assert_eq!(results, items.iter().map(|item| item * 2).collect::<Vec<_>>());
+        }
+        assert!(run_batch(&Vec::<usize>::new(), 0, |_, item| *item).is_empty());
+    }
+
+    #[test]
+    fn grouped() {
+        let items: Vec<usize> = (0..103).collect();
+        let results = run_batch_grouped(&items, 4, 3, |_, group| {
+            assert!(group.len() <= 4);
+            if group.contains(&50) {
+                panic!("bad group")
+            }
+            group.iter().map(|item| item * 2).collect()
+        });
+        for (item, result) in items.iter().zip(results) {
+            if (48..52).contains(item) {
+                assert_eq!(result, None);
+            } else {
+                assert_eq!(result, Some(item * 2));
+            }
+        }
+    }
+}
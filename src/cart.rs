@@ -1,10 +1,16 @@
-use std::io::{Write, Read};
+use std::io::{Write, Read, Seek, SeekFrom, IoSlice};
 use anyhow::Context;
 use bytes::{BufMut, Buf};
 use rc4::{KeyInit, StreamCipher};
 
-use crate::cipher::{CipherPassthroughIn, CipherPassthroughOut, DEFAULT_RC4_KEY, Rc4};
-use crate::digesters::Digester;
+use crate::cipher::{CipherEncoder, CipherPassthroughIn, CipherTrailingIn, DEFAULT_RC4_KEY, Rc4};
+use crate::deflate::MAX_DEFLATE_RATIO;
+use crate::digesters::{Digester, DigestWriter, digest_results};
+use crate::seek::add_index;
+use crate::stats::{count, record, record_io, Stage};
+
+pub use crate::pipeline::{pack_stream_pipelined, pack_stream_parallel};
+use crate::pipeline::pack_pipeline;
 
 /// Alias for a serde mapping cart will accept for metadata.
 pub type JsonMap = serde_json::Map<String, serde_json::Value>;
@@ -12,80 +18,272 @@ pub type JsonMap = serde_json::Map<String, serde_json::Value>;
 
 // Constants regarding header and footer encoding
 const MAJOR_VERSION: i16 = 1;
-const MANDATORY_HEADER_SIZE: usize = 38;
-const MANDATORY_FOOTER_SIZE: usize = 8 * 3 + 4;
+pub (crate) const MANDATORY_HEADER_SIZE: usize = 38;
+pub (crate) const MANDATORY_FOOTER_SIZE: usize = 8 * 3 + 4;
 pub (crate) const BLOCK_SIZE: usize = 64 * 1024;
+/// Buffer size used where the extent of the data is known and large reads or writes are safe.
+pub (crate) const LARGE_BLOCK_SIZE: usize = 1024 * 1024;
+/// The zlib compression level used unless another is requested.
+pub const DEFAULT_COMPRESSION_LEVEL: u32 = 1;
+/// The highest zlib compression level.
+pub const MAX_COMPRESSION_LEVEL: u32 = 9;
 const HEADER_MAGIC: &[u8; 4] = b"CART";
 const FOOTER_MAGIC: &[u8; 4] = b"TRAC";
 const RESERVED: u64 = 0;
+/// Room set aside for optional metadata when reserving output for a buffer being encoded.
+pub (crate) const METADATA_RESERVE: usize = 4 * 1024;
+
+
+/// Options controlling how cart data is encoded.
+#[derive(Clone, Debug)]
+pub struct PackOptions {
+    /// The zlib compression level, from 0 (store without compressing) to 9.
+    pub compression_level: u32,
+    /// Run reading, digesting, and compression on separate threads, see [pack_stream_pipelined].
+    pub pipelined: bool,
+    /// Deflate in parallel on this many threads, see [pack_stream_parallel].
+    /// Zero uses a single compressor.
+    pub compress_threads: usize,
+    /// Record a seek index with a point every this many decoded bytes, see [crate::seek].
+    /// Zero writes no index. Only the single threaded encoder can write an index.
+    pub index_interval: u64,
+}
+
+impl Default for PackOptions {
+    fn default() -> Self {
+        Self {
+            compression_level: DEFAULT_COMPRESSION_LEVEL,
+            pipelined: false,
+            compress_threads: 0,
+            index_interval: 0,
+        }
+    }
+}
+
+impl PackOptions {
+    /// Check the options and convert the compression level for the deflate backend.
+    pub (crate) fn compression(&self) -> anyhow::Result<flate2::Compression> {
+        if self.compression_level > MAX_COMPRESSION_LEVEL {
+            return Err(anyhow::anyhow!("Compression level must be between 0 and {MAX_COMPRESSION_LEVEL}"))
+        }
+        if self.index_interval > 0 && (self.pipelined || self.compress_threads > 0) {
+            return Err(anyhow::anyhow!("A seek index can only be written by the single threaded encoder"))
+        }
+        return Ok(flate2::Compression::new(self.compression_level))
+    }
+}
+
+/// Options limiting how much output decoding cart data may produce.
+///
+/// These guard against small inputs that expand to much more data than the caller can hold.
+#[derive(Clone, Debug, Default)]
+pub struct UnpackOptions {
+    /// The most bytes that may be decoded, zero for no limit.
+    pub max_output_size: u64,
+    /// The most bytes that may be decoded for each compressed byte read, zero for no limit.
+    /// One block of output is always allowed so that very short bodies aren't rejected.
+    pub max_ratio: u64,
+}
+
+impl UnpackOptions {
+    /// Check the decoded size so far against the limits, before that output is written.
+    pub (crate) fn check(&self, total_in: u64, total_out: u64) -> Result<(), OutputLimitExceeded> {
+        if self.max_output_size > 0 && total_out > self.max_output_size {
+            return Err(OutputLimitExceeded{limit: self.max_output_size})
+        }
+        if self.max_ratio > 0 {
+            let limit = self.max_ratio.saturating_mul(total_in).max(BLOCK_SIZE as u64);
+            if total_out > limit {
+                return Err(OutputLimitExceeded{limit})
+            }
+        }
+        return Ok(())
+    }
+}
 
 
 /// Encoding function for cart format.
-pub fn pack_stream<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
+pub fn pack_stream<IN: Read, OUT: Write>(istream: IN, ostream: OUT,
     optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
-    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
 {
-    let (rc4_key, key_override) = match rc4_key_override {
-        Some(key) => (key, true),
-        None => (DEFAULT_RC4_KEY.to_vec(), false),
-    };
+    pack_stream_serial(istream, ostream, encode_metadata(optional_header)?, optional_footer, digesters,
+        rc4_key_override, flate2::Compression::new(DEFAULT_COMPRESSION_LEVEL), 0)
+}
 
-    // Build the optional header first if necessary. We need to know
-    // it's size before serializing the mandatory header.
-    let mut opt_header_len: u64 = 0;
-    let mut opt_header_crypt = None;
-    let mut pos: u64 = 0;
+/// Encoding function for cart format with extended options.
+///
+/// Which encoder is used depends on the threading options set, see [PackOptions].
+pub fn pack_stream_ex<IN: Read + Send, OUT: Write>(istream: IN, ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<()>
+{
+    pack_stream_raw(istream, ostream, encode_metadata(optional_header)?, optional_footer, digesters,
+        rc4_key_override, options)
+}
 
-    if let Some(header) = optional_header {
-        // JSON encode
-        let mut opt_header_buffer = serde_json::to_vec(&header)?;
+/// Encoding function for cart format taking a header that is already JSON encoded.
+///
+/// This works like [pack_stream_ex], with the header bytes enciphered as given rather than
+/// serialized from a map. The bytes are not checked, see [check_metadata].
+pub fn pack_stream_raw<IN: Read + Send, OUT: Write>(istream: IN, ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<()>
+{
+    let level = options.compression()?;
+    if options.compress_threads > 0 {
+        pack_pipeline(istream, ostream, optional_header, optional_footer, digesters,
+            rc4_key_override, level, Some(options.compress_threads))
+    } else if options.pipelined {
+        pack_pipeline(istream, ostream, optional_header, optional_footer, digesters,
+            rc4_key_override, level, None)
+    } else {
+        pack_stream_serial(istream, ostream, optional_header, optional_footer, digesters,
+            rc4_key_override, level, options.index_interval)
+    }
+}
 
-        // RC4
-        let mut cipher = Rc4::new_from_slice(&rc4_key).context("Bad RC4 Key")?;
-        cipher.try_apply_keystream(&mut opt_header_buffer)?;
+/// Encode a buffer held in memory with extended options.
+///
+/// See [pack_slice] for how the buffer is encoded. The output is reserved up front
+/// for the largest the body could compress to, so it isn't grown and copied while encoding.
+/// When built with the `libdeflate` feature the whole buffer is compressed in a single
+/// call, unless a seek index or threading is requested.
+pub fn pack_data(data: &[u8], optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<Vec<u8>>
+{
+    pack_data_raw(data, encode_metadata(optional_header)?, optional_footer, digesters,
+        rc4_key_override, options)
+}
 
-        opt_header_len = opt_header_buffer.len() as u64;
-        opt_header_crypt = Some(opt_header_buffer);
-    };
+/// Encode a buffer held in memory taking a header that is already JSON encoded.
+///
+/// This works like [pack_data] with the header handled as by [pack_stream_raw].
+pub fn pack_data_raw(data: &[u8], optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<Vec<u8>>
+{
+    let mut output = Vec::with_capacity(MANDATORY_HEADER_SIZE + crate::deflate::zlib_bound(data.len())
+        + MANDATORY_FOOTER_SIZE + METADATA_RESERVE);
+
+    // Compress straight into the output rather than through a separate body buffer
+    #[cfg(feature = "libdeflate")]
+    if !options.pipelined && options.compress_threads == 0 && options.index_interval == 0 {
+        let level = options.compression()?;
+        pack_data_whole(data, &mut output, optional_header, optional_footer, digesters,
+            rc4_key_override, level.level())?;
+        return Ok(output)
+    }
 
-    // Write the mandatory header
-    ostream.write_all(&{
-        // Build the header in a buffer first
-        let mut header = vec![];
-        header.reserve(MANDATORY_HEADER_SIZE);
-        header.put_slice(HEADER_MAGIC); // MAGIC
-        header.put_i16_le(MAJOR_VERSION); // MAJOR VERSION
-        header.put_u64_le(RESERVED); // Reserved
-        if key_override {
-            header.put_bytes(0, 16);
-        } else {
-            header.put_slice(&rc4_key);
-        }
-        header.put_u64_le(opt_header_len); // optional header length
+    pack_slice_raw(data, &mut output, optional_header, optional_footer, digesters,
+        rc4_key_override, options)?;
+    return Ok(output)
+}
 
-        // Check the header, and write it
-        pos += header.len() as u64;
-        if header.len() != MANDATORY_HEADER_SIZE {
-            return Err(anyhow::anyhow!("Header encoding error"))
+/// Encode a buffer held in memory, such as a mapped file, to an output stream.
+///
+/// Without threading options the buffer is passed to the digests and compressor
+/// directly rather than copied through an intermediate read buffer. The body is
+/// streamed to the output a block at a time, so a large mapped input isn't
+/// compressed into memory first. [pack_data] is the whole-buffer path.
+pub fn pack_slice<OUT: Write>(data: &[u8], ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<()>
+{
+    pack_slice_raw(data, ostream, encode_metadata(optional_header)?, optional_footer, digesters,
+        rc4_key_override, options)
+}
+
+/// Encode a buffer held in memory to an output stream taking a header that is already JSON encoded.
+///
+/// This works like [pack_slice] with the header handled as by [pack_stream_raw].
+pub fn pack_slice_raw<OUT: Write>(data: &[u8], ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    options: &PackOptions) -> anyhow::Result<()>
+{
+    let level = options.compression()?;
+    if options.pipelined || options.compress_threads > 0 {
+        return pack_stream_raw(data, ostream, optional_header, optional_footer, digesters,
+            rc4_key_override, options)
+    }
+
+    return pack_slice_serial(data, ostream, optional_header, optional_footer, digesters,
+        rc4_key_override, level, options.index_interval);
+}
+
+/// Encode a buffer on the calling thread, handing it to each stage a block at a time.
+fn pack_slice_serial<OUT: Write>(data: &[u8], mut ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    level: flate2::Compression, index_interval: u64) -> anyhow::Result<()>
+{
+    let (rc4_key, key_override) = select_key(rc4_key_override);
+    let mut pos = pack_raw_header(&mut ostream, &rc4_key, key_override, optional_header)?;
+
+    let mut bz = CipherEncoder::new(&mut ostream, &rc4_key, level)?.with_index(index_interval);
+
+    // Keep each block in cache while it is digested and compressed
+    count(Stage::Read, data.len());
+    for block in data.chunks(BLOCK_SIZE) {
+        for digest in digesters.iter_mut() {
+            digest.update(block)?;
         }
-        header
-    })?;
+        bz.write_all(block)?;
+    }
+    let index = bz.take_index();
+    pos += bz.finish()?;
 
-    // Write optional header
-    if let Some(buffer) = opt_header_crypt {
-        pos += buffer.len() as u64;
-        ostream.write_all(&buffer)?;
-    };
+    let optional_footer = add_index(finish_digests(optional_footer, &mut digesters), index);
+    pack_footer(&mut ostream, &rc4_key, pos, optional_footer)
+}
 
-    // Create a zlib processor which will write its output to the passthrough
-    // processor which will rc4 it before writing to the output stream
-    let mut bz = flate2::write::ZlibEncoder::new(
-        CipherPassthroughOut::new(&mut ostream, &rc4_key)?,
-        flate2::Compression::fast());
+/// Encode a buffer as a single compressor call, appending the cart to the output.
+///
+/// The body is compressed and enciphered in place in the output buffer.
+#[cfg(feature = "libdeflate")]
+fn pack_data_whole(data: &[u8], output: &mut Vec<u8>,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    level: u32) -> anyhow::Result<()>
+{
+    let (rc4_key, key_override) = select_key(rc4_key_override);
+    let pos = pack_raw_header(&mut *output, &rc4_key, key_override, optional_header)?;
+
+    count(Stage::Read, data.len());
+    for digest in digesters.iter_mut() {
+        digest.update(data)?;
+    }
+
+    let body_start = output.len();
+    let size = record(Stage::Deflate, data.len(), || crate::deflate::zlib_compress_whole(data, level, output))?;
+    let mut cipher = Rc4::new_from_slice(&rc4_key).context("Bad RC4 Key")?;
+    record(Stage::Cipher, size, || cipher.try_apply_keystream(&mut output[body_start..]))?;
+    count(Stage::Write, size);
+
+    let optional_footer = finish_digests(optional_footer, &mut digesters);
+    pack_footer(&mut *output, &rc4_key, pos + size as u64, optional_footer)
+}
+
+/// Encode on the calling thread with a single compressor.
+fn pack_stream_serial<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    level: flate2::Compression, index_interval: u64) -> anyhow::Result<()>
+{
+    let (rc4_key, key_override) = select_key(rc4_key_override);
+    let mut pos = pack_raw_header(&mut ostream, &rc4_key, key_override, optional_header)?;
+
+    // Create a zlib processor which will rc4 its output before writing to the output stream
+    let mut bz = CipherEncoder::new(&mut ostream, &rc4_key, level)?.with_index(index_interval);
     let mut buffer = vec![0u8; BLOCK_SIZE];
     loop {
         // read the next block from input
-        let bytes_read = istream.read(&mut buffer)?;
+        let bytes_read = record_io(Stage::Read, || istream.read(&mut buffer))?;
         if bytes_read == 0 {
             break
         }
@@ -100,49 +298,160 @@ pub fn pack_stream<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
     }
 
     // Finish any remaining data in compressor
-    pos += bz.total_out();
-    bz.finish()?;
+    let index = bz.take_index();
+    pos += bz.finish()?;
 
-    // insert any requests digests into the optional footer.
-    let optional_footer = if digesters.is_empty() {
+    let optional_footer = add_index(finish_digests(optional_footer, &mut digesters), index);
+    pack_footer(&mut ostream, &rc4_key, pos, optional_footer)
+}
+
+/// Pick the rc4 key used for encoding and whether it is an override that should be left out of the header.
+pub (crate) fn select_key(rc4_key_override: Option<Vec<u8>>) -> (Vec<u8>, bool) {
+    match rc4_key_override {
+        Some(key) => (key, true),
+        None => (DEFAULT_RC4_KEY.to_vec(), false),
+    }
+}
+
+/// JSON encode optional metadata.
+pub (crate) fn encode_metadata(metadata: Option<JsonMap>) -> anyhow::Result<Option<Vec<u8>>> {
+    match metadata {
+        Some(metadata) => Ok(Some(serde_json::to_vec(&metadata)?)),
+        None => Ok(None),
+    }
+}
+
+/// Check that JSON encoded metadata is a single object, without building a map of it.
+pub fn check_metadata(metadata: &[u8]) -> anyhow::Result<()> {
+    let value: &serde_json::value::RawValue = serde_json::from_slice(metadata)?;
+    if !value.get().starts_with('{') {
+        return Err(anyhow::anyhow!("Metadata must be a JSON object"))
+    }
+    return Ok(())
+}
+
+/// Encode and write the mandatory and optional headers.
+///
+/// This returns how many bytes have been written.
+pub (crate) fn pack_header<OUT: Write>(ostream: OUT, rc4_key: &[u8], key_override: bool,
+    optional_header: Option<JsonMap>) -> anyhow::Result<u64>
+{
+    pack_raw_header(ostream, rc4_key, key_override, encode_metadata(optional_header)?)
+}
+
+/// Encode and write the mandatory header and an optional header that is already JSON encoded.
+///
+/// This returns how many bytes have been written.
+pub (crate) fn pack_raw_header<OUT: Write>(mut ostream: OUT, rc4_key: &[u8], key_override: bool,
+    optional_header: Option<Vec<u8>>) -> anyhow::Result<u64>
+{
+    // Build the optional header first if necessary. We need to know
+    // it's size before serializing the mandatory header.
+    let mut opt_header_len: u64 = 0;
+    let mut opt_header_crypt = None;
+    let mut pos: u64 = 0;
+
+    if let Some(mut opt_header_buffer) = optional_header {
+        // RC4
+        let mut cipher = Rc4::new_from_slice(rc4_key).context("Bad RC4 Key")?;
+        cipher.try_apply_keystream(&mut opt_header_buffer)?;
+
+        opt_header_len = opt_header_buffer.len() as u64;
+        opt_header_crypt = Some(opt_header_buffer);
+    };
+
+    // Build the mandatory header on the stack
+    if rc4_key.len() != DEFAULT_RC4_KEY.len() {
+        return Err(anyhow::anyhow!("Header encoding error"))
+    }
+    let mut header = [0u8; MANDATORY_HEADER_SIZE];
+    {
+        let mut cursor = &mut header[..];
+        cursor.put_slice(HEADER_MAGIC); // MAGIC
+        cursor.put_i16_le(MAJOR_VERSION); // MAJOR VERSION
+        cursor.put_u64_le(RESERVED); // Reserved
+        if key_override {
+            cursor.put_bytes(0, 16);
+        } else {
+            cursor.put_slice(rc4_key);
+        }
+        cursor.put_u64_le(opt_header_len); // optional header length
+    }
+    pos += header.len() as u64;
+
+    // Write both headers together
+    let optional = opt_header_crypt.unwrap_or_default();
+    pos += optional.len() as u64;
+    write_all_vectored(&mut ostream, &mut [IoSlice::new(&header), IoSlice::new(&optional)])?;
+
+    return Ok(pos)
+}
+
+/// Write every slice to the output, in as few calls as the output allows.
+///
+/// Outputs that support it, such as files, get a single vectored write.
+pub (crate) fn write_all_vectored<OUT: Write>(ostream: &mut OUT, mut slices: &mut [IoSlice<'_>]) -> std::io::Result<()> {
+    IoSlice::advance_slices(&mut slices, 0);
+    while !slices.is_empty() {
+        match ostream.write_vectored(slices) {
+            Ok(0) => return Err(std::io::ErrorKind::WriteZero.into()),
+            Ok(size) => IoSlice::advance_slices(&mut slices, size),
+            Err(err) if err.kind() == std::io::ErrorKind::Interrupted => {},
+            Err(err) => return Err(err),
+        }
+    }
+    return Ok(())
+}
+
+/// Insert the results of any digests into the optional footer.
+///
+/// Each digester is reset as it is finished, so it can be used again.
+pub (crate) fn finish_digests(optional_footer: Option<JsonMap>, digesters: &mut [Box<dyn Digester>]) -> Option<JsonMap> {
+    if digesters.is_empty() {
         optional_footer
     } else {
         let mut optional_footer = optional_footer.unwrap_or_default();
-        for mut digest in digesters {
-            optional_footer.insert(digest.name(), serde_json::Value::String(digest.finish()));
-        }
+        optional_footer.extend(digest_results(digesters));
         Some(optional_footer)
-    };
+    }
+}
 
-    // Write the optional footer if found
-    let (footer_pos, footer_len) = if let Some(footer) = optional_footer {
-        let opt_footer_pos = pos;
-        let mut opt_footer_buffer = serde_json::to_vec(&footer)?;
-        let mut cipher = Rc4::new_from_slice(&rc4_key)?;
+/// Encode and write the optional and mandatory footers.
+///
+/// The position given should be the number of bytes written before the footer.
+pub (crate) fn pack_footer<OUT: Write>(ostream: OUT, rc4_key: &[u8], pos: u64,
+    optional_footer: Option<JsonMap>) -> anyhow::Result<()>
+{
+    pack_raw_footer(ostream, rc4_key, pos, encode_metadata(optional_footer)?)
+}
+
+/// Encode and write an optional footer that is already JSON encoded, and the mandatory footer.
+///
+/// The position given should be the number of bytes written before the footer.
+fn pack_raw_footer<OUT: Write>(mut ostream: OUT, rc4_key: &[u8], pos: u64,
+    optional_footer: Option<Vec<u8>>) -> anyhow::Result<()>
+{
+    // Encode the optional footer if found
+    let (footer_pos, opt_footer_buffer) = if let Some(mut opt_footer_buffer) = optional_footer {
+        let mut cipher = Rc4::new_from_slice(rc4_key)?;
         cipher.try_apply_keystream(&mut opt_footer_buffer)?;
-        let opt_footer_len = opt_footer_buffer.len() as u64;
-        ostream.write_all(&opt_footer_buffer)?;
-        (opt_footer_pos, opt_footer_len)
+        (pos, opt_footer_buffer)
     } else {
-        (0, 0)
+        (0, vec![])
     };
 
-    // Write the mandatory footer
-    ostream.write_all(&{
-        // Build the header in a buffer first
-        let mut footer = vec![];
-        footer.reserve(MANDATORY_FOOTER_SIZE);
-        footer.put_slice(FOOTER_MAGIC); // MAGIC
-        footer.put_u64_le(RESERVED); // Reserved
-        footer.put_u64_le(footer_pos);
-        footer.put_u64_le(footer_len);
-
-        // Check the footer, and write it
-        if footer.len() != MANDATORY_FOOTER_SIZE {
-            return Err(anyhow::anyhow!("Footer encoding error"))
-        }
-        footer
-    })?;
+    // Build the mandatory footer on the stack
+    let mut footer = [0u8; MANDATORY_FOOTER_SIZE];
+    {
+        let mut cursor = &mut footer[..];
+        cursor.put_slice(FOOTER_MAGIC); // MAGIC
+        cursor.put_u64_le(RESERVED); // Reserved
+        cursor.put_u64_le(footer_pos);
+        cursor.put_u64_le(opt_footer_buffer.len() as u64);
+    }
+
+    // Write both footers together
+    write_all_vectored(&mut ostream, &mut [IoSlice::new(&opt_footer_buffer), IoSlice::new(&footer)])?;
     ostream.flush()?;
     return Ok(())
 }
@@ -189,11 +498,19 @@ pub (crate) fn unpack_required_header<IN: Read>(mut istream: IN, rc4_key_overrid
 }
 
 /// Decode and check the entire header, including the optional metadata
-pub (crate) fn unpack_header<IN: Read>(mut istream: IN, rc4_key_override: Option<Vec<u8>>)
+pub (crate) fn unpack_header<IN: Read>(istream: IN, rc4_key_override: Option<Vec<u8>>)
     -> anyhow::Result<(Vec<u8>, Option<JsonMap>, u64)>
+{
+    let (rc4_key, optional_header, pos) = unpack_raw_header(istream, rc4_key_override)?;
+    return Ok((rc4_key, parse_metadata(optional_header)?, pos))
+}
+
+/// Decode and check the entire header, leaving the optional metadata JSON encoded
+pub (crate) fn unpack_raw_header<IN: Read>(mut istream: IN, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<(Vec<u8>, Option<Vec<u8>>, u64)>
 {
     let (rc4_key, opt_header_len, mut pos) = unpack_required_header(&mut istream, rc4_key_override)?;
-    // Read and unpack any optional header.
+    // Read and decrypt any optional header.
     let mut optional_header = None;
     if opt_header_len > 0 {
         let mut buffer = vec![0u8; opt_header_len as usize];
@@ -202,14 +519,32 @@ pub (crate) fn unpack_header<IN: Read>(mut istream: IN, rc4_key_override: Option
 
         let mut cipher = Rc4::new_from_slice(&rc4_key)?;
         cipher.try_apply_keystream(&mut buffer)?;
-        optional_header = Some(serde_json::from_slice(&buffer)?);
+        optional_header = Some(buffer);
     }
     return Ok((rc4_key, optional_header, pos))
 }
 
+/// Parse JSON encoded optional metadata into a map.
+fn parse_metadata(metadata: Option<Vec<u8>>) -> anyhow::Result<Option<JsonMap>> {
+    match metadata {
+        Some(metadata) => Ok(Some(serde_json::from_slice(&metadata)?)),
+        None => Ok(None),
+    }
+}
+
 /// Decode function for cart formatted data.
-pub fn unpack_stream<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
+pub fn unpack_stream<IN: Read, OUT: Write>(istream: IN, ostream: OUT,
     rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    unpack_stream_ex(istream, ostream, rc4_key_override, &UnpackOptions::default())
+}
+
+/// Decode function for cart formatted data with limits on the output.
+///
+/// If the decoded data grows past a limit set in the options decoding stops with
+/// an [OutputLimitExceeded] error, output beyond the limit is never written.
+pub fn unpack_stream_ex<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
+    rc4_key_override: Option<Vec<u8>>, options: &UnpackOptions) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
 {
     // unpack to output stream, return header / footer
     // First read and unpack the mandatory header. This will tell us the RC4 key
@@ -219,25 +554,57 @@ pub fn unpack_stream<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
         .context("Could not unpack header")?;
 
     // Read / Unpack / Output the binary stream 1 block at a time.
-    let cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
-    let mut bz = flate2::read::ZlibDecoder::new_with_buf(
-        CipherPassthroughIn::new(istream, cipher),
-        vec![0u8; BLOCK_SIZE]
-    );
+    let body = CipherTrailingIn::new(istream, &rc4_key).context("Invalid rc4 key")?;
+    let mut bz = flate2::bufread::ZlibDecoder::new(std::io::BufReader::with_capacity(BLOCK_SIZE, body));
 
     let mut buffer = vec![0u8; BLOCK_SIZE];
     loop {
-        let size = bz.read(&mut buffer).context("reading from compressed stream")?;
+        let size = record_io(Stage::Inflate, || bz.read(&mut buffer)).context("reading from compressed stream")?;
         if size == 0 {
             break;
         }
-        ostream.write_all(&buffer[0..size]).context("writing output")?;
+        options.check(bz.total_in(), bz.total_out())?;
+        record(Stage::Write, size, || ostream.write_all(&buffer[0..size])).context("writing output")?;
     }
-    let last_chunk = bz.into_inner().last_chunk();
+    // Data the decoder left in the buffer is the start of the footers, since
+    // the buffer is only refilled once it has been fully consumed. Anything that
+    // didn't fit in the final read is still waiting in the stream.
+    let reader = bz.into_inner();
+    let mut last_chunk = reader.buffer().to_vec();
+    let mut istream = reader.into_inner().into_inner_restoring(&mut last_chunk)?;
+    istream.read_to_end(&mut last_chunk).context("reading footer")?;
+
+    // unused data will be the footers
+    let optional_footer = unpack_trailer(&last_chunk, &rc4_key)?;
+
+    ostream.flush()?;
+    return Ok((optional_header, optional_footer))
+}
 
-    // unused data will be the
-    let footer_offset = last_chunk.len() - MANDATORY_FOOTER_SIZE;
-    let mut mandatory_footer_raw = bytes::Bytes::copy_from_slice(&last_chunk[footer_offset..]);
+/// Decode the footers from all of the data that followed the compressed body.
+pub (crate) fn unpack_trailer(trailer: &[u8], rc4_key: &[u8]) -> anyhow::Result<Option<JsonMap>> {
+    if trailer.len() < MANDATORY_FOOTER_SIZE {
+        return Err(anyhow::anyhow!("Corrupt cart: Missing footer"));
+    }
+    let footer_offset = trailer.len() - MANDATORY_FOOTER_SIZE;
+    let (_opt_footer_pos, opt_footer_len) = unpack_required_footer(&trailer[footer_offset..])?;
+    if opt_footer_len as usize > footer_offset {
+        return Err(anyhow::anyhow!("Corrupt cart: Optional footer truncated"));
+    }
+    let opt_footer_offset = footer_offset - opt_footer_len as usize;
+    unpack_optional_footer(&trailer[opt_footer_offset..footer_offset], rc4_key)
+}
+
+/// Decode and check the mandatory footer
+///
+/// This returns the position and the size of the optional footer.
+/// Older encoders did not always record the position accurately, so the optional
+/// footer should be located from the end of the data using its size.
+pub (crate) fn unpack_required_footer(footer: &[u8]) -> anyhow::Result<(u64, u64)> {
+    if footer.len() != MANDATORY_FOOTER_SIZE {
+        return Err(anyhow::anyhow!("Corrupt cart: Missing footer"));
+    }
+    let mut mandatory_footer_raw = bytes::Bytes::copy_from_slice(footer);
 
     {
         if !mandatory_footer_raw.starts_with(FOOTER_MAGIC) {
@@ -248,22 +615,564 @@ pub fn unpack_stream<IN: Read, OUT: Write>(mut istream: IN, mut ostream: OUT,
             return Err(anyhow::anyhow!("Corrupt cart: Reserved footer space not zeroed"));
         }
     }
-    let _opt_footer_pos = mandatory_footer_raw.get_u64_le();
-    let opt_footer_len = mandatory_footer_raw.get_u64_le() as usize;
+    let opt_footer_pos = mandatory_footer_raw.get_u64_le();
+    let opt_footer_len = mandatory_footer_raw.get_u64_le();
+    return Ok((opt_footer_pos, opt_footer_len))
+}
 
-    let opt_footer_offset = footer_offset - opt_footer_len;
+/// Decrypt and parse the optional footer, which may be empty.
+pub (crate) fn unpack_optional_footer(footer: &[u8], rc4_key: &[u8]) -> anyhow::Result<Option<JsonMap>> {
+    parse_metadata(decrypt_optional_footer(footer.to_vec(), rc4_key)?)
+}
 
-    let mut optional_footer = None;
-    if opt_footer_len > 0 {
-        let mut cipher = Rc4::new_from_slice(&rc4_key)?;
-        let mut optional_crypt = last_chunk[opt_footer_offset..(opt_footer_offset + opt_footer_len)].to_vec();
-        cipher.try_apply_keystream(&mut optional_crypt)?;
-        optional_footer = Some(serde_json::from_slice(&optional_crypt)?);
+/// Decrypt the optional footer in place, leaving it JSON encoded. An empty footer is None.
+fn decrypt_optional_footer(mut footer: Vec<u8>, rc4_key: &[u8]) -> anyhow::Result<Option<Vec<u8>>> {
+    if footer.is_empty() {
+        return Ok(None)
+    }
+    let mut cipher = Rc4::new_from_slice(rc4_key)?;
+    cipher.try_apply_keystream(&mut footer)?;
+    return Ok(Some(footer))
+}
+
+/// Read the footers from the end of a seekable stream.
+///
+/// The stream should be positioned after the header, the rc4 key taken from the
+/// header is needed to decrypt the optional footer. This returns the optional footer
+/// and the offset where the footers begin, which is also where the body ends.
+pub (crate) fn unpack_footer_at_end<IN: Read + Seek>(istream: IN, rc4_key: &[u8])
+    -> anyhow::Result<(Option<JsonMap>, u64)>
+{
+    let (optional_footer, footer_start) = unpack_raw_footer_at_end(istream, rc4_key)?;
+    return Ok((parse_metadata(optional_footer)?, footer_start))
+}
+
+/// Read the footers from the end of a seekable stream, leaving the optional footer JSON encoded.
+///
+/// This works like [unpack_footer_at_end] without parsing the optional footer.
+fn unpack_raw_footer_at_end<IN: Read + Seek>(mut istream: IN, rc4_key: &[u8])
+    -> anyhow::Result<(Option<Vec<u8>>, u64)>
+{
+    let body_start = istream.stream_position()?;
+    let end = istream.seek(SeekFrom::End(0))?;
+    if end < body_start + MANDATORY_FOOTER_SIZE as u64 {
+        return Err(anyhow::anyhow!("Corrupt cart: Missing footer"));
+    }
+
+    let mut footer = [0u8; MANDATORY_FOOTER_SIZE];
+    istream.seek(SeekFrom::Start(end - MANDATORY_FOOTER_SIZE as u64))?;
+    istream.read_exact(&mut footer)?;
+    let (_opt_footer_pos, opt_footer_len) = unpack_required_footer(&footer)?;
+
+    let footer_start = end - MANDATORY_FOOTER_SIZE as u64;
+    if opt_footer_len > footer_start - body_start {
+        return Err(anyhow::anyhow!("Corrupt cart: Optional footer truncated"));
     }
+    let footer_start = footer_start - opt_footer_len;
+
+    let mut buffer = vec![0u8; opt_footer_len as usize];
+    istream.seek(SeekFrom::Start(footer_start))?;
+    istream.read_exact(&mut buffer)?;
+    let optional_footer = decrypt_optional_footer(buffer, rc4_key)?;
+    return Ok((optional_footer, footer_start))
+}
+
+/// Read only the optional footer from a seekable cart stream without decoding the body.
+pub fn unpack_footer<IN: Read + Seek>(istream: IN, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<Option<JsonMap>> {
+    let (_, footer) = unpack_metadata(istream, rc4_key_override)?;
+    return Ok(footer)
+}
+
+/// Read the optional header and footer from a seekable cart stream without decoding the body.
+pub fn unpack_metadata<IN: Read + Seek>(mut istream: IN, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let (optional_footer, _) = unpack_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+    return Ok((optional_header, optional_footer))
+}
+
+/// Read the optional header and footer from a seekable cart stream exactly as they were encoded.
+///
+/// The metadata is only deciphered, not parsed, so it is returned as the JSON the encoder wrote.
+/// It is not checked either, [check_metadata] can be used on untrusted input.
+pub fn unpack_raw_metadata<IN: Read + Seek>(mut istream: IN, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<(Option<Vec<u8>>, Option<Vec<u8>>)>
+{
+    let (rc4_key, optional_header, _pos) = unpack_raw_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let (optional_footer, _) = unpack_raw_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+    return Ok((optional_header, optional_footer))
+}
+
+/// Rewrite the metadata of a seekable cart stream, and optionally its key, without recompressing the body.
+///
+/// The output gets exactly the header and footer given, so the footer should carry over any
+/// digests or seek index from the input that are to be kept. The body is deciphered with the
+/// input's key and enciphered with the new one, it is never inflated. When both keys are the same
+/// the body is copied as it is. `rc4_key_override` is the key the input was encoded with, if it
+/// isn't stored in its header, and `new_rc4_key_override` the key to encode the output with.
+pub fn repack_metadata<IN: Read + Seek, OUT: Write>(istream: IN, ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    rc4_key_override: Option<Vec<u8>>, new_rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+{
+    repack_metadata_raw(istream, ostream, encode_metadata(optional_header)?, encode_metadata(optional_footer)?,
+        rc4_key_override, new_rc4_key_override)
+}
+
+/// Rewrite the metadata of a seekable cart stream with a header and footer that are already JSON encoded.
+///
+/// This works like [repack_metadata], with the metadata handled as by [pack_stream_raw].
+pub fn repack_metadata_raw<IN: Read + Seek, OUT: Write>(mut istream: IN, mut ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<Vec<u8>>,
+    rc4_key_override: Option<Vec<u8>>, new_rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+{
+    // Find the body without reading the old metadata
+    let (rc4_key, opt_header_len, pos) = unpack_required_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let body_start = istream.seek(SeekFrom::Start(pos + opt_header_len))?;
+    let (_, footer_start) = unpack_raw_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+    istream.seek(SeekFrom::Start(body_start))?;
+    let mut body = (&mut istream).take(footer_start - body_start);
+
+    let (new_rc4_key, key_override) = select_key(new_rc4_key_override);
+    let mut pos = pack_raw_header(&mut ostream, &new_rc4_key, key_override, optional_header)?;
+
+    // Every part of a cart starts its own keystream, so the body can be re-keyed on its own
+    let mut ciphers = if rc4_key == new_rc4_key {
+        None
+    } else {
+        Some((Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?,
+            Rc4::new_from_slice(&new_rc4_key).context("Bad RC4 Key")?))
+    };
+    let mut buffer = vec![0u8; LARGE_BLOCK_SIZE];
+    loop {
+        let size = body.read(&mut buffer)?;
+        if size == 0 {
+            break
+        }
+        if let Some((old, new)) = &mut ciphers {
+            old.try_apply_keystream(&mut buffer[0..size])?;
+            new.try_apply_keystream(&mut buffer[0..size])?;
+        }
+        ostream.write_all(&buffer[0..size])?;
+        pos += size as u64;
+    }
+    pack_raw_footer(&mut ostream, &new_rc4_key, pos, optional_footer)
+}
+
+/// Find a single field of the optional header without building a map of the whole header.
+///
+/// This returns the JSON encoding of the field's value, or None if the header doesn't have it.
+/// Only the header is read. Keys are compared where they lie and the values of other fields
+/// are skipped over without being kept, so nothing is allocated for them. The rest of the
+/// header is still checked to be well formed, and the first of any repeated field is used.
+pub fn unpack_header_field<IN: Read>(istream: IN, field: &str, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<Option<Vec<u8>>>
+{
+    let (_, optional_header, _pos) = unpack_raw_header(istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let optional_header = match optional_header {
+        Some(header) => header,
+        None => return Ok(None),
+    };
+    let mut deserializer = serde_json::Deserializer::from_slice(&optional_header);
+    let value = serde::de::DeserializeSeed::deserialize(FieldSeeker{field}, &mut deserializer)?;
+    deserializer.end()?;
+    return Ok(value.map(|value| value.get().as_bytes().to_vec()))
+}
+
+/// Finds one field of a JSON object, comparing keys in place and skipping the values of the others.
+struct FieldSeeker<'f> {
+    field: &'f str,
+}
+
+impl<'de, 'f> serde::de::DeserializeSeed<'de> for FieldSeeker<'f> {
+    type Value = Option<&'de serde_json::value::RawValue>;
+
+    fn deserialize<D: serde::Deserializer<'de>>(self, deserializer: D) -> Result<Self::Value, D::Error> {
+        deserializer.deserialize_map(self)
+    }
+}
+
+impl<'de, 'f> serde::de::Visitor<'de> for FieldSeeker<'f> {
+    type Value = Option<&'de serde_json::value::RawValue>;
+
+    fn expecting(&self, formatter: &mut std::fmt::Formatter) -> std::fmt::Result {
+        formatter.write_str("a JSON object")
+    }
+
+    fn visit_map<A: serde::de::MapAccess<'de>>(self, mut map: A) -> Result<Self::Value, A::Error> {
+        let mut found = None;
+        while let Some(matches) = map.next_key_seed(KeyMatches{field: self.field})? {
+            if matches && found.is_none() {
+                found = Some(map.next_value()?);
+                continue
+            }
+            map.next_value::<serde::de::IgnoredAny>()?;
+        }
+        Ok(found)
+    }
+}
+
+/// Checks if a key is the one wanted, without keeping a copy of it.
+struct KeyMatches<'f> {
+    field: &'f str,
+}
+
+impl<'de, 'f> serde::de::DeserializeSeed<'de> for KeyMatches<'f> {
+    type Value = bool;
+
+    fn deserialize<D: serde::Deserializer<'de>>(self, deserializer: D) -> Result<Self::Value, D::Error> {
+        deserializer.deserialize_str(self)
+    }
+}
+
+impl<'de, 'f> serde::de::Visitor<'de> for KeyMatches<'f> {
+    type Value = bool;
+
+    fn expecting(&self, formatter: &mut std::fmt::Formatter) -> std::fmt::Result {
+        formatter.write_str("a string key")
+    }
+
+    fn visit_str<E: serde::de::Error>(self, key: &str) -> Result<Self::Value, E> {
+        Ok(key == self.field)
+    }
+}
+
+/// Error returned when decoded data does not fit in the buffer provided for it.
+#[derive(Debug)]
+pub struct BufferTooSmall {
+    /// The size of the buffer that was provided.
+    pub capacity: usize,
+}
+
+impl std::fmt::Display for BufferTooSmall {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Decoded data is larger than the {} byte output buffer", self.capacity)
+    }
+}
+
+impl std::error::Error for BufferTooSmall {}
+
+/// Error returned when decoding produces more output than the [UnpackOptions] allow.
+#[derive(Debug)]
+pub struct OutputLimitExceeded {
+    /// The number of bytes the output was limited to when decoding stopped.
+    pub limit: u64,
+}
+
+impl std::fmt::Display for OutputLimitExceeded {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Decoded data is larger than the {} byte output limit", self.limit)
+    }
+}
+
+impl std::error::Error for OutputLimitExceeded {}
+
+/// Reads the decoded body of a seekable cart stream, whose compressed size is known from the footers.
+///
+/// The whole body must be one complete zlib stream. A body that runs out before the end
+/// of the stream, or that continues after it, is reported as corrupt rather than decoded short.
+pub (crate) struct BodyDecoder<IN: Read> {
+    body: CipherPassthroughIn<std::io::Take<IN>>,
+    body_len: u64,
+    decompress: flate2::Decompress,
+    buffer: Vec<u8>,
+    start: usize,
+    end: usize,
+    finished: bool,
+}
+
+impl<IN: Read> BodyDecoder<IN> {
+    /// Decode the next `body_len` bytes of a stream, deciphered with the given cipher.
+    fn new(istream: IN, cipher: Rc4, body_len: u64, buffer_size: usize) -> Self {
+        Self {
+            body: CipherPassthroughIn::new(istream.take(body_len), cipher),
+            body_len,
+            decompress: flate2::Decompress::new(true),
+            buffer: vec![0u8; buffer_size],
+            start: 0,
+            end: 0,
+            finished: false,
+        }
+    }
+
+    /// How much of the compressed body has been inflated.
+    pub (crate) fn total_in(&self) -> u64 {
+        self.decompress.total_in()
+    }
+
+    /// How much decoded data has been produced.
+    pub (crate) fn total_out(&self) -> u64 {
+        self.decompress.total_out()
+    }
+}
+
+impl<IN: Read> Read for BodyDecoder<IN> {
+    fn read(&mut self, output: &mut [u8]) -> std::io::Result<usize> {
+        if self.finished || output.is_empty() {
+            return Ok(0)
+        }
+        loop {
+            let mut ended = false;
+            if self.start == self.end {
+                self.start = 0;
+                self.end = self.body.read(&mut self.buffer)?;
+                ended = self.end == 0;
+            }
+
+            let (total_in, total_out) = (self.decompress.total_in(), self.decompress.total_out());
+            let status = self.decompress.decompress(&self.buffer[self.start..self.end], output, flate2::FlushDecompress::None)
+                .map_err(|err| std::io::Error::new(std::io::ErrorKind::InvalidData, err))?;
+            self.start += (self.decompress.total_in() - total_in) as usize;
+            let size = (self.decompress.total_out() - total_out) as usize;
+
+            if status == flate2::Status::StreamEnd {
+                self.finished = true;
+                if self.decompress.total_in() != self.body_len {
+                    return Err(std::io::Error::new(std::io::ErrorKind::InvalidData,
+                        anyhow::anyhow!("Corrupt cart: Body continues past the compressed stream")))
+                }
+                return Ok(size)
+            }
+            if size > 0 {
+                return Ok(size)
+            }
+            if ended && self.decompress.total_in() == total_in {
+                return Err(std::io::Error::new(std::io::ErrorKind::UnexpectedEof,
+                    anyhow::anyhow!("Corrupt cart: Body ended early")))
+            }
+        }
+    }
+}
+
+/// Read the headers and footers of a seekable cart stream and prepare to decode its body.
+///
+/// The footers are read first so the body can be decoded with reads of `buffer_size`
+/// that stop exactly where it ends.
+pub (crate) fn open_body<IN: Read + Seek>(mut istream: IN, rc4_key_override: Option<Vec<u8>>, buffer_size: usize)
+    -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>, BodyDecoder<IN>)>
+{
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let body_start = istream.stream_position()?;
+    let (optional_footer, footer_start) = unpack_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+
+    // Decode only the range between the headers and footers
+    istream.seek(SeekFrom::Start(body_start))?;
+    let body_len = footer_start - body_start;
+    let cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
+    let bz = BodyDecoder::new(istream, cipher, body_len, buffer_size);
+    return Ok((optional_header, optional_footer, bz))
+}
+
+/// Fill as much of a buffer as a decoder can, stopping when the buffer is full or the decoded data ends.
+fn read_prefix<R: Read>(mut bz: R, output: &mut [u8]) -> anyhow::Result<usize> {
+    let mut filled = 0;
+    while filled < output.len() {
+        let size = record_io(Stage::Inflate, || bz.read(&mut output[filled..])).context("reading from compressed stream")?;
+        if size == 0 {
+            break
+        }
+        filled += size;
+    }
+    count(Stage::Write, filled);
+    return Ok(filled)
+}
+
+/// Decode function for cart formatted data in a seekable stream.
+///
+/// The footers are read from the end of the stream before the body is decoded,
+/// so the body can be inflated with large reads that stop exactly where it ends.
+pub fn unpack_stream_seekable<IN: Read + Seek, OUT: Write>(istream: IN, ostream: OUT,
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    unpack_stream_seekable_ex(istream, ostream, rc4_key_override, &UnpackOptions::default())
+}
+
+/// Decode function for cart formatted data in a seekable stream with limits on the output.
+///
+/// The limits are enforced the same way as by [unpack_stream_ex].
+pub fn unpack_stream_seekable_ex<IN: Read + Seek, OUT: Write>(istream: IN, mut ostream: OUT,
+    rc4_key_override: Option<Vec<u8>>, options: &UnpackOptions) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    let (optional_header, optional_footer, mut bz) = open_body(istream, rc4_key_override, LARGE_BLOCK_SIZE)?;
+
+    let mut buffer = vec![0u8; LARGE_BLOCK_SIZE];
+    loop {
+        let size = record_io(Stage::Inflate, || bz.read(&mut buffer)).context("reading from compressed stream")?;
+        if size == 0 {
+            break;
+        }
+        options.check(bz.total_in(), bz.total_out())?;
+        record(Stage::Write, size, || ostream.write_all(&buffer[0..size])).context("writing output")?;
+    }
+
     ostream.flush()?;
     return Ok((optional_header, optional_footer))
 }
 
+/// Decode function for cart formatted data that also digests the decoded output.
+///
+/// The digests are calculated as the output is written, and their results are
+/// returned by name along with the header and footer.
+pub fn unpack_stream_digested<IN: Read, OUT: Write>(istream: IN, ostream: OUT,
+    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>, JsonMap)>
+{
+    let (optional_header, optional_footer) = unpack_stream(istream,
+        DigestWriter::new(ostream, &mut digesters), rc4_key_override)?;
+    return Ok((optional_header, optional_footer, digest_results(&mut digesters)))
+}
+
+/// Decode function for cart formatted data in a seekable stream that also digests the decoded output.
+///
+/// This works like [unpack_stream_digested] using [unpack_stream_seekable] to decode.
+pub fn unpack_stream_seekable_digested<IN: Read + Seek, OUT: Write>(istream: IN, ostream: OUT,
+    mut digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>)
+    -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>, JsonMap)>
+{
+    let (optional_header, optional_footer) = unpack_stream_seekable(istream,
+        DigestWriter::new(ostream, &mut digesters), rc4_key_override)?;
+    return Ok((optional_header, optional_footer, digest_results(&mut digesters)))
+}
+
+/// Decode a seekable cart stream directly into a buffer provided by the caller.
+///
+/// This returns how much of the buffer was filled along with the metadata.
+/// If the decoded data would not fit a [BufferTooSmall] error is returned,
+/// [unpack_decoded_size] can be used to size the buffer beforehand.
+pub fn unpack_into<IN: Read + Seek>(istream: IN, output: &mut [u8],
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(usize, Option<JsonMap>, Option<JsonMap>)>
+{
+    let (optional_header, optional_footer, mut bz) = open_body(istream, rc4_key_override, LARGE_BLOCK_SIZE)?;
+
+    let mut filled = 0;
+    while filled < output.len() {
+        let size = record_io(Stage::Inflate, || bz.read(&mut output[filled..])).context("reading from compressed stream")?;
+        if size == 0 {
+            count(Stage::Write, filled);
+            return Ok((filled, optional_header, optional_footer))
+        }
+        filled += size;
+    }
+
+    // The buffer is full, make sure nothing is left to decode
+    let mut extra = [0u8; 1];
+    if bz.read(&mut extra).context("reading from compressed stream")? > 0 {
+        return Err(BufferTooSmall{capacity: output.len()}.into())
+    }
+    count(Stage::Write, filled);
+    return Ok((filled, optional_header, optional_footer))
+}
+
+/// Decode only the start of the body of a seekable cart stream into a buffer provided by the caller.
+///
+/// Decoding stops once the buffer is full, the rest of the body is never inflated or read.
+/// The footer is found by seeking to the end of the stream and returned when it can be read.
+/// If it is missing or damaged, as in a truncated file, None is returned in its place and the
+/// start of the body is still decoded. This returns how much of the buffer was filled along
+/// with the metadata.
+pub fn unpack_prefix<IN: Read + Seek>(mut istream: IN, output: &mut [u8],
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(usize, Option<JsonMap>, Option<JsonMap>)>
+{
+    // Only the start of the body is wanted, so read it in blocks no larger than that
+    let buffer_size = BLOCK_SIZE.min(output.len().max(4096));
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let body_start = istream.stream_position()?;
+    let footer = unpack_footer_at_end(&mut istream, &rc4_key).ok();
+
+    istream.seek(SeekFrom::Start(body_start))?;
+    let cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
+    let (filled, optional_footer) = match footer {
+        Some((optional_footer, footer_start)) => {
+            let bz = BodyDecoder::new(istream, cipher, footer_start - body_start, buffer_size);
+            (read_prefix(bz, output)?, optional_footer)
+        },
+        None => {
+            // Without the footer the end of the body isn't known, so decode until the zlib stream ends
+            let body = CipherPassthroughIn::new(istream, cipher);
+            let bz = flate2::read::ZlibDecoder::new_with_buf(body, vec![0u8; buffer_size]);
+            (read_prefix(bz, output)?, None)
+        },
+    };
+    return Ok((filled, optional_header, optional_footer))
+}
+
+/// Decode cart data held in memory into a new buffer with limits on the output.
+///
+/// When the footer records the decoded length the output is allocated at exactly that size,
+/// and the body is deciphered and inflated into it with one call each. If the length is
+/// missing, beyond the limits, or too small, the body is decoded as a stream like
+/// [unpack_stream_seekable_ex] instead. The returned buffer never has spare capacity, but
+/// only a correct recorded length avoids trimming it, which may copy it.
+pub fn unpack_data(data: &[u8], rc4_key_override: Option<Vec<u8>>, options: &UnpackOptions)
+    -> anyhow::Result<(Vec<u8>, Option<JsonMap>, Option<JsonMap>)>
+{
+    let mut cursor = std::io::Cursor::new(data);
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut cursor, rc4_key_override.clone())
+        .context("Could not unpack header")?;
+    let body_start = cursor.position() as usize;
+    let (optional_footer, footer_start) = unpack_footer_at_end(&mut cursor, &rc4_key)
+        .context("Could not unpack footer")?;
+    let body = data.get(body_start..footer_start as usize).context("Body overlaps footer")?;
+
+    // The recorded length can't be trusted, only use it if the limits allow it
+    let length = optional_footer.as_ref().and_then(footer_length)
+        .filter(|length| *length <= (body.len() as u64).saturating_mul(MAX_DEFLATE_RATIO))
+        .filter(|length| options.check(body.len() as u64, *length).is_ok());
+
+    if let Some(length) = length {
+        let mut body = body.to_vec();
+        let mut cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
+        record(Stage::Cipher, body.len(), || cipher.try_apply_keystream(&mut body))?;
+
+        let mut output = vec![0u8; length as usize];
+        if let Some(size) = record(Stage::Inflate, length as usize,
+            || crate::deflate::zlib_decompress_whole(&body, &mut output))? {
+            // A recorded length larger than the data leaves space to give back
+            output.truncate(size);
+            output.shrink_to_fit();
+            count(Stage::Read, data.len());
+            count(Stage::Write, size);
+            return Ok((output, optional_header, optional_footer))
+        }
+    }
+
+    let mut output = vec![];
+    let (optional_header, optional_footer) = unpack_stream_seekable_ex(std::io::Cursor::new(data),
+        &mut output, rc4_key_override, options)?;
+    output.shrink_to_fit();
+    return Ok((output, optional_header, optional_footer))
+}
+
+/// Read the decoded size of a seekable cart stream without decoding the body.
+///
+/// This is the length recorded in the footer by the length digest,
+/// None is returned if the footer does not have one.
+pub fn unpack_decoded_size<IN: Read + Seek>(istream: IN, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<Option<u64>> {
+    let footer = match unpack_footer(istream, rc4_key_override)? {
+        Some(footer) => footer,
+        None => return Ok(None),
+    };
+    return Ok(footer_length(&footer))
+}
+
+/// The length recorded in a footer by the length digest.
+fn footer_length(footer: &JsonMap) -> Option<u64> {
+    match footer.get("length") {
+        Some(serde_json::Value::String(length)) => length.parse().ok(),
+        Some(serde_json::Value::Number(length)) => length.as_u64(),
+        _ => None,
+    }
+}
 
 #[cfg(test)]
 mod tests {
@@ -274,7 +1183,13 @@ mod tests {
     use crate::cart::{JsonMap, MANDATORY_HEADER_SIZE};
     use crate::digesters::default_digesters;
 
-    use super::{pack_stream, unpack_stream};
+    use super::{pack_stream, pack_stream_ex, pack_data, unpack_stream, PackOptions};
+    use super::{unpack_footer, unpack_metadata, unpack_required_footer, unpack_stream_seekable, MANDATORY_FOOTER_SIZE};
+    use super::{unpack_into, unpack_prefix, unpack_decoded_size, unpack_data, BufferTooSmall};
+    use super::{pack_stream_raw, pack_data_raw, unpack_raw_metadata, unpack_header_field, check_metadata};
+    use super::{repack_metadata, repack_metadata_raw};
+    use super::{unpack_stream_ex, unpack_stream_seekable_ex, UnpackOptions, OutputLimitExceeded, BLOCK_SIZE};
+    use super::{unpack_stream_digested, unpack_stream_seekable_digested};
 
     #[test]
     fn round_trip_headerless() {
@@ -336,6 +1251,337 @@ mod tests {
         assert_eq!(output, raw_data);
     }
 
+    #[test]
+    fn metadata_by_seek() {
+        let raw_data = std::include_bytes!("cart.rs");
+
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, Some(original_header.clone()), None, default_digesters(), None).unwrap();
+
+        let mut output = vec![];
+        let (_, footer) = unpack_stream(buffer.as_slice(), &mut output, None).unwrap();
+
+        let (header, seek_footer) = unpack_metadata(std::io::Cursor::new(&buffer), None).unwrap();
+        assert_eq!(header, Some(original_header));
+        assert_eq!(seek_footer, footer);
+        assert_eq!(unpack_footer(std::io::Cursor::new(&buffer), None).unwrap(), footer);
+
+        // The recorded position of the optional footer should be accurate
+        let (opt_footer_pos, opt_footer_len) = unpack_required_footer(&buffer[buffer.len() - MANDATORY_FOOTER_SIZE..]).unwrap();
+        assert_eq!(opt_footer_pos + opt_footer_len + MANDATORY_FOOTER_SIZE as u64, buffer.len() as u64);
+
+        // Truncated data should be an error
+        assert!(unpack_footer(std::io::Cursor::new(&buffer[0..buffer.len() - 1]), None).is_err());
+        assert!(unpack_footer(std::io::Cursor::new(&buffer[0..50]), None).is_err());
+    }
+
+    #[test]
+    fn seekable_round_trip() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut data = vec![];
+        while data.len() < 3 << 20 {
+            data.extend_from_slice(raw_data);
+        }
+
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+        let mut original_footer = JsonMap::new();
+        original_footer.insert("xyz".to_owned(), serde_json::to_value("999").unwrap());
+
+        for data in [vec![], raw_data.to_vec(), data] {
+            let mut buffer = vec![];
+            pack_stream(data.as_slice(), &mut buffer, Some(original_header.clone()), Some(original_footer.clone()), default_digesters(), None).unwrap();
+
+            let mut expected = vec![];
+            let metadata = unpack_stream(buffer.as_slice(), &mut expected, None).unwrap();
+
+            let mut output = vec![];
+            let seek_metadata = unpack_stream_seekable(std::io::Cursor::new(&buffer), &mut output, None).unwrap();
+            assert_eq!(seek_metadata, metadata);
+            assert_eq!(output, data);
+
+            // Truncated data should be an error
+            let mut output = vec![];
+            assert!(unpack_stream_seekable(std::io::Cursor::new(&buffer[0..buffer.len() - 1]), &mut output, None).is_err());
+        }
+    }
+
+    #[test]
+    fn unpack_into_buffer() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, None, default_digesters(), None).unwrap();
+
+        let size = unpack_decoded_size(std::io::Cursor::new(&buffer), None).unwrap();
+        assert_eq!(size, Some(raw_data.len() as u64));
+
+        // Exact and oversized buffers
+        for extra in [0, 100] {
+            let mut output = vec![0u8; raw_data.len() + extra];
+            let (filled, header, footer) = unpack_into(std::io::Cursor::new(&buffer), &mut output, None).unwrap();
+            assert_eq!(filled, raw_data.len());
+            assert_eq!(&output[0..filled], raw_data);
+            assert!(header.is_none());
+            assert!(footer.is_some());
+        }
+
+        // Undersized buffer
+        let mut output = vec![0u8; raw_data.len() - 1];
+        let err = unpack_into(std::io::Cursor::new(&buffer), &mut output, None).unwrap_err();
+        assert!(err.downcast_ref::<BufferTooSmall>().is_some());
+
+        // Without the length digest the size is unknown
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, None, vec![], None).unwrap();
+        assert_eq!(unpack_decoded_size(std::io::Cursor::new(&buffer), None).unwrap(), None);
+    }
+
+    #[test]
+    fn output_limits() {
+        let raw_data = vec![0u8; 4 * BLOCK_SIZE];
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, None, default_digesters(), None).unwrap();
+
+        let limited = |max_output_size, max_ratio| UnpackOptions{max_output_size, max_ratio};
+        for (options, ok) in [
+            (limited(0, 0), true),
+            (limited(raw_data.len() as u64, 0), true),
+            (limited(raw_data.len() as u64 - 1, 0), false),
+            (limited(0, 2000), true),
+            (limited(0, 10), false),
+        ] {
+            let mut output = vec![];
+            let result = unpack_stream_ex(buffer.as_slice(), &mut output, None, &options);
+            let mut seek_output = vec![];
+            let seek_result = unpack_stream_seekable_ex(std::io::Cursor::new(&buffer), &mut seek_output, None, &options);
+            if ok {
+                result.unwrap();
+                seek_result.unwrap();
+                assert_eq!(output, raw_data);
+                assert_eq!(seek_output, raw_data);
+            } else {
+                assert!(result.unwrap_err().downcast_ref::<OutputLimitExceeded>().is_some());
+                assert!(seek_result.unwrap_err().downcast_ref::<OutputLimitExceeded>().is_some());
+                assert!(output.len() as u64 <= options.max_output_size.max(BLOCK_SIZE as u64));
+                assert!(seek_output.len() as u64 <= options.max_output_size.max(BLOCK_SIZE as u64));
+            }
+        }
+    }
+
+    #[test]
+    fn unpack_whole_buffer() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let with_length = pack_data(raw_data, None, None, default_digesters(), None, &PackOptions::default()).unwrap();
+
+        // The recorded length sizes the output exactly
+        let (output, _header, footer) = unpack_data(&with_length, None, &UnpackOptions::default()).unwrap();
+        assert_eq!(output, raw_data);
+        assert_eq!(output.capacity(), output.len());
+        assert_eq!(footer.unwrap().get("length").unwrap(), &raw_data.len().to_string());
+
+        // Missing or wrong lengths still give an output with no spare capacity
+        let mut short = JsonMap::new();
+        short.insert("length".to_owned(), serde_json::to_value("10").unwrap());
+        let mut long = JsonMap::new();
+        long.insert("length".to_owned(), serde_json::to_value((raw_data.len() * 2).to_string()).unwrap());
+        for footer in [None, Some(short), Some(long)] {
+            let mut buffer = vec![];
+            pack_stream(&raw_data[..], &mut buffer, None, footer.clone(), vec![], None).unwrap();
+            let (output, _header, out_footer) = unpack_data(&buffer, None, &UnpackOptions::default()).unwrap();
+            assert_eq!(output, raw_data);
+            assert_eq!(output.capacity(), output.len());
+            assert_eq!(out_footer, footer);
+        }
+
+        // Limits apply whichever way the body is decoded
+        let limited = UnpackOptions{max_output_size: raw_data.len() as u64 - 1, max_ratio: 0};
+        let error = unpack_data(&with_length, None, &limited).unwrap_err();
+        assert!(error.downcast_ref::<OutputLimitExceeded>().is_some());
+
+        assert!(unpack_data(&with_length[0..with_length.len() - 1], None, &UnpackOptions::default()).is_err());
+        let (output, _, _) = unpack_data(&pack_data(&[], None, None, default_digesters(), None,
+            &PackOptions::default()).unwrap(), None, &UnpackOptions::default()).unwrap();
+        assert!(output.is_empty());
+    }
+
+    #[test]
+    fn truncated_body() {
+        let raw_data = std::include_bytes!("cart.rs");
+        // Stored blocks make a cut body still look like valid deflate up to where it runs out
+        for (level, from_end) in [(0, false), (0, true), (6, false), (6, true)] {
+            let options = PackOptions{compression_level: level, ..Default::default()};
+            let mut buffer = vec![];
+            pack_stream_ex(&raw_data[..], &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+            let (body_end, _) = unpack_required_footer(&buffer[buffer.len() - MANDATORY_FOOTER_SIZE..]).unwrap();
+            let start = if from_end { body_end as usize - 100 } else { MANDATORY_HEADER_SIZE + 1000 };
+            buffer.drain(start..start + 100);
+
+            assert!(unpack_stream_seekable(std::io::Cursor::new(&buffer), &mut vec![], None).is_err());
+            assert!(unpack_data(&buffer, None, &UnpackOptions::default()).is_err());
+            let mut output = vec![0u8; raw_data.len()];
+            assert!(unpack_into(std::io::Cursor::new(&buffer), &mut output, None).is_err());
+            assert!(crate::verify::verify_stream_seekable(std::io::Cursor::new(&buffer), default_digesters(), None).is_err());
+            // As was already the case when streaming
+            assert!(unpack_stream(buffer.as_slice(), &mut vec![], None).is_err());
+        }
+    }
+
+    #[test]
+    fn trailing_body() {
+        let raw_data = std::include_bytes!("cart.rs");
+        for level in [0, 6] {
+            let options = PackOptions{compression_level: level, ..Default::default()};
+            let mut buffer = vec![];
+            pack_stream_ex(&raw_data[..], &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+
+            // Bytes between the end of the zlib stream and the footers are corrupt however they are decoded
+            let (body_end, _) = unpack_required_footer(&buffer[buffer.len() - MANDATORY_FOOTER_SIZE..]).unwrap();
+            let body_end = body_end as usize;
+            buffer.splice(body_end..body_end, [0x55u8; 100]);
+
+            assert!(unpack_stream_seekable(std::io::Cursor::new(&buffer), &mut vec![], None).is_err());
+            assert!(unpack_data(&buffer, None, &UnpackOptions::default()).is_err());
+            let mut output = vec![0u8; raw_data.len()];
+            assert!(unpack_into(std::io::Cursor::new(&buffer), &mut output, None).is_err());
+        }
+    }
+
+    #[test]
+    fn raw_metadata() {
+        let raw_data = std::include_bytes!("cart.rs");
+        // Out of order keys and spacing would not survive being parsed and re-encoded
+        let header = br#"{"name": "cart.rs", "files": [1, 2, {"x": null}], "age": 5}"#.to_vec();
+
+        let packed = pack_data_raw(raw_data, Some(header.clone()), None, default_digesters(), None,
+            &PackOptions::default()).unwrap();
+        let mut streamed = vec![];
+        pack_stream_raw(&raw_data[..], &mut streamed, Some(header.clone()), None, default_digesters(), None,
+            &PackOptions::default()).unwrap();
+        assert_eq!(packed, streamed);
+
+        let (raw_header, raw_footer) = unpack_raw_metadata(std::io::Cursor::new(&packed), None).unwrap();
+        assert_eq!(raw_header.unwrap(), header);
+        let (parsed_header, parsed_footer) = unpack_metadata(std::io::Cursor::new(&packed), None).unwrap();
+        assert_eq!(parsed_footer.unwrap(), serde_json::from_slice::<JsonMap>(&raw_footer.unwrap()).unwrap());
+        assert_eq!(parsed_header.unwrap(), serde_json::from_slice::<JsonMap>(&header).unwrap());
+
+        // Single fields come back as their json encoding
+        assert_eq!(unpack_header_field(packed.as_slice(), "files", None).unwrap().unwrap(), br#"[1, 2, {"x": null}]"#);
+        assert_eq!(unpack_header_field(packed.as_slice(), "name", None).unwrap().unwrap(), br#""cart.rs""#);
+        assert!(unpack_header_field(packed.as_slice(), "missing", None).unwrap().is_none());
+        // Escaped keys are still matched, and a broken header is an error even past the field
+        let escaped = pack_data_raw(raw_data, Some(br#"{"n\u0061me": 1, "age": {"a": [}"#.to_vec()), None,
+            default_digesters(), None, &PackOptions::default()).unwrap();
+        assert!(unpack_header_field(escaped.as_slice(), "name", None).is_err());
+        let escaped = pack_data_raw(raw_data, Some(br#"{"n\u0061me": 1, "age": 2}"#.to_vec()), None,
+            default_digesters(), None, &PackOptions::default()).unwrap();
+        assert_eq!(unpack_header_field(escaped.as_slice(), "name", None).unwrap().unwrap(), b"1");
+        let mut headerless = vec![];
+        pack_stream(&raw_data[..], &mut headerless, None, None, vec![], None).unwrap();
+        assert!(unpack_header_field(headerless.as_slice(), "name", None).unwrap().is_none());
+        assert_eq!(unpack_raw_metadata(std::io::Cursor::new(&headerless), None).unwrap(), (None, None));
+
+        assert!(check_metadata(&header).is_ok());
+        assert!(check_metadata(b" {} ").is_ok());
+        assert!(check_metadata(b"[1, 2]").is_err());
+        assert!(check_metadata(b"{\"a\": ").is_err());
+        assert!(check_metadata(b"{} {}").is_err());
+    }
+
+    #[test]
+    fn repack() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut header = JsonMap::new();
+        header.insert("label".to_owned(), serde_json::to_value("old").unwrap());
+        let mut packed = vec![];
+        pack_stream(&raw_data[..], &mut packed, Some(header), None, default_digesters(), None).unwrap();
+        let (_, footer) = unpack_metadata(std::io::Cursor::new(&packed), None).unwrap();
+
+        // New metadata with the same key leaves the body bytes alone
+        let mut new_header = JsonMap::new();
+        new_header.insert("label".to_owned(), serde_json::to_value("a much longer new label").unwrap());
+        let mut relabeled = vec![];
+        repack_metadata(std::io::Cursor::new(&packed), &mut relabeled, Some(new_header.clone()), footer.clone(), None, None).unwrap();
+        let mut output = vec![];
+        let (out_header, out_footer) = unpack_stream(relabeled.as_slice(), &mut output, None).unwrap();
+        assert_eq!(output, raw_data);
+        assert_eq!(out_header.unwrap(), new_header);
+        assert_eq!(out_footer, footer);
+        assert_eq!(unpack_metadata(std::io::Cursor::new(&relabeled), None).unwrap().1, footer);
+
+        // Switching to another key and back gives the original cart
+        let key = b"0123456789abcdef".to_vec();
+        let (raw_header, raw_footer) = unpack_raw_metadata(std::io::Cursor::new(&packed), None).unwrap();
+        let mut rekeyed = vec![];
+        repack_metadata_raw(std::io::Cursor::new(&packed), &mut rekeyed, raw_header.clone(), raw_footer.clone(),
+            None, Some(key.clone())).unwrap();
+        assert!(unpack_stream(rekeyed.as_slice(), &mut vec![], None).is_err());
+        let mut output = vec![];
+        unpack_stream(rekeyed.as_slice(), &mut output, Some(key.clone())).unwrap();
+        assert_eq!(output, raw_data);
+
+        let mut restored = vec![];
+        repack_metadata_raw(std::io::Cursor::new(&rekeyed), &mut restored, raw_header, raw_footer,
+            Some(key), None).unwrap();
+        assert_eq!(restored, packed);
+
+        assert!(repack_metadata(std::io::Cursor::new(&packed[0..packed.len() - 1]), &mut vec![], None, None, None, None).is_err());
+    }
+
+    #[test]
+    fn unpack_prefix_only() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut header = JsonMap::new();
+        header.insert("name".to_owned(), serde_json::to_value("cart.rs").unwrap());
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, Some(header.clone()), None, default_digesters(), None).unwrap();
+
+        for size in [0, 1, 4096, raw_data.len(), raw_data.len() + 100] {
+            let mut output = vec![0u8; size];
+            let (filled, h, f) = unpack_prefix(std::io::Cursor::new(&buffer), &mut output, None).unwrap();
+            assert_eq!(filled, size.min(raw_data.len()));
+            assert_eq!(&output[0..filled], &raw_data[0..filled]);
+            assert_eq!(h, Some(header.clone()));
+            assert!(f.unwrap().contains_key("length"));
+        }
+
+        // A truncated trailer only loses the footer
+        for cut in [1, 100] {
+            let mut output = vec![0u8; 4096];
+            let (filled, h, f) = unpack_prefix(std::io::Cursor::new(&buffer[0..buffer.len() - cut]), &mut output, None).unwrap();
+            assert_eq!(filled, 4096);
+            assert_eq!(&output[..], &raw_data[0..4096]);
+            assert_eq!(h, Some(header.clone()));
+            assert!(f.is_none());
+        }
+
+        // The header is still required
+        let mut output = vec![0u8; 16];
+        assert!(unpack_prefix(std::io::Cursor::new(&buffer[0..20]), &mut output, None).is_err());
+    }
+
+    #[test]
+    fn digest_on_unpack() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, None, default_digesters(), None).unwrap();
+
+        let mut output = vec![];
+        let (_, footer, digests) = unpack_stream_digested(buffer.as_slice(), &mut output, default_digesters(), None).unwrap();
+        assert_eq!(output, raw_data);
+        assert_eq!(digests, footer.unwrap());
+
+        let mut output = vec![];
+        let (_, _, digests) = unpack_stream_seekable_digested(std::io::Cursor::new(&buffer), &mut output,
+            vec![Box::new(crate::digesters::SHA256Digest::new())], None).unwrap();
+        assert_eq!(output, raw_data);
+        assert_eq!(digests.get("sha256").unwrap(), &serde_json::to_value(format!("{:x}", sha2::Sha256::digest(raw_data))).unwrap());
+        assert_eq!(digests.len(), 1);
+    }
+
     #[test]
     fn empty() {
         let raw_data = vec![];
@@ -378,6 +1624,39 @@ mod tests {
         assert_eq!(output, raw_data);
     }
 
+    #[test]
+    fn compression_levels() {
+        let raw_data = std::include_bytes!("cart.rs");
+
+        let mut sizes = vec![];
+        for compression_level in [0, 1, 9] {
+            let options = PackOptions{compression_level, ..Default::default()};
+            let mut buffer = vec![];
+            pack_stream_ex(&raw_data[..], &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+            sizes.push(buffer.len());
+
+            let mut output = vec![];
+            unpack_stream(buffer.as_slice(), &mut output, None).unwrap();
+            assert_eq!(output, raw_data);
+
+            let buffer = pack_data(raw_data, None, None, default_digesters(), None, &options).unwrap();
+            let mut output = vec![];
+            unpack_stream(buffer.as_slice(), &mut output, None).unwrap();
+            assert_eq!(output, raw_data);
+        }
+
+        // Stored data can't be smaller than the input
+        assert!(sizes[0] > raw_data.len());
+        assert!(sizes[1] < sizes[0]);
+        assert!(sizes[2] <= sizes[1]);
+
+        // Out of range levels are rejected
+        let options = PackOptions{compression_level: 10, ..Default::default()};
+        let mut buffer = vec![];
+        assert!(pack_stream_ex(&raw_data[..], &mut buffer, None, None, vec![], None, &options).is_err());
+        assert!(pack_data(raw_data, None, None, vec![], None, &options).is_err());
+    }
+
     #[test]
     fn incomplete_data() {
         let raw_data = std::include_bytes!("cart.rs");
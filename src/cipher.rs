@@ -3,63 +3,99 @@
 
 use std::io::{Read, Write};
 use anyhow::Context;
+use flate2::{Compress, Compression, FlushCompress, Status};
 use rc4::{KeyInit, StreamCipher};
 
 use crate::cart::BLOCK_SIZE;
+use crate::seek::SeekPoint;
+use crate::stats::{record, record_io, Stage};
 
 
 /// Alias for the specific configuration of RC4 that cart uses.
-pub (crate) type Rc4 = rc4::Rc4::<rc4::consts::U16>;
+pub type Rc4 = rc4::Rc4::<rc4::consts::U16>;
 
 /// Our default passkey for rc4 is the first 8 digits of PI twice.
-pub (crate) const DEFAULT_RC4_KEY: [u8; 16] = [
+pub const DEFAULT_RC4_KEY: [u8; 16] = [
     0x03, 0x01, 0x04, 0x01, 0x05, 0x09, 0x02, 0x06,
     0x03, 0x01, 0x04, 0x01, 0x05, 0x09, 0x02, 0x06
 ];
 
 
 /// A utility object that adapts a reader to apply the RC4 cypher as data is read.
-/// A buffer of read data is preserved to allow access to trailing data after expected stream content is exhausted.
-pub (crate) struct CipherPassthroughIn<IN: Read> {
+///
+/// Data is read straight into the caller's buffer and deciphered in place.
+pub struct CipherPassthroughIn<IN: Read> {
     stream: IN,
     cipher: Rc4,
-    buffer: Vec<u8>
 }
 
 impl<IN: Read> Read for CipherPassthroughIn<IN> {
     fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
-        // make sure the intermediary buffer is the right size
-        self.buffer.resize(buf.len(), 0);
-
-        // Perform the underlying read
-        let out = self.stream.read(&mut self.buffer);
-
-        if let Ok(size) = &out {
-            // Trim the buffer to frame actual content
-            self.buffer.resize(*size, 0);
-
-            // Apply the rc4 cipher pass and copy at the same time
-            if let Err(err) = self.cipher.apply_keystream_b2b(&self.buffer, &mut buf[0..*size]) {
-                return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, anyhow::anyhow!("rc4 error {err}")))
-            }
+        let size = record_io(Stage::Read, || self.stream.read(buf))?;
+        if let Err(err) = record(Stage::Cipher, size, || self.cipher.try_apply_keystream(&mut buf[0..size])) {
+            return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, anyhow::anyhow!("rc4 error {err}")))
         }
-        return out;
+        return Ok(size)
     }
 }
 
 impl<IN: Read> CipherPassthroughIn<IN> {
+    /// Decipher a stream that is limited to the ciphered content.
     pub fn new(stream: IN, cipher: Rc4) -> Self {
         Self {
             stream,
             cipher,
-            buffer: vec![]
         }
     }
+}
+
+
+/// A utility object that deciphers a reader whose ciphered content is followed by raw data.
+///
+/// Where the ciphered content ends is only found once it has been read past, by which point
+/// the start of the raw data has been deciphered along with it. Rather than copying each read,
+/// the key stream state from before the last read is kept, so the raw data can be recovered
+/// by applying the same key stream to it again.
+pub struct CipherTrailingIn<IN: Read> {
+    stream: IN,
+    cipher: Rc4Stream,
+    saved: Rc4Stream,
+    last_read: usize,
+}
+
+impl<IN: Read> Read for CipherTrailingIn<IN> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        let size = record_io(Stage::Read, || self.stream.read(buf))?;
+        self.saved.clone_from(&self.cipher);
+        self.last_read = size;
+        record(Stage::Cipher, size, || self.cipher.apply(&mut buf[0..size]));
+        return Ok(size)
+    }
+}
+
+impl<IN: Read> CipherTrailingIn<IN> {
+    pub fn new(stream: IN, key: &[u8]) -> anyhow::Result<Self> {
+        let cipher = Rc4Stream::new(key)?;
+        Ok(Self {
+            stream,
+            saved: cipher.clone(),
+            cipher,
+            last_read: 0,
+        })
+    }
 
-    // Extract the last chunk read from the stream. This can be used to
-    // recover less-than-chunk sized footer data that was appended.
-    pub fn last_chunk(self) -> Vec<u8> {
-        self.buffer
+    /// Extract the underlying stream, restoring the raw form of data that was read but not used.
+    ///
+    /// The data must be the end of what the last read returned, such as what a buffered
+    /// reader over this one has left. It is ciphered back to its raw form in place.
+    pub fn into_inner_restoring(self, unread: &mut [u8]) -> anyhow::Result<IN> {
+        if unread.len() > self.last_read {
+            return Err(anyhow::anyhow!("More data left unread than was last read"))
+        }
+        let mut cipher = self.saved;
+        cipher.skip(self.last_read - unread.len());
+        cipher.apply(unread);
+        return Ok(self.stream)
     }
 }
 
@@ -67,25 +103,28 @@ impl<IN: Read> CipherPassthroughIn<IN> {
 /// A utility object that adapts a writer to apply the RC4 cypher as data is written.
 ///
 /// Since the content buffer as defined by the Write trait is const, we need to
-/// use an intermediary buffer to apply the rc4.
-pub (crate) struct CipherPassthroughOut<'a, OUT: Write> {
+/// use an intermediary buffer to apply the rc4. The packing paths cipher their own
+/// output buffers in place instead, so this is only kept to check and measure them against.
+#[cfg(any(test, feature = "bench"))]
+pub struct CipherPassthroughOut<'a, OUT: Write> {
     cipher: Rc4,
     output: &'a mut OUT,
     buffer: Vec<u8>,
 }
 
+#[cfg(any(test, feature = "bench"))]
 impl<'a, OUT: Write> Write for CipherPassthroughOut<'a, OUT> {
     fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
         // Adjust buffer to fit
         self.buffer.resize(buf.len(), 0);
 
         // Apply rc4 pass and copy between buffers at the same time
-        if let Err(err) = self.cipher.apply_keystream_b2b(buf, &mut self.buffer) {
+        if let Err(err) = record(Stage::Cipher, buf.len(), || self.cipher.apply_keystream_b2b(buf, &mut self.buffer)) {
             return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, anyhow::anyhow!(err)))
         };
 
         // Call the underlying write operation
-        self.output.write_all(&self.buffer[0..buf.len()])?;
+        record(Stage::Write, buf.len(), || self.output.write_all(&self.buffer[0..buf.len()]))?;
         return Ok(buf.len());
     }
 
@@ -94,6 +133,7 @@ impl<'a, OUT: Write> Write for CipherPassthroughOut<'a, OUT> {
     }
 }
 
+#[cfg(any(test, feature = "bench"))]
 impl<'a, OUT: Write> CipherPassthroughOut<'a, OUT> {
     pub fn new(output: &'a mut OUT, rc4_key: &Vec<u8>) -> anyhow::Result<Self> {
         Ok(Self {
@@ -102,4 +142,383 @@ impl<'a, OUT: Write> CipherPassthroughOut<'a, OUT> {
             buffer: vec![0u8; BLOCK_SIZE]
         })
     }
-}
\ No newline at end of file
+}
+
+/// A zlib encoder that applies the RC4 cypher to its output in place before writing it.
+///
+/// This replaces a [flate2::write::ZlibEncoder] writing to a `CipherPassthroughOut`,
+/// the compressed data is ciphered in the compressor's own output buffer rather than copied.
+/// It can also make full flush points at a fixed interval of input, see [crate::seek].
+pub (crate) struct CipherEncoder<OUT: Write> {
+    compress: Compress,
+    cipher: Rc4,
+    output: OUT,
+    buffer: Vec<u8>,
+    /// Input bytes between full flush points, zero to never make them
+    index_interval: u64,
+    index: Vec<SeekPoint>,
+}
+
+impl<OUT: Write> CipherEncoder<OUT> {
+    pub fn new(output: OUT, rc4_key: &[u8], level: Compression) -> anyhow::Result<Self> {
+        Ok(Self {
+            compress: Compress::new(level, true),
+            cipher: Rc4::new_from_slice(rc4_key).context("Bad RC4 Key")?,
+            output,
+            buffer: Vec::with_capacity(BLOCK_SIZE),
+            index_interval: 0,
+            index: vec![],
+        })
+    }
+
+    /// Make a full flush point every `interval` bytes of input, zero for none.
+    pub fn with_index(mut self, interval: u64) -> Self {
+        self.index_interval = interval;
+        self
+    }
+
+    /// Take the flush points made so far, None if they aren't being made.
+    pub fn take_index(&mut self) -> Option<Vec<SeekPoint>> {
+        if self.index_interval == 0 {
+            return None
+        }
+        Some(std::mem::take(&mut self.index))
+    }
+
+    /// Access the output, for callers that collect output in a buffer and drain it as they go.
+    pub fn get_ref(&self) -> &OUT {
+        &self.output
+    }
+
+    /// Access the output, for callers that collect output in a buffer and drain it as they go.
+    pub fn get_mut(&mut self) -> &mut OUT {
+        &mut self.output
+    }
+
+    /// Finish the compressed stream, returning the number of bytes written to the output.
+    pub fn finish(self) -> anyhow::Result<u64> {
+        Ok(self.finish_output()?.0)
+    }
+
+    /// Finish the compressed stream, returning the number of bytes written and the output.
+    pub fn finish_output(mut self) -> anyhow::Result<(u64, OUT)> {
+        loop {
+            let status = record(Stage::Deflate, 0, || self.compress.compress_vec(&[], &mut self.buffer, FlushCompress::Finish))?;
+            if status == Status::StreamEnd {
+                break
+            }
+            if self.buffer.is_empty() {
+                return Err(anyhow::anyhow!("Compressor could not finish stream"))
+            }
+            self.write_buffer()?;
+        }
+        self.write_buffer()?;
+        return Ok((self.compress.total_out(), self.output))
+    }
+
+    /// Compress all of the given data, writing out the buffer whenever it fills.
+    ///
+    /// Writing out the buffer is counted as its own stages rather than as compression.
+    fn compress_all(&mut self, buf: &[u8]) -> std::io::Result<()> {
+        record(Stage::Deflate, buf.len(), || self.compress_all_untimed(buf))
+    }
+
+    fn compress_all_untimed(&mut self, buf: &[u8]) -> std::io::Result<()> {
+        let start = self.compress.total_in();
+        while ((self.compress.total_in() - start) as usize) < buf.len() {
+            let consumed = (self.compress.total_in() - start) as usize;
+            self.compress.compress_vec(&buf[consumed..], &mut self.buffer, FlushCompress::None)
+                .map_err(|err| std::io::Error::new(std::io::ErrorKind::Other, err))?;
+            if self.buffer.len() == self.buffer.capacity() {
+                self.write_buffer()?;
+            }
+        }
+        return Ok(())
+    }
+
+    /// Write out everything given so far with a full flush and record the point.
+    ///
+    /// After a full flush the output is byte aligned and nothing later refers back to
+    /// earlier data, so raw inflating can start from this point on its own.
+    fn full_flush(&mut self) -> std::io::Result<()> {
+        loop {
+            record(Stage::Deflate, 0, || self.compress.compress_vec(&[], &mut self.buffer, FlushCompress::Full))
+                .map_err(|err| std::io::Error::new(std::io::ErrorKind::Other, err))?;
+            let filled = self.buffer.len() == self.buffer.capacity();
+            self.write_buffer()?;
+            if !filled {
+                break
+            }
+        }
+        self.index.push(SeekPoint {
+            compressed: self.compress.total_out(),
+            decoded: self.compress.total_in(),
+        });
+        return Ok(())
+    }
+
+    /// Cipher and write out the compressed data held in the buffer.
+    fn write_buffer(&mut self) -> std::io::Result<()> {
+        if let Err(err) = record(Stage::Cipher, self.buffer.len(), || self.cipher.try_apply_keystream(&mut self.buffer)) {
+            return Err(std::io::Error::new(std::io::ErrorKind::InvalidData, anyhow::anyhow!(err)))
+        }
+        record(Stage::Write, self.buffer.len(), || self.output.write_all(&self.buffer))?;
+        self.buffer.clear();
+        return Ok(())
+    }
+}
+
+impl<OUT: Write> Write for CipherEncoder<OUT> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if self.index_interval == 0 {
+            self.compress_all(buf)?;
+            return Ok(buf.len())
+        }
+
+        // Split the input at each interval, flushing only once more data follows a boundary
+        let mut remaining = buf;
+        while !remaining.is_empty() {
+            let total_in = self.compress.total_in();
+            let offset = total_in % self.index_interval;
+            if total_in > 0 && offset == 0 && self.index.last().map_or(true, |point| point.decoded != total_in) {
+                self.full_flush()?;
+            }
+            let room = (self.index_interval - offset).min(remaining.len() as u64) as usize;
+            let (now, rest) = remaining.split_at(room);
+            self.compress_all(now)?;
+            remaining = rest;
+        }
+        return Ok(buf.len())
+    }
+
+    /// Only the output is flushed, compressed data still held by the compressor stays there.
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.output.flush()
+    }
+}
+
+
+/// Advance a cipher past the given number of keystream bytes without using them.
+pub (crate) fn skip_keystream(cipher: &mut Rc4, mut count: u64) -> anyhow::Result<()> {
+    let mut discard = vec![0u8; BLOCK_SIZE];
+    while count > 0 {
+        let size = count.min(BLOCK_SIZE as u64) as usize;
+        cipher.try_apply_keystream(&mut discard[0..size])?;
+        count -= size as u64;
+    }
+    return Ok(())
+}
+
+/// How many independent streams [apply_keystreams] runs interleaved.
+pub (crate) const RC4_LANES: usize = 4;
+
+/// The state of one RC4 key stream.
+///
+/// This gives the same key stream as [Rc4], but its state can be copied to replay the stream from a point.
+#[derive(Clone)]
+pub (crate) struct Rc4Stream {
+    s: [u8; 256],
+    i: u8,
+    j: u8,
+}
+
+impl Rc4Stream {
+    pub (crate) fn new(key: &[u8]) -> anyhow::Result<Self> {
+        // Keep the same key requirements as the single stream cipher
+        if key.len() != DEFAULT_RC4_KEY.len() {
+            return Err(anyhow::anyhow!("Bad RC4 Key"))
+        }
+        let mut s = [0u8; 256];
+        for (index, value) in s.iter_mut().enumerate() {
+            *value = index as u8;
+        }
+        let mut j = 0u8;
+        for index in 0..256 {
+            j = j.wrapping_add(s[index]).wrapping_add(key[index % key.len()]);
+            s.swap(index, j as usize);
+        }
+        Ok(Self { s, i: 0, j: 0 })
+    }
+
+    #[inline(always)]
+    fn next(&mut self) -> u8 {
+        self.i = self.i.wrapping_add(1);
+        let si = self.s[self.i as usize];
+        self.j = self.j.wrapping_add(si);
+        let sj = self.s[self.j as usize];
+        self.s[self.i as usize] = sj;
+        self.s[self.j as usize] = si;
+        self.s[si.wrapping_add(sj) as usize]
+    }
+
+    /// Cipher data in place.
+    pub (crate) fn apply(&mut self, data: &mut [u8]) {
+        for byte in data.iter_mut() {
+            *byte ^= self.next();
+        }
+    }
+
+    /// Advance past the given number of key stream bytes without using them.
+    pub (crate) fn skip(&mut self, count: usize) {
+        for _ in 0..count {
+            self.next();
+        }
+    }
+}
+
+/// One RC4 key stream and the data it is ciphering, so several can be stepped together.
+struct Rc4Lane<'a> {
+    stream: Rc4Stream,
+    data: &'a mut [u8],
+}
+
+impl<'a> Rc4Lane<'a> {
+    fn new(key: &[u8], data: &'a mut [u8]) -> anyhow::Result<Self> {
+        Ok(Self { stream: Rc4Stream::new(key)?, data })
+    }
+
+    #[inline(always)]
+    fn next(&mut self) -> u8 {
+        self.stream.next()
+    }
+
+    /// Drop the first bytes of this lane's data once they have been ciphered.
+    fn advance(&mut self, size: usize) {
+        let data = std::mem::take(&mut self.data);
+        self.data = &mut data[size..];
+    }
+}
+
+/// Cipher the same number of bytes from the front of every lane, one byte from each in turn.
+#[inline(always)]
+fn interleave<const N: usize>(lanes: &mut [Rc4Lane; N], size: usize) {
+    for index in 0..size {
+        for lane in lanes.iter_mut() {
+            lane.data[index] ^= lane.next();
+        }
+    }
+    for lane in lanes.iter_mut() {
+        lane.advance(size);
+    }
+}
+
+/// Apply the RC4 cypher to several independent buffers, each with its own key.
+///
+/// Every byte of an RC4 key stream depends on the state left by the byte before it,
+/// so a single stream can't go faster than that chain allows. Stepping several streams
+/// in turn gives the processor independent work to overlap. The result is the same
+/// as ciphering each buffer on its own with a new [Rc4].
+pub (crate) fn apply_keystreams(streams: &mut [(&[u8], &mut [u8])]) -> anyhow::Result<()> {
+    for group in streams.chunks_mut(RC4_LANES) {
+        let mut lanes = vec![];
+        for (key, data) in group.iter_mut() {
+            lanes.push(Rc4Lane::new(key, data)?);
+        }
+
+        // Run the lanes together until the shortest is done, then carry on with the rest
+        loop {
+            lanes.retain(|lane| !lane.data.is_empty());
+            let size = match lanes.iter().map(|lane| lane.data.len()).min() {
+                Some(size) => size,
+                None => break,
+            };
+            match lanes.len() {
+                4 => interleave::<4>((&mut lanes[..]).try_into().unwrap(), size),
+                3 => interleave::<3>((&mut lanes[..]).try_into().unwrap(), size),
+                2 => interleave::<2>((&mut lanes[..]).try_into().unwrap(), size),
+                _ => for lane in lanes.iter_mut() {
+                    for index in 0..size {
+                        lane.data[index] ^= lane.next();
+                    }
+                    lane.advance(size);
+                },
+            }
+        }
+    }
+    return Ok(())
+}
+
+
+#[cfg(test)]
+mod tests {
+    use std::io::{Read, Write};
+
+    use rc4::{KeyInit, StreamCipher};
+
+    use super::{apply_keystreams, CipherEncoder, CipherPassthroughIn, CipherPassthroughOut, CipherTrailingIn, Rc4, DEFAULT_RC4_KEY};
+
+    #[test]
+    fn in_place() {
+        let raw_data = std::include_bytes!("cipher.rs");
+
+        // The in place encoder should match the encoder chain it replaces
+        let mut expected = vec![];
+        let mut bz = flate2::write::ZlibEncoder::new(
+            CipherPassthroughOut::new(&mut expected, &DEFAULT_RC4_KEY.to_vec()).unwrap(),
+            flate2::Compression::new(6));
+        bz.write_all(raw_data).unwrap();
+        bz.try_finish().unwrap();
+        drop(bz);
+
+        let mut output = vec![];
+        let mut encoder = CipherEncoder::new(&mut output, &DEFAULT_RC4_KEY, flate2::Compression::new(6)).unwrap();
+        for block in raw_data.chunks(1000) {
+            encoder.write_all(block).unwrap();
+        }
+        assert_eq!(encoder.finish().unwrap(), expected.len() as u64);
+        assert_eq!(output, expected);
+
+        let cipher = Rc4::new_from_slice(&DEFAULT_RC4_KEY).unwrap();
+        let mut reader = flate2::read::ZlibDecoder::new(CipherPassthroughIn::new(&expected[..], cipher));
+        let mut decoded = vec![];
+        reader.read_to_end(&mut decoded).unwrap();
+        assert_eq!(decoded, raw_data);
+
+        // Raw data after the ciphered content can be recovered from the end of the last read
+        output.extend_from_slice(b"trailer");
+        for size in [10, 1000, output.len() + 10] {
+            let mut reader = CipherTrailingIn::new(output.as_slice(), &DEFAULT_RC4_KEY).unwrap();
+            let mut buffer = vec![0u8; size];
+            let mut total = 0;
+            let mut last = 0;
+            while total < output.len() {
+                last = reader.read(&mut buffer).unwrap();
+                total += last;
+            }
+            let unread_size = last.min(7);
+            let mut unread = buffer[last - unread_size..last].to_vec();
+            reader.into_inner_restoring(&mut unread).unwrap();
+            assert_eq!(unread, &b"trailer"[7 - unread_size..]);
+        }
+        let reader = CipherTrailingIn::new(output.as_slice(), &DEFAULT_RC4_KEY).unwrap();
+        assert!(reader.into_inner_restoring(&mut [0u8; 1]).is_err());
+    }
+
+    #[test]
+    fn interleaved() {
+        let raw_data = std::include_bytes!("cipher.rs");
+        let keys: Vec<Vec<u8>> = (0..7u8).map(|index| {
+            let mut key = DEFAULT_RC4_KEY.to_vec();
+            key[0] = index;
+            key
+        }).collect();
+
+        // Streams of different lengths, including an empty one
+        let mut expected = vec![];
+        let mut buffers = vec![];
+        for (index, key) in keys.iter().enumerate() {
+            let mut data = raw_data[0..(index * 997) % raw_data.len()].to_vec();
+            buffers.push(data.clone());
+            Rc4::new_from_slice(key).unwrap().apply_keystream(&mut data);
+            expected.push(data);
+        }
+
+        let mut streams: Vec<(&[u8], &mut [u8])> = keys.iter().map(|key| &key[..])
+            .zip(buffers.iter_mut().map(|data| &mut data[..])).collect();
+        apply_keystreams(&mut streams).unwrap();
+        assert_eq!(buffers, expected);
+
+        let mut data = vec![0u8; 10];
+        assert!(apply_keystreams(&mut [(&b"short"[..], &mut data[..])]).is_err());
+    }
+}
@@ -0,0 +1,436 @@
+//! A reusable encoder and decoder for processing many small cart files.
+//!
+//! Each of the functions in the [cart](crate::cart) module sets up new buffers,
+//! compressor state, and digests for every call. When the data being processed
+//! is small that setup can take longer than the work itself. A [CartContext]
+//! keeps that state between calls and resets it instead.
+
+use std::io::{Read, Write};
+use std::ops::Range;
+
+use anyhow::Context;
+use flate2::{Compress, Compression, Decompress, FlushCompress, FlushDecompress, Status};
+use rc4::{KeyInit, StreamCipher};
+
+use crate::cart::{JsonMap, BLOCK_SIZE, DEFAULT_COMPRESSION_LEVEL, LARGE_BLOCK_SIZE};
+use crate::cart::{MANDATORY_HEADER_SIZE, MANDATORY_FOOTER_SIZE, METADATA_RESERVE};
+use crate::cart::{select_key, pack_header, finish_digests, pack_footer, unpack_header, unpack_footer_at_end};
+use crate::cipher::{apply_keystreams, Rc4};
+use crate::deflate::{zlib_bound, MAX_DEFLATE_RATIO};
+use crate::digesters::{default_digesters, Digester};
+
+/// Buffers that grow larger than this are released after a call rather than kept.
+const RETAINED_BUFFER_LIMIT: usize = 4 * LARGE_BLOCK_SIZE;
+
+
+/// Encoder and decoder state kept between calls.
+///
+/// Data is always processed whole, so a context is best suited to data that
+/// comfortably fits in memory. Encoding always uses the default digests.
+/// A context may be moved between threads but only used by one at a time,
+/// each worker thread should hold its own.
+pub struct CartContext {
+    compress: Compress,
+    decompress: Decompress,
+    digesters: Vec<Box<dyn Digester>>,
+    /// Raw data read from streams
+    input: Vec<u8>,
+    /// Deciphered compressed body
+    body: Vec<u8>,
+    /// Encoded or decoded data written to streams
+    output: Vec<u8>,
+}
+
+impl CartContext {
+    /// Create a context that encodes at the default compression level.
+    pub fn new() -> Self {
+        Self {
+            compress: Compress::new(Compression::new(DEFAULT_COMPRESSION_LEVEL), true),
+            decompress: Decompress::new(true),
+            digesters: default_digesters(),
+            input: vec![],
+            body: vec![],
+            output: vec![],
+        }
+    }
+
+    /// Encode a buffer held in memory.
+    pub fn pack_data(&mut self, data: &[u8], optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+        rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<Vec<u8>>
+    {
+        // Encode into a new buffer since it is being returned, sized so that it rarely grows
+        let mut output = Vec::with_capacity(MANDATORY_HEADER_SIZE + zlib_bound(data.len())
+            + MANDATORY_FOOTER_SIZE + METADATA_RESERVE);
+        let result = self.encode(data, optional_header, optional_footer, rc4_key_override, &mut output);
+        self.release();
+        result?;
+        return Ok(output)
+    }
+
+    /// Encode a stream, reading it entirely into memory first.
+    pub fn pack_stream<IN: Read, OUT: Write>(&mut self, mut istream: IN, mut ostream: OUT,
+        optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+        rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+    {
+        let mut input = std::mem::take(&mut self.input);
+        let mut output = std::mem::take(&mut self.output);
+        input.clear();
+        let result = istream.read_to_end(&mut input).context("reading input")
+            .and_then(|_| self.encode(&input, optional_header, optional_footer, rc4_key_override, &mut output))
+            .and_then(|_| Ok(ostream.write_all(&output)?))
+            .and_then(|_| Ok(ostream.flush()?));
+        self.input = input;
+        self.output = output;
+        self.release();
+        return result
+    }
+
+    /// Decode cart data held in memory.
+    pub fn unpack_data(&mut self, data: &[u8], rc4_key_override: Option<Vec<u8>>)
+        -> anyhow::Result<(Vec<u8>, Option<JsonMap>, Option<JsonMap>)>
+    {
+        // Decode into a new buffer since it is being returned, sizing it from
+        // the recorded length when it is plausible for the input given.
+        let mut output = vec![];
+        let result = self.decode(data, &mut output, rc4_key_override, true);
+        self.release();
+        let (optional_header, optional_footer) = result?;
+        return Ok((output, optional_header, optional_footer))
+    }
+
+    /// Decode a cart stream, reading it entirely into memory first.
+    pub fn unpack_stream<IN: Read, OUT: Write>(&mut self, mut istream: IN, mut ostream: OUT,
+        rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+    {
+        let mut input = std::mem::take(&mut self.input);
+        let mut output = std::mem::take(&mut self.output);
+        input.clear();
+        let result = istream.read_to_end(&mut input).context("reading input")
+            .and_then(|_| self.decode(&input, &mut output, rc4_key_override, false))
+            .and_then(|metadata| {
+                ostream.write_all(&output)?;
+                ostream.flush()?;
+                Ok(metadata)
+            });
+        self.input = input;
+        self.output = output;
+        self.release();
+        return result
+    }
+
+    /// Encode several buffers, ciphering their bodies together.
+    ///
+    /// This gives the same result as calling [pack_data](Self::pack_data) for each item,
+    /// but runs the cipher for several items at once, which is faster
+    /// when the items are small. Each item is a buffer and its optional header.
+    pub fn pack_data_group(&mut self, items: &[(&[u8], Option<JsonMap>)], rc4_key_override: Option<Vec<u8>>)
+        -> Vec<anyhow::Result<Vec<u8>>>
+    {
+        let mut results = vec![];
+        let mut bodies = vec![];
+        for (data, optional_header) in items {
+            let mut output = vec![];
+            let result = self.encode_into(data, optional_header.clone(), None, rc4_key_override.clone(), &mut output);
+            results.push(result.map(|(rc4_key, body)| {
+                bodies.push((rc4_key, body));
+                output
+            }));
+        }
+
+        // Cipher every body that was compressed successfully
+        let mut outputs: Vec<&mut Vec<u8>> = results.iter_mut().filter_map(|result| result.as_mut().ok()).collect();
+        let mut streams: Vec<(&[u8], &mut [u8])> = outputs.iter_mut().zip(bodies.iter())
+            .map(|(output, (rc4_key, body))| (&rc4_key[..], &mut output[body.clone()]))
+            .collect();
+        if let Err(err) = apply_keystreams(&mut streams) {
+            let message = format!("{err}");
+            return items.iter().map(|_| Err(anyhow::anyhow!("{message}"))).collect()
+        }
+        self.release();
+        return results
+    }
+
+    /// Decode several buffers of cart data, deciphering their bodies together.
+    ///
+    /// This gives the same result as calling [unpack_data](Self::unpack_data) for each item,
+    /// but runs the cipher for several items at once, which is faster
+    /// when the items are small.
+    pub fn unpack_data_group(&mut self, items: &[&[u8]], rc4_key_override: Option<Vec<u8>>)
+        -> Vec<anyhow::Result<(Vec<u8>, Option<JsonMap>, Option<JsonMap>)>>
+    {
+        // Gather the bodies into the reusable buffer
+        let mut body = std::mem::take(&mut self.body);
+        body.clear();
+        let mut located = vec![];
+        for data in items {
+            located.push(self.locate(data, rc4_key_override.clone()).map(|(rc4_key, header, footer, range)| {
+                let start = body.len();
+                body.extend_from_slice(&data[range]);
+                (rc4_key, header, footer, start..body.len())
+            }));
+        }
+
+        // Split the buffer back into a slice per body to decipher them
+        let mut streams: Vec<(&[u8], &mut [u8])> = vec![];
+        let mut rest = &mut body[..];
+        for (rc4_key, _, _, range) in located.iter().filter_map(|item| item.as_ref().ok()) {
+            let (stream, remaining) = std::mem::take(&mut rest).split_at_mut(range.len());
+            streams.push((&rc4_key[..], stream));
+            rest = remaining;
+        }
+        let deciphered = apply_keystreams(&mut streams).map_err(|err| format!("{err}"));
+
+        let mut results = vec![];
+        for item in located {
+            results.push(match (item, &deciphered) {
+                (Ok((_, header, footer, range)), Ok(_)) => {
+                    let mut output = vec![];
+                    self.reserve_length(&footer, range.len(), &mut output);
+                    self.inflate(&body[range], &mut output).map(|_| (output, header, footer))
+                },
+                (Err(err), _) => Err(err),
+                (_, Err(err)) => Err(anyhow::anyhow!("{err}")),
+            });
+        }
+        self.body = body;
+        self.release();
+        return results
+    }
+
+    /// Encode the data into the given output buffer.
+    fn encode(&mut self, data: &[u8], optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+        rc4_key_override: Option<Vec<u8>>, output: &mut Vec<u8>) -> anyhow::Result<()>
+    {
+        let (rc4_key, body) = self.encode_into(data, optional_header, optional_footer, rc4_key_override, output)?;
+        let mut cipher = Rc4::new_from_slice(&rc4_key).context("Bad RC4 Key")?;
+        cipher.try_apply_keystream(&mut output[body])?;
+        return Ok(())
+    }
+
+    /// Encode the data into an output buffer, leaving the body to be ciphered.
+    ///
+    /// This returns the key and location of the body that still needs the cipher applied.
+    fn encode_into(&mut self, data: &[u8], optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+        rc4_key_override: Option<Vec<u8>>, output: &mut Vec<u8>) -> anyhow::Result<(Vec<u8>, Range<usize>)>
+    {
+        output.clear();
+        let (rc4_key, key_override) = select_key(rc4_key_override);
+        let pos = pack_header(&mut *output, &rc4_key, key_override, optional_header)?;
+
+        for digest in self.digesters.iter_mut() {
+            digest.update(data)?;
+        }
+
+        // Compress the whole buffer in one pass, growing the output only once it is full
+        self.compress.reset();
+        let body_start = output.len();
+        loop {
+            if output.len() == output.capacity() {
+                output.reserve(BLOCK_SIZE);
+            }
+            let consumed = self.compress.total_in() as usize;
+            let status = self.compress.compress_vec(&data[consumed..], output, FlushCompress::Finish)?;
+            if status == Status::StreamEnd {
+                break
+            }
+        }
+        let body = body_start..output.len();
+
+        // The footer is ciphered separately so it can be written before the body is ciphered
+        let optional_footer = finish_digests(optional_footer, &mut self.digesters);
+        pack_footer(&mut *output, &rc4_key, pos + body.len() as u64, optional_footer)?;
+        return Ok((rc4_key, body))
+    }
+
+    /// Decode the data into the given output buffer, optionally reserving the recorded length first.
+    fn decode(&mut self, data: &[u8], output: &mut Vec<u8>, rc4_key_override: Option<Vec<u8>>,
+        reserve_length: bool) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+    {
+        let (rc4_key, optional_header, optional_footer, range) = self.locate(data, rc4_key_override)?;
+
+        // Decipher the body into the reusable buffer
+        let mut body = std::mem::take(&mut self.body);
+        body.clear();
+        body.extend_from_slice(&data[range]);
+        let mut cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
+        cipher.try_apply_keystream(&mut body)?;
+
+        output.clear();
+        if reserve_length {
+            self.reserve_length(&optional_footer, body.len(), output);
+        }
+
+        let result = self.inflate(&body, output);
+        self.body = body;
+        result?;
+        return Ok((optional_header, optional_footer))
+    }
+
+    /// Read the metadata of cart data, returning the key and the location of the body.
+    fn locate(&self, data: &[u8], rc4_key_override: Option<Vec<u8>>)
+        -> anyhow::Result<(Vec<u8>, Option<JsonMap>, Option<JsonMap>, Range<usize>)>
+    {
+        let mut cursor = std::io::Cursor::new(data);
+        let (rc4_key, optional_header, _pos) = unpack_header(&mut cursor, rc4_key_override)
+            .context("Could not unpack header")?;
+        let body_start = cursor.position() as usize;
+        let (optional_footer, footer_start) = unpack_footer_at_end(&mut cursor, &rc4_key)
+            .context("Could not unpack footer")?;
+        return Ok((rc4_key, optional_header, optional_footer, body_start..footer_start as usize))
+    }
+
+    /// Reserve the recorded length of the decoded data, when it is plausible for the body given.
+    fn reserve_length(&self, optional_footer: &Option<JsonMap>, body_len: usize, output: &mut Vec<u8>) {
+        let length = optional_footer.as_ref()
+            .and_then(|footer| footer.get("length"))
+            .and_then(|length| length.as_str())
+            .and_then(|length| length.parse::<u64>().ok())
+            .unwrap_or(0);
+        output.reserve(length.min((body_len as u64).saturating_mul(MAX_DEFLATE_RATIO)) as usize);
+    }
+
+    /// Inflate a complete zlib stream, growing the output as needed.
+    ///
+    /// The stream must use the whole body, anything after its end is reported as corrupt.
+    fn inflate(&mut self, body: &[u8], output: &mut Vec<u8>) -> anyhow::Result<()> {
+        self.decompress.reset(true);
+        loop {
+            if output.len() == output.capacity() {
+                output.reserve(BLOCK_SIZE.max(output.len()));
+            }
+            let consumed = self.decompress.total_in();
+            let produced = self.decompress.total_out();
+            // Finish would ask for the whole stream in one call, which the rust backend
+            // can't continue from if the output is too small, so the end is left to the stream
+            let status = self.decompress.decompress_vec(&body[consumed as usize..], output, FlushDecompress::None)
+                .context("reading from compressed stream")?;
+            if status == Status::StreamEnd {
+                if self.decompress.total_in() as usize != body.len() {
+                    return Err(anyhow::anyhow!("Corrupt cart: Body continues past the compressed stream"))
+                }
+                return Ok(())
+            }
+
+            // With room left for output, no progress means the body ended early
+            if self.decompress.total_in() == consumed && self.decompress.total_out() == produced
+                && output.len() < output.capacity() {
+                return Err(anyhow::anyhow!("Corrupt cart: Compressed body is truncated"))
+            }
+        }
+    }
+
+    /// Drop any buffers that grew too large to be worth keeping.
+    fn release(&mut self) {
+        if self.input.capacity() > RETAINED_BUFFER_LIMIT {
+            self.input = vec![];
+        }
+        if self.body.capacity() > RETAINED_BUFFER_LIMIT {
+            self.body = vec![];
+        }
+        if self.output.capacity() > RETAINED_BUFFER_LIMIT {
+            self.output = vec![];
+        }
+    }
+}
+
+impl Default for CartContext {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use crate::cart::{JsonMap, pack_stream, unpack_stream, unpack_required_footer};
+    use crate::digesters::default_digesters;
+
+    use super::CartContext;
+
+    #[test]
+    fn reuse() {
+        let raw_data = std::include_bytes!("context.rs");
+        let mut context = CartContext::new();
+
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+
+        for data in [&raw_data[..], &raw_data[100..5000], &[], &raw_data[..]] {
+            // Output should match the streaming encoder, including the digests
+            let mut expected = vec![];
+            pack_stream(data, &mut expected, Some(original_header.clone()), None, default_digesters(), None).unwrap();
+            let packed = context.pack_data(data, Some(original_header.clone()), None, None).unwrap();
+            let mut expected_body = vec![];
+            let expected_meta = unpack_stream(expected.as_slice(), &mut expected_body, None).unwrap();
+
+            let (body, header, footer) = context.unpack_data(&packed, None).unwrap();
+            assert_eq!(body, data);
+            assert_eq!((header, footer), expected_meta);
+
+            let mut output = vec![];
+            let meta = context.unpack_stream(packed.as_slice(), &mut output, None).unwrap();
+            assert_eq!(output, data);
+            assert_eq!(meta, expected_meta);
+
+            let mut repacked = vec![];
+            context.pack_stream(data, &mut repacked, Some(original_header.clone()), None, None).unwrap();
+            assert_eq!(repacked, packed);
+        }
+    }
+
+    #[test]
+    fn group() {
+        let raw_data = std::include_bytes!("context.rs");
+        let mut context = CartContext::new();
+
+        let mut header = JsonMap::new();
+        header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+        let items: Vec<(&[u8], Option<JsonMap>)> = (0..6)
+            .map(|index| (&raw_data[index * 100..raw_data.len() - index * 1000], Some(header.clone())))
+            .collect();
+
+        // Grouped output should match encoding each item alone
+        let packed: Vec<Vec<u8>> = context.pack_data_group(&items, None).into_iter().map(Result::unwrap).collect();
+        for ((data, header), packed) in items.iter().zip(packed.iter()) {
+            assert_eq!(packed, &context.pack_data(data, header.clone(), None, None).unwrap());
+        }
+
+        // Bad items fail on their own
+        let mut inputs: Vec<&[u8]> = packed.iter().map(|packed| &packed[..]).collect();
+        inputs.insert(2, &raw_data[..]);
+        let results = context.unpack_data_group(&inputs, None);
+        assert!(results[2].is_err());
+        for (index, result) in results.into_iter().enumerate().filter(|(index, _)| *index != 2) {
+            let item = if index < 2 { &items[index] } else { &items[index - 1] };
+            let (body, header, _) = result.unwrap();
+            assert_eq!(body, item.0);
+            assert_eq!(header, item.1);
+        }
+    }
+
+    #[test]
+    fn corrupt() {
+        let raw_data = std::include_bytes!("context.rs");
+        let mut context = CartContext::new();
+        let packed = context.pack_data(raw_data, None, None, None).unwrap();
+
+        // A body cut short should fail rather than loop
+        let (_, opt_footer_len) = unpack_required_footer(&packed[packed.len() - 28..]).unwrap();
+        let mut truncated = packed[0..100].to_vec();
+        truncated.extend_from_slice(&packed[packed.len() - 28 - opt_footer_len as usize..]);
+        assert!(context.unpack_data(&truncated, None).is_err());
+        assert!(context.unpack_data(&packed[0..packed.len() - 1], None).is_err());
+
+        // As should one with data after the end of the zlib stream
+        let body_end = packed.len() - 28 - opt_footer_len as usize;
+        let mut trailing = packed[0..body_end].to_vec();
+        trailing.extend_from_slice(&[0x55; 100]);
+        trailing.extend_from_slice(&packed[body_end..]);
+        assert!(context.unpack_data(&trailing, None).is_err());
+        assert!(context.unpack_stream(trailing.as_slice(), &mut vec![], None).is_err());
+
+        // The context should still work afterwards
+        let (body, _, _) = context.unpack_data(&packed, None).unwrap();
+        assert_eq!(body, raw_data);
+    }
+}
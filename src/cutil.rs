@@ -28,6 +28,10 @@ impl std::io::Read for CFileReader {
     }
 }
 
+// The handle is only used from one thread at a time, and libc streams lock
+// internally, so the reader can be handed to the pipelined encoders.
+unsafe impl Send for CFileReader {}
+
 impl CFileReader {
     pub fn new(stream: *mut libc::FILE) -> Result<Self> {
         if stream == null_mut() {
@@ -46,7 +50,12 @@ impl std::io::Write for CFileWriter {
     fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
         unsafe {
             let ptr = buf.as_ptr() as *const c_void;
-            Ok(libc::fwrite(ptr, 1, buf.len(), self.stream))
+            let size = libc::fwrite(ptr, 1, buf.len(), self.stream);
+            // A short write is only an error if the stream says so, otherwise the rest is retried
+            if size < buf.len() && libc::ferror(self.stream) != 0 {
+                return Err(std::io::Error::new(std::io::ErrorKind::Other, anyhow::anyhow!("Failed to write to raw file handle")))
+            }
+            Ok(size)
         }
     }
 
@@ -67,4 +76,123 @@ impl CFileWriter {
             Ok(Self{stream})
         }
     }
-}
\ No newline at end of file
+}
+
+/// Borrow a raw file descriptor, or a HANDLE on windows, as a file without taking ownership of it.
+pub (crate) fn borrow_raw_file(raw: isize) -> Result<std::mem::ManuallyDrop<std::fs::File>> {
+    #[cfg(unix)]
+    {
+        use std::os::unix::io::FromRawFd;
+        if raw < 0 || raw > libc::c_int::MAX as isize {
+            return Err(anyhow::anyhow!("Not a valid file descriptor."))
+        }
+        Ok(std::mem::ManuallyDrop::new(unsafe { std::fs::File::from_raw_fd(raw as libc::c_int) }))
+    }
+
+    #[cfg(windows)]
+    {
+        use std::os::windows::io::{FromRawHandle, RawHandle};
+        if raw == 0 || raw == -1 {
+            return Err(anyhow::anyhow!("Not a valid file handle."))
+        }
+        Ok(std::mem::ManuallyDrop::new(unsafe { std::fs::File::from_raw_handle(raw as RawHandle) }))
+    }
+}
+
+/// Tell the kernel a file will be read from start to end, so it can read further ahead.
+pub (crate) fn advise_sequential(_file: &std::fs::File) {
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    unsafe {
+        use std::os::unix::io::AsRawFd;
+        libc::posix_fadvise(_file.as_raw_fd(), 0, 0, libc::POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+/// Drop the clean pages of a file from the page cache.
+pub (crate) fn drop_cached(_file: &std::fs::File) {
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    unsafe {
+        use std::os::unix::io::AsRawFd;
+        libc::posix_fadvise(_file.as_raw_fd(), 0, 0, libc::POSIX_FADV_DONTNEED);
+    }
+}
+
+/// Writes to a borrowed file, optionally dropping what it writes from the page cache.
+///
+/// When not caching, writeback of each write is started straight away and waited on at the
+/// next write, after which those pages are dropped. This keeps the disk busy without letting
+/// dirty pages build up. It only has an effect on linux, and should be wrapped in a large buffer.
+pub (crate) struct FdWriter<'a> {
+    file: &'a std::fs::File,
+    /// Where the next write lands in the file, None if written data is left in the cache
+    position: Option<u64>,
+    /// The last range written that may still be cached
+    pending: Option<(u64, u64)>,
+}
+
+impl<'a> FdWriter<'a> {
+    pub fn new(file: &'a std::fs::File, nocache: bool) -> Self {
+        use std::io::Seek;
+        // Only files with a position can have ranges dropped, pipes and sockets are left alone
+        let position = if nocache {
+            let mut file = file;
+            file.stream_position().ok()
+        } else {
+            None
+        };
+        Self{file, position, pending: None}
+    }
+
+    /// Wait for the pending range to reach the disk and drop it from the cache.
+    fn release_pending(&mut self) {
+        if let Some((_start, _size)) = self.pending.take() {
+            #[cfg(any(target_os = "linux", target_os = "android"))]
+            unsafe {
+                use std::os::unix::io::AsRawFd;
+                let fd = self.file.as_raw_fd();
+                let flags = libc::SYNC_FILE_RANGE_WAIT_BEFORE | libc::SYNC_FILE_RANGE_WRITE | libc::SYNC_FILE_RANGE_WAIT_AFTER;
+                libc::sync_file_range(fd, _start as libc::off64_t, _size as libc::off64_t, flags);
+                libc::posix_fadvise(fd, _start as libc::off_t, _size as libc::off_t, libc::POSIX_FADV_DONTNEED);
+            }
+        }
+    }
+
+    /// Start writeback of what was just written, and drop what was written before it.
+    fn written(&mut self, size: usize) {
+        if let Some(position) = self.position {
+            #[cfg(any(target_os = "linux", target_os = "android"))]
+            unsafe {
+                use std::os::unix::io::AsRawFd;
+                libc::sync_file_range(self.file.as_raw_fd(), position as libc::off64_t, size as libc::off64_t,
+                    libc::SYNC_FILE_RANGE_WRITE);
+            }
+            self.release_pending();
+            self.pending = Some((position, size as u64));
+            self.position = Some(position + size as u64);
+        }
+    }
+}
+
+impl<'a> std::io::Write for FdWriter<'a> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        let mut file = self.file;
+        let size = file.write(buf)?;
+        self.written(size);
+        Ok(size)
+    }
+
+    /// Files support vectored writes, so the slices go out in a single call.
+    fn write_vectored(&mut self, bufs: &[std::io::IoSlice<'_>]) -> std::io::Result<usize> {
+        let mut file = self.file;
+        let size = file.write_vectored(bufs)?;
+        self.written(size);
+        Ok(size)
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        let mut file = self.file;
+        file.flush()?;
+        self.release_pending();
+        Ok(())
+    }
+}
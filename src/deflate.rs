@@ -0,0 +1,503 @@
+//! A block parallel deflate encoder in the style of pigz.
+//!
+//! Input is cut into chunks that are compressed on a pool of worker threads. Each
+//! chunk is ended with a sync flush, so the chunks can be concatenated, in order,
+//! into a single zlib stream that any inflater can read. Worker outputs are put
+//! back in order before they reach the output, so they can be ciphered in place
+//! under a single RC4 keystream as they are written.
+
+use std::collections::BTreeMap;
+use std::io::Write;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::thread::JoinHandle;
+
+use anyhow::Context;
+use flate2::{Compress, Compression, FlushCompress, Status};
+use rc4::{KeyInit, StreamCipher};
+
+use crate::cart::BLOCK_SIZE;
+use crate::cipher::Rc4;
+use crate::stats::{self, record, Stage};
+
+/// How much input is compressed as a single job.
+pub (crate) const CHUNK_SIZE: usize = 1 << 20;
+/// How far back deflate can reference, and so how much of the previous chunk primes the next.
+const WINDOW_SIZE: usize = 32 * 1024;
+/// The most deflate can expand its input by, used to bound sizes read from untrusted metadata.
+pub (crate) const MAX_DEFLATE_RATIO: u64 = 1032;
+
+/// Constants for calculating adler-32 checksums.
+const ADLER_MOD: u32 = 65521;
+const ADLER_NMAX: usize = 5552;
+
+
+/// A chunk of input sent to a worker.
+struct Job {
+    index: u64,
+    level: Compression,
+    window: Vec<u8>,
+    data: Vec<u8>,
+    last: bool,
+}
+
+/// A chunk of compressed output returned from a worker.
+///
+/// The input buffer is sent back so it can be reused for later chunks.
+struct Finished {
+    index: u64,
+    data: Vec<u8>,
+    adler: u32,
+    compressed: anyhow::Result<Vec<u8>>,
+}
+
+/// Compresses input on a thread pool and writes one zlib stream to the output in order.
+pub (crate) struct ParallelDeflater<W: Write> {
+    output: W,
+    cipher: Option<Rc4>,
+    level: Compression,
+    jobs: Option<Sender<Job>>,
+    results: Receiver<Finished>,
+    workers: Vec<JoinHandle<()>>,
+    max_outstanding: u64,
+    chunk: Vec<u8>,
+    window: Vec<u8>,
+    spare: Vec<Vec<u8>>,
+    pending: BTreeMap<u64, Finished>,
+    next_index: u64,
+    next_write: u64,
+    adler: u32,
+    total_out: u64,
+}
+
+impl<W: Write> ParallelDeflater<W> {
+    /// Start the worker threads and write the zlib header.
+    pub fn new(output: W, level: Compression, threads: usize) -> anyhow::Result<Self> {
+        Self::start(output, None, level, threads)
+    }
+
+    /// Like [ParallelDeflater::new], but the stream is ciphered with RC4 in place as it is written.
+    pub fn new_ciphered(output: W, rc4_key: &[u8], level: Compression, threads: usize) -> anyhow::Result<Self> {
+        let cipher = Rc4::new_from_slice(rc4_key).context("Bad RC4 Key")?;
+        Self::start(output, Some(cipher), level, threads)
+    }
+
+    fn start(output: W, cipher: Option<Rc4>, level: Compression, threads: usize) -> anyhow::Result<Self> {
+        let threads = threads.max(1);
+        let (job_send, job_recv) = channel::<Job>();
+        let (result_send, result_recv) = channel::<Finished>();
+        let job_recv = Arc::new(Mutex::new(job_recv));
+
+        let mut workers = vec![];
+        let scope = stats::current();
+        for _ in 0..threads {
+            let jobs = job_recv.clone();
+            let results = result_send.clone();
+            let scope = scope.clone();
+            workers.push(std::thread::spawn(move || {
+                stats::attach(scope);
+                deflate_worker(jobs, results)
+            }));
+        }
+
+        let mut deflater = Self {
+            output,
+            cipher,
+            level,
+            jobs: Some(job_send),
+            results: result_recv,
+            workers,
+            max_outstanding: 2 * threads as u64,
+            chunk: Vec::with_capacity(CHUNK_SIZE),
+            window: vec![],
+            spare: vec![],
+            pending: BTreeMap::new(),
+            next_index: 0,
+            next_write: 0,
+            adler: 1,
+            total_out: 0,
+        };
+        deflater.emit(&mut zlib_header(level))?;
+        return Ok(deflater)
+    }
+
+    /// Add data to the stream, dispatching any chunks that fill up.
+    pub fn write(&mut self, mut data: &[u8]) -> anyhow::Result<()> {
+        while !data.is_empty() {
+            let take = (CHUNK_SIZE - self.chunk.len()).min(data.len());
+            self.chunk.extend_from_slice(&data[0..take]);
+            data = &data[take..];
+            if self.chunk.len() == CHUNK_SIZE {
+                self.submit(false)?;
+            }
+        }
+        return Ok(())
+    }
+
+    /// Compress any remaining input and write the end of the zlib stream.
+    ///
+    /// This returns the total number of bytes written to the output.
+    pub fn finish(mut self) -> anyhow::Result<u64> {
+        self.submit(true)?;
+        while self.next_write < self.next_index {
+            self.collect()?;
+        }
+        let mut trailer = self.adler.to_be_bytes();
+        self.emit(&mut trailer)?;
+        return Ok(self.total_out)
+    }
+
+    /// Send the current chunk to a worker, waiting if too many are already in progress.
+    fn submit(&mut self, last: bool) -> anyhow::Result<()> {
+        while self.next_index - self.next_write >= self.max_outstanding {
+            self.collect()?;
+        }
+
+        let next_chunk = self.spare.pop().unwrap_or_else(|| Vec::with_capacity(CHUNK_SIZE));
+        let data = std::mem::replace(&mut self.chunk, next_chunk);
+        let window_start = data.len().saturating_sub(WINDOW_SIZE);
+        let window = std::mem::replace(&mut self.window, data[window_start..].to_vec());
+
+        let job = Job { index: self.next_index, level: self.level, window, data, last };
+        let sent = match &self.jobs {
+            Some(jobs) => jobs.send(job).is_ok(),
+            None => false,
+        };
+        if !sent {
+            return Err(anyhow::anyhow!("Compression workers stopped unexpectedly"))
+        }
+        self.next_index += 1;
+        return Ok(())
+    }
+
+    /// Wait for a worker to finish a chunk and write out any chunks that are now in order.
+    fn collect(&mut self) -> anyhow::Result<()> {
+        let finished = self.results.recv()?;
+        self.pending.insert(finished.index, finished);
+
+        while let Some(mut finished) = self.pending.remove(&self.next_write) {
+            let mut compressed = finished.compressed?;
+            self.emit(&mut compressed)?;
+            self.adler = adler32_combine(self.adler, finished.adler, finished.data.len() as u64);
+            self.next_write += 1;
+
+            finished.data.clear();
+            self.spare.push(finished.data);
+        }
+        return Ok(())
+    }
+
+    /// Cipher the next piece of the stream in place, if there is a cipher, and write it out.
+    fn emit(&mut self, data: &mut [u8]) -> anyhow::Result<()> {
+        if let Some(cipher) = &mut self.cipher {
+            if let Err(err) = record(Stage::Cipher, data.len(), || cipher.try_apply_keystream(data)) {
+                return Err(anyhow::anyhow!(err))
+            }
+        }
+        record(Stage::Write, data.len(), || self.output.write_all(data))?;
+        self.total_out += data.len() as u64;
+        return Ok(())
+    }
+}
+
+impl<W: Write> Drop for ParallelDeflater<W> {
+    fn drop(&mut self) {
+        // Closing the job queue lets the workers exit
+        self.jobs.take();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+/// Compress jobs from the shared queue until it is closed.
+fn deflate_worker(jobs: Arc<Mutex<Receiver<Job>>>, results: Sender<Finished>) {
+    loop {
+        let job = match jobs.lock() {
+            Ok(jobs) => jobs.recv(),
+            Err(_) => return,
+        };
+        let job = match job {
+            Ok(job) => job,
+            Err(_) => return,
+        };
+
+        let compressed = record(Stage::Deflate, job.data.len(),
+            || deflate_chunk(job.level, &job.window, &job.data, job.last));
+        let adler = adler32(1, &job.data);
+        let finished = Finished { index: job.index, data: job.data, adler, compressed };
+        if results.send(finished).is_err() {
+            return
+        }
+    }
+}
+
+/// Raw deflate a single chunk, ending on a byte boundary so it can be followed by the next chunk.
+fn deflate_chunk(level: Compression, window: &[u8], data: &[u8], last: bool) -> anyhow::Result<Vec<u8>> {
+    let mut compress = Compress::new(level, false);
+    let mut output = Vec::with_capacity(data.len() / 2 + BLOCK_SIZE);
+
+    // Prime the compressor with the end of the previous chunk, the inflater will
+    // already have those bytes in its window so references to them are valid.
+    // Not every deflate backend supports preset dictionaries, so the window is
+    // compressed and its output thrown away instead.
+    if !window.is_empty() {
+        deflate_into(&mut compress, window, &mut output, FlushCompress::Sync)?;
+        output.clear();
+    }
+
+    let flush = if last { FlushCompress::Finish } else { FlushCompress::Sync };
+    deflate_into(&mut compress, data, &mut output, flush)?;
+    return Ok(output)
+}
+
+/// Run all of the input through the compressor and complete the given flush.
+fn deflate_into(compress: &mut Compress, input: &[u8], output: &mut Vec<u8>, flush: FlushCompress) -> anyhow::Result<()> {
+    let start = compress.total_in();
+    loop {
+        if output.len() == output.capacity() {
+            output.reserve(BLOCK_SIZE);
+        }
+        let consumed = (compress.total_in() - start) as usize;
+        let status = compress.compress_vec(&input[consumed..], output, flush)?;
+        let consumed = (compress.total_in() - start) as usize;
+
+        // A flush is complete once all input is taken and there is output space left over
+        match status {
+            Status::StreamEnd => break,
+            Status::Ok | Status::BufError => {
+                if consumed == input.len() && output.len() < output.capacity() && flush != FlushCompress::Finish {
+                    break
+                }
+            }
+        }
+    }
+    return Ok(())
+}
+
+/// Compress a whole buffer into a zlib stream with a single libdeflate call.
+///
+/// The stream is appended to the output, which is grown once to the worst case size
+/// and then cut back to what was written. Returns the size of the stream.
+#[cfg(feature = "libdeflate")]
+pub (crate) fn zlib_compress_whole(data: &[u8], level: u32, output: &mut Vec<u8>) -> anyhow::Result<usize> {
+    let level = match libdeflater::CompressionLvl::new(level as i32) {
+        Ok(level) => level,
+        Err(err) => return Err(anyhow::anyhow!("Bad compression level: {err:?}")),
+    };
+    let mut compressor = libdeflater::Compressor::new(level);
+    let start = output.len();
+    output.resize(start + compressor.zlib_compress_bound(data.len()), 0);
+    let size = match compressor.zlib_compress(data, &mut output[start..]) {
+        Ok(size) => size,
+        Err(err) => return Err(anyhow::anyhow!("Compression error: {err:?}")),
+    };
+    output.truncate(start + size);
+    return Ok(size)
+}
+
+/// The largest zlib stream a buffer of this size can compress to, as given by zlib's deflateBound.
+pub (crate) fn zlib_bound(size: usize) -> usize {
+    size + (size >> 12) + (size >> 14) + (size >> 25) + 13 + 6
+}
+
+/// Inflate a whole zlib stream into a buffer with a single call.
+///
+/// Returns how much of the buffer was filled, or None if the stream doesn't fit.
+/// The stream must use all of the data, anything after it is reported as corrupt.
+#[cfg(feature = "libdeflate")]
+pub (crate) fn zlib_decompress_whole(data: &[u8], output: &mut [u8]) -> anyhow::Result<Option<usize>> {
+    use libdeflate_sys::{libdeflate_alloc_decompressor, libdeflate_free_decompressor, libdeflate_zlib_decompress_ex,
+        libdeflate_result_LIBDEFLATE_SUCCESS, libdeflate_result_LIBDEFLATE_INSUFFICIENT_SPACE};
+
+    // libdeflater doesn't say how much input the stream used, so call libdeflate directly
+    let decompressor = unsafe { libdeflate_alloc_decompressor() };
+    if decompressor.is_null() {
+        return Err(anyhow::anyhow!("Could not allocate decompressor"))
+    }
+    let mut consumed = 0usize;
+    let mut size = 0usize;
+    let result = unsafe {
+        libdeflate_zlib_decompress_ex(decompressor, data.as_ptr() as *const _, data.len(),
+            output.as_mut_ptr() as *mut _, output.len(), &mut consumed, &mut size)
+    };
+    unsafe { libdeflate_free_decompressor(decompressor) };
+
+    if result == libdeflate_result_LIBDEFLATE_INSUFFICIENT_SPACE {
+        return Ok(None)
+    }
+    if result != libdeflate_result_LIBDEFLATE_SUCCESS {
+        return Err(anyhow::anyhow!("Decompression error: {result}"))
+    }
+    if consumed != data.len() {
+        return Err(anyhow::anyhow!("Compressed data continues past the end of the stream"))
+    }
+    Ok(Some(size))
+}
+
+/// Inflate a whole zlib stream into a buffer with a single call.
+///
+/// Returns how much of the buffer was filled, or None if the stream doesn't fit.
+/// The stream must use all of the data, anything after it is reported as corrupt.
+#[cfg(not(feature = "libdeflate"))]
+pub (crate) fn zlib_decompress_whole(data: &[u8], output: &mut [u8]) -> anyhow::Result<Option<usize>> {
+    let mut inflater = flate2::Decompress::new(true);
+    let status = inflater.decompress(data, output, flate2::FlushDecompress::Finish)?;
+    match status {
+        Status::StreamEnd => {
+            if (inflater.total_in() as usize) != data.len() {
+                return Err(anyhow::anyhow!("Compressed data continues past the end of the stream"))
+            }
+            Ok(Some(inflater.total_out() as usize))
+        },
+        // Either the output is full or the input stopped before the end of the stream
+        Status::Ok | Status::BufError => {
+            if (inflater.total_out() as usize) < output.len() {
+                return Err(anyhow::anyhow!("Compressed stream ended early"))
+            }
+            Ok(None)
+        }
+    }
+}
+
+/// Build the two byte zlib header matching a compression level.
+fn zlib_header(level: Compression) -> [u8; 2] {
+    // 32k window and deflate compression method
+    let cmf: u8 = 0x78;
+    let flevel: u8 = match level.level() {
+        0 | 1 => 0,
+        2..=5 => 1,
+        6 => 2,
+        _ => 3,
+    };
+    let mut flg = flevel << 6;
+    flg += (31 - ((cmf as u16 * 256 + flg as u16) % 31) as u8) % 31;
+    [cmf, flg]
+}
+
+/// Update an adler-32 checksum with more data.
+pub (crate) fn adler32(adler: u32, data: &[u8]) -> u32 {
+    let mut a = adler & 0xffff;
+    let mut b = adler >> 16;
+    for chunk in data.chunks(ADLER_NMAX) {
+        for byte in chunk {
+            a += *byte as u32;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    (b << 16) | a
+}
+
+/// Combine the adler-32 checksums of two sequential pieces of data, given the length of the second.
+pub (crate) fn adler32_combine(adler1: u32, adler2: u32, len2: u64) -> u32 {
+    let rem = (len2 % ADLER_MOD as u64) as u32;
+    let mut sum1 = adler1 & 0xffff;
+    let mut sum2 = (rem * sum1) % ADLER_MOD;
+    sum1 += (adler2 & 0xffff) + ADLER_MOD - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_MOD - rem;
+    if sum1 >= ADLER_MOD {
+        sum1 -= ADLER_MOD;
+    }
+    if sum1 >= ADLER_MOD {
+        sum1 -= ADLER_MOD;
+    }
+    if sum2 >= ADLER_MOD << 1 {
+        sum2 -= ADLER_MOD << 1;
+    }
+    if sum2 >= ADLER_MOD {
+        sum2 -= ADLER_MOD;
+    }
+    (sum2 << 16) | sum1
+}
+
+
+#[cfg(test)]
+mod tests {
+    use std::io::Read;
+
+    use flate2::Compression;
+    use rc4::{KeyInit, StreamCipher};
+
+    use super::{adler32, adler32_combine, zlib_decompress_whole, ParallelDeflater, CHUNK_SIZE};
+    use crate::cipher::{Rc4, DEFAULT_RC4_KEY};
+
+    fn inflate(data: &[u8]) -> Vec<u8> {
+        let mut output = vec![];
+        flate2::read::ZlibDecoder::new(data).read_to_end(&mut output).unwrap();
+        output
+    }
+
+    fn sample_input(size: usize) -> Vec<u8> {
+        let raw_data = std::include_bytes!("cart.rs");
+        raw_data.iter().cycle().take(size).enumerate().map(|(index, byte)| byte ^ (index / 4000) as u8).collect()
+    }
+
+    #[test]
+    fn adler() {
+        let data = sample_input(100000);
+        let (head, tail) = data.split_at(31415);
+        let whole = adler32(1, &data);
+        assert_eq!(adler32(adler32(1, head), tail), whole);
+        assert_eq!(adler32_combine(adler32(1, head), adler32(1, tail), tail.len() as u64), whole);
+        assert_eq!(adler32_combine(whole, 1, 0), whole);
+    }
+
+    #[test]
+    fn round_trip() {
+        for size in [0, 1000, CHUNK_SIZE, 3 * CHUNK_SIZE + 12345] {
+            let data = sample_input(size);
+            for level in [Compression::none(), Compression::fast(), Compression::best()] {
+                let mut output = vec![];
+                let mut deflater = ParallelDeflater::new(&mut output, level, 3).unwrap();
+                for block in data.chunks(50000) {
+                    deflater.write(block).unwrap();
+                }
+                let total = deflater.finish().unwrap();
+                assert_eq!(total, output.len() as u64);
+                assert_eq!(inflate(&output), data);
+            }
+        }
+    }
+
+    #[test]
+    fn ciphered() {
+        let data = sample_input(2 * CHUNK_SIZE + 999);
+        let mut plain = vec![];
+        let mut deflater = ParallelDeflater::new(&mut plain, Compression::fast(), 3).unwrap();
+        deflater.write(&data).unwrap();
+        deflater.finish().unwrap();
+
+        // Ciphering in place gives the plain stream under one keystream
+        let mut output = vec![];
+        let mut deflater = ParallelDeflater::new_ciphered(&mut output, &DEFAULT_RC4_KEY, Compression::fast(), 3).unwrap();
+        for block in data.chunks(50000) {
+            deflater.write(block).unwrap();
+        }
+        assert_eq!(deflater.finish().unwrap(), output.len() as u64);
+        Rc4::new_from_slice(&DEFAULT_RC4_KEY).unwrap().apply_keystream(&mut output);
+        assert_eq!(output, plain);
+        assert!(ParallelDeflater::new_ciphered(vec![], &[], Compression::fast(), 1).is_err());
+    }
+
+    #[test]
+    fn whole_stream() {
+        let data = sample_input(100000);
+        let mut compressed = vec![];
+        let mut encoder = flate2::write::ZlibEncoder::new(&mut compressed, Compression::fast());
+        std::io::Write::write_all(&mut encoder, &data).unwrap();
+        encoder.finish().unwrap();
+
+        let mut output = vec![0u8; data.len()];
+        assert_eq!(zlib_decompress_whole(&compressed, &mut output).unwrap(), Some(data.len()));
+        assert_eq!(output, data);
+        let mut small = vec![0u8; data.len() - 1];
+        assert_eq!(zlib_decompress_whole(&compressed, &mut small).unwrap(), None);
+
+        // Data after the end of the stream is corrupt rather than ignored
+        compressed.extend_from_slice(b"garbage");
+        assert!(zlib_decompress_whole(&compressed, &mut output).is_err());
+        assert!(zlib_decompress_whole(&compressed[0..compressed.len() - 20], &mut output).is_err());
+    }
+}
@@ -3,12 +3,68 @@
 /// to include in a cart file footer.
 ///
 
+use std::io::Write;
+
 use md5::Digest;
 
-pub trait Digester {
+use crate::stats::{record, Stage};
+
+/// The largest raw digest produced by any [Digester], in bytes.
+pub const MAX_DIGEST_SIZE: usize = 64;
+
+/// Digesters must be [Send] so they can be run on their own thread by [pack_stream_pipelined](crate::cart::pack_stream_pipelined).
+///
+/// Digests are finished into a fixed size buffer in their raw form, they are only
+/// formatted as text when a footer is being written or compared.
+///
+/// This changed incompatibly in 0.2. `name` now returns a `&'static str`, and
+/// `finish_into` replaced `finish` as the required method. To port a digester written
+/// for 0.1, return its name as a literal and write its raw result into the buffer.
+/// If that result isn't stored as hex, override [format](Digester::format) and
+/// [matches](Digester::matches) as well.
+pub trait Digester: Send {
     fn update(&mut self, data: &[u8]) -> anyhow::Result<()>;
-    fn name(&self) -> String;
-    fn finish(&mut self) -> String;
+    fn name(&self) -> &'static str;
+    /// Write the raw summary of all data given so far, returning its size, and reset for new data.
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize;
+
+    /// Format a raw summary from this digester as it is stored in a footer, lower case hex by default.
+    fn format(&self, raw: &[u8]) -> String {
+        let mut text = vec![0u8; raw.len() * 2];
+        encode_hex(raw, &mut text);
+        String::from_utf8(text).unwrap_or_default()
+    }
+
+    /// Check a raw summary from this digester against the text stored in a footer.
+    ///
+    /// Other encoders may write hex digests in upper case, so case is ignored.
+    fn matches(&self, raw: &[u8], expected: &str) -> bool {
+        let mut text = [0u8; MAX_DIGEST_SIZE * 2];
+        let text = &mut text[0..raw.len() * 2];
+        encode_hex(raw, text);
+        expected.as_bytes().eq_ignore_ascii_case(text)
+    }
+
+    /// Produce the formatted summary of all data given so far and reset for new data.
+    fn finish(&mut self) -> String {
+        let mut raw = [0u8; MAX_DIGEST_SIZE];
+        let size = self.finish_into(&mut raw);
+        self.format(&raw[0..size])
+    }
+}
+
+/// Write the lower case hex encoding of the input into an output twice its size.
+///
+/// This is branch free so the compiler can vectorise it.
+pub fn encode_hex(input: &[u8], output: &mut [u8]) {
+    // Maps 0-9 to '0'-'9' and 10-15 to 'a'-'f' without a lookup
+    fn nibble(value: u8) -> u8 {
+        value + b'0' + ((9u8.wrapping_sub(value) >> 7) * (b'a' - b'0' - 10))
+    }
+    for (byte, pair) in input.iter().zip(output.chunks_exact_mut(2)) {
+        pair[0] = nibble(byte >> 4);
+        pair[1] = nibble(byte & 0xf);
+    }
 }
 
 /// Generate the default set of digests taken for cart files.
@@ -23,6 +79,49 @@ pub fn default_digesters() -> Vec<Box<dyn Digester>> {
     ]
 }
 
+/// Finish a set of digests, collecting their results by name.
+pub fn digest_results(digesters: &mut [Box<dyn Digester>]) -> serde_json::Map<String, serde_json::Value> {
+    let mut results = serde_json::Map::new();
+    let mut raw = [0u8; MAX_DIGEST_SIZE];
+    for digest in digesters.iter_mut() {
+        let size = digest.finish_into(&mut raw);
+        results.insert(digest.name().to_owned(), serde_json::Value::String(digest.format(&raw[0..size])));
+    }
+    results
+}
+
+/// An output stream adapter that updates a set of digests with everything written through it.
+pub struct DigestWriter<'a, OUT: Write> {
+    output: OUT,
+    digesters: &'a mut [Box<dyn Digester>],
+}
+
+impl<'a, OUT: Write> DigestWriter<'a, OUT> {
+    pub fn new(output: OUT, digesters: &'a mut [Box<dyn Digester>]) -> Self {
+        Self {
+            output,
+            digesters,
+        }
+    }
+}
+
+impl<'a, OUT: Write> Write for DigestWriter<'a, OUT> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        // Only digest what the output accepted
+        let size = self.output.write(buf)?;
+        for digest in self.digesters.iter_mut() {
+            if let Err(err) = digest.update(&buf[0..size]) {
+                return Err(std::io::Error::new(std::io::ErrorKind::Other, err))
+            }
+        }
+        return Ok(size)
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.output.flush()
+    }
+}
+
 pub struct MD5Digest {
     hasher: md5::Md5
 }
@@ -37,16 +136,18 @@ impl MD5Digest {
 
 impl Digester for MD5Digest {
     fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
-        self.hasher.update(data);
+        record(Stage::Md5, data.len(), || self.hasher.update(data));
         return Ok(())
     }
 
-    fn name(&self) -> String {
-        return "md5".to_owned()
+    fn name(&self) -> &'static str {
+        return "md5"
     }
 
-    fn finish(&mut self) -> String {
-        format!("{:x}", self.hasher.finalize_reset())
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+        let output = &mut output[0..16];
+        self.hasher.finalize_into_reset(output.into());
+        return output.len()
     }
 }
 
@@ -64,16 +165,18 @@ impl SHA1Digest {
 
 impl Digester for SHA1Digest {
     fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
-        self.hasher.update(data);
+        record(Stage::Sha1, data.len(), || self.hasher.update(data));
         return Ok(())
     }
 
-    fn name(&self) -> String {
-        return "sha1".to_owned()
+    fn name(&self) -> &'static str {
+        return "sha1"
     }
 
-    fn finish(&mut self) -> String {
-        format!("{:x}", self.hasher.finalize_reset())
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+        let output = &mut output[0..20];
+        self.hasher.finalize_into_reset(output.into());
+        return output.len()
     }
 }
 
@@ -91,16 +194,47 @@ impl SHA256Digest {
 
 impl Digester for SHA256Digest {
     fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
-        self.hasher.update(data);
+        record(Stage::Sha256, data.len(), || self.hasher.update(data));
         return Ok(())
     }
 
-    fn name(&self) -> String {
-        return "sha256".to_owned()
+    fn name(&self) -> &'static str {
+        return "sha256"
     }
 
-    fn finish(&mut self) -> String {
-        format!("{:x}", self.hasher.finalize_reset())
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+        let output = &mut output[0..32];
+        self.hasher.finalize_into_reset(output.into());
+        return output.len()
+    }
+}
+
+pub struct SHA512Digest {
+    hasher: sha2::Sha512
+}
+
+impl SHA512Digest {
+    pub fn new() -> Self {
+        Self {
+            hasher: sha2::Sha512::new()
+        }
+    }
+}
+
+impl Digester for SHA512Digest {
+    fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        record(Stage::Sha512, data.len(), || self.hasher.update(data));
+        return Ok(())
+    }
+
+    fn name(&self) -> &'static str {
+        return "sha512"
+    }
+
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+        let output = &mut output[0..64];
+        self.hasher.finalize_into_reset(output.into());
+        return output.len()
     }
 }
 
@@ -114,19 +248,74 @@ impl LengthDigest {
             counter: 0
         }
     }
+
+    fn decode(raw: &[u8]) -> u64 {
+        raw.try_into().map_or(0, u64::from_be_bytes)
+    }
 }
 
 impl Digester for LengthDigest {
     fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
-        self.counter += data.len() as u64;
+        record(Stage::Length, data.len(), || self.counter += data.len() as u64);
         return Ok(())
     }
 
-    fn name(&self) -> String {
-        return "length".to_owned()
+    fn name(&self) -> &'static str {
+        return "length"
     }
 
-    fn finish(&mut self) -> String {
-        format!("{}", self.counter)
+    /// The raw form of the length is the count as big endian bytes.
+    fn finish_into(&mut self, output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+        output[0..8].copy_from_slice(&std::mem::take(&mut self.counter).to_be_bytes());
+        return 8
+    }
+
+    /// The length is stored in decimal.
+    fn format(&self, raw: &[u8]) -> String {
+        Self::decode(raw).to_string()
     }
-}
\ No newline at end of file
+
+    fn matches(&self, raw: &[u8], expected: &str) -> bool {
+        expected.parse::<u64>().map_or(false, |expected| expected == Self::decode(raw))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{default_digesters, digest_results, encode_hex, Digester, LengthDigest, SHA512Digest, MAX_DIGEST_SIZE};
+
+    #[test]
+    fn hex() {
+        let input: Vec<u8> = (0..=255).collect();
+        let mut output = vec![0u8; input.len() * 2];
+        encode_hex(&input, &mut output);
+        let expected: String = input.iter().map(|byte| format!("{:02x}", byte)).collect();
+        assert_eq!(output, expected.as_bytes());
+    }
+
+    #[test]
+    fn raw_results() {
+        let mut digesters = default_digesters();
+        digesters.push(Box::new(SHA512Digest::new()));
+        for digest in digesters.iter_mut() {
+            digest.update(b"abc").unwrap();
+        }
+        let results = digest_results(&mut digesters);
+        assert_eq!(results.get("sha256").unwrap(), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        assert_eq!(results.get("md5").unwrap().as_str().unwrap().len(), 32);
+        assert_eq!(results.get("length").unwrap(), "3");
+
+        // Finishing resets the digest
+        let mut raw = [0u8; MAX_DIGEST_SIZE];
+        let mut length = LengthDigest::new();
+        length.update(b"abc").unwrap();
+        assert_eq!(length.finish_into(&mut raw), 8);
+        assert!(length.matches(&raw[0..8], "3"));
+        assert_eq!(length.finish(), "0");
+
+        let mut sha512 = SHA512Digest::new();
+        assert_eq!(sha512.finish_into(&mut raw), 64);
+        assert!(sha512.matches(&raw, &sha512.format(&raw).to_uppercase()));
+        assert!(!sha512.matches(&raw, "00"));
+    }
+}
@@ -38,17 +38,44 @@
 use std::ffi::c_char;
 use std::ptr::{null, null_mut};
 
-use cart::{JsonMap, unpack_header};
-use cart::{pack_stream, unpack_stream};
-use cutil::{CFileReader, CFileWriter};
-use digesters::default_digesters;
+use cart::{JsonMap, PackOptions, unpack_header, unpack_footer, unpack_metadata};
+use cart::{pack_stream, pack_data, unpack_stream};
+use cart::{pack_stream_raw, pack_data_raw, pack_slice_raw, encode_metadata, check_metadata};
+use cart::{unpack_raw_metadata, unpack_header_field, repack_metadata_raw};
+use cart::{unpack_into, unpack_prefix, unpack_decoded_size, BufferTooSmall, LARGE_BLOCK_SIZE};
+use cart::{UnpackOptions, OutputLimitExceeded, unpack_stream_ex, unpack_stream_seekable_ex, unpack_data};
+use batch::{run_batch, run_batch_grouped};
+use cipher::RC4_LANES;
+use deflate::MAX_DEFLATE_RATIO;
+use context::CartContext;
+use cutil::{CFileReader, CFileWriter, FdWriter, advise_sequential, borrow_raw_file, drop_cached};
+use push::{CartDecoder, CartEncoder, DataIncomplete, OutputPending};
+use digesters::{default_digesters, Digester, DigestWriter, MAX_DIGEST_SIZE};
+use digesters::{MD5Digest, SHA1Digest, SHA256Digest, SHA512Digest, LengthDigest};
+use seek::{unpack_range, unpack_stream_parallel};
+use stats::Stage;
+use verify::{Verification, verify_stream, verify_stream_seekable};
 
 use crate::cart::unpack_required_header;
 
+mod batch;
+#[cfg(not(feature = "bench"))]
 mod cipher;
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod cipher;
 mod cutil;
+mod deflate;
+mod pipeline;
+#[cfg(feature = "async")]
+pub mod asyncio;
 pub mod cart;
+pub mod context;
 pub mod digesters;
+pub mod push;
+pub mod seek;
+pub mod stats;
+pub mod verify;
 
 /// Error code set when a call completes without errors
 pub const CART_NO_ERROR: u32 = 0;
@@ -64,9 +91,61 @@ pub const CART_ERROR_BAD_JSON_ARGUMENT: u32 = 5;
 pub const CART_ERROR_NULL_ARGUMENT: u32 = 7;
 /// Error code when an error occurs processing the input data
 pub const CART_ERROR_PROCESSING: u32 = 6;
+/// Error code when an options struct contains an invalid value
+pub const CART_ERROR_BAD_OPTIONS: u32 = 8;
+/// Error code when decoded data does not fit in the buffer provided
+pub const CART_ERROR_BUFFER_TOO_SMALL: u32 = 9;
+/// Error code when the decoded size is not recorded in the cart footer
+pub const CART_ERROR_UNKNOWN_SIZE: u32 = 10;
+/// Error code when decoded data does not match a digest recorded in the cart footer
+pub const CART_ERROR_DIGEST_MISMATCH: u32 = 11;
+/// Error code when more data is needed before a result is available
+pub const CART_ERROR_INCOMPLETE: u32 = 12;
+/// Error code when decoding stopped because the output grew past a limit set in the options
+pub const CART_ERROR_OUTPUT_LIMIT: u32 = 13;
+/// Error code when decoded output has to be read before a decoder can finish
+pub const CART_ERROR_OUTPUT_PENDING: u32 = 14;
+
+/// Flag for the md5 digest
+pub const CART_DIGEST_MD5: u32 = 1;
+/// Flag for the sha1 digest
+pub const CART_DIGEST_SHA1: u32 = 2;
+/// Flag for the sha256 digest
+pub const CART_DIGEST_SHA256: u32 = 4;
+/// Flag for the length of the decoded data
+pub const CART_DIGEST_LENGTH: u32 = 8;
+/// Flag for the sha512 digest
+pub const CART_DIGEST_SHA512: u32 = 16;
+/// The digests included by the default encoding functions
+pub const CART_DIGEST_DEFAULT: u32 = CART_DIGEST_MD5 | CART_DIGEST_SHA1 | CART_DIGEST_SHA256 | CART_DIGEST_LENGTH;
+/// Every digest supported
+pub const CART_DIGEST_ALL: u32 = CART_DIGEST_DEFAULT | CART_DIGEST_SHA512;
+
+/// Flag for the file descriptor functions to keep what they read and write out of the page cache
+pub const CART_FD_NOCACHE: u32 = 1;
+
+/// Flag for metadata handling to pass header json through as given, without parsing and re-encoding it
+pub const CART_METADATA_RAW: u32 = 1;
+/// Flag for metadata handling to check that raw json is a json object, without building a map of it
+pub const CART_METADATA_VALIDATE: u32 = 2;
+
+/// Size in bytes of the rc4 keys taken by [cart_repack_metadata]
+pub const CART_RC4_KEY_SIZE: u32 = 16;
+
+/// Compression level that stores data without compressing it
+pub const CART_COMPRESSION_STORE: u32 = 0;
+/// Compression level favouring speed, used by the default encoding functions
+pub const CART_COMPRESSION_FAST: u32 = 1;
+/// Compression level favouring output size
+pub const CART_COMPRESSION_BEST: u32 = 9;
 
 /// Helper function to convert a c string with a path into a file object
 fn _open(path: *const c_char, read: bool) -> Result<std::fs::File, u32> {
+    _open_path(_path(path)?, read)
+}
+
+/// Helper function to check and convert a c string with a path
+fn _path<'a>(path: *const c_char) -> Result<&'a str, u32> {
     // Check for null values
     if path == null() {
         return Err(CART_ERROR_BAD_ARGUMENT_STR)
@@ -76,11 +155,14 @@ fn _open(path: *const c_char, read: bool) -> Result<std::fs::File, u32> {
     let path = unsafe { std::ffi::CStr::from_ptr(path) };
 
     // Make sure the input strings are valid utf-8
-    let path = match path.to_str() {
-        Ok(path) => path,
-        Err(_) => return Err(CART_ERROR_BAD_ARGUMENT_STR),
-    };
+    match path.to_str() {
+        Ok(path) => Ok(path),
+        Err(_) => Err(CART_ERROR_BAD_ARGUMENT_STR),
+    }
+}
 
+/// Helper function to open a file for reading, or create a file for writing
+fn _open_path(path: &str, read: bool) -> Result<std::fs::File, u32> {
     if read {
         match std::fs::File::open(path) {
             Ok(file) => Ok(file),
@@ -94,6 +176,121 @@ fn _open(path: *const c_char, read: bool) -> Result<std::fs::File, u32> {
     }
 }
 
+/// Helper function to check if two paths name the same existing file.
+///
+/// Different spellings of a path, and links to the same file, are the same file.
+fn _same_file(left: &str, right: &str) -> bool {
+    #[cfg(unix)]
+    {
+        use std::os::unix::fs::MetadataExt;
+        match (std::fs::metadata(left), std::fs::metadata(right)) {
+            (Ok(left), Ok(right)) => left.dev() == right.dev() && left.ino() == right.ino(),
+            _ => false,
+        }
+    }
+    #[cfg(not(unix))]
+    {
+        match (std::fs::canonicalize(left), std::fs::canonicalize(right)) {
+            (Ok(left), Ok(right)) => left == right,
+            _ => false,
+        }
+    }
+}
+
+/// Helper function to map a regular file into memory.
+///
+/// Returns None when the file can't be mapped, in which case it should be streamed instead.
+/// If the file is truncated while the mapping is in use, reading past its new end raises
+/// SIGBUS, so this is only used when the caller asks for it with a `map_input` option.
+fn _map(file: &std::fs::File) -> Option<memmap2::Mmap> {
+    match file.metadata() {
+        Ok(metadata) if metadata.is_file() && metadata.len() > 0 => {},
+        _ => return None,
+    }
+    unsafe { memmap2::Mmap::map(file) }.ok()
+}
+
+/// Helper function to encode a file from disk into a new file.
+fn _pack_file(input_path: *const c_char, output_path: *const c_char, header_json: *const c_char,
+    options: &PackOptions, digesters: Vec<Box<dyn Digester>>, metadata_flags: u32, map_input: bool) -> u32
+{
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+
+    // Open output file
+    let output_file = match _open(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+
+    // Load in the header json if any is set.
+    let header_json = match _ready_header(header_json, metadata_flags) {
+        Ok(header) => header,
+        Err(err) => return err,
+    };
+
+    match _pack_opened(input_file, output_file, header_json, options, digesters, map_input) {
+        Ok(_) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// Helper function to encode between open files.
+///
+/// If `map_input` is set regular files are memory mapped and encoded directly from the mapping.
+/// The output is collected into large writes.
+fn _pack_opened(input_file: std::fs::File, output_file: std::fs::File, header_json: Option<Vec<u8>>,
+    options: &PackOptions, digesters: Vec<Box<dyn Digester>>, map_input: bool) -> anyhow::Result<()>
+{
+    let output_file = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output_file);
+    match map_input.then(|| _map(&input_file)).flatten() {
+        Some(input_data) => pack_slice_raw(
+            &input_data,
+            output_file,
+            header_json,
+            None,
+            digesters,
+            None,
+            options
+        ),
+        None => pack_stream_raw(
+            std::io::BufReader::new(input_file),
+            output_file,
+            header_json,
+            None,
+            digesters,
+            None,
+            options
+        ),
+    }
+}
+
+/// Helper function to decode between open files.
+///
+/// If `map_input` is set regular files are memory mapped and decoded directly from the mapping.
+/// Pipes and other inputs that can't seek are decoded as a stream instead.
+/// The output is collected into large writes.
+fn _unpack_opened(mut input_file: std::fs::File, output_file: std::fs::File, digesters: &mut [Box<dyn Digester>],
+    options: &UnpackOptions, map_input: bool) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    let output_file = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output_file);
+    let output_file = DigestWriter::new(output_file, digesters);
+    if let Some(input_data) = map_input.then(|| _map(&input_file)).flatten() {
+        return unpack_stream_seekable_ex(std::io::Cursor::new(&input_data[..]), output_file, None, options)
+    }
+
+    let seekable = input_file.metadata().map_or(false, |metadata| metadata.is_file())
+        && std::io::Seek::stream_position(&mut input_file).is_ok();
+    if seekable {
+        unpack_stream_seekable_ex(std::io::BufReader::new(input_file), output_file, None, options)
+    } else {
+        unpack_stream_ex(input_file, output_file, None, options)
+    }
+}
+
 /// Helper function to load a c string into a json map
 fn _ready_json(header_json: *const c_char) -> Result<Option<JsonMap>, u32> {
     if header_json == null() {
@@ -116,6 +313,311 @@ fn _ready_json(header_json: *const c_char) -> Result<Option<JsonMap>, u32> {
     }
 }
 
+/// Helper function to load a c string of header json ready to be enciphered.
+///
+/// Unless the metadata flags include [CART_METADATA_RAW] the json is parsed and re-encoded
+/// as [_ready_json] would. Raw json is only checked if [CART_METADATA_VALIDATE] is set.
+fn _ready_header(header_json: *const c_char, metadata_flags: u32) -> Result<Option<Vec<u8>>, u32> {
+    if metadata_flags & CART_METADATA_RAW == 0 {
+        return match encode_metadata(_ready_json(header_json)?) {
+            Ok(header) => Ok(header),
+            Err(_) => Err(CART_ERROR_BAD_JSON_ARGUMENT),
+        }
+    }
+    if header_json == null() {
+        return Ok(None)
+    }
+    let header_json = unsafe { std::ffi::CStr::from_ptr(header_json) }.to_bytes();
+    if metadata_flags & CART_METADATA_VALIDATE != 0 && check_metadata(header_json).is_err() {
+        return Err(CART_ERROR_BAD_JSON_ARGUMENT)
+    }
+    Ok(Some(header_json.to_vec()))
+}
+
+/// Options for the extended encoding functions.
+///
+/// This should be initialized with [cart_default_pack_options] so that any fields
+/// not being changed are given their default values.
+#[repr(C)]
+pub struct CartPackOptions {
+    /// The zlib compression level, from [CART_COMPRESSION_STORE] to [CART_COMPRESSION_BEST].
+    pub compression_level: u32,
+    /// Run reading, digesting, and compression on separate threads.
+    pub pipelined: bool,
+    /// Deflate in parallel on this many threads, zero uses a single compressor.
+    pub compress_threads: u32,
+    /// Digests to include in the footer, as a combination of the `CART_DIGEST_` flags.
+    pub digests: u32,
+    /// Record a seek index with a point every this many decoded bytes, zero for no index.
+    /// The index allows [cart_unpack_file_range] to start decoding part way through the body.
+    /// It can't be combined with the threading options.
+    pub index_interval: u64,
+    /// How the header json is handled, as a combination of the `CART_METADATA_` flags.
+    /// With [CART_METADATA_RAW] the header json is enciphered as given rather than parsed and re-encoded.
+    pub metadata_flags: u32,
+    /// If not null, the time and bytes of each stage of the call are written here when it returns.
+    /// See [CartStats], this is ignored by [cart_encoder_new].
+    pub stats: *mut CartStats,
+    /// Memory map the input of [cart_pack_file_ex] rather than reading it, which avoids a copy
+    /// for large files. The input must not be truncated during the call, reading past its new
+    /// end raises SIGBUS and kills the process, so only set this for files nothing else writes.
+    pub map_input: bool,
+}
+
+/// Helper function to load encoding options from a c pointer, using defaults for null.
+///
+/// This returns the options along with the digests selected and the metadata flags.
+fn _ready_pack_options(options: *const CartPackOptions) -> Result<(PackOptions, Vec<Box<dyn Digester>>, u32), u32> {
+    if options == null() {
+        return Ok((PackOptions::default(), default_digesters(), 0))
+    }
+    let options = unsafe { &*options };
+    if options.metadata_flags & !(CART_METADATA_RAW | CART_METADATA_VALIDATE) != 0 {
+        return Err(CART_ERROR_BAD_OPTIONS)
+    }
+    let metadata_flags = options.metadata_flags;
+    let digesters = _digesters(options.digests)?;
+    let options = PackOptions {
+        compression_level: options.compression_level,
+        pipelined: options.pipelined,
+        compress_threads: options.compress_threads as usize,
+        index_interval: options.index_interval,
+    };
+    match options.compression() {
+        Ok(_) => Ok((options, digesters, metadata_flags)),
+        Err(_) => Err(CART_ERROR_BAD_OPTIONS),
+    }
+}
+
+/// Get the options used by the default encoding functions.
+#[no_mangle]
+pub extern "C" fn cart_default_pack_options() -> CartPackOptions {
+    let options = PackOptions::default();
+    CartPackOptions {
+        compression_level: options.compression_level,
+        pipelined: options.pipelined,
+        compress_threads: options.compress_threads as u32,
+        digests: CART_DIGEST_DEFAULT,
+        index_interval: options.index_interval,
+        metadata_flags: 0,
+        stats: null_mut(),
+        map_input: false,
+    }
+}
+
+/// Options for the extended decoding functions.
+///
+/// This should be initialized with [cart_default_unpack_options] so that any fields
+/// not being changed are given their default values.
+#[repr(C)]
+pub struct CartUnpackOptions {
+    /// Digests to calculate over the decoded data, as a combination of the `CART_DIGEST_` flags.
+    pub digests: u32,
+    /// Stop with [CART_ERROR_OUTPUT_LIMIT] once more than this many bytes are decoded, zero for no limit.
+    pub max_output_size: u64,
+    /// Stop with [CART_ERROR_OUTPUT_LIMIT] once more than this many bytes are decoded for
+    /// each compressed byte, zero for no limit. The first 64 KiB of output are always allowed.
+    pub max_ratio: u64,
+    /// If not null, the time and bytes of each stage of the call are written here when it returns.
+    /// See [CartStats].
+    pub stats: *mut CartStats,
+    /// Memory map the input of [cart_unpack_file_ex] rather than reading it, which avoids a copy
+    /// for large files. The input must not be truncated during the call, reading past its new
+    /// end raises SIGBUS and kills the process, so only set this for files nothing else writes.
+    pub map_input: bool,
+}
+
+/// Helper function to build the digests selected by a combination of `CART_DIGEST_` flags
+fn _digesters(flags: u32) -> Result<Vec<Box<dyn Digester>>, u32> {
+    if flags & !CART_DIGEST_ALL != 0 {
+        return Err(CART_ERROR_BAD_OPTIONS)
+    }
+    let mut digesters: Vec<Box<dyn Digester>> = vec![];
+    if flags & CART_DIGEST_MD5 != 0 {
+        digesters.push(Box::new(MD5Digest::new()));
+    }
+    if flags & CART_DIGEST_SHA1 != 0 {
+        digesters.push(Box::new(SHA1Digest::new()));
+    }
+    if flags & CART_DIGEST_SHA256 != 0 {
+        digesters.push(Box::new(SHA256Digest::new()));
+    }
+    if flags & CART_DIGEST_SHA512 != 0 {
+        digesters.push(Box::new(SHA512Digest::new()));
+    }
+    if flags & CART_DIGEST_LENGTH != 0 {
+        digesters.push(Box::new(LengthDigest::new()));
+    }
+    return Ok(digesters)
+}
+
+/// Helper function to find the `CART_DIGEST_` flag for a digest name, zero if it isn't one of ours
+fn _digest_flag(name: &str) -> u32 {
+    match name {
+        "md5" => CART_DIGEST_MD5,
+        "sha1" => CART_DIGEST_SHA1,
+        "sha256" => CART_DIGEST_SHA256,
+        "sha512" => CART_DIGEST_SHA512,
+        "length" => CART_DIGEST_LENGTH,
+        _ => 0,
+    }
+}
+
+/// Helper function to build every digest supported, for checking footers written with any selection
+fn _all_digesters() -> Vec<Box<dyn Digester>> {
+    _digesters(CART_DIGEST_ALL).unwrap_or_default()
+}
+
+/// Helper function to load decoding options from a c pointer, using defaults for null.
+///
+/// This returns the output limits and the digests selected.
+fn _ready_unpack_options(options: *const CartUnpackOptions) -> Result<(UnpackOptions, Vec<Box<dyn Digester>>), u32> {
+    if options == null() {
+        return Ok((UnpackOptions::default(), vec![]))
+    }
+    let options = unsafe { &*options };
+    let limits = UnpackOptions {
+        max_output_size: options.max_output_size,
+        max_ratio: options.max_ratio,
+    };
+    Ok((limits, _digesters(options.digests)?))
+}
+
+/// Helper function to choose the error code for a failed decode
+fn _unpack_error(err: &anyhow::Error) -> u32 {
+    if err.downcast_ref::<OutputLimitExceeded>().is_some() {
+        CART_ERROR_OUTPUT_LIMIT
+    } else {
+        CART_ERROR_PROCESSING
+    }
+}
+
+/// Get the options used by the default decoding functions.
+#[no_mangle]
+pub extern "C" fn cart_default_unpack_options() -> CartUnpackOptions {
+    CartUnpackOptions {
+        digests: 0,
+        max_output_size: 0,
+        max_ratio: 0,
+        stats: null_mut(),
+        map_input: false,
+    }
+}
+
+/// The time spent and bytes handled by each stage of encoding and decoding.
+///
+/// Counters are only recorded when the library is built with the `stats` feature,
+/// otherwise they are all zero. Times are in nanoseconds and don't include time spent
+/// in other stages, so the read time of a decode doesn't count towards inflating.
+/// Stages run on several threads add the time from every thread.
+/// Metadata is not counted, only the body of the cart.
+#[repr(C)]
+#[derive(Clone, Copy, Debug, Default, PartialEq, Eq)]
+pub struct CartStats {
+    /// Bytes read from the input, or given in memory.
+    pub bytes_in: u64,
+    /// Bytes written to the output, or returned in memory.
+    pub bytes_out: u64,
+    pub read_ns: u64,
+    pub write_ns: u64,
+    pub deflate_ns: u64,
+    /// Bytes given to the compressor.
+    pub deflate_bytes: u64,
+    pub inflate_ns: u64,
+    /// Bytes produced by the decompressor.
+    pub inflate_bytes: u64,
+    pub cipher_ns: u64,
+    pub cipher_bytes: u64,
+    pub md5_ns: u64,
+    pub md5_bytes: u64,
+    pub sha1_ns: u64,
+    pub sha1_bytes: u64,
+    pub sha256_ns: u64,
+    pub sha256_bytes: u64,
+    pub sha512_ns: u64,
+    pub sha512_bytes: u64,
+    pub length_ns: u64,
+    pub length_bytes: u64,
+}
+
+impl From<stats::Stats> for CartStats {
+    fn from(stats: stats::Stats) -> Self {
+        Self {
+            bytes_in: stats.bytes(Stage::Read),
+            bytes_out: stats.bytes(Stage::Write),
+            read_ns: stats.nanos(Stage::Read),
+            write_ns: stats.nanos(Stage::Write),
+            deflate_ns: stats.nanos(Stage::Deflate),
+            deflate_bytes: stats.bytes(Stage::Deflate),
+            inflate_ns: stats.nanos(Stage::Inflate),
+            inflate_bytes: stats.bytes(Stage::Inflate),
+            cipher_ns: stats.nanos(Stage::Cipher),
+            cipher_bytes: stats.bytes(Stage::Cipher),
+            md5_ns: stats.nanos(Stage::Md5),
+            md5_bytes: stats.bytes(Stage::Md5),
+            sha1_ns: stats.nanos(Stage::Sha1),
+            sha1_bytes: stats.bytes(Stage::Sha1),
+            sha256_ns: stats.nanos(Stage::Sha256),
+            sha256_bytes: stats.bytes(Stage::Sha256),
+            sha512_ns: stats.nanos(Stage::Sha512),
+            sha512_bytes: stats.bytes(Stage::Sha512),
+            length_ns: stats.nanos(Stage::Length),
+            length_bytes: stats.bytes(Stage::Length),
+        }
+    }
+}
+
+/// Collects the stages of one call, writing them out for the caller once the call returns.
+struct StatsOutput {
+    collector: Option<stats::Collector>,
+    output: *mut CartStats,
+}
+
+impl Drop for StatsOutput {
+    fn drop(&mut self) {
+        if let Some(collector) = self.collector.take() {
+            unsafe { *self.output = collector.finish().into() };
+        }
+    }
+}
+
+/// Helper function to start collecting stats for a call if the options ask for them
+fn _collect_stats(output: *mut CartStats) -> StatsOutput {
+    StatsOutput {
+        collector: if output == null_mut() { None } else { Some(stats::collect()) },
+        output,
+    }
+}
+
+/// Helper function to start collecting stats for an encoding call
+fn _pack_stats(options: *const CartPackOptions) -> StatsOutput {
+    _collect_stats(unsafe { options.as_ref() }.map_or(null_mut(), |options| options.stats))
+}
+
+/// Helper function to start collecting stats for a decoding call
+fn _unpack_stats(options: *const CartUnpackOptions) -> StatsOutput {
+    _collect_stats(unsafe { options.as_ref() }.map_or(null_mut(), |options| options.stats))
+}
+
+/// Helper function to check if encoding options ask for the input file to be mapped
+fn _pack_map_input(options: *const CartPackOptions) -> bool {
+    unsafe { options.as_ref() }.map_or(false, |options| options.map_input)
+}
+
+/// Helper function to check if decoding options ask for the input file to be mapped
+fn _unpack_map_input(options: *const CartUnpackOptions) -> bool {
+    unsafe { options.as_ref() }.map_or(false, |options| options.map_input)
+}
+
+/// Get the totals of every stage run by this process so far.
+///
+/// These count every call, including those that didn't ask for their stats, and only ever grow.
+/// See [CartStats] for what is counted.
+#[no_mangle]
+pub extern "C" fn cart_get_global_stats() -> CartStats {
+    stats::global().into()
+}
+
 
 /// Cart encode a file from disk into a new file.
 ///
@@ -127,18 +629,33 @@ pub extern "C" fn cart_pack_file_default(
     input_path: *const c_char,
     output_path: *const c_char,
     header_json: *const c_char,
+) -> u32 {
+    _pack_file(input_path, output_path, header_json, &PackOptions::default(), default_digesters(), 0, false)
+}
+
+
+/// Cart encode between open libc file handles.
+///
+/// Encode a file in the cart format using default parameters for all optional parameters.
+/// The input handle must be open for reading, the output handle must be open for writing.
+/// The header json should be a json encoded string with a mapping of key value pairs.
+#[no_mangle]
+pub extern "C" fn cart_pack_stream_default(
+    input_stream: *mut libc::FILE,
+    output_stream: *mut libc::FILE,
+    header_json: *const c_char,
 ) -> u32 {
     // Open input file
-    let input_file = match _open(input_path, true) {
-        Ok(file) => file,
-        Err(err) => return err,
+    let input_file = match CFileReader::new(input_stream) {
+        Ok(input) => input,
+        Err(_) => return CART_ERROR_NULL_ARGUMENT,
     };
     let input_file = std::io::BufReader::new(input_file);
 
     // Open output file
-    let output_file = match _open(output_path, false) {
-        Ok(file) => file,
-        Err(err) => return err,
+    let output_file = match CFileWriter::new(output_stream) {
+        Ok(output) => std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output),
+        Err(_) => return CART_ERROR_NULL_ARGUMENT,
     };
 
     // Load in the header json if any is set.
@@ -163,18 +680,44 @@ pub extern "C" fn cart_pack_file_default(
     }
 }
 
+/// Cart encode a file from disk into a new file with extended options.
+///
+/// This behaves like [cart_pack_file_default], with encoding controlled by the given options.
+/// If the options pointer is null the default options are used.
+#[no_mangle]
+pub extern "C" fn cart_pack_file_ex(
+    input_path: *const c_char,
+    output_path: *const c_char,
+    header_json: *const c_char,
+    options: *const CartPackOptions,
+) -> u32 {
+    let _stats = _pack_stats(options);
+    let map_input = _pack_map_input(options);
+    let (options, digesters, metadata_flags) = match _ready_pack_options(options) {
+        Ok(options) => options,
+        Err(err) => return err,
+    };
+
+    _pack_file(input_path, output_path, header_json, &options, digesters, metadata_flags, map_input)
+}
 
-/// Cart encode between open libc file handles.
+/// Cart encode between open libc file handles with extended options.
 ///
-/// Encode a file in the cart format using default parameters for all optional parameters.
-/// The input handle must be open for reading, the output handle must be open for writing.
-/// The header json should be a json encoded string with a mapping of key value pairs.
+/// This behaves like [cart_pack_stream_default], with encoding controlled by the given options.
+/// If the options pointer is null the default options are used.
 #[no_mangle]
-pub extern "C" fn cart_pack_stream_default(
+pub extern "C" fn cart_pack_stream_ex(
     input_stream: *mut libc::FILE,
     output_stream: *mut libc::FILE,
     header_json: *const c_char,
+    options: *const CartPackOptions,
 ) -> u32 {
+    let _stats = _pack_stats(options);
+    let (options, digesters, metadata_flags) = match _ready_pack_options(options) {
+        Ok(options) => options,
+        Err(err) => return err,
+    };
+
     // Open input file
     let input_file = match CFileReader::new(input_stream) {
         Ok(input) => input,
@@ -184,24 +727,25 @@ pub extern "C" fn cart_pack_stream_default(
 
     // Open output file
     let output_file = match CFileWriter::new(output_stream) {
-        Ok(output) => output,
+        Ok(output) => std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output),
         Err(_) => return CART_ERROR_NULL_ARGUMENT,
     };
 
     // Load in the header json if any is set.
-    let header_json = match _ready_json(header_json) {
+    let header_json = match _ready_header(header_json, metadata_flags) {
         Ok(header) => header,
         Err(err) => return err,
     };
 
     // Process stream
-    let result = pack_stream(
+    let result = pack_stream_raw(
         input_file,
         output_file,
         header_json,
         None,
-        default_digesters(),
-        None
+        digesters,
+        None,
+        &options
     );
 
     match result {
@@ -210,6 +754,66 @@ pub extern "C" fn cart_pack_stream_default(
     }
 }
 
+/// Cart encode between raw file descriptors, or file HANDLEs on windows, with extended options.
+///
+/// Input is read from the current position of the input descriptor and output is written at
+/// the current position of the output descriptor, neither is closed. Both are accessed with
+/// large buffers and the input is marked for sequential read ahead. If `flags` includes
+/// [CART_FD_NOCACHE], on linux, output is dropped from the page cache once it has been
+/// written back, and the input once it has been read. A negative descriptor is treated
+/// as a null argument. If the options pointer is null the default options are used.
+#[no_mangle]
+pub extern "C" fn cart_pack_fd(
+    input_fd: isize,
+    output_fd: isize,
+    header_json: *const c_char,
+    options: *const CartPackOptions,
+    flags: u32,
+) -> u32 {
+    let _stats = _pack_stats(options);
+    let (options, digesters, metadata_flags) = match _ready_pack_options(options) {
+        Ok(options) => options,
+        Err(err) => return err,
+    };
+    if flags & !CART_FD_NOCACHE != 0 {
+        return CART_ERROR_BAD_OPTIONS
+    }
+    let nocache = flags & CART_FD_NOCACHE != 0;
+
+    // Borrow the files
+    let (input_file, output_file) = match (borrow_raw_file(input_fd), borrow_raw_file(output_fd)) {
+        (Ok(input), Ok(output)) => (input, output),
+        _ => return CART_ERROR_NULL_ARGUMENT,
+    };
+
+    // Load in the header json if any is set.
+    let header_json = match _ready_header(header_json, metadata_flags) {
+        Ok(header) => header,
+        Err(err) => return err,
+    };
+
+    // Process stream
+    advise_sequential(&input_file);
+    let mut output = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, FdWriter::new(&output_file, nocache));
+    let result = pack_stream_raw(
+        std::io::BufReader::with_capacity(LARGE_BLOCK_SIZE, &*input_file),
+        &mut output,
+        header_json,
+        None,
+        digesters,
+        None,
+        &options
+    ).and_then(|_| Ok(std::io::Write::flush(&mut output)?));
+    if nocache {
+        drop_cached(&input_file);
+    }
+
+    match result {
+        Ok(_) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
 /// A struct returned from encoding functions that may return a buffer.
 ///
 /// The buffer `packed` should only be set if the `error` field is set to [CART_NO_ERROR].
@@ -268,21 +872,67 @@ pub extern "C" fn cart_pack_data_default(
         Err(err) => return CartPackResult::new_err(err),
     };
 
-    // capture output data in vector
-    let mut output_buffer = vec![];
-
-    // Process stream
-    let result = pack_stream(
+    // Process buffer
+    let result = pack_data(
         input_data,
-        &mut output_buffer,
         header_json,
         None,
         default_digesters(),
-        None
+        None,
+        &PackOptions::default()
+    );
+
+    match result {
+        Ok(output_buffer) => CartPackResult::new(output_buffer),
+        Err(_) => CartPackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Cart encode a buffer with extended options.
+///
+/// This behaves like [cart_pack_data_default], with encoding controlled by the given options.
+/// If the options pointer is null the default options are used.
+#[no_mangle]
+pub extern "C" fn cart_pack_data_ex(
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    header_json: *const c_char,
+    options: *const CartPackOptions,
+) -> CartPackResult {
+    let _stats = _pack_stats(options);
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartPackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    let (options, digesters, metadata_flags) = match _ready_pack_options(options) {
+        Ok(options) => options,
+        Err(err) => return CartPackResult::new_err(err),
+    };
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+
+    // Load in the header json if any is set.
+    let header_json = match _ready_header(header_json, metadata_flags) {
+        Ok(header) => header,
+        Err(err) => return CartPackResult::new_err(err),
+    };
+
+    // Process buffer
+    let result = pack_data_raw(
+        input_data,
+        header_json,
+        None,
+        digesters,
+        None,
+        &options
     );
 
     match result {
-        Ok(_) => CartPackResult::new(output_buffer),
+        Ok(output_buffer) => CartPackResult::new(output_buffer),
         Err(_) => CartPackResult::new_err(CART_ERROR_PROCESSING),
     }
 }
@@ -355,9 +1005,12 @@ impl CartUnpackResult {
             Some(footer) => serde_json::to_vec(&footer).unwrap_or_default(),
             None => Default::default(),
         };
+        Self::new_raw_meta(Some(header_data), Some(footer_data))
+    }
 
-        let (header_json, header_json_size) = Self::str_to_ptr(header_data);
-        let (footer_json, footer_json_size) = Self::str_to_ptr(footer_data);
+    fn new_raw_meta(header: Option<Vec<u8>>, footer: Option<Vec<u8>>) -> Self {
+        let (header_json, header_json_size) = Self::str_to_ptr(header.unwrap_or_default());
+        let (footer_json, footer_json_size) = Self::str_to_ptr(footer.unwrap_or_default());
 
         Self {
             error: CART_NO_ERROR,
@@ -371,6 +1024,113 @@ impl CartUnpackResult {
     }
 }
 
+/// A struct returned from the extended decoding functions.
+///
+/// This has the same fields as [CartUnpackResult], followed by a json mapping of
+/// the results of any digests requested, by digest name, and the same results in raw form.
+/// Buffers behind this structure can be released using the [cart_free_unpack_ex_result] function.
+#[repr(C)]
+pub struct CartUnpackExResult {
+    error: u32,
+    body: *mut u8,
+    body_size: u64,
+    header_json: *mut u8,
+    header_json_size: u64,
+    footer_json: *mut u8,
+    footer_json_size: u64,
+    digest_json: *mut u8,
+    digest_json_size: u64,
+    digests: CartDigests,
+}
+
+impl CartUnpackExResult {
+    fn new_err(error: u32) -> Self {
+        Self::new(CartUnpackResult::new_err(error), &mut [])
+    }
+
+    /// Finish the digests given, collecting both their raw and json forms.
+    fn new(result: CartUnpackResult, digesters: &mut [Box<dyn Digester>]) -> Self {
+        let mut digests = CartDigests::new();
+        let mut json = JsonMap::new();
+        let mut raw = [0u8; MAX_DIGEST_SIZE];
+        for digest in digesters.iter_mut() {
+            let size = digest.finish_into(&mut raw);
+            let raw = &raw[0..size];
+            digests.set(digest.name(), raw);
+            json.insert(digest.name().to_owned(), serde_json::Value::String(digest.format(raw)));
+        }
+
+        let (digest_json, digest_json_size) = if json.is_empty() {
+            (null_mut(), 0)
+        } else {
+            CartUnpackResult::str_to_ptr(serde_json::to_vec(&json).unwrap_or_default())
+        };
+
+        Self {
+            error: result.error,
+            body: result.body,
+            body_size: result.body_size,
+            header_json: result.header_json,
+            header_json_size: result.header_json_size,
+            footer_json: result.footer_json,
+            footer_json_size: result.footer_json_size,
+            digest_json,
+            digest_json_size,
+            digests,
+        }
+    }
+}
+
+/// The raw results of digests taken while decoding.
+///
+/// The `present` field is a combination of the `CART_DIGEST_` flags for the digests
+/// that were taken, the fields of any others are zero. The length is in native byte order.
+#[repr(C)]
+pub struct CartDigests {
+    present: u32,
+    md5: [u8; 16],
+    sha1: [u8; 20],
+    sha256: [u8; 32],
+    sha512: [u8; 64],
+    length: u64,
+}
+
+impl CartDigests {
+    fn new() -> Self {
+        Self {
+            present: 0,
+            md5: [0; 16],
+            sha1: [0; 20],
+            sha256: [0; 32],
+            sha512: [0; 64],
+            length: 0,
+        }
+    }
+
+    /// Store the raw result of a digest by name, ignoring digests without a field.
+    fn set(&mut self, name: &str, raw: &[u8]) {
+        let field: &mut [u8] = match name {
+            "md5" => &mut self.md5,
+            "sha1" => &mut self.sha1,
+            "sha256" => &mut self.sha256,
+            "sha512" => &mut self.sha512,
+            "length" => match raw.try_into() {
+                Ok(raw) => {
+                    self.length = u64::from_be_bytes(raw);
+                    self.present |= CART_DIGEST_LENGTH;
+                    return
+                }
+                Err(_) => return,
+            },
+            _ => return,
+        };
+        if field.len() == raw.len() {
+            field.copy_from_slice(raw);
+            self.present |= _digest_flag(name);
+        }
+    }
+}
+
 /// Decode a cart encoded file into a new file.
 ///
 /// The decoded file body is written to the output file and is not set the returned struct.
@@ -385,7 +1145,6 @@ pub extern "C" fn cart_unpack_file(
         Ok(file) => file,
         Err(err) => return CartUnpackResult::new_err(err),
     };
-    let input_file = std::io::BufReader::new(input_file);
 
     // Open output file
     let output_file = match _open(output_path, false) {
@@ -394,11 +1153,7 @@ pub extern "C" fn cart_unpack_file(
     };
 
     // Process stream
-    let result = unpack_stream(
-        input_file,
-        output_file,
-        None
-    );
+    let result = _unpack_opened(input_file, output_file, &mut [], &UnpackOptions::default(), false);
 
     match result {
         Ok((header, footer)) => {
@@ -408,6 +1163,45 @@ pub extern "C" fn cart_unpack_file(
     }
 }
 
+/// Decode a cart encoded file into a new file, inflating the body on several threads.
+///
+/// Files encoded with a seek index, see [CartPackOptions::index_interval], have the segments
+/// between index points inflated on `threads` worker threads, zero uses all available cores.
+/// Workers read their segments a block at a time and write each decoded block directly to its
+/// place in the output file, so any index interval can be used. Files without an index are
+/// decoded the same way as [cart_unpack_file].
+#[no_mangle]
+pub extern "C" fn cart_unpack_file_parallel(
+    input_path: *const c_char,
+    output_path: *const c_char,
+    threads: u32,
+) -> CartUnpackResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    // Open output file
+    let output_file = match _open(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    // Process stream
+    let result = unpack_stream_parallel(
+        std::io::BufReader::with_capacity(LARGE_BLOCK_SIZE, input_file),
+        &output_file,
+        threads as usize,
+        None
+    );
+
+    match result {
+        Ok((header, footer)) => CartUnpackResult::new_meta(header, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
 /// Decode cart data from an open libc file into another.
 ///
 /// The decoded file body is written to the output and is not set the returned struct.
@@ -459,195 +1253,1720 @@ pub extern "C" fn cart_unpack_data (
         std::slice::from_raw_parts(input_buffer, input_buffer_size)
     };
 
-    // Capture output in buffer
-    let mut output = vec![];
-
-    // Process stream
-    let result = unpack_stream(
-        input_data,
-        &mut output,
-        None
-    );
-
-    match result {
-        Ok((header, footer)) => {
+    match _unpack_data(input_data, &mut [], &UnpackOptions::default()) {
+        Ok((output, header, footer)) => {
             CartUnpackResult::new(output, header, footer)
         },
         Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
     }
 }
 
-/// Test if the file at a given path contains cart data.
+/// Helper function to decode a buffer into a new buffer, digesting the output
+fn _unpack_data(input_data: &[u8], digesters: &mut [Box<dyn Digester>], options: &UnpackOptions)
+    -> anyhow::Result<(Vec<u8>, Option<JsonMap>, Option<JsonMap>)>
+{
+    // The output is allocated at its recorded size where possible, so it isn't copied again when returned
+    if digesters.is_empty() {
+        return unpack_data(input_data, None, options)
+    }
+
+    // Digests are taken as the output is decoded, so the whole output isn't read a second time.
+    // Reserving the recorded size still avoids growing the buffer, but the recorded size can't
+    // be trusted, so don't reserve more than the input could possibly expand to, or the output limit.
+    let mut capacity = match unpack_decoded_size(std::io::Cursor::new(input_data), None) {
+        Ok(Some(size)) => size.min((input_data.len() as u64).saturating_mul(MAX_DEFLATE_RATIO)),
+        _ => 0,
+    };
+    if options.max_output_size > 0 {
+        capacity = capacity.min(options.max_output_size);
+    }
+    let mut output = Vec::with_capacity(capacity as usize);
+
+    let (header, footer) = unpack_stream_seekable_ex(
+        std::io::Cursor::new(input_data),
+        DigestWriter::new(&mut output, digesters),
+        None,
+        options
+    )?;
+    return Ok((output, header, footer))
+}
+
+/// Decode a cart encoded file into a new file with extended options.
+///
+/// This behaves like [cart_unpack_file], and also returns the results of any digests
+/// selected in the options as json. If the options pointer is null the default options are used.
+/// Decoding stops with [CART_ERROR_OUTPUT_LIMIT] if the output grows past the limits set in the options.
 #[no_mangle]
-pub extern "C" fn cart_is_file_cart (
+pub extern "C" fn cart_unpack_file_ex(
     input_path: *const c_char,
-) -> bool {
+    output_path: *const c_char,
+    options: *const CartUnpackOptions,
+) -> CartUnpackExResult {
+    let _stats = _unpack_stats(options);
+    let map_input = _unpack_map_input(options);
+    let (limits, mut digesters) = match _ready_unpack_options(options) {
+        Ok(options) => options,
+        Err(err) => return CartUnpackExResult::new_err(err),
+    };
+
     // Open input file
     let input_file = match _open(input_path, true) {
         Ok(file) => file,
-        Err(_) => return false,
+        Err(err) => return CartUnpackExResult::new_err(err),
     };
 
-    unpack_required_header(input_file, None).is_ok()
+    // Open output file
+    let output_file = match _open(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackExResult::new_err(err),
+    };
+
+    // Process stream
+    match _unpack_opened(input_file, output_file, &mut digesters, &limits, map_input) {
+        Ok((header, footer)) => CartUnpackExResult::new(
+            CartUnpackResult::new_meta(header, footer), &mut digesters),
+        Err(err) => CartUnpackExResult::new_err(_unpack_error(&err)),
+    }
 }
 
-/// Test if the given file object contains cart data.
+/// Decode cart data from an open libc file into another with extended options.
 ///
-/// The file handle is read from and is not reset to its original location.
+/// This behaves like [cart_unpack_stream], and also returns the results of any digests
+/// selected in the options as json. If the options pointer is null the default options are used.
+/// Decoding stops with [CART_ERROR_OUTPUT_LIMIT] if the output grows past the limits set in the options.
 #[no_mangle]
-pub extern "C" fn cart_is_stream_cart (
-    stream: *mut libc::FILE,
-) -> bool {
-    // Open input file
-    let input_file = match CFileReader::new(stream) {
-        Ok(file) => file,
-        Err(_) => return false,
+pub extern "C" fn cart_unpack_stream_ex(
+    input_stream: *mut libc::FILE,
+    output_stream: *mut libc::FILE,
+    options: *const CartUnpackOptions,
+) -> CartUnpackExResult {
+    let _stats = _unpack_stats(options);
+    let (limits, mut digesters) = match _ready_unpack_options(options) {
+        Ok(options) => options,
+        Err(err) => return CartUnpackExResult::new_err(err),
     };
-    unpack_required_header(input_file, None).is_ok()
+
+    // Wrap the input file object
+    let input_stream = match CFileReader::new(input_stream) {
+        Ok(input) => input,
+        Err(_) => return CartUnpackExResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    let input_file = std::io::BufReader::new(input_stream);
+    let output_file = match CFileWriter::new(output_stream) {
+        Ok(out) => out,
+        Err(_) => return CartUnpackExResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+
+    // Process stream
+    match unpack_stream_ex(input_file, DigestWriter::new(output_file, &mut digesters), None, &limits) {
+        Ok((header, footer)) => CartUnpackExResult::new(
+            CartUnpackResult::new_meta(header, footer), &mut digesters),
+        Err(err) => CartUnpackExResult::new_err(_unpack_error(&err)),
+    }
 }
 
-/// Test if the given buffer contains cart data.
+/// Decode cart data between raw file descriptors, or file HANDLEs on windows, with extended options.
+///
+/// The descriptors are used the same way as by [cart_pack_fd], including the `flags`. The
+/// input is read as a stream from its current position, so it can be a pipe or socket.
+/// This otherwise behaves like [cart_unpack_stream_ex].
 #[no_mangle]
-pub extern "C" fn cart_is_data_cart (
-    data: *const c_char,
-    data_size: usize,
-) -> bool {
-    // Refuse empty input
-    if data == null() || data_size == 0 {
-        return false
+pub extern "C" fn cart_unpack_fd(
+    input_fd: isize,
+    output_fd: isize,
+    options: *const CartUnpackOptions,
+    flags: u32,
+) -> CartUnpackExResult {
+    let _stats = _unpack_stats(options);
+    let (limits, mut digesters) = match _ready_unpack_options(options) {
+        Ok(options) => options,
+        Err(err) => return CartUnpackExResult::new_err(err),
+    };
+    if flags & !CART_FD_NOCACHE != 0 {
+        return CartUnpackExResult::new_err(CART_ERROR_BAD_OPTIONS)
+    }
+    let nocache = flags & CART_FD_NOCACHE != 0;
+
+    // Borrow the files
+    let (input_file, output_file) = match (borrow_raw_file(input_fd), borrow_raw_file(output_fd)) {
+        (Ok(input), Ok(output)) => (input, output),
+        _ => return CartUnpackExResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+
+    // Process stream
+    advise_sequential(&input_file);
+    let output = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, FdWriter::new(&output_file, nocache));
+    let result = unpack_stream_ex(
+        std::io::BufReader::with_capacity(LARGE_BLOCK_SIZE, &*input_file),
+        DigestWriter::new(output, &mut digesters),
+        None,
+        &limits
+    );
+    if nocache {
+        drop_cached(&input_file);
+    }
+
+    match result {
+        Ok((header, footer)) => CartUnpackExResult::new(
+            CartUnpackResult::new_meta(header, footer), &mut digesters),
+        Err(err) => CartUnpackExResult::new_err(_unpack_error(&err)),
+    }
+}
+
+/// Decode cart data from a buffer with extended options.
+///
+/// This behaves like [cart_unpack_data], and also returns the results of any digests
+/// selected in the options as json. If the options pointer is null the default options are used.
+/// Decoding stops with [CART_ERROR_OUTPUT_LIMIT] if the output grows past the limits set in the options.
+#[no_mangle]
+pub extern "C" fn cart_unpack_data_ex(
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    options: *const CartUnpackOptions,
+) -> CartUnpackExResult {
+    let _stats = _unpack_stats(options);
+    let (limits, mut digesters) = match _ready_unpack_options(options) {
+        Ok(options) => options,
+        Err(err) => return CartUnpackExResult::new_err(err),
+    };
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartUnpackExResult::new_err(CART_ERROR_NULL_ARGUMENT)
     }
 
     // cast c pointer to rust slice
     let input_data = unsafe {
-        let input_buffer = data as *const u8;
-        std::slice::from_raw_parts(input_buffer, data_size)
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
     };
-    unpack_required_header(input_data, None).is_ok()
+
+    match _unpack_data(input_data, &mut digesters, &limits) {
+        Ok((output, header, footer)) => CartUnpackExResult::new(
+            CartUnpackResult::new(output, header, footer), &mut digesters),
+        Err(err) => CartUnpackExResult::new_err(_unpack_error(&err)),
+    }
 }
 
-/// Open the cart file at the given path and read out its metadata.
+/// Decode cart data from a buffer into an output buffer provided by the caller.
 ///
-/// In the returned struct only the header buffer will contain data.
+/// The body is decoded directly into the output buffer, which remains owned by the caller.
+/// In the returned struct the body pointer is not set, the body size is the number of bytes
+/// written to the output buffer. If the decoded data does not fit [CART_ERROR_BUFFER_TOO_SMALL]
+/// is returned, [cart_get_data_decoded_size] can be used to size the buffer beforehand.
 #[no_mangle]
-pub extern "C" fn cart_get_file_metadata_only(
-    input_path: *const c_char
+pub extern "C" fn cart_unpack_data_into (
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    output_buffer: *mut c_char,
+    output_buffer_size: usize,
 ) -> CartUnpackResult {
-    // Open input file
-    let input_file = match _open(input_path, true) {
-        Ok(file) => file,
-        Err(err) => return CartUnpackResult::new_err(err),
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+    if output_buffer == null_mut() && output_buffer_size > 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // cast c pointers to rust slices
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+    let output_data: &mut [u8] = if output_buffer_size == 0 {
+        &mut []
+    } else {
+        unsafe {
+            let output_buffer = output_buffer as *mut u8;
+            std::slice::from_raw_parts_mut(output_buffer, output_buffer_size)
+        }
     };
 
-    match unpack_header(input_file, None) {
-        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+    // Process stream
+    let result = unpack_into(
+        std::io::Cursor::new(input_data),
+        output_data,
+        None
+    );
+
+    match result {
+        Ok((size, header, footer)) => {
+            let mut out = CartUnpackResult::new_meta(header, footer);
+            out.body_size = size as u64;
+            out
+        },
+        Err(err) if err.downcast_ref::<BufferTooSmall>().is_some() => CartUnpackResult::new_err(CART_ERROR_BUFFER_TOO_SMALL),
         Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
     }
 }
 
-/// Read header metadata only from a cart file object.
+/// Decode the start of the body of a cart file into an output buffer provided by the caller.
 ///
-/// In the returned struct only the header buffer will contain data.
+/// At most `max_bytes` are decoded into the output buffer, which must be at least that large,
+/// the rest of the body is not decoded. The header and footer are returned as they would be by
+/// [cart_get_file_metadata], except that a missing or damaged footer, as in a truncated file,
+/// leaves the footer json null rather than failing. In the returned struct the body pointer is
+/// not set, the body size is the number of bytes written, which is less than `max_bytes` for short files.
 #[no_mangle]
-pub extern "C" fn cart_get_stream_metadata_only(
-    stream: *mut libc::FILE
+pub extern "C" fn cart_unpack_file_prefix (
+    input_path: *const c_char,
+    max_bytes: usize,
+    output_buffer: *mut c_char,
 ) -> CartUnpackResult {
-    let input_file = match CFileReader::new(stream) {
-        Ok(file) => file,
-        Err(_) => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    if output_buffer == null_mut() && max_bytes > 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => std::io::BufReader::new(file),
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+    let output_data: &mut [u8] = if max_bytes == 0 {
+        &mut []
+    } else {
+        unsafe { std::slice::from_raw_parts_mut(output_buffer as *mut u8, max_bytes) }
     };
 
-    match unpack_header(input_file, None) {
-        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+    match unpack_prefix(input_file, output_data, None) {
+        Ok((size, header, footer)) => {
+            let mut out = CartUnpackResult::new_meta(header, footer);
+            out.body_size = size as u64;
+            out
+        },
         Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
     }
 }
 
-/// Read header metadata only from a buffer of cart data.
+/// Decode the start of the body of cart data in a buffer into an output buffer provided by the caller.
 ///
-/// In the returned struct only the header buffer will contain data.
+/// This works the same as [cart_unpack_file_prefix] reading from a buffer.
 #[no_mangle]
-pub extern "C" fn cart_get_data_metadata_only(
-    data: *const c_char,
-    data_size: usize
+pub extern "C" fn cart_unpack_data_prefix (
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    max_bytes: usize,
+    output_buffer: *mut c_char,
 ) -> CartUnpackResult {
-    if data == null() || data_size == 0 {
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+    if output_buffer == null_mut() && max_bytes > 0 {
         return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
     }
 
+    // cast c pointers to rust slices
     let input_data = unsafe {
-        let input_buffer = data as *const u8;
-        std::slice::from_raw_parts(input_buffer, data_size)
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
     };
-    match unpack_header(input_data, None) {
-        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+    let output_data: &mut [u8] = if max_bytes == 0 {
+        &mut []
+    } else {
+        unsafe { std::slice::from_raw_parts_mut(output_buffer as *mut u8, max_bytes) }
+    };
+
+    match unpack_prefix(std::io::Cursor::new(input_data), output_data, None) {
+        Ok((size, header, footer)) => {
+            let mut out = CartUnpackResult::new_meta(header, footer);
+            out.body_size = size as u64;
+            out
+        },
         Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
     }
 }
 
-
-/// Release any resources behind a [CartUnpackResult] struct.
+/// Decode part of the body of a cart file into an output buffer provided by the caller.
 ///
-/// This function should be safe to call even if the struct has no data.
-/// This function should be safe to call repeatedly on the same struct.
+/// Up to `length` bytes of decoded data starting at `offset` are written to the output buffer,
+/// which must be at least that large. Files encoded with a seek index are decoded starting
+/// from the nearest index point before the offset. The header and footer are returned as for
+/// [cart_unpack_file_prefix]. The body size is the number of bytes written, which is less than
+/// `length` if the range runs past the end of the decoded data.
 #[no_mangle]
-pub extern "C" fn cart_free_unpack_result(mut buf: CartUnpackResult) {
-    unsafe {
-        if buf.body != null_mut() {
-            let s = std::slice::from_raw_parts_mut(buf.body, buf.body_size as usize);
-            let s = s.as_mut_ptr();
-            drop(Box::from_raw(s));
-            buf.body = null_mut();
-            buf.body_size = 0;
-        }
-        if buf.header_json != null_mut() {
-            let s = std::slice::from_raw_parts_mut(buf.header_json, buf.header_json_size as usize);
-            let s = s.as_mut_ptr();
-            drop(Box::from_raw(s));
-            buf.header_json = null_mut();
-            buf.header_json_size = 0;
-        }
-        if buf.footer_json != null_mut() {
-            let s = std::slice::from_raw_parts_mut(buf.footer_json, buf.footer_json_size as usize);
-            let s = s.as_mut_ptr();
-            drop(Box::from_raw(s));
-            buf.footer_json = null_mut();
-            buf.footer_json_size = 0;
-        }
+pub extern "C" fn cart_unpack_file_range (
+    input_path: *const c_char,
+    offset: u64,
+    length: usize,
+    output_buffer: *mut c_char,
+) -> CartUnpackResult {
+    if output_buffer == null_mut() && length > 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
     }
-}
 
-/// Release any resources behind a [CartPackResult] struct.
-///
-/// This function should be safe to call even if the struct has no data.
-/// This function should be safe to call repeatedly on the same struct.
-#[no_mangle]
-pub extern "C" fn cart_free_pack_result(mut buf: CartPackResult) {
-    unsafe {
-        if buf.packed != null_mut() {
-            let s = std::slice::from_raw_parts_mut(buf.packed, buf.packed_size as usize);
-            let s = s.as_mut_ptr();
-            drop(Box::from_raw(s));
-            buf.packed = null_mut();
-            buf.packed_size = 0;
-        }
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => std::io::BufReader::new(file),
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+    let output_data: &mut [u8] = if length == 0 {
+        &mut []
+    } else {
+        unsafe { std::slice::from_raw_parts_mut(output_buffer as *mut u8, length) }
+    };
+
+    match unpack_range(input_file, offset, output_data, None) {
+        Ok((size, header, footer)) => {
+            let mut out = CartUnpackResult::new_meta(header, footer);
+            out.body_size = size as u64;
+            out
+        },
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Decode part of the body of cart data in a buffer into an output buffer provided by the caller.
+///
+/// This works the same as [cart_unpack_file_range] reading from a buffer.
+#[no_mangle]
+pub extern "C" fn cart_unpack_data_range (
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    offset: u64,
+    length: usize,
+    output_buffer: *mut c_char,
+) -> CartUnpackResult {
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+    if output_buffer == null_mut() && length > 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // cast c pointers to rust slices
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+    let output_data: &mut [u8] = if length == 0 {
+        &mut []
+    } else {
+        unsafe { std::slice::from_raw_parts_mut(output_buffer as *mut u8, length) }
+    };
+
+    match unpack_range(std::io::Cursor::new(input_data), offset, output_data, None) {
+        Ok((size, header, footer)) => {
+            let mut out = CartUnpackResult::new_meta(header, footer);
+            out.body_size = size as u64;
+            out
+        },
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read the decoded size of cart data in a buffer without decoding it.
+///
+/// The size is taken from the length recorded in the footer, which the default
+/// encoding functions always include. If no length is recorded [CART_ERROR_UNKNOWN_SIZE]
+/// is returned. The size is only written on success.
+#[no_mangle]
+pub extern "C" fn cart_get_data_decoded_size (
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    decoded_size: *mut u64,
+) -> u32 {
+    if input_buffer == null() || input_buffer_size == 0 || decoded_size == null_mut() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+
+    match unpack_decoded_size(std::io::Cursor::new(input_data), None) {
+        Ok(Some(size)) => {
+            unsafe { *decoded_size = size; }
+            CART_NO_ERROR
+        },
+        Ok(None) => CART_ERROR_UNKNOWN_SIZE,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// Test if the file at a given path contains cart data.
+#[no_mangle]
+pub extern "C" fn cart_is_file_cart (
+    input_path: *const c_char,
+) -> bool {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(_) => return false,
+    };
+
+    unpack_required_header(input_file, None).is_ok()
+}
+
+/// Test if the given file object contains cart data.
+///
+/// The file handle is read from and is not reset to its original location.
+#[no_mangle]
+pub extern "C" fn cart_is_stream_cart (
+    stream: *mut libc::FILE,
+) -> bool {
+    // Open input file
+    let input_file = match CFileReader::new(stream) {
+        Ok(file) => file,
+        Err(_) => return false,
+    };
+    unpack_required_header(input_file, None).is_ok()
+}
+
+/// Test if the given buffer contains cart data.
+#[no_mangle]
+pub extern "C" fn cart_is_data_cart (
+    data: *const c_char,
+    data_size: usize,
+) -> bool {
+    // Refuse empty input
+    if data == null() || data_size == 0 {
+        return false
+    }
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    unpack_required_header(input_data, None).is_ok()
+}
+
+/// Open the cart file at the given path and read out its metadata.
+///
+/// In the returned struct only the header buffer will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_file_metadata_only(
+    input_path: *const c_char
+) -> CartUnpackResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match unpack_header(input_file, None) {
+        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read header metadata only from a cart file object.
+///
+/// In the returned struct only the header buffer will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_stream_metadata_only(
+    stream: *mut libc::FILE
+) -> CartUnpackResult {
+    let input_file = match CFileReader::new(stream) {
+        Ok(file) => file,
+        Err(_) => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+
+    match unpack_header(input_file, None) {
+        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read header metadata only from a buffer of cart data.
+///
+/// In the returned struct only the header buffer will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_data_metadata_only(
+    data: *const c_char,
+    data_size: usize
+) -> CartUnpackResult {
+    if data == null() || data_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    match unpack_header(input_data, None) {
+        Ok((_, header, _)) => CartUnpackResult::new_meta(header, None),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Open the cart file at the given path and read out its footer metadata.
+///
+/// Only the header and footer are read from the file, the body is not decoded.
+/// In the returned struct only the footer buffer will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_file_footer(
+    input_path: *const c_char
+) -> CartUnpackResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match unpack_footer(input_file, None) {
+        Ok(footer) => CartUnpackResult::new_meta(None, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Open the cart file at the given path and read out its header and footer metadata.
+///
+/// Only the header and footer are read from the file, the body is not decoded.
+/// In the returned struct only the header and footer buffers will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_file_metadata(
+    input_path: *const c_char
+) -> CartUnpackResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match unpack_metadata(input_file, None) {
+        Ok((header, footer)) => CartUnpackResult::new_meta(header, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read footer metadata only from a buffer of cart data.
+///
+/// In the returned struct only the footer buffer will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_data_footer(
+    data: *const c_char,
+    data_size: usize
+) -> CartUnpackResult {
+    if data == null() || data_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    match unpack_footer(std::io::Cursor::new(input_data), None) {
+        Ok(footer) => CartUnpackResult::new_meta(None, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read header and footer metadata from a buffer of cart data.
+///
+/// In the returned struct only the header and footer buffers will contain data.
+#[no_mangle]
+pub extern "C" fn cart_get_data_metadata(
+    data: *const c_char,
+    data_size: usize
+) -> CartUnpackResult {
+    if data == null() || data_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    match unpack_metadata(std::io::Cursor::new(input_data), None) {
+        Ok((header, footer)) => CartUnpackResult::new_meta(header, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Helper function to check raw metadata read from a cart if the flags ask for it.
+fn _check_raw_metadata(header: &Option<Vec<u8>>, footer: &Option<Vec<u8>>, flags: u32) -> Result<(), u32> {
+    if flags & !(CART_METADATA_RAW | CART_METADATA_VALIDATE) != 0 {
+        return Err(CART_ERROR_BAD_OPTIONS)
+    }
+    if flags & CART_METADATA_VALIDATE != 0 {
+        for metadata in [header, footer].into_iter().flatten() {
+            if check_metadata(metadata).is_err() {
+                return Err(CART_ERROR_PROCESSING)
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Open the cart file at the given path and read out its header and footer json exactly as stored.
+///
+/// This works like [cart_get_file_metadata] except the metadata is only deciphered, it isn't
+/// parsed and re-encoded. The flags may include [CART_METADATA_VALIDATE] to check that both
+/// are json objects, without building a map of them, failing with [CART_ERROR_PROCESSING] if not.
+#[no_mangle]
+pub extern "C" fn cart_get_file_metadata_raw(
+    input_path: *const c_char,
+    flags: u32,
+) -> CartUnpackResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match unpack_raw_metadata(std::io::BufReader::new(input_file), None) {
+        Ok((header, footer)) => match _check_raw_metadata(&header, &footer, flags) {
+            Ok(()) => CartUnpackResult::new_raw_meta(header, footer),
+            Err(err) => CartUnpackResult::new_err(err),
+        },
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read header and footer json exactly as stored from a buffer of cart data.
+///
+/// The metadata and flags are handled as in [cart_get_file_metadata_raw].
+#[no_mangle]
+pub extern "C" fn cart_get_data_metadata_raw(
+    data: *const c_char,
+    data_size: usize,
+    flags: u32,
+) -> CartUnpackResult {
+    if data == null() || data_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    match unpack_raw_metadata(std::io::Cursor::new(input_data), None) {
+        Ok((header, footer)) => match _check_raw_metadata(&header, &footer, flags) {
+            Ok(()) => CartUnpackResult::new_raw_meta(header, footer),
+            Err(err) => CartUnpackResult::new_err(err),
+        },
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Open the cart file at the given path and read a single field of its header.
+///
+/// The header is searched for the field without building a map of it.
+/// In the returned struct the header buffer holds the json encoding of the field's value,
+/// it is left empty if the header has no such field.
+#[no_mangle]
+pub extern "C" fn cart_get_header_field(
+    input_path: *const c_char,
+    field: *const c_char,
+) -> CartUnpackResult {
+    let field = match _path(field) {
+        Ok(field) => field,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match unpack_header_field(input_file, field, None) {
+        Ok(value) => CartUnpackResult::new_raw_meta(value, None),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Read a single field of the header from a buffer of cart data.
+///
+/// The field is found and returned as in [cart_get_header_field].
+#[no_mangle]
+pub extern "C" fn cart_get_data_header_field(
+    data: *const c_char,
+    data_size: usize,
+    field: *const c_char,
+) -> CartUnpackResult {
+    if data == null() || data_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+    let field = match _path(field) {
+        Ok(field) => field,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    let input_data = unsafe {
+        let input_buffer = data as *const u8;
+        std::slice::from_raw_parts(input_buffer, data_size)
+    };
+    match unpack_header_field(input_data, field, None) {
+        Ok(value) => CartUnpackResult::new_raw_meta(value, None),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Helper function to load an optional rc4 key from a c pointer to [CART_RC4_KEY_SIZE] bytes
+fn _ready_key(key: *const u8) -> Option<Vec<u8>> {
+    if key == null() {
+        None
+    } else {
+        Some(unsafe { std::slice::from_raw_parts(key, CART_RC4_KEY_SIZE as usize) }.to_vec())
+    }
+}
+
+/// Rewrite the metadata of a cart file into a new file without recompressing its body.
+///
+/// The header and footer json replace those of the input, where either is null the input's
+/// is copied over as it is. A new footer replaces the digests and any seek index recorded in
+/// the old one, so they must be included in it to be kept. The body is only re-enciphered,
+/// so this takes about as long as copying the file. The output path must not be the input path,
+/// an output naming the same file as the input is refused with [CART_ERROR_BAD_ARGUMENT_STR].
+///
+/// The keys should point to [CART_RC4_KEY_SIZE] bytes. A null input key uses the key stored in
+/// the input's header, a null output key encodes the output with the default key. An output key
+/// that is given is not stored in the output, it is needed again to decode it.
+#[no_mangle]
+pub extern "C" fn cart_repack_metadata(
+    input_path: *const c_char,
+    output_path: *const c_char,
+    header_json: *const c_char,
+    footer_json: *const c_char,
+    input_key: *const u8,
+    output_key: *const u8,
+) -> u32 {
+    let (input_path, output_path) = match (_path(input_path), _path(output_path)) {
+        (Ok(input_path), Ok(output_path)) => (input_path, output_path),
+        (Err(err), _) | (_, Err(err)) => return err,
+    };
+
+    // Open input file
+    let input_file = match _open_path(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+
+    // Opening the output truncates it, which would destroy the input before it is read
+    if _same_file(input_path, output_path) {
+        return CART_ERROR_BAD_ARGUMENT_STR
+    }
+
+    // Load in the new metadata if any is set.
+    let header_json = match _ready_header(header_json, 0) {
+        Ok(header) => header,
+        Err(err) => return err,
+    };
+    let footer_json = match _ready_header(footer_json, 0) {
+        Ok(footer) => footer,
+        Err(err) => return err,
+    };
+    let input_key = _ready_key(input_key);
+    let output_key = _ready_key(output_key);
+
+    // Open output file
+    let output_file = match _open_path(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+    let output_file = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output_file);
+
+    let repack = |mut input: std::io::BufReader<std::fs::File>| -> anyhow::Result<()> {
+        // Metadata that isn't replaced is carried over without being parsed
+        let (header_json, footer_json) = if header_json.is_none() || footer_json.is_none() {
+            let (header, footer) = unpack_raw_metadata(&mut input, input_key.clone())?;
+            std::io::Seek::rewind(&mut input)?;
+            (header_json.or(header), footer_json.or(footer))
+        } else {
+            (header_json, footer_json)
+        };
+        repack_metadata_raw(input, output_file, header_json, footer_json, input_key, output_key)
+    };
+
+    match repack(std::io::BufReader::with_capacity(LARGE_BLOCK_SIZE, input_file)) {
+        Ok(_) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+
+/// Create a context that keeps encoder and decoder state between calls.
+///
+/// Reusing a context avoids setting up buffers, compressor state, and digests for every
+/// file, which is most of the cost when processing many small files. Data is processed
+/// whole in memory. A context must only be used by one thread at a time, each worker
+/// thread should create its own. Release it with [cart_context_free].
+#[no_mangle]
+pub extern "C" fn cart_context_new() -> *mut CartContext {
+    Box::into_raw(Box::new(CartContext::new()))
+}
+
+/// Release a context created by [cart_context_new].
+///
+/// This function is safe to call with a null pointer.
+#[no_mangle]
+pub extern "C" fn cart_context_free(context: *mut CartContext) {
+    if context != null_mut() {
+        drop(unsafe { Box::from_raw(context) });
+    }
+}
+
+/// Cart encode a buffer using a context.
+///
+/// This behaves like [cart_pack_data_default].
+#[no_mangle]
+pub extern "C" fn cart_context_pack_data(
+    context: *mut CartContext,
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+    header_json: *const c_char,
+) -> CartPackResult {
+    let context = match unsafe { context.as_mut() } {
+        Some(context) => context,
+        None => return CartPackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartPackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+
+    // Load in the header json if any is set.
+    let header_json = match _ready_json(header_json) {
+        Ok(header) => header,
+        Err(err) => return CartPackResult::new_err(err),
+    };
+
+    match context.pack_data(input_data, header_json, None, None) {
+        Ok(output_buffer) => CartPackResult::new(output_buffer),
+        Err(_) => CartPackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Cart encode a file from disk into a new file using a context.
+///
+/// This behaves like [cart_pack_file_default], except the input is read entirely into memory.
+#[no_mangle]
+pub extern "C" fn cart_context_pack_file(
+    context: *mut CartContext,
+    input_path: *const c_char,
+    output_path: *const c_char,
+    header_json: *const c_char,
+) -> u32 {
+    let context = match unsafe { context.as_mut() } {
+        Some(context) => context,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+
+    // Open output file
+    let output_file = match _open(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+
+    // Load in the header json if any is set.
+    let header_json = match _ready_json(header_json) {
+        Ok(header) => header,
+        Err(err) => return err,
+    };
+
+    match context.pack_stream(input_file, output_file, header_json, None, None) {
+        Ok(_) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// Decode cart data from a buffer using a context.
+///
+/// This behaves like [cart_unpack_data].
+#[no_mangle]
+pub extern "C" fn cart_context_unpack_data(
+    context: *mut CartContext,
+    input_buffer: *const c_char,
+    input_buffer_size: usize
+) -> CartUnpackResult {
+    let context = match unsafe { context.as_mut() } {
+        Some(context) => context,
+        None => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+
+    match context.unpack_data(input_data, None) {
+        Ok((output, header, footer)) => CartUnpackResult::new(output, header, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+/// Decode a cart encoded file into a new file using a context.
+///
+/// This behaves like [cart_unpack_file], except the input is read entirely into memory.
+#[no_mangle]
+pub extern "C" fn cart_context_unpack_file(
+    context: *mut CartContext,
+    input_path: *const c_char,
+    output_path: *const c_char,
+) -> CartUnpackResult {
+    let context = match unsafe { context.as_mut() } {
+        Some(context) => context,
+        None => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    // Open output file
+    let output_file = match _open(output_path, false) {
+        Ok(file) => file,
+        Err(err) => return CartUnpackResult::new_err(err),
+    };
+
+    match context.unpack_stream(input_file, output_file, None) {
+        Ok((header, footer)) => CartUnpackResult::new_meta(header, footer),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+
+/// Files up to this size are processed in memory by a batch worker's context, larger files are streamed.
+const BATCH_CONTEXT_FILE_LIMIT: u64 = 4 * LARGE_BLOCK_SIZE as u64;
+
+/// Helper function to copy the entries of a c array, a null array is read as all null entries
+fn _entries<T>(array: *const *const T, count: usize) -> Vec<*const T> {
+    if array == null() {
+        vec![null(); count]
+    } else {
+        unsafe { std::slice::from_raw_parts(array, count) }.to_vec()
+    }
+}
+
+/// Helper function to load the buffers of a batch into slices
+fn _batch_buffers<'a>(input_buffers: *const *const c_char, input_buffer_sizes: *const usize, count: usize)
+    -> Vec<Result<&'a [u8], u32>>
+{
+    let sizes = unsafe { std::slice::from_raw_parts(input_buffer_sizes, count) };
+    _entries(input_buffers, count).into_iter().zip(sizes).map(|(buffer, size)| {
+        if buffer == null() || *size == 0 {
+            Err(CART_ERROR_NULL_ARGUMENT)
+        } else {
+            Ok(unsafe { std::slice::from_raw_parts(buffer as *const u8, *size) })
+        }
+    }).collect()
+}
+
+/// Helper function to encode one file of a batch
+fn _pack_batch_file(context: &mut CartContext, input_path: Result<&str, u32>, output_path: Result<&str, u32>,
+    header_json: &Result<Option<JsonMap>, u32>) -> u32
+{
+    let input_file = match input_path.and_then(|path| _open_path(path, true)) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+    let output_file = match output_path.and_then(|path| _open_path(path, false)) {
+        Ok(file) => file,
+        Err(err) => return err,
+    };
+    let header_json = match header_json {
+        Ok(header) => header.clone(),
+        Err(err) => return *err,
+    };
+
+    let result = match input_file.metadata() {
+        Ok(metadata) if metadata.len() <= BATCH_CONTEXT_FILE_LIMIT =>
+            context.pack_stream(input_file, output_file, header_json, None, None),
+        _ => encode_metadata(header_json).and_then(|header_json|
+            _pack_opened(input_file, output_file, header_json, &PackOptions::default(), default_digesters(), false)),
+    };
+
+    match result {
+        Ok(_) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// Helper function to decode one file of a batch
+fn _unpack_batch_file(context: &mut CartContext, input_path: Result<&str, u32>, output_path: Result<&str, u32>)
+    -> Result<(Option<JsonMap>, Option<JsonMap>), u32>
+{
+    let input_file = input_path.and_then(|path| _open_path(path, true))?;
+    let output_file = output_path.and_then(|path| _open_path(path, false))?;
+
+    let result = match input_file.metadata() {
+        Ok(metadata) if metadata.len() <= BATCH_CONTEXT_FILE_LIMIT =>
+            context.unpack_stream(input_file, output_file, None),
+        _ => _unpack_opened(input_file, output_file, &mut [], &UnpackOptions::default(), false),
+    };
+    result.map_err(|_| CART_ERROR_PROCESSING)
+}
+
+/// Cart encode a batch of files on a pool of threads.
+///
+/// Each item behaves like [cart_pack_file_default], taking its input path, output path, and
+/// header json from the same position in each array. The header json array may be null,
+/// as may any of its entries. Up to `threads` worker threads are used, zero uses one per core.
+/// The error code for each item is written to the same position in `results`,
+/// which must have room for `count` entries. The return value only reports
+/// problems with the arrays themselves.
+#[no_mangle]
+pub extern "C" fn cart_pack_files_batch(
+    input_paths: *const *const c_char,
+    output_paths: *const *const c_char,
+    header_jsons: *const *const c_char,
+    count: usize,
+    threads: u32,
+    results: *mut u32,
+) -> u32 {
+    if count == 0 {
+        return CART_NO_ERROR
+    }
+    if input_paths == null() || output_paths == null() || results == null_mut() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    // Load all the arguments before handing them to other threads
+    let items: Vec<_> = _entries(input_paths, count).into_iter()
+        .zip(_entries(output_paths, count))
+        .zip(_entries(header_jsons, count))
+        .map(|((input_path, output_path), header_json)| (_path(input_path), _path(output_path), _ready_json(header_json)))
+        .collect();
+
+    let outcomes = run_batch(&items, threads as usize, |context, (input_path, output_path, header_json)| {
+        _pack_batch_file(context, *input_path, *output_path, header_json)
+    });
+
+    for (index, outcome) in outcomes.into_iter().enumerate() {
+        unsafe { results.add(index).write(outcome.unwrap_or(CART_ERROR_PROCESSING)) };
+    }
+    return CART_NO_ERROR
+}
+
+/// Decode a batch of cart encoded files on a pool of threads.
+///
+/// Each item behaves like [cart_unpack_file], taking its input and output path from the
+/// same position in each array. Up to `threads` worker threads are used, zero uses one per core.
+/// The result for each item is written to the same position in `results`, which must have
+/// room for `count` entries, each to be released with [cart_free_unpack_result].
+/// The return value only reports problems with the arrays themselves.
+#[no_mangle]
+pub extern "C" fn cart_unpack_files_batch(
+    input_paths: *const *const c_char,
+    output_paths: *const *const c_char,
+    count: usize,
+    threads: u32,
+    results: *mut CartUnpackResult,
+) -> u32 {
+    if count == 0 {
+        return CART_NO_ERROR
+    }
+    if input_paths == null() || output_paths == null() || results == null_mut() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    // Load all the arguments before handing them to other threads
+    let items: Vec<_> = _entries(input_paths, count).into_iter()
+        .zip(_entries(output_paths, count))
+        .map(|(input_path, output_path)| (_path(input_path), _path(output_path)))
+        .collect();
+
+    let outcomes = run_batch(&items, threads as usize, |context, (input_path, output_path)| {
+        _unpack_batch_file(context, *input_path, *output_path)
+    });
+
+    for (index, outcome) in outcomes.into_iter().enumerate() {
+        let result = match outcome {
+            Some(Ok((header, footer))) => CartUnpackResult::new_meta(header, footer),
+            Some(Err(err)) => CartUnpackResult::new_err(err),
+            None => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+        };
+        unsafe { results.add(index).write(result) };
+    }
+    return CART_NO_ERROR
+}
+
+/// Cart encode a batch of buffers on a pool of threads.
+///
+/// Each item behaves like [cart_pack_data_default], taking its buffer, buffer size, and
+/// header json from the same position in each array. The header json array may be null,
+/// as may any of its entries. Up to `threads` worker threads are used, zero uses one per core.
+/// The result for each item is written to the same position in `results`, which must have
+/// room for `count` entries, each to be released with [cart_free_pack_result].
+/// The return value only reports problems with the arrays themselves.
+#[no_mangle]
+pub extern "C" fn cart_pack_data_batch(
+    input_buffers: *const *const c_char,
+    input_buffer_sizes: *const usize,
+    header_jsons: *const *const c_char,
+    count: usize,
+    threads: u32,
+    results: *mut CartPackResult,
+) -> u32 {
+    if count == 0 {
+        return CART_NO_ERROR
+    }
+    if input_buffers == null() || input_buffer_sizes == null() || results == null_mut() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    // Load all the arguments before handing them to other threads
+    let items: Vec<_> = _batch_buffers(input_buffers, input_buffer_sizes, count).into_iter()
+        .zip(_entries(header_jsons, count))
+        .map(|(input_data, header_json)| (input_data, _ready_json(header_json)))
+        .collect();
+
+    // Items are encoded in small groups so their bodies can be ciphered together
+    let outcomes = run_batch_grouped(&items, RC4_LANES, threads as usize, |context, group| {
+        let ready: Vec<(&[u8], Option<JsonMap>)> = group.iter()
+            .filter_map(|(input_data, header_json)| Some(((*input_data).ok()?, header_json.clone().ok()?)))
+            .collect();
+        let mut packed = context.pack_data_group(&ready, None).into_iter();
+
+        group.iter().map(|(input_data, header_json)| match (input_data, header_json) {
+            (Err(err), _) | (_, Err(err)) => Err(*err),
+            _ => packed.next().and_then(|packed| packed.ok()).ok_or(CART_ERROR_PROCESSING),
+        }).collect()
+    });
+
+    for (index, outcome) in outcomes.into_iter().enumerate() {
+        let result = match outcome {
+            Some(Ok(output_buffer)) => CartPackResult::new(output_buffer),
+            Some(Err(err)) => CartPackResult::new_err(err),
+            None => CartPackResult::new_err(CART_ERROR_PROCESSING),
+        };
+        unsafe { results.add(index).write(result) };
+    }
+    return CART_NO_ERROR
+}
+
+/// Decode a batch of buffers on a pool of threads.
+///
+/// Each item behaves like [cart_unpack_data], taking its buffer and buffer size from the
+/// same position in each array. Up to `threads` worker threads are used, zero uses one per core.
+/// The result for each item is written to the same position in `results`, which must have
+/// room for `count` entries, each to be released with [cart_free_unpack_result].
+/// The return value only reports problems with the arrays themselves.
+#[no_mangle]
+pub extern "C" fn cart_unpack_data_batch(
+    input_buffers: *const *const c_char,
+    input_buffer_sizes: *const usize,
+    count: usize,
+    threads: u32,
+    results: *mut CartUnpackResult,
+) -> u32 {
+    if count == 0 {
+        return CART_NO_ERROR
+    }
+    if input_buffers == null() || input_buffer_sizes == null() || results == null_mut() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    // Load all the arguments before handing them to other threads
+    let items = _batch_buffers(input_buffers, input_buffer_sizes, count);
+
+    // Items are decoded in small groups so their bodies can be deciphered together
+    let outcomes = run_batch_grouped(&items, RC4_LANES, threads as usize, |context, group| {
+        let ready: Vec<&[u8]> = group.iter().filter_map(|input_data| (*input_data).ok()).collect();
+        let mut unpacked = context.unpack_data_group(&ready, None).into_iter();
+
+        group.iter().map(|input_data| match input_data {
+            Err(err) => Err(*err),
+            Ok(_) => unpacked.next().and_then(|unpacked| unpacked.ok()).ok_or(CART_ERROR_PROCESSING),
+        }).collect()
+    });
+
+    for (index, outcome) in outcomes.into_iter().enumerate() {
+        let result = match outcome {
+            Some(Ok((output, header, footer))) => CartUnpackResult::new(output, header, footer),
+            Some(Err(err)) => CartUnpackResult::new_err(err),
+            None => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+        };
+        unsafe { results.add(index).write(result) };
+    }
+    return CART_NO_ERROR
+}
+
+
+/// Create an encoder for data that arrives in pieces.
+///
+/// Data is given to the encoder with [cart_encoder_write] as it arrives, and the encoded
+/// output collected with [cart_encoder_read]. The header is available as output right away.
+/// The options are used as in [cart_pack_data_ex] except that output is always produced on
+/// the calling thread, if the options pointer is null the default options are used.
+/// Returns null if the header json or the options are invalid.
+/// Release it with [cart_encoder_free].
+#[no_mangle]
+pub extern "C" fn cart_encoder_new(
+    header_json: *const c_char,
+    options: *const CartPackOptions,
+) -> *mut CartEncoder {
+    let (options, digesters, metadata_flags) = match _ready_pack_options(options) {
+        Ok(options) => options,
+        Err(_) => return null_mut(),
+    };
+    let header_json = match _ready_header(header_json, metadata_flags) {
+        Ok(header) => header,
+        Err(_) => return null_mut(),
+    };
+
+    match CartEncoder::new_raw(header_json, digesters, None, &options) {
+        Ok(encoder) => Box::into_raw(Box::new(encoder)),
+        Err(_) => null_mut(),
+    }
+}
+
+/// Release an encoder created by [cart_encoder_new].
+///
+/// This function is safe to call with a null pointer.
+#[no_mangle]
+pub extern "C" fn cart_encoder_free(encoder: *mut CartEncoder) {
+    if encoder != null_mut() {
+        drop(unsafe { Box::from_raw(encoder) });
+    }
+}
+
+/// Give the next piece of data to an encoder.
+///
+/// Pieces may be of any size, including empty. The encoded output is held by the encoder
+/// until read with [cart_encoder_read].
+#[no_mangle]
+pub extern "C" fn cart_encoder_write(
+    encoder: *mut CartEncoder,
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+) -> u32 {
+    let encoder = match unsafe { encoder.as_mut() } {
+        Some(encoder) => encoder,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+    if input_buffer_size == 0 {
+        return CART_NO_ERROR
+    }
+    if input_buffer == null() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    let input_data = unsafe {
+        std::slice::from_raw_parts(input_buffer as *const u8, input_buffer_size)
+    };
+    match encoder.write(input_data) {
+        Ok(()) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// The number of encoded bytes an encoder is holding, waiting to be read.
+///
+/// Returns zero for a null encoder.
+#[no_mangle]
+pub extern "C" fn cart_encoder_pending(encoder: *const CartEncoder) -> usize {
+    match unsafe { encoder.as_ref() } {
+        Some(encoder) => encoder.output().len(),
+        None => 0,
+    }
+}
+
+/// Copy encoded data out of an encoder into a buffer provided by the caller.
+///
+/// Up to `output_buffer_size` bytes are copied and the number copied is written to
+/// `output_size`, which is zero once there is nothing waiting.
+#[no_mangle]
+pub extern "C" fn cart_encoder_read(
+    encoder: *mut CartEncoder,
+    output_buffer: *mut c_char,
+    output_buffer_size: usize,
+    output_size: *mut usize,
+) -> u32 {
+    let encoder = match unsafe { encoder.as_mut() } {
+        Some(encoder) => encoder,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+    if output_size == null_mut() || (output_buffer == null_mut() && output_buffer_size > 0) {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    let size = if output_buffer_size == 0 {
+        0
+    } else {
+        let output_data = unsafe {
+            std::slice::from_raw_parts_mut(output_buffer as *mut u8, output_buffer_size)
+        };
+        encoder.read_output(output_data)
+    };
+    unsafe { output_size.write(size) };
+    return CART_NO_ERROR
+}
+
+/// Complete encoding once all of the data has been given to an encoder.
+///
+/// The footer json may be null. The rest of the body and the footer, including the digests,
+/// are added to the output waiting to be read with [cart_encoder_read].
+/// An encoder can only be finished once.
+#[no_mangle]
+pub extern "C" fn cart_encoder_finish(
+    encoder: *mut CartEncoder,
+    footer_json: *const c_char,
+) -> u32 {
+    let encoder = match unsafe { encoder.as_mut() } {
+        Some(encoder) => encoder,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+    let footer_json = match _ready_json(footer_json) {
+        Ok(footer) => footer,
+        Err(err) => return err,
+    };
+    match encoder.finish(footer_json) {
+        Ok(()) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// Create a decoder for cart data that arrives in pieces.
+///
+/// Data is given to the decoder with [cart_decoder_feed] as it arrives, and the decoded
+/// output collected with [cart_decoder_read]. Only the header and footer are held until
+/// complete, so memory use doesn't grow with the size of the data.
+/// Release it with [cart_decoder_free].
+#[no_mangle]
+pub extern "C" fn cart_decoder_new() -> *mut CartDecoder {
+    Box::into_raw(Box::new(CartDecoder::new(None)))
+}
+
+/// Release a decoder created by [cart_decoder_new].
+///
+/// This function is safe to call with a null pointer.
+#[no_mangle]
+pub extern "C" fn cart_decoder_free(decoder: *mut CartDecoder) {
+    if decoder != null_mut() {
+        drop(unsafe { Box::from_raw(decoder) });
+    }
+}
+
+/// Give the next piece of cart data to a decoder.
+///
+/// Pieces may be of any size, including empty. The decoded output is held by the decoder
+/// until read with [cart_decoder_read], at most a block of it at a time, and the rest of the
+/// piece is decoded as that output is read. After an error the decoder refuses any further data.
+#[no_mangle]
+pub extern "C" fn cart_decoder_feed(
+    decoder: *mut CartDecoder,
+    input_buffer: *const c_char,
+    input_buffer_size: usize,
+) -> u32 {
+    let decoder = match unsafe { decoder.as_mut() } {
+        Some(decoder) => decoder,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+    if input_buffer_size == 0 {
+        return CART_NO_ERROR
+    }
+    if input_buffer == null() {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    let input_data = unsafe {
+        std::slice::from_raw_parts(input_buffer as *const u8, input_buffer_size)
+    };
+    match decoder.feed(input_data) {
+        Ok(()) => CART_NO_ERROR,
+        Err(_) => CART_ERROR_PROCESSING,
+    }
+}
+
+/// The number of decoded bytes a decoder is holding, waiting to be read.
+///
+/// Returns zero for a null decoder.
+#[no_mangle]
+pub extern "C" fn cart_decoder_pending(decoder: *const CartDecoder) -> usize {
+    match unsafe { decoder.as_ref() } {
+        Some(decoder) => decoder.output().len(),
+        None => 0,
+    }
+}
+
+/// Copy decoded data out of a decoder into a buffer provided by the caller.
+///
+/// Up to `output_buffer_size` bytes are copied and the number copied is written to
+/// `output_size`, which is zero once there is nothing waiting. Reading all of the waiting
+/// output decodes more of the data already given, an error doing so is returned by the
+/// next call to [cart_decoder_feed] or [cart_decoder_finish].
+#[no_mangle]
+pub extern "C" fn cart_decoder_read(
+    decoder: *mut CartDecoder,
+    output_buffer: *mut c_char,
+    output_buffer_size: usize,
+    output_size: *mut usize,
+) -> u32 {
+    let decoder = match unsafe { decoder.as_mut() } {
+        Some(decoder) => decoder,
+        None => return CART_ERROR_NULL_ARGUMENT,
+    };
+    if output_size == null_mut() || (output_buffer == null_mut() && output_buffer_size > 0) {
+        return CART_ERROR_NULL_ARGUMENT
+    }
+
+    let size = if output_buffer_size == 0 {
+        0
+    } else {
+        let output_data = unsafe {
+            std::slice::from_raw_parts_mut(output_buffer as *mut u8, output_buffer_size)
+        };
+        decoder.read_output(output_data)
+    };
+    unsafe { output_size.write(size) };
+    return CART_NO_ERROR
+}
+
+/// Get the header json from a decoder, as soon as the whole header has been given to it.
+///
+/// Until then the result has the [CART_ERROR_INCOMPLETE] error. Only the header json is set
+/// in the result, which should be released with [cart_free_unpack_result].
+#[no_mangle]
+pub extern "C" fn cart_decoder_header(decoder: *const CartDecoder) -> CartUnpackResult {
+    let decoder = match unsafe { decoder.as_ref() } {
+        Some(decoder) => decoder,
+        None => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    match decoder.header() {
+        Some(header) => CartUnpackResult::new_meta(header.clone(), None),
+        None => CartUnpackResult::new_err(CART_ERROR_INCOMPLETE),
+    }
+}
+
+/// Complete decoding once all of the data has been given to a decoder.
+///
+/// The header and footer json are set in the result, which should be released with
+/// [cart_free_unpack_result]. If the data ended early the [CART_ERROR_INCOMPLETE] error is
+/// returned, and if it is corrupt [CART_ERROR_PROCESSING]. No more than a block of output
+/// is held while finishing, so if there is more of the body to decode than fits the
+/// [CART_ERROR_OUTPUT_PENDING] error is returned. Read the waiting output with
+/// [cart_decoder_read] and call this again. Output not yet read remains available with
+/// [cart_decoder_read] afterwards. A decoder can only be finished once.
+#[no_mangle]
+pub extern "C" fn cart_decoder_finish(decoder: *mut CartDecoder) -> CartUnpackResult {
+    let decoder = match unsafe { decoder.as_mut() } {
+        Some(decoder) => decoder,
+        None => return CartUnpackResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    match decoder.finish() {
+        Ok(footer) => CartUnpackResult::new_meta(decoder.header().cloned().flatten(), footer),
+        Err(err) if err.downcast_ref::<OutputPending>().is_some() => CartUnpackResult::new_err(CART_ERROR_OUTPUT_PENDING),
+        Err(err) if err.downcast_ref::<DataIncomplete>().is_some() => CartUnpackResult::new_err(CART_ERROR_INCOMPLETE),
+        Err(_) => CartUnpackResult::new_err(CART_ERROR_PROCESSING),
+    }
+}
+
+
+/// A struct returned from verification functions.
+///
+/// The digest fields are combinations of the `CART_DIGEST_` flags, describing which of the
+/// digests recorded in the footer were checked and which of those did not match.
+/// The `error` field is [CART_ERROR_DIGEST_MISMATCH] if any digest did not match.
+/// This struct holds no resources and does not need to be released.
+#[repr(C)]
+pub struct CartVerifyResult {
+    error: u32,
+    checked_digests: u32,
+    failed_digests: u32,
+}
+
+impl CartVerifyResult {
+    fn new_err(error: u32) -> Self {
+        Self {
+            error,
+            checked_digests: 0,
+            failed_digests: 0,
+        }
+    }
+
+    fn new(verification: Verification) -> Self {
+        let flags = |names: &Vec<String>| names.iter()
+            .map(|name| _digest_flag(name))
+            .fold(0, |flags, flag| flags | flag);
+
+        let failed_digests = flags(&verification.mismatched);
+        Self {
+            error: if verification.is_ok() { CART_NO_ERROR } else { CART_ERROR_DIGEST_MISMATCH },
+            checked_digests: flags(&verification.matched) | failed_digests,
+            failed_digests,
+        }
+    }
+
+    fn from_result(result: anyhow::Result<Verification>) -> Self {
+        match result {
+            Ok(verification) => Self::new(verification),
+            Err(_) => Self::new_err(CART_ERROR_PROCESSING),
+        }
+    }
+}
+
+/// Check that a cart encoded file decodes and matches the digests in its footer.
+///
+/// No decoded output is written, only the digests recorded in the footer are calculated.
+#[no_mangle]
+pub extern "C" fn cart_verify_file(
+    input_path: *const c_char,
+) -> CartVerifyResult {
+    // Open input file
+    let input_file = match _open(input_path, true) {
+        Ok(file) => file,
+        Err(err) => return CartVerifyResult::new_err(err),
+    };
+
+    // Process stream
+    let result = verify_stream_seekable(
+        std::io::BufReader::new(input_file),
+        _all_digesters(),
+        None
+    );
+    CartVerifyResult::from_result(result)
+}
+
+/// Check that cart data from an open libc file decodes and matches the digests in its footer.
+///
+/// No decoded output is written. The input handle must be open for reading.
+#[no_mangle]
+pub extern "C" fn cart_verify_stream(
+    input_stream: *mut libc::FILE,
+) -> CartVerifyResult {
+    // Wrap the input file object
+    let input_stream = match CFileReader::new(input_stream) {
+        Ok(input) => input,
+        Err(_) => return CartVerifyResult::new_err(CART_ERROR_NULL_ARGUMENT),
+    };
+    let input_file = std::io::BufReader::new(input_stream);
+
+    CartVerifyResult::from_result(verify_stream(input_file, _all_digesters(), None))
+}
+
+/// Check that cart data in a buffer decodes and matches the digests in its footer.
+///
+/// No decoded output is kept, only the digests recorded in the footer are calculated.
+#[no_mangle]
+pub extern "C" fn cart_verify_data(
+    input_buffer: *const c_char,
+    input_buffer_size: usize
+) -> CartVerifyResult {
+    if input_buffer == null() || input_buffer_size == 0 {
+        return CartVerifyResult::new_err(CART_ERROR_NULL_ARGUMENT)
+    }
+
+    // cast c pointer to rust slice
+    let input_data = unsafe {
+        let input_buffer = input_buffer as *const u8;
+        std::slice::from_raw_parts(input_buffer, input_buffer_size)
+    };
+
+    CartVerifyResult::from_result(verify_stream_seekable(std::io::Cursor::new(input_data), _all_digesters(), None))
+}
+
+
+/// Release any resources behind a [CartUnpackResult] struct.
+///
+/// This function should be safe to call even if the struct has no data.
+/// This function should be safe to call repeatedly on the same struct.
+#[no_mangle]
+pub extern "C" fn cart_free_unpack_result(mut buf: CartUnpackResult) {
+    _free_buffer(&mut buf.body, &mut buf.body_size);
+    _free_buffer(&mut buf.header_json, &mut buf.header_json_size);
+    _free_buffer(&mut buf.footer_json, &mut buf.footer_json_size);
+}
+
+/// Release any resources behind a [CartUnpackExResult] struct.
+///
+/// This function should be safe to call even if the struct has no data.
+/// This function should be safe to call repeatedly on the same struct.
+#[no_mangle]
+pub extern "C" fn cart_free_unpack_ex_result(mut buf: CartUnpackExResult) {
+    _free_buffer(&mut buf.body, &mut buf.body_size);
+    _free_buffer(&mut buf.header_json, &mut buf.header_json_size);
+    _free_buffer(&mut buf.footer_json, &mut buf.footer_json_size);
+    _free_buffer(&mut buf.digest_json, &mut buf.digest_json_size);
+}
+
+/// Release any resources behind a [CartPackResult] struct.
+///
+/// This function should be safe to call even if the struct has no data.
+/// This function should be safe to call repeatedly on the same struct.
+#[no_mangle]
+pub extern "C" fn cart_free_pack_result(mut buf: CartPackResult) {
+    _free_buffer(&mut buf.packed, &mut buf.packed_size);
+}
+
+/// Helper function to release a buffer handed out by one of the result structs
+fn _free_buffer(buffer: &mut *mut u8, size: &mut u64) {
+    if *buffer != null_mut() {
+        unsafe {
+            let buffer = std::ptr::slice_from_raw_parts_mut(*buffer, *size as usize);
+            drop(Box::from_raw(buffer));
+        }
     }
+    *buffer = null_mut();
+    *size = 0;
 }
 
 
 #[cfg(test)]
 mod tests {
-    use std::ffi::CString;
+    use std::ffi::{CStr, CString};
     use std::io::{Write, Read};
     use std::ptr::{null, null_mut};
 
     #[cfg(unix)]
-    use libc::fopen;
+    use libc::{fclose, fopen};
 
     #[cfg(unix)]
     use crate::cart_unpack_stream;
 
     use crate::{cart_pack_file_default, CART_NO_ERROR, cart_unpack_file, cart_free_unpack_result, cart_is_file_cart, cart_is_stream_cart, cart_is_data_cart, cart_unpack_data, cart_get_file_metadata_only, cart_get_stream_metadata_only, cart_get_data_metadata_only, cart_pack_stream_default, cart_pack_data_default, cart_free_pack_result};
+    use crate::{cart_get_file_footer, cart_get_file_metadata, cart_get_data_footer, cart_get_data_metadata};
+    use crate::{cart_default_pack_options, cart_pack_file_ex, cart_pack_data_ex, CART_ERROR_BAD_OPTIONS, CART_COMPRESSION_STORE};
+    use crate::{CART_DIGEST_SHA512, CART_DIGEST_DEFAULT, CART_DIGEST_ALL};
+    use crate::{cart_unpack_data_into, cart_get_data_decoded_size, CART_ERROR_BUFFER_TOO_SMALL};
+    use crate::{cart_pack_fd, cart_unpack_fd, CART_FD_NOCACHE};
+    use crate::{cart_unpack_file_prefix, cart_unpack_data_prefix, cart_unpack_file_range, cart_unpack_data_range, cart_unpack_file_parallel};
+    use crate::{cart_context_new, cart_context_free, cart_context_pack_data, cart_context_unpack_data, cart_context_pack_file, cart_context_unpack_file};
+    use crate::{cart_pack_files_batch, cart_unpack_files_batch, cart_pack_data_batch, cart_unpack_data_batch, CartUnpackResult, CartPackResult};
+    use crate::{CART_ERROR_OPEN_FILE_READ, CART_ERROR_NULL_ARGUMENT, CART_ERROR_BAD_ARGUMENT_STR};
+    use crate::{cart_verify_file, cart_verify_stream, cart_verify_data, CART_ERROR_DIGEST_MISMATCH, CART_DIGEST_MD5, CART_DIGEST_SHA1, CART_DIGEST_SHA256, CART_DIGEST_LENGTH};
+    use crate::{JsonMap, CART_ERROR_PROCESSING};
+    use crate::{cart_get_file_metadata_raw, cart_get_data_metadata_raw, cart_get_header_field, cart_get_data_header_field};
+    use crate::{CART_METADATA_RAW, CART_METADATA_VALIDATE};
+    use crate::{cart_repack_metadata, CART_RC4_KEY_SIZE};
+    use crate::{cart_decoder_new, cart_decoder_free, cart_decoder_feed, cart_decoder_pending, cart_decoder_read, cart_decoder_header, cart_decoder_finish, CART_ERROR_INCOMPLETE, CART_ERROR_OUTPUT_PENDING};
+    use crate::{cart_encoder_new, cart_encoder_free, cart_encoder_write, cart_encoder_pending, cart_encoder_read, cart_encoder_finish, CART_ERROR_BAD_JSON_ARGUMENT};
+    use crate::{cart_default_unpack_options, cart_unpack_file_ex, cart_unpack_stream_ex, cart_unpack_data_ex, cart_free_unpack_ex_result, CART_ERROR_OUTPUT_LIMIT};
+    use crate::{cart_get_global_stats, CartStats};
+
+
+    #[cfg(unix)]
+    #[test]
+    fn unpack_file_from_pipe() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let packed = cart_pack_data_default(raw_data.as_ptr() as *const i8, raw_data.len(), null());
+        let packed_data = unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }.to_vec();
+        cart_free_pack_result(packed);
+
+        // A pipe can't be mapped or seeked, so it has to be decoded as a stream
+        let directory = tempfile::tempdir().unwrap();
+        let pipe_path = CString::new(directory.path().join("pipe").to_str().unwrap()).unwrap();
+        assert_eq!(unsafe { libc::mkfifo(pipe_path.as_ptr(), 0o600) }, 0);
+        let writer_path = directory.path().join("pipe");
+        let writer = std::thread::spawn(move || std::fs::write(writer_path, packed_data).unwrap());
 
+        let output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file(pipe_path.as_ptr(), output_path.as_ptr());
+        writer.join().unwrap();
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(std::fs::read(output.path()).unwrap(), raw_data);
+        cart_free_unpack_result(out);
+    }
 
     #[test]
     fn round_trip_file() {
@@ -666,32 +2985,94 @@ mod tests {
         // Encode the data with cart
         let buffer = tempfile::NamedTempFile::new().unwrap();
         let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
-        assert_eq!(cart_pack_file_default(input_path.as_ptr(), buffer_path.as_ptr(), input_json.as_ptr()), CART_NO_ERROR);
-        assert!(cart_is_file_cart(buffer_path.as_ptr()));
-
-        // Decode the cart data
-        let mut output = tempfile::NamedTempFile::new().unwrap();
+        assert_eq!(cart_pack_file_default(input_path.as_ptr(), buffer_path.as_ptr(), input_json.as_ptr()), CART_NO_ERROR);
+        assert!(cart_is_file_cart(buffer_path.as_ptr()));
+
+        // Decode the cart data
+        let mut output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file(buffer_path.as_ptr(), output_path.as_ptr());
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.body, null_mut());
+        assert_eq!(out.body_size, 0);
+        assert!(out.footer_json != null_mut());
+        assert!(out.footer_json_size > 0);
+
+        // Check the header metadata
+        let output_json = unsafe { std::slice::from_raw_parts(out.header_json, out.header_json_size as usize - 1) };
+        let output_meta: serde_json::Map<String, serde_json::Value> = serde_json::from_slice(output_json).unwrap();
+        assert_eq!(output_meta, input_meta);
+
+        // Check the output is decoded right
+        let mut output_data = vec![];
+        let bytes = output.as_file_mut().read_to_end(&mut output_data).unwrap();
+        assert_eq!(bytes, raw_data.len());
+        assert_eq!(output_data, raw_data);
+
+        // Read the metadata without decoding
+        let footer_json = unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize) }.to_vec();
+        let meta = cart_get_file_metadata(buffer_path.as_ptr());
+        assert_eq!(meta.error, CART_NO_ERROR);
+        assert_eq!(meta.body, null_mut());
+        assert_eq!(unsafe { std::slice::from_raw_parts(meta.header_json, meta.header_json_size as usize - 1) }, output_json);
+        assert_eq!(unsafe { std::slice::from_raw_parts(meta.footer_json, meta.footer_json_size as usize) }, footer_json);
+        cart_free_unpack_result(meta);
+
+        let meta = cart_get_file_footer(buffer_path.as_ptr());
+        assert_eq!(meta.error, CART_NO_ERROR);
+        assert_eq!(meta.header_json, null_mut());
+        assert_eq!(unsafe { std::slice::from_raw_parts(meta.footer_json, meta.footer_json_size as usize) }, footer_json);
+        cart_free_unpack_result(meta);
+
+        // Release resources
+        cart_free_unpack_result(out);
+    }
+
+    #[test]
+    fn round_trip_empty_file() {
+        // An empty input can't be mapped so is streamed instead
+        let input = tempfile::NamedTempFile::new().unwrap();
+        let input_path = CString::new(input.path().to_str().unwrap()).unwrap();
+
+        let buffer = tempfile::NamedTempFile::new().unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        assert_eq!(cart_pack_file_default(input_path.as_ptr(), buffer_path.as_ptr(), null()), CART_NO_ERROR);
+
+        let mut output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file(buffer_path.as_ptr(), output_path.as_ptr());
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.header_json, null_mut());
+
+        let mut output_data = vec![];
+        assert_eq!(output.as_file_mut().read_to_end(&mut output_data).unwrap(), 0);
+        cart_free_unpack_result(out);
+    }
+
+    #[test]
+    fn round_trip_mapped_file() {
+        // Mapping the input is only done when the options ask for it
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut input = tempfile::NamedTempFile::new().unwrap();
+        input.write_all(raw_data).unwrap();
+        let input_path = CString::new(input.path().to_str().unwrap()).unwrap();
+        let buffer = tempfile::NamedTempFile::new().unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let output = tempfile::NamedTempFile::new().unwrap();
         let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
-        let out = cart_unpack_file(buffer_path.as_ptr(), output_path.as_ptr());
-        assert_eq!(out.error, CART_NO_ERROR);
-        assert_eq!(out.body, null_mut());
-        assert_eq!(out.body_size, 0);
-        assert!(out.footer_json != null_mut());
-        assert!(out.footer_json_size > 0);
-
-        // Check the header metadata
-        let output_json = unsafe { std::slice::from_raw_parts(out.header_json, out.header_json_size as usize - 1) };
-        let output_meta: serde_json::Map<String, serde_json::Value> = serde_json::from_slice(output_json).unwrap();
-        assert_eq!(output_meta, input_meta);
 
-        // Check the output is decoded right
-        let mut output_data = vec![];
-        let bytes = output.as_file_mut().read_to_end(&mut output_data).unwrap();
-        assert_eq!(bytes, raw_data.len());
-        assert_eq!(output_data, raw_data);
+        let mut options = cart_default_pack_options();
+        assert!(!options.map_input);
+        options.map_input = true;
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), null(), &options), CART_NO_ERROR);
 
-        // Release resources
-        cart_free_unpack_result(out);
+        let mut options = cart_default_unpack_options();
+        assert!(!options.map_input);
+        options.map_input = true;
+        let out = cart_unpack_file_ex(buffer_path.as_ptr(), output_path.as_ptr(), &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        cart_free_unpack_ex_result(out);
+        assert_eq!(std::fs::read(output.path()).unwrap(), raw_data);
     }
 
     #[cfg(unix)]
@@ -738,6 +3119,357 @@ mod tests {
         cart_free_unpack_result(out);
     }
 
+    #[test]
+    fn verify() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let all_digests = CART_DIGEST_MD5 | CART_DIGEST_SHA1 | CART_DIGEST_SHA256 | CART_DIGEST_SHA512 | CART_DIGEST_LENGTH;
+
+        // Check a buffer, then the same data as a file and a stream
+        let mut options = cart_default_pack_options();
+        options.digests = CART_DIGEST_ALL;
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), &options);
+        assert_eq!(packed.error, CART_NO_ERROR);
+        let result = cart_verify_data(packed.packed as *const i8, packed.packed_size as usize);
+        assert_eq!(result.error, CART_NO_ERROR);
+        assert_eq!(result.checked_digests, all_digests);
+        assert_eq!(result.failed_digests, 0);
+
+        let mut buffer = tempfile::NamedTempFile::new().unwrap();
+        buffer.write_all(unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }).unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let result = cart_verify_file(buffer_path.as_ptr());
+        assert_eq!(result.error, CART_NO_ERROR);
+        assert_eq!(result.checked_digests, all_digests);
+
+        #[cfg(unix)]
+        {
+            let mode_r = CString::new("rb").unwrap();
+            let buffer_file = unsafe {fopen(buffer_path.as_ptr(), mode_r.as_ptr())};
+            let result = cart_verify_stream(buffer_file);
+            unsafe {fclose(buffer_file)};
+            assert_eq!(result.error, CART_NO_ERROR);
+            assert_eq!(result.checked_digests, all_digests);
+        }
+        cart_free_pack_result(packed);
+
+        // A footer with a wrong digest
+        let mut footer = JsonMap::new();
+        footer.insert("md5".to_owned(), serde_json::to_value("00").unwrap());
+        let mut packed = vec![];
+        crate::cart::pack_stream(&raw_data[..], &mut packed, None, Some(footer), vec![], None).unwrap();
+        let result = cart_verify_data(packed.as_ptr() as *const i8, packed.len());
+        assert_eq!(result.error, CART_ERROR_DIGEST_MISMATCH);
+        assert_eq!(result.checked_digests, CART_DIGEST_MD5);
+        assert_eq!(result.failed_digests, CART_DIGEST_MD5);
+
+        // Corrupt data
+        assert_eq!(cart_verify_data(packed.as_ptr() as *const i8, packed.len() - 1).error, CART_ERROR_PROCESSING);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn digest_on_unpack() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let packed = cart_pack_data_default(raw_data.as_ptr() as *const i8, raw_data.len(), null());
+        let packed_data = unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }.to_vec();
+        cart_free_pack_result(packed);
+
+        let mut options = cart_default_unpack_options();
+        options.digests = CART_DIGEST_SHA256 | CART_DIGEST_LENGTH;
+        let out = cart_unpack_data_ex(packed_data.as_ptr() as *const i8, packed_data.len(), &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(unsafe { std::slice::from_raw_parts(out.body, out.body_size as usize) }, raw_data);
+
+        // The digests should match those stored when encoding
+        let footer: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize - 1) }).unwrap();
+        let digests: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.digest_json, out.digest_json_size as usize - 1) }).unwrap();
+        assert_eq!(digests.len(), 2);
+        assert_eq!(digests.get("sha256"), footer.get("sha256"));
+        assert_eq!(digests.get("length"), footer.get("length"));
+
+        // The raw digests are the same values
+        assert_eq!(out.digests.present, CART_DIGEST_SHA256 | CART_DIGEST_LENGTH);
+        assert_eq!(out.digests.length, raw_data.len() as u64);
+        let sha256: String = out.digests.sha256.iter().map(|byte| format!("{:02x}", byte)).collect();
+        assert_eq!(footer.get("sha256").unwrap(), &sha256);
+        assert_eq!(out.digests.md5, [0; 16]);
+        cart_free_unpack_ex_result(out);
+
+        // Same again for files and streams
+        let mut buffer = tempfile::NamedTempFile::new().unwrap();
+        buffer.write_all(&packed_data).unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file_ex(buffer_path.as_ptr(), output_path.as_ptr(), &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let file_digests: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.digest_json, out.digest_json_size as usize - 1) }).unwrap();
+        assert_eq!(file_digests, digests);
+        cart_free_unpack_ex_result(out);
+
+        let mode_r = CString::new("rb").unwrap();
+        let mode_w = CString::new("wb").unwrap();
+        let buffer_file = unsafe {fopen(buffer_path.as_ptr(), mode_r.as_ptr())};
+        let output_file = unsafe {fopen(output_path.as_ptr(), mode_w.as_ptr())};
+        let out = cart_unpack_stream_ex(buffer_file, output_file, &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let stream_digests: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.digest_json, out.digest_json_size as usize - 1) }).unwrap();
+        assert_eq!(stream_digests, digests);
+        cart_free_unpack_ex_result(out);
+
+        // Without options no digests are returned
+        let out = cart_unpack_data_ex(packed_data.as_ptr() as *const i8, packed_data.len(), null());
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.digest_json, null_mut());
+        assert_eq!(out.digests.present, 0);
+        cart_free_unpack_ex_result(out);
+
+        options.digests = 1 << 30;
+        let out = cart_unpack_data_ex(packed_data.as_ptr() as *const i8, packed_data.len(), &options);
+        assert_eq!(out.error, CART_ERROR_BAD_OPTIONS);
+    }
+
+    #[test]
+    fn output_limit() {
+        let raw_data = vec![0u8; 1 << 20];
+        let packed = cart_pack_data_default(raw_data.as_ptr() as *const i8, raw_data.len(), null());
+        let packed_data = unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }.to_vec();
+        cart_free_pack_result(packed);
+
+        let mut buffer = tempfile::NamedTempFile::new().unwrap();
+        buffer.write_all(&packed_data).unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+
+        for (max_output_size, max_ratio, expected) in [
+            (raw_data.len() as u64, 0, CART_NO_ERROR),
+            (raw_data.len() as u64 - 1, 0, CART_ERROR_OUTPUT_LIMIT),
+            (0, 10, CART_ERROR_OUTPUT_LIMIT),
+        ] {
+            let mut options = cart_default_unpack_options();
+            options.max_output_size = max_output_size;
+            options.max_ratio = max_ratio;
+
+            let out = cart_unpack_data_ex(packed_data.as_ptr() as *const i8, packed_data.len(), &options);
+            assert_eq!(out.error, expected);
+            cart_free_unpack_ex_result(out);
+
+            let out = cart_unpack_file_ex(buffer_path.as_ptr(), output_path.as_ptr(), &options);
+            assert_eq!(out.error, expected);
+            cart_free_unpack_ex_result(out);
+        }
+    }
+
+    #[test]
+    fn stage_stats() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut input = tempfile::NamedTempFile::new().unwrap();
+        input.write_all(raw_data).unwrap();
+        let input_path = CString::new(input.path().to_str().unwrap()).unwrap();
+        let buffer = tempfile::NamedTempFile::new().unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let before = cart_get_global_stats();
+
+        let mut pack_stats = CartStats::default();
+        let mut options = cart_default_pack_options();
+        options.stats = &mut pack_stats;
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), null(), &options), CART_NO_ERROR);
+        let packed_data = std::fs::read(buffer.path()).unwrap();
+
+        // Stages run on the pipeline's threads are counted for the call that started them
+        let mut pipelined_stats = CartStats::default();
+        options.pipelined = true;
+        options.stats = &mut pipelined_stats;
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), output_path.as_ptr(), null(), &options), CART_NO_ERROR);
+
+        let mut unpack_stats = CartStats::default();
+        let mut options = cart_default_unpack_options();
+        options.digests = CART_DIGEST_SHA512;
+        options.stats = &mut unpack_stats;
+        let out = cart_unpack_file_ex(buffer_path.as_ptr(), output_path.as_ptr(), &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        cart_free_unpack_ex_result(out);
+
+        let mut data_stats = CartStats::default();
+        options.stats = &mut data_stats;
+        let out = cart_unpack_data_ex(packed_data.as_ptr() as *const i8, packed_data.len(), &options);
+        assert_eq!(out.error, CART_NO_ERROR);
+        cart_free_unpack_ex_result(out);
+
+        if !cfg!(feature = "stats") {
+            for stats in [pack_stats, pipelined_stats, unpack_stats, data_stats, cart_get_global_stats()] {
+                assert_eq!(stats, CartStats::default());
+            }
+            return
+        }
+
+        let length = raw_data.len() as u64;
+        assert_eq!(pack_stats.bytes_in, length);
+        assert_eq!(pack_stats.deflate_bytes, length);
+        assert_eq!(pack_stats.md5_bytes, length);
+        assert_eq!(pack_stats.length_bytes, length);
+        assert_eq!(pack_stats.sha512_bytes, 0);
+        assert_eq!(pack_stats.inflate_bytes, 0);
+        assert!(pack_stats.bytes_out > 0 && pack_stats.bytes_out < packed_data.len() as u64);
+        assert_eq!(pack_stats.cipher_bytes, pack_stats.bytes_out);
+        assert_eq!(pipelined_stats.bytes_in, length);
+        assert_eq!(pipelined_stats.md5_bytes, length);
+        assert_eq!(pipelined_stats.sha256_bytes, length);
+
+        for stats in [unpack_stats, data_stats] {
+            assert_eq!(stats.inflate_bytes, length);
+            assert_eq!(stats.bytes_out, length);
+            assert_eq!(stats.sha512_bytes, length);
+            assert_eq!(stats.md5_bytes, 0);
+            assert_eq!(stats.deflate_bytes, 0);
+            assert!(stats.bytes_in > 0 && stats.bytes_in <= packed_data.len() as u64);
+            assert!(stats.cipher_bytes > 0 && stats.cipher_bytes <= stats.bytes_in);
+        }
+
+        // Other tests run at the same time, so the totals only have to cover these calls
+        let after = cart_get_global_stats();
+        assert!(after.bytes_out - before.bytes_out >= pack_stats.bytes_out + 2 * length);
+        assert!(after.sha512_bytes - before.sha512_bytes >= 2 * length);
+    }
+
+    #[test]
+    fn raw_metadata() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let header = CString::new(r#"{"name": "cart.rs",  "tags": ["a", "b"]}"#).unwrap();
+        let mut options = cart_default_pack_options();
+
+        // Raw headers are stored as given, parsed headers are re-encoded
+        for flags in [0, CART_METADATA_RAW, CART_METADATA_RAW | CART_METADATA_VALIDATE] {
+            options.metadata_flags = flags;
+            let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), header.as_ptr(), &options);
+            assert_eq!(packed.error, CART_NO_ERROR);
+
+            let meta = cart_get_data_metadata_raw(packed.packed as *const i8, packed.packed_size as usize, CART_METADATA_VALIDATE);
+            assert_eq!(meta.error, CART_NO_ERROR);
+            assert!(meta.footer_json_size > 0);
+            let header_json = unsafe { CStr::from_ptr(meta.header_json as *const i8) }.to_bytes();
+            if flags & CART_METADATA_RAW != 0 {
+                assert_eq!(header_json, header.as_bytes());
+            } else {
+                assert_eq!(header_json, br#"{"name":"cart.rs","tags":["a","b"]}"#);
+            }
+            cart_free_unpack_result(meta);
+
+            let field = CString::new("tags").unwrap();
+            let value = cart_get_data_header_field(packed.packed as *const i8, packed.packed_size as usize, field.as_ptr());
+            assert_eq!(value.error, CART_NO_ERROR);
+            assert_eq!(value.footer_json, null_mut());
+            let value_json = unsafe { CStr::from_ptr(value.header_json as *const i8) }.to_bytes();
+            assert_eq!(serde_json::from_slice::<serde_json::Value>(value_json).unwrap(), serde_json::json!(["a", "b"]));
+            cart_free_unpack_result(value);
+
+            let field = CString::new("missing").unwrap();
+            let value = cart_get_data_header_field(packed.packed as *const i8, packed.packed_size as usize, field.as_ptr());
+            assert_eq!(value.error, CART_NO_ERROR);
+            assert_eq!(value.header_json, null_mut());
+            cart_free_unpack_result(value);
+
+            cart_free_pack_result(packed);
+        }
+
+        // Invalid json is only caught when it is parsed or validated
+        let invalid = CString::new(r#"{"name": "#).unwrap();
+        for (flags, expected) in [
+            (0, CART_ERROR_BAD_JSON_ARGUMENT),
+            (CART_METADATA_RAW, CART_NO_ERROR),
+            (CART_METADATA_RAW | CART_METADATA_VALIDATE, CART_ERROR_BAD_JSON_ARGUMENT),
+            (4, CART_ERROR_BAD_OPTIONS),
+        ] {
+            options.metadata_flags = flags;
+            let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), invalid.as_ptr(), &options);
+            assert_eq!(packed.error, expected);
+            if expected == CART_NO_ERROR {
+                let meta = cart_get_data_metadata_raw(packed.packed as *const i8, packed.packed_size as usize, 0);
+                assert_eq!(meta.error, CART_NO_ERROR);
+                cart_free_unpack_result(meta);
+                let meta = cart_get_data_metadata_raw(packed.packed as *const i8, packed.packed_size as usize, CART_METADATA_VALIDATE);
+                assert_eq!(meta.error, CART_ERROR_PROCESSING);
+                let meta = cart_get_data_metadata(packed.packed as *const i8, packed.packed_size as usize);
+                assert_eq!(meta.error, CART_ERROR_PROCESSING);
+            }
+            cart_free_pack_result(packed);
+        }
+
+        // The file variants read the same metadata
+        let input_file = tempfile::NamedTempFile::new().unwrap();
+        std::fs::write(input_file.path(), raw_data).unwrap();
+        let buffer_file = tempfile::NamedTempFile::new().unwrap();
+        let input_path = CString::new(input_file.path().to_str().unwrap()).unwrap();
+        let buffer_path = CString::new(buffer_file.path().to_str().unwrap()).unwrap();
+        options.metadata_flags = CART_METADATA_RAW;
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), header.as_ptr(), &options), CART_NO_ERROR);
+        let meta = cart_get_file_metadata_raw(buffer_path.as_ptr(), 0);
+        assert_eq!(meta.error, CART_NO_ERROR);
+        assert_eq!(unsafe { CStr::from_ptr(meta.header_json as *const i8) }.to_bytes(), header.as_bytes());
+        cart_free_unpack_result(meta);
+        let field = CString::new("name").unwrap();
+        let value = cart_get_header_field(buffer_path.as_ptr(), field.as_ptr());
+        assert_eq!(value.error, CART_NO_ERROR);
+        assert_eq!(unsafe { CStr::from_ptr(value.header_json as *const i8) }.to_bytes(), br#""cart.rs""#);
+        cart_free_unpack_result(value);
+    }
+
+    #[test]
+    fn repack_metadata() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let input_file = tempfile::NamedTempFile::new().unwrap();
+        std::fs::write(input_file.path(), raw_data).unwrap();
+        let packed_file = tempfile::NamedTempFile::new().unwrap();
+        let relabeled_file = tempfile::NamedTempFile::new().unwrap();
+        let rekeyed_file = tempfile::NamedTempFile::new().unwrap();
+        let output_file = tempfile::NamedTempFile::new().unwrap();
+        let input_path = CString::new(input_file.path().to_str().unwrap()).unwrap();
+        let packed_path = CString::new(packed_file.path().to_str().unwrap()).unwrap();
+        let relabeled_path = CString::new(relabeled_file.path().to_str().unwrap()).unwrap();
+        let rekeyed_path = CString::new(rekeyed_file.path().to_str().unwrap()).unwrap();
+        let output_path = CString::new(output_file.path().to_str().unwrap()).unwrap();
+
+        let header = CString::new(r#"{"label": "old"}"#).unwrap();
+        assert_eq!(cart_pack_file_default(input_path.as_ptr(), packed_path.as_ptr(), header.as_ptr()), CART_NO_ERROR);
+        let original = cart_get_file_metadata(packed_path.as_ptr());
+        let original_footer = unsafe { CStr::from_ptr(original.footer_json as *const i8) }.to_bytes().to_vec();
+        cart_free_unpack_result(original);
+
+        // Replace the header, keeping the footer
+        let new_header = CString::new(r#"{"label": "new"}"#).unwrap();
+        assert_eq!(cart_repack_metadata(packed_path.as_ptr(), relabeled_path.as_ptr(), new_header.as_ptr(), null(), null(), null()), CART_NO_ERROR);
+        let out = cart_unpack_file(relabeled_path.as_ptr(), output_path.as_ptr());
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(unsafe { CStr::from_ptr(out.header_json as *const i8) }.to_bytes(), br#"{"label":"new"}"#);
+        assert_eq!(unsafe { CStr::from_ptr(out.footer_json as *const i8) }.to_bytes(), original_footer.as_slice());
+        assert_eq!(std::fs::read(output_file.path()).unwrap(), raw_data);
+        cart_free_unpack_result(out);
+
+        // Switch key and back, keeping all the metadata
+        let key = [7u8; CART_RC4_KEY_SIZE as usize];
+        assert_eq!(cart_repack_metadata(relabeled_path.as_ptr(), rekeyed_path.as_ptr(), null(), null(), null(), key.as_ptr()), CART_NO_ERROR);
+        let out = cart_unpack_file(rekeyed_path.as_ptr(), output_path.as_ptr());
+        assert_ne!(out.error, CART_NO_ERROR);
+        assert_eq!(cart_repack_metadata(rekeyed_path.as_ptr(), output_path.as_ptr(), null(), null(), key.as_ptr(), null()), CART_NO_ERROR);
+        assert_eq!(std::fs::read(output_file.path()).unwrap(), std::fs::read(relabeled_file.path()).unwrap());
+
+        let bad_json = CString::new("{").unwrap();
+        assert_eq!(cart_repack_metadata(packed_path.as_ptr(), output_path.as_ptr(), null(), bad_json.as_ptr(), null(), null()), CART_ERROR_BAD_JSON_ARGUMENT);
+        assert_eq!(cart_repack_metadata(input_path.as_ptr(), output_path.as_ptr(), null(), null(), null(), null()), CART_ERROR_PROCESSING);
+
+        // Writing over the input is refused, however its path is spelled
+        let packed = std::fs::read(packed_file.path()).unwrap();
+        let path = packed_file.path();
+        let respelled = path.parent().unwrap().join(".").join(path.file_name().unwrap());
+        let respelled_path = CString::new(respelled.to_str().unwrap()).unwrap();
+        assert_eq!(cart_repack_metadata(packed_path.as_ptr(), packed_path.as_ptr(), new_header.as_ptr(), null(), null(), null()), CART_ERROR_BAD_ARGUMENT_STR);
+        assert_eq!(cart_repack_metadata(packed_path.as_ptr(), respelled_path.as_ptr(), new_header.as_ptr(), null(), null(), null()), CART_ERROR_BAD_ARGUMENT_STR);
+        assert_eq!(std::fs::read(packed_file.path()).unwrap(), packed);
+    }
+
     #[test]
     fn round_trip_buffer() {
         // prepare an input
@@ -760,11 +3492,361 @@ mod tests {
         let output_data = unsafe { std::slice::from_raw_parts(out.body, out.body_size as usize)};
         assert_eq!(output_data, raw_data);
 
+        // Read the metadata without decoding
+        let footer_json = unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize) };
+        let meta = cart_get_data_metadata(packed.packed as *const i8, packed.packed_size as usize);
+        assert_eq!(meta.error, CART_NO_ERROR);
+        assert_eq!(meta.header_json, null_mut());
+        assert_eq!(unsafe { std::slice::from_raw_parts(meta.footer_json, meta.footer_json_size as usize) }, footer_json);
+        cart_free_unpack_result(meta);
+
+        let meta = cart_get_data_footer(packed.packed as *const i8, packed.packed_size as usize - 1);
+        assert_ne!(meta.error, CART_NO_ERROR);
+
+        // Decode into a buffer sized from the footer
+        let mut decoded_size = 0u64;
+        assert_eq!(cart_get_data_decoded_size(packed.packed as *const i8, packed.packed_size as usize, &mut decoded_size), CART_NO_ERROR);
+        assert_eq!(decoded_size, raw_data.len() as u64);
+        let mut output_data = vec![0u8; decoded_size as usize];
+        let into = cart_unpack_data_into(packed.packed as *const i8, packed.packed_size as usize, output_data.as_mut_ptr() as *mut i8, output_data.len());
+        assert_eq!(into.error, CART_NO_ERROR);
+        assert_eq!(into.body, null_mut());
+        assert_eq!(into.body_size, raw_data.len() as u64);
+        assert_eq!(unsafe { std::slice::from_raw_parts(into.footer_json, into.footer_json_size as usize) }, footer_json);
+        assert_eq!(output_data, raw_data);
+        cart_free_unpack_result(into);
+
+        let into = cart_unpack_data_into(packed.packed as *const i8, packed.packed_size as usize, output_data.as_mut_ptr() as *mut i8, output_data.len() - 1);
+        assert_eq!(into.error, CART_ERROR_BUFFER_TOO_SMALL);
+
+        // Decode only the start of the body
+        let mut output_data = vec![0u8; 64];
+        let prefix = cart_unpack_data_prefix(packed.packed as *const i8, packed.packed_size as usize, output_data.len(), output_data.as_mut_ptr() as *mut i8);
+        assert_eq!(prefix.error, CART_NO_ERROR);
+        assert_eq!(prefix.body, null_mut());
+        assert_eq!(prefix.body_size, 64);
+        assert_eq!(unsafe { std::slice::from_raw_parts(prefix.footer_json, prefix.footer_json_size as usize) }, footer_json);
+        assert_eq!(output_data, raw_data[0..64]);
+        cart_free_unpack_result(prefix);
+
+        let mut buffer = tempfile::NamedTempFile::new().unwrap();
+        buffer.write_all(unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }).unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        let mut output_data = vec![0u8; raw_data.len() + 10];
+        let prefix = cart_unpack_file_prefix(buffer_path.as_ptr(), output_data.len(), output_data.as_mut_ptr() as *mut i8);
+        assert_eq!(prefix.error, CART_NO_ERROR);
+        assert_eq!(prefix.body_size, raw_data.len() as u64);
+        assert_eq!(unsafe { std::slice::from_raw_parts(prefix.footer_json, prefix.footer_json_size as usize) }, footer_json);
+        assert_eq!(&output_data[0..raw_data.len()], raw_data);
+        cart_free_unpack_result(prefix);
+
         // Release resources
         cart_free_pack_result(packed);
         cart_free_unpack_result(out);
     }
 
+    #[test]
+    fn round_trip_decoder() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let header = CString::new(r#"{"name": "cart.rs"}"#).unwrap();
+        let packed = cart_pack_data_default(raw_data.as_ptr() as *const i8, raw_data.len(), header.as_ptr());
+        assert_eq!(packed.error, CART_NO_ERROR);
+        let packed_data = unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }.to_vec();
+        cart_free_pack_result(packed);
+
+        // Feed the data in uneven pieces, reading output as it becomes available
+        let decoder = cart_decoder_new();
+        let out = cart_decoder_header(decoder);
+        assert_eq!(out.error, CART_ERROR_INCOMPLETE);
+        let mut output = vec![];
+        let mut buffer = [0u8; 1000];
+        for piece in packed_data.chunks(1460) {
+            assert_eq!(cart_decoder_feed(decoder, piece.as_ptr() as *const i8, piece.len()), CART_NO_ERROR);
+            while cart_decoder_pending(decoder) > 0 {
+                let mut size = 0;
+                assert_eq!(cart_decoder_read(decoder, buffer.as_mut_ptr() as *mut i8, buffer.len(), &mut size), CART_NO_ERROR);
+                output.extend_from_slice(&buffer[0..size]);
+            }
+        }
+        assert_eq!(output, raw_data);
+
+        let out = cart_decoder_header(decoder);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let header: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.header_json, out.header_json_size as usize - 1) }).unwrap();
+        assert_eq!(header.get("name").unwrap(), "cart.rs");
+        cart_free_unpack_result(out);
+
+        let out = cart_decoder_finish(decoder);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let footer: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize - 1) }).unwrap();
+        assert_eq!(footer.get("length").unwrap(), &raw_data.len().to_string());
+        cart_free_unpack_result(out);
+        cart_decoder_free(decoder);
+
+        // Encode in pieces as well, the output should match
+        let header = CString::new(r#"{"name": "cart.rs"}"#).unwrap();
+        let encoder = cart_encoder_new(header.as_ptr(), null());
+        assert!(encoder != null_mut());
+        let mut encoded = vec![];
+        let mut drain = |encoded: &mut Vec<u8>| while cart_encoder_pending(encoder) > 0 {
+            let mut size = 0;
+            assert_eq!(cart_encoder_read(encoder, buffer.as_mut_ptr() as *mut i8, buffer.len(), &mut size), CART_NO_ERROR);
+            encoded.extend_from_slice(&buffer[0..size]);
+        };
+        for piece in raw_data.chunks(1460) {
+            assert_eq!(cart_encoder_write(encoder, piece.as_ptr() as *const i8, piece.len()), CART_NO_ERROR);
+            drain(&mut encoded);
+        }
+        assert_eq!(cart_encoder_finish(encoder, null()), CART_NO_ERROR);
+        drain(&mut encoded);
+        assert_eq!(encoded, packed_data);
+        assert_eq!(cart_encoder_finish(encoder, null()), CART_ERROR_PROCESSING);
+        cart_encoder_free(encoder);
+
+        // Data that stops within the body is incomplete
+        let decoder = cart_decoder_new();
+        assert_eq!(cart_decoder_feed(decoder, packed_data.as_ptr() as *const i8, 1000), CART_NO_ERROR);
+        assert_eq!(cart_decoder_finish(decoder).error, CART_ERROR_INCOMPLETE);
+        cart_decoder_free(decoder);
+
+        // Finishing with more output than a block waits for it to be read. A body corrupted
+        // past that point is then reported as corrupt rather than incomplete.
+        let mut corrupt = packed_data.clone();
+        let position = corrupt.len() - 400;
+        corrupt[position] ^= 0x55;
+        for (data, error) in [(&packed_data, CART_NO_ERROR), (&corrupt, CART_ERROR_PROCESSING)] {
+            let decoder = cart_decoder_new();
+            assert_eq!(cart_decoder_feed(decoder, data.as_ptr() as *const i8, data.len()), CART_NO_ERROR);
+            assert_eq!(cart_decoder_finish(decoder).error, CART_ERROR_OUTPUT_PENDING);
+            let mut size = 1;
+            while size > 0 {
+                assert_eq!(cart_decoder_read(decoder, buffer.as_mut_ptr() as *mut i8, buffer.len(), &mut size), CART_NO_ERROR);
+            }
+            let out = cart_decoder_finish(decoder);
+            assert_eq!(out.error, error);
+            cart_free_unpack_result(out);
+            cart_decoder_free(decoder);
+        }
+    }
+
+    #[test]
+    fn round_trip_context() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let context = cart_context_new();
+
+        for size in [raw_data.len(), 1, 5000] {
+            let data = &raw_data[0..size];
+            let packed = cart_context_pack_data(context, data.as_ptr() as *const i8, data.len(), null());
+            assert_eq!(packed.error, CART_NO_ERROR);
+
+            // Should be readable by the regular decoder
+            let out = cart_unpack_data(packed.packed as *const i8, packed.packed_size as usize);
+            assert_eq!(out.error, CART_NO_ERROR);
+            assert_eq!(unsafe { std::slice::from_raw_parts(out.body, out.body_size as usize) }, data);
+
+            let context_out = cart_context_unpack_data(context, packed.packed as *const i8, packed.packed_size as usize);
+            assert_eq!(context_out.error, CART_NO_ERROR);
+            assert_eq!(unsafe { std::slice::from_raw_parts(context_out.body, context_out.body_size as usize) }, data);
+            assert_eq!(unsafe { std::slice::from_raw_parts(context_out.footer_json, context_out.footer_json_size as usize) },
+                unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize) });
+
+            cart_free_unpack_result(out);
+            cart_free_unpack_result(context_out);
+            cart_free_pack_result(packed);
+        }
+
+        // File versions
+        let mut input = tempfile::NamedTempFile::new().unwrap();
+        input.write_all(raw_data).unwrap();
+        let input_path = CString::new(input.path().to_str().unwrap()).unwrap();
+        let buffer = tempfile::NamedTempFile::new().unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        assert_eq!(cart_context_pack_file(context, input_path.as_ptr(), buffer_path.as_ptr(), null()), CART_NO_ERROR);
+
+        let mut output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_context_unpack_file(context, buffer_path.as_ptr(), output_path.as_ptr());
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.body, null_mut());
+        let mut output_data = vec![];
+        output.as_file_mut().read_to_end(&mut output_data).unwrap();
+        assert_eq!(output_data, raw_data);
+        cart_free_unpack_result(out);
+
+        cart_context_free(context);
+    }
+
+    #[test]
+    fn round_trip_batch() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let sizes = [raw_data.len(), 0, 1, 5000];
+        let directory = tempfile::tempdir().unwrap();
+        let path = |name: String| CString::new(directory.path().join(name).to_str().unwrap()).unwrap();
+
+        // Prepare inputs, with a missing file at the end
+        let mut inputs = vec![];
+        for (index, size) in sizes.iter().enumerate() {
+            let input = path(format!("input{index}"));
+            std::fs::write(input.to_str().unwrap(), &raw_data[0..*size]).unwrap();
+            inputs.push(input);
+        }
+        inputs.push(path("missing".to_owned()));
+        let carts: Vec<CString> = (0..inputs.len()).map(|index| path(format!("cart{index}"))).collect();
+        let outputs: Vec<CString> = (0..inputs.len()).map(|index| path(format!("output{index}"))).collect();
+        let header = CString::new("{\"cat\": \"dog\"}").unwrap();
+
+        let input_ptrs: Vec<_> = inputs.iter().map(|path| path.as_ptr()).collect();
+        let cart_ptrs: Vec<_> = carts.iter().map(|path| path.as_ptr()).collect();
+        let output_ptrs: Vec<_> = outputs.iter().map(|path| path.as_ptr()).collect();
+        let header_ptrs: Vec<_> = inputs.iter().map(|_| header.as_ptr()).collect();
+
+        let mut codes = vec![u32::MAX; inputs.len()];
+        assert_eq!(cart_pack_files_batch(input_ptrs.as_ptr(), cart_ptrs.as_ptr(), header_ptrs.as_ptr(), inputs.len(), 2, codes.as_mut_ptr()), CART_NO_ERROR);
+        assert_eq!(codes, vec![CART_NO_ERROR, CART_NO_ERROR, CART_NO_ERROR, CART_NO_ERROR, CART_ERROR_OPEN_FILE_READ]);
+
+        let mut results: Vec<CartUnpackResult> = inputs.iter().map(|_| CartUnpackResult::new_err(0)).collect();
+        assert_eq!(cart_unpack_files_batch(cart_ptrs.as_ptr(), output_ptrs.as_ptr(), inputs.len(), 0, results.as_mut_ptr()), CART_NO_ERROR);
+        for (index, size) in sizes.iter().enumerate() {
+            assert_eq!(results[index].error, CART_NO_ERROR);
+            assert!(results[index].header_json != null_mut());
+            assert_eq!(std::fs::read(outputs[index].to_str().unwrap()).unwrap(), &raw_data[0..*size]);
+        }
+        assert_eq!(results[sizes.len()].error, CART_ERROR_OPEN_FILE_READ);
+        results.into_iter().for_each(|result| cart_free_unpack_result(result));
+
+        // Buffers, with an empty one that should be rejected
+        let buffer_ptrs: Vec<*const i8> = sizes.iter().map(|_| raw_data.as_ptr() as *const i8).collect();
+        let mut packed: Vec<CartPackResult> = sizes.iter().map(|_| CartPackResult::new_err(0)).collect();
+        assert_eq!(cart_pack_data_batch(buffer_ptrs.as_ptr(), sizes.as_ptr(), null(), sizes.len(), 3, packed.as_mut_ptr()), CART_NO_ERROR);
+        assert_eq!(packed[1].error, CART_ERROR_NULL_ARGUMENT);
+
+        let packed_ptrs: Vec<*const i8> = packed.iter().map(|result| result.packed as *const i8).collect();
+        let packed_sizes: Vec<usize> = packed.iter().map(|result| result.packed_size as usize).collect();
+        let mut results: Vec<CartUnpackResult> = sizes.iter().map(|_| CartUnpackResult::new_err(0)).collect();
+        assert_eq!(cart_unpack_data_batch(packed_ptrs.as_ptr(), packed_sizes.as_ptr(), sizes.len(), 0, results.as_mut_ptr()), CART_NO_ERROR);
+        for (index, size) in sizes.iter().enumerate() {
+            if *size == 0 {
+                assert_eq!(results[index].error, CART_ERROR_NULL_ARGUMENT);
+            } else {
+                assert_eq!(results[index].error, CART_NO_ERROR);
+                assert_eq!(unsafe { std::slice::from_raw_parts(results[index].body, results[index].body_size as usize) }, &raw_data[0..*size]);
+            }
+        }
+        results.into_iter().for_each(|result| cart_free_unpack_result(result));
+        packed.into_iter().for_each(|result| cart_free_pack_result(result));
+    }
+
+    #[test]
+    fn round_trip_ex() {
+        // prepare an input
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut input = tempfile::NamedTempFile::new().unwrap();
+        input.write_all(raw_data).unwrap();
+        let input_path = CString::new(input.path().to_str().unwrap()).unwrap();
+
+        let mut options = cart_default_pack_options();
+        options.compression_level = CART_COMPRESSION_STORE;
+        options.compress_threads = 2;
+
+        // Encode the data with cart
+        let buffer = tempfile::NamedTempFile::new().unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), null(), &options), CART_NO_ERROR);
+
+        // Decode the cart data
+        let mut output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file(buffer_path.as_ptr(), output_path.as_ptr());
+        assert_eq!(out.error, CART_NO_ERROR);
+        let mut output_data = vec![];
+        output.as_file_mut().read_to_end(&mut output_data).unwrap();
+        assert_eq!(output_data, raw_data);
+        cart_free_unpack_result(out);
+
+        // Encode a buffer with the default options
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), null());
+        assert_eq!(packed.error, CART_NO_ERROR);
+        let out = cart_unpack_data(packed.packed as *const i8, packed.packed_size as usize);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let output_data = unsafe { std::slice::from_raw_parts(out.body, out.body_size as usize)};
+        assert_eq!(output_data, raw_data);
+        cart_free_pack_result(packed);
+        cart_free_unpack_result(out);
+
+        // Only the selected digests are written to the footer
+        options.digests = CART_DIGEST_SHA512 | CART_DIGEST_LENGTH;
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), &options);
+        assert_eq!(packed.error, CART_NO_ERROR);
+        let out = cart_get_data_footer(packed.packed as *const i8, packed.packed_size as usize);
+        assert_eq!(out.error, CART_NO_ERROR);
+        let footer: JsonMap = serde_json::from_slice(unsafe { std::slice::from_raw_parts(out.footer_json, out.footer_json_size as usize - 1) }).unwrap();
+        let mut keys: Vec<&String> = footer.keys().collect();
+        keys.sort();
+        assert_eq!(keys, vec!["length", "sha512"]);
+        cart_free_unpack_result(out);
+        let verified = cart_verify_data(packed.packed as *const i8, packed.packed_size as usize);
+        assert_eq!(verified.error, CART_NO_ERROR);
+        assert_eq!(verified.checked_digests, CART_DIGEST_SHA512 | CART_DIGEST_LENGTH);
+        cart_free_pack_result(packed);
+
+        // Bad options are refused
+        options.digests = 1 << 20;
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), &options);
+        assert_eq!(packed.error, CART_ERROR_BAD_OPTIONS);
+        options.digests = CART_DIGEST_DEFAULT;
+        options.compression_level = 100;
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), &options);
+        assert_eq!(packed.error, CART_ERROR_BAD_OPTIONS);
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), null(), &options), CART_ERROR_BAD_OPTIONS);
+
+        // A seek index can't be written with threads
+        options.compression_level = CART_COMPRESSION_STORE;
+        options.index_interval = 4096;
+        assert_eq!(cart_pack_file_ex(input_path.as_ptr(), buffer_path.as_ptr(), null(), &options), CART_ERROR_BAD_OPTIONS);
+    }
+
+    #[test]
+    fn seek_index() {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut options = cart_default_pack_options();
+        options.index_interval = 4096;
+        let packed = cart_pack_data_ex(raw_data.as_ptr() as *const i8, raw_data.len(), null(), &options);
+        assert_eq!(packed.error, CART_NO_ERROR);
+        let packed_data = unsafe { std::slice::from_raw_parts(packed.packed, packed.packed_size as usize) }.to_vec();
+        cart_free_pack_result(packed);
+
+        let mut buffer = tempfile::NamedTempFile::new().unwrap();
+        buffer.write_all(&packed_data).unwrap();
+        let buffer_path = CString::new(buffer.path().to_str().unwrap()).unwrap();
+
+        let offset = 3 * 4096 + 100;
+        let mut output_data = vec![0u8; 5000];
+        let out = cart_unpack_data_range(packed_data.as_ptr() as *const i8, packed_data.len(), offset as u64, output_data.len(), output_data.as_mut_ptr() as *mut i8);
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.body_size, 5000);
+        assert_eq!(output_data, raw_data[offset..offset + 5000]);
+        cart_free_unpack_result(out);
+
+        let mut output_data = vec![0u8; 5000];
+        let offset = raw_data.len() - 10;
+        let out = cart_unpack_file_range(buffer_path.as_ptr(), offset as u64, output_data.len(), output_data.as_mut_ptr() as *mut i8);
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert_eq!(out.body_size, 10);
+        assert_eq!(output_data[0..10], raw_data[offset..]);
+        cart_free_unpack_result(out);
+
+        // Decode the whole file on several threads
+        let mut output = tempfile::NamedTempFile::new().unwrap();
+        let output_path = CString::new(output.path().to_str().unwrap()).unwrap();
+        let out = cart_unpack_file_parallel(buffer_path.as_ptr(), output_path.as_ptr(), 4);
+        assert_eq!(out.error, CART_NO_ERROR);
+        assert!(out.footer_json_size > 0);
+        let mut output_data = vec![];
+        output.as_file_mut().read_to_end(&mut output_data).unwrap();
+        assert_eq!(output_data, raw_data);
+        cart_free_unpack_result(out);
+    }
+
     #[test]
     fn bad_input_buffer() {
         // prepare an input
@@ -782,6 +3864,46 @@ mod tests {
         assert_ne!(packed.error, CART_NO_ERROR);
     }
 
+    #[cfg(unix)]
+    #[test]
+    fn round_trip_fd() {
+        use std::io::{Seek, SeekFrom};
+        use std::os::unix::io::AsRawFd;
+
+        let raw_data = std::include_bytes!("cart.rs");
+        let header = CString::new(r#"{"name": "cart.rs"}"#).unwrap();
+        for flags in [0, CART_FD_NOCACHE] {
+            let mut input = tempfile::tempfile().unwrap();
+            input.write_all(raw_data).unwrap();
+            input.seek(SeekFrom::Start(0)).unwrap();
+            let mut packed = tempfile::tempfile().unwrap();
+            assert_eq!(cart_pack_fd(input.as_raw_fd() as isize, packed.as_raw_fd() as isize, header.as_ptr(), null(), flags), CART_NO_ERROR);
+
+            // The descriptors are left open where the data ended
+            packed.seek(SeekFrom::Start(0)).unwrap();
+            let mut output = tempfile::tempfile().unwrap();
+            let mut options = cart_default_unpack_options();
+            options.digests = CART_DIGEST_LENGTH;
+            let out = cart_unpack_fd(packed.as_raw_fd() as isize, output.as_raw_fd() as isize, &options, flags);
+            assert_eq!(out.error, CART_NO_ERROR);
+            assert_eq!(out.digests.length, raw_data.len() as u64);
+            assert!(out.header_json_size > 0);
+            cart_free_unpack_ex_result(out);
+
+            output.seek(SeekFrom::Start(0)).unwrap();
+            let mut output_data = vec![];
+            output.read_to_end(&mut output_data).unwrap();
+            assert_eq!(output_data, raw_data);
+        }
+
+        // Bad descriptors and flags are refused
+        let input = tempfile::tempfile().unwrap();
+        assert_eq!(cart_pack_fd(-1, input.as_raw_fd() as isize, null(), null(), 0), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_pack_fd(input.as_raw_fd() as isize, input.as_raw_fd() as isize, null(), null(), 1 << 10), CART_ERROR_BAD_OPTIONS);
+        assert_eq!(cart_unpack_fd(input.as_raw_fd() as isize, -1, null(), 0).error, CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_unpack_fd(input.as_raw_fd() as isize, input.as_raw_fd() as isize, null(), 0).error, CART_ERROR_PROCESSING);
+    }
+
 
     #[test]
     fn null_is_cart_calls() {
@@ -829,6 +3951,101 @@ mod tests {
         cart_get_data_metadata_only(null(), 0);
         cart_get_data_metadata_only(null(), 10000);
         cart_get_data_metadata_only(test_string.as_ptr(), 0);
+        cart_get_file_footer(null());
+        cart_get_file_metadata(null());
+        cart_get_file_metadata(test_string.as_ptr());
+        cart_get_data_footer(null(), 0);
+        cart_get_data_footer(null(), 10000);
+        cart_get_data_metadata(null(), 10000);
+        cart_get_data_metadata(test_string.as_ptr(), 0);
+        cart_get_data_decoded_size(null(), 10000, null_mut());
+        cart_get_data_decoded_size(test_string.as_ptr(), 10, null_mut());
+        cart_unpack_data_into(null(), 10000, null_mut(), 0);
+        cart_unpack_data_into(test_string.as_ptr(), 10, null_mut(), 10000);
+        cart_unpack_data_into(test_string.as_ptr(), 10, null_mut(), 0);
+        cart_unpack_data_prefix(null(), 10000, 0, null_mut());
+        cart_unpack_data_prefix(test_string.as_ptr(), 10, 10000, null_mut());
+        cart_unpack_file_prefix(null(), 0, null_mut());
+        cart_unpack_file_prefix(test_string.as_ptr(), 10000, null_mut());
+        cart_unpack_data_range(null(), 10000, 0, 0, null_mut());
+        cart_unpack_data_range(test_string.as_ptr(), 10, 0, 10000, null_mut());
+        cart_unpack_file_range(null(), 0, 0, null_mut());
+        cart_unpack_file_range(test_string.as_ptr(), 0, 10000, null_mut());
+        cart_unpack_file_parallel(null(), null(), 0);
+        cart_unpack_file_parallel(test_string.as_ptr(), null(), 0);
+        cart_get_file_metadata_raw(null(), 0);
+        cart_get_file_metadata_raw(test_string.as_ptr(), CART_METADATA_VALIDATE);
+        cart_get_data_metadata_raw(null(), 10000, 0);
+        cart_get_data_metadata_raw(test_string.as_ptr(), 0, 0);
+        cart_get_header_field(null(), null());
+        cart_get_header_field(test_string.as_ptr(), null());
+        cart_get_data_header_field(null(), 10000, test_string.as_ptr());
+        cart_get_data_header_field(test_string.as_ptr(), 10, null());
+        cart_repack_metadata(null(), null(), null(), null(), null(), null());
+        cart_repack_metadata(test_string.as_ptr(), null(), null(), null(), null(), null());
+
+        let context = cart_context_new();
+        cart_context_pack_data(null_mut(), test_string.as_ptr(), 10, null());
+        cart_context_pack_data(context, null(), 10, null());
+        cart_context_unpack_data(null_mut(), test_string.as_ptr(), 10);
+        cart_context_unpack_data(context, null(), 10);
+        cart_context_unpack_data(context, test_string.as_ptr(), 10);
+        cart_context_pack_file(null_mut(), test_string.as_ptr(), test_string.as_ptr(), null());
+        cart_context_pack_file(context, null(), null(), null());
+        cart_context_unpack_file(null_mut(), test_string.as_ptr(), test_string.as_ptr());
+        cart_context_unpack_file(context, null(), null());
+        cart_context_free(context);
+        cart_context_free(null_mut());
+
+        let paths = [null(), test_string.as_ptr()];
+        let sizes = [10, 0];
+        let mut codes = [0u32; 2];
+        cart_pack_files_batch(null(), null(), null(), 2, 0, null_mut());
+        cart_pack_files_batch(paths.as_ptr(), paths.as_ptr(), paths.as_ptr(), 2, 0, codes.as_mut_ptr());
+        cart_unpack_files_batch(null(), null(), 2, 0, null_mut());
+        cart_pack_data_batch(null(), null(), null(), 2, 0, null_mut());
+        cart_unpack_data_batch(null(), null(), 2, 0, null_mut());
+        cart_unpack_data_batch(paths.as_ptr(), sizes.as_ptr(), 0, 0, null_mut());
+
+        cart_verify_file(null());
+        cart_verify_file(test_string.as_ptr());
+        cart_verify_stream(null_mut());
+        cart_verify_data(null(), 10000);
+        cart_verify_data(test_string.as_ptr(), 0);
+
+        cart_unpack_file_ex(null(), null(), null());
+        cart_unpack_stream_ex(null_mut(), null_mut(), null());
+        cart_unpack_data_ex(null(), 10000, null());
+        cart_unpack_data_ex(test_string.as_ptr(), 0, null());
+
+        let decoder = cart_decoder_new();
+        let mut size = 0usize;
+        assert_eq!(cart_decoder_feed(null_mut(), test_string.as_ptr(), 10), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_feed(decoder, null(), 10), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_read(null_mut(), null_mut(), 0, &mut size), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_read(decoder, null_mut(), 10, &mut size), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_read(decoder, null_mut(), 0, null_mut()), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_pending(null()), 0);
+        assert_eq!(cart_decoder_header(null()).error, CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_decoder_finish(null_mut()).error, CART_ERROR_NULL_ARGUMENT);
+        cart_decoder_free(decoder);
+        cart_decoder_free(null_mut());
+
+        let mut options = cart_default_pack_options();
+        options.compression_level = 100;
+        assert_eq!(cart_encoder_new(null(), &options), null_mut());
+        assert_eq!(cart_encoder_new(test_string.as_ptr(), null()), null_mut());
+        let encoder = cart_encoder_new(null(), null());
+        assert_eq!(cart_encoder_write(null_mut(), test_string.as_ptr(), 10), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_write(encoder, null(), 10), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_read(null_mut(), null_mut(), 0, &mut size), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_read(encoder, null_mut(), 10, &mut size), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_read(encoder, null_mut(), 0, null_mut()), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_pending(null()), 0);
+        assert_eq!(cart_encoder_finish(null_mut(), null()), CART_ERROR_NULL_ARGUMENT);
+        assert_eq!(cart_encoder_finish(encoder, test_string.as_ptr()), CART_ERROR_BAD_JSON_ARGUMENT);
+        cart_encoder_free(encoder);
+        cart_encoder_free(null_mut());
     }
 
     #[test]
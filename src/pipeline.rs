@@ -0,0 +1,312 @@
+//! Multi-threaded variants of the cart encoder.
+//!
+//! Input is read on its own thread and handed out in blocks to a thread per digest
+//! and to the compression stage, which runs on the calling thread. Bounded queues
+//! between the stages keep memory use fixed, and block buffers are recycled once
+//! every stage has released them. The compression stage can itself spread deflate
+//! over a thread pool with a [ParallelDeflater].
+
+use std::collections::VecDeque;
+use std::io::{Read, Write};
+use std::sync::Arc;
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
+use std::thread::ScopedJoinHandle;
+
+use flate2::Compression;
+
+use crate::cart::{JsonMap, BLOCK_SIZE, DEFAULT_COMPRESSION_LEVEL, select_key, encode_metadata, pack_raw_header, finish_digests, pack_footer};
+use crate::cipher::CipherEncoder;
+use crate::deflate::ParallelDeflater;
+use crate::digesters::Digester;
+use crate::stats::{self, record_io, Stage};
+
+/// How many blocks can be queued for a stage before the reader has to wait for it.
+const PIPELINE_DEPTH: usize = 8;
+
+/// A shared block of input data and how many bytes of it are filled.
+type Block = (Arc<Vec<u8>>, usize);
+
+
+/// Encoding function for cart format that runs each processing stage on its own thread.
+///
+/// The output is byte for byte the same as [pack_stream](crate::cart::pack_stream)
+/// given the same arguments, but the time taken should be closer to that of the
+/// slowest stage rather than the sum of all of them.
+pub fn pack_stream_pipelined<IN: Read + Send, OUT: Write>(istream: IN, ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<()>
+{
+    pack_pipeline(istream, ostream, encode_metadata(optional_header)?, optional_footer, digesters, rc4_key_override,
+        Compression::new(DEFAULT_COMPRESSION_LEVEL), None)
+}
+
+/// Encoding function for cart format that also compresses blocks of input in parallel.
+///
+/// This works like [pack_stream_pipelined] except the body is deflated in independent
+/// chunks on `threads` worker threads, using all available cores if zero is given.
+/// The result is still a single zlib stream readable by any cart decoder, but the
+/// bytes will not match what the single threaded encoders produce.
+pub fn pack_stream_parallel<IN: Read + Send, OUT: Write>(istream: IN, ostream: OUT,
+    optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>, threads: usize) -> anyhow::Result<()>
+{
+    let threads = if threads == 0 {
+        std::thread::available_parallelism().map(|count| count.get()).unwrap_or(1)
+    } else {
+        threads
+    };
+    pack_pipeline(istream, ostream, encode_metadata(optional_header)?, optional_footer, digesters, rc4_key_override,
+        Compression::new(DEFAULT_COMPRESSION_LEVEL), Some(threads))
+}
+
+/// Run the encoding pipeline, using a parallel deflater if a number of compression threads is given.
+///
+/// The optional header should already be JSON encoded.
+pub (crate) fn pack_pipeline<IN: Read + Send, OUT: Write>(istream: IN, mut ostream: OUT,
+    optional_header: Option<Vec<u8>>, optional_footer: Option<JsonMap>,
+    digesters: Vec<Box<dyn Digester>>, rc4_key_override: Option<Vec<u8>>,
+    level: Compression, compress_threads: Option<usize>) -> anyhow::Result<()>
+{
+    let (rc4_key, key_override) = select_key(rc4_key_override);
+    let pos = pack_raw_header(&mut ostream, &rc4_key, key_override, optional_header)?;
+
+    // Every stage gets its own queue of blocks from the reader
+    let (compress_send, compress_recv) = sync_channel::<Block>(PIPELINE_DEPTH);
+    let mut senders = vec![compress_send];
+    let mut digest_inputs = vec![];
+    for _ in 0..digesters.len() {
+        let (send, recv) = sync_channel::<Block>(PIPELINE_DEPTH);
+        senders.push(send);
+        digest_inputs.push(recv);
+    }
+
+    // Stages on the other threads are collected along with this call
+    let call_stats = stats::current();
+    let (body_len, mut digesters) = std::thread::scope(|scope| -> anyhow::Result<_> {
+        let reader_stats = call_stats.clone();
+        let reader = scope.spawn(move || {
+            stats::attach(reader_stats);
+            read_blocks(istream, senders)
+        });
+        let workers: Vec<_> = digesters.into_iter().zip(digest_inputs)
+            .map(|(digest, input)| {
+                let digest_stats = call_stats.clone();
+                scope.spawn(move || {
+                    stats::attach(digest_stats);
+                    digest_blocks(digest, input)
+                })
+            })
+            .collect();
+
+        // Compress on this thread so the output stream never has to be moved.
+        let compressed = compress_blocks(&mut ostream, &rc4_key, compress_recv, level, compress_threads);
+        let digested: Vec<_> = workers.into_iter().map(join_stage).collect();
+        let read = join_stage(reader);
+
+        // A failing stage will cause the reader to stop early, so report
+        // errors from the other stages before the reader.
+        let body_len = compressed?;
+        let digesters = digested.into_iter().collect::<anyhow::Result<Vec<_>>>()?;
+        read?;
+        Ok((body_len, digesters))
+    })?;
+
+    let optional_footer = finish_digests(optional_footer, &mut digesters);
+    pack_footer(&mut ostream, &rc4_key, pos + body_len, optional_footer)
+}
+
+/// Read the input stream in blocks and send each one to every stage.
+fn read_blocks<IN: Read>(mut istream: IN, outputs: Vec<SyncSender<Block>>) -> anyhow::Result<()> {
+    // A block can only still be held by a stage if it is at most this many blocks old.
+    let ring_size = PIPELINE_DEPTH + 2;
+    let mut in_flight: VecDeque<Arc<Vec<u8>>> = VecDeque::with_capacity(ring_size);
+
+    loop {
+        // Reuse the oldest buffer if every stage is done with it
+        let recycled = if in_flight.len() >= ring_size {
+            in_flight.pop_front().and_then(|block| Arc::try_unwrap(block).ok())
+        } else {
+            None
+        };
+        let mut buffer = recycled.unwrap_or_else(|| vec![0u8; BLOCK_SIZE]);
+
+        // read the next block from input
+        let bytes_read = record_io(Stage::Read, || istream.read(&mut buffer))?;
+        if bytes_read == 0 {
+            return Ok(())
+        }
+
+        let block = Arc::new(buffer);
+        for output in outputs.iter() {
+            if output.send((block.clone(), bytes_read)).is_err() {
+                return Err(anyhow::anyhow!("Pipeline stage stopped before input was finished"))
+            }
+        }
+        in_flight.push_back(block);
+    }
+}
+
+/// Update a digest with every block received.
+fn digest_blocks(mut digest: Box<dyn Digester>, input: Receiver<Block>) -> anyhow::Result<Box<dyn Digester>> {
+    for (block, size) in input {
+        digest.update(&block[0..size])?;
+    }
+    return Ok(digest)
+}
+
+/// Compress and cipher every block received, returning the size of the compressed body.
+fn compress_blocks<OUT: Write>(ostream: &mut OUT, rc4_key: &Vec<u8>, input: Receiver<Block>,
+    level: Compression, threads: Option<usize>) -> anyhow::Result<u64>
+{
+    if let Some(threads) = threads {
+        let mut deflater = ParallelDeflater::new_ciphered(ostream, rc4_key, level, threads)?;
+        for (block, size) in input {
+            deflater.write(&block[0..size])?;
+        }
+        return deflater.finish()
+    }
+
+    let mut bz = CipherEncoder::new(ostream, rc4_key, level)?;
+    for (block, size) in input {
+        bz.write_all(&block[0..size])?;
+    }
+
+    // Finish any remaining data in compressor
+    return bz.finish()
+}
+
+/// Wait for a stage to finish, turning a panic into an error.
+pub (crate) fn join_stage<T>(handle: ScopedJoinHandle<'_, anyhow::Result<T>>) -> anyhow::Result<T> {
+    match handle.join() {
+        Ok(result) => result,
+        Err(_) => Err(anyhow::anyhow!("Pipeline stage panicked")),
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use std::io::Read;
+
+    use crate::cart::{JsonMap, pack_stream, unpack_stream};
+    use crate::digesters::{default_digesters, Digester, MAX_DIGEST_SIZE};
+
+    use super::{pack_stream_pipelined, pack_stream_parallel};
+
+    /// Input spanning many blocks, including a partial one at the end.
+    fn sample_input() -> Vec<u8> {
+        let raw_data = std::include_bytes!("cart.rs");
+        let mut data = vec![];
+        while data.len() < 1 << 20 {
+            data.extend_from_slice(raw_data);
+        }
+        data
+    }
+
+    /// A reader that returns data in short uneven reads.
+    struct TrickleReader<'a> {
+        data: &'a [u8],
+        step: usize,
+    }
+
+    impl<'a> Read for TrickleReader<'a> {
+        fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+            self.step = self.step % 7 + 1;
+            let size = buf.len().min(self.data.len()).min(self.step * 5000);
+            buf[0..size].copy_from_slice(&self.data[0..size]);
+            self.data = &self.data[size..];
+            Ok(size)
+        }
+    }
+
+    /// A digest that fails part way through the input.
+    struct FailingDigest {
+        remaining: usize,
+    }
+
+    impl Digester for FailingDigest {
+        fn update(&mut self, data: &[u8]) -> anyhow::Result<()> {
+            if data.len() > self.remaining {
+                return Err(anyhow::anyhow!("digest failed"))
+            }
+            self.remaining -= data.len();
+            return Ok(())
+        }
+
+        fn name(&self) -> &'static str {
+            return "fail"
+        }
+
+        fn finish_into(&mut self, _output: &mut [u8; MAX_DIGEST_SIZE]) -> usize {
+            0
+        }
+    }
+
+    #[test]
+    fn matches_pack_stream() {
+        let raw_data = sample_input();
+
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+
+        let mut expected = vec![];
+        pack_stream(TrickleReader{data: &raw_data, step: 0}, &mut expected,
+            Some(original_header.clone()), None, default_digesters(), None).unwrap();
+
+        let mut output = vec![];
+        pack_stream_pipelined(TrickleReader{data: &raw_data, step: 0}, &mut output,
+            Some(original_header.clone()), None, default_digesters(), None).unwrap();
+        assert_eq!(output, expected);
+
+        let mut decoded = vec![];
+        let (header, footer) = unpack_stream(output.as_slice(), &mut decoded, None).unwrap();
+        assert_eq!(header, Some(original_header));
+        assert_eq!(footer.unwrap().get("length"), Some(&serde_json::to_value(raw_data.len().to_string()).unwrap()));
+        assert_eq!(decoded, raw_data);
+    }
+
+    #[test]
+    fn parallel_round_trip() {
+        let raw_data = sample_input();
+        let mut doubled = raw_data.clone();
+        doubled.extend_from_slice(&raw_data);
+        doubled.extend_from_slice(&raw_data[0..12345]);
+
+        for data in [vec![], raw_data, doubled] {
+            let mut original_footer = JsonMap::new();
+            original_footer.insert("xyz".to_owned(), serde_json::to_value("999").unwrap());
+
+            let mut output = vec![];
+            pack_stream_parallel(TrickleReader{data: &data, step: 0}, &mut output,
+                None, Some(original_footer), default_digesters(), None, 3).unwrap();
+
+            let mut decoded = vec![];
+            let (header, footer) = unpack_stream(output.as_slice(), &mut decoded, None).unwrap();
+            let footer = footer.unwrap();
+            assert!(header.is_none());
+            assert_eq!(footer.get("xyz"), Some(&serde_json::to_value("999").unwrap()));
+            assert_eq!(footer.get("length"), Some(&serde_json::to_value(data.len().to_string()).unwrap()));
+            assert_eq!(decoded, data);
+        }
+    }
+
+    #[test]
+    fn empty() {
+        let mut expected = vec![];
+        pack_stream(&[][..], &mut expected, None, None, default_digesters(), None).unwrap();
+
+        let mut output = vec![];
+        pack_stream_pipelined(&[][..], &mut output, None, None, default_digesters(), None).unwrap();
+        assert_eq!(output, expected);
+    }
+
+    #[test]
+    fn digest_error() {
+        let raw_data = sample_input();
+        let mut digesters = default_digesters();
+        digesters.push(Box::new(FailingDigest{remaining: raw_data.len() / 2}));
+
+        let mut output = vec![];
+        assert!(pack_stream_pipelined(raw_data.as_slice(), &mut output, None, None, digesters, None).is_err());
+    }
+}
@@ -0,0 +1,590 @@
+//! Incremental encoding and decoding for data that arrives in pieces.
+//!
+//! Rather than pulling from a stream, a [CartEncoder] or [CartDecoder] is given data as it
+//! becomes available and holds whatever it has produced until the caller collects it.
+//! Only the header and trailing footer are buffered, the body is decoded at most a block at a time.
+
+use std::io::Write;
+
+use anyhow::Context;
+use flate2::{Decompress, FlushDecompress, Status};
+
+use crate::cart::{JsonMap, PackOptions, UnpackOptions, BLOCK_SIZE, MANDATORY_HEADER_SIZE};
+use crate::cart::{select_key, encode_metadata, pack_raw_header, finish_digests, pack_footer};
+use crate::cart::{unpack_required_header, unpack_header, unpack_trailer};
+use crate::cipher::{CipherEncoder, Rc4Stream};
+use crate::digesters::Digester;
+use crate::seek::add_index;
+
+
+/// An incremental encoder for cart data.
+///
+/// Data is given to [write](Self::write) in pieces of any size, and the encoded output is
+/// held until it is taken with [read_output](Self::read_output). The header is available
+/// as output from the start. Once all of the data has been given [finish](Self::finish)
+/// adds the footer. Output is always written on a single thread, the threading options
+/// of [PackOptions] are not used.
+pub struct CartEncoder {
+    rc4_key: Vec<u8>,
+    digesters: Vec<Box<dyn Digester>>,
+    /// The encoder, until it is finished and its output moved to `finished`
+    encoder: Option<CipherEncoder<Vec<u8>>>,
+    finished: Vec<u8>,
+    /// Everything from output_start on is yet to be read
+    output_start: usize,
+    header_len: u64,
+}
+
+impl CartEncoder {
+    /// Create an encoder, writing the header to the output right away.
+    pub fn new(optional_header: Option<JsonMap>, digesters: Vec<Box<dyn Digester>>,
+        rc4_key_override: Option<Vec<u8>>, options: &PackOptions) -> anyhow::Result<Self>
+    {
+        Self::new_raw(encode_metadata(optional_header)?, digesters, rc4_key_override, options)
+    }
+
+    /// Create an encoder with a header that is already JSON encoded.
+    ///
+    /// The header bytes are enciphered as given, see [pack_stream_raw](crate::cart::pack_stream_raw).
+    pub fn new_raw(optional_header: Option<Vec<u8>>, digesters: Vec<Box<dyn Digester>>,
+        rc4_key_override: Option<Vec<u8>>, options: &PackOptions) -> anyhow::Result<Self>
+    {
+        let (rc4_key, key_override) = select_key(rc4_key_override);
+        let mut output = Vec::with_capacity(BLOCK_SIZE);
+        let header_len = pack_raw_header(&mut output, &rc4_key, key_override, optional_header)?;
+        let encoder = CipherEncoder::new(output, &rc4_key, options.compression()?)?
+            .with_index(options.index_interval);
+        Ok(Self {
+            rc4_key,
+            digesters,
+            encoder: Some(encoder),
+            finished: vec![],
+            output_start: 0,
+            header_len,
+        })
+    }
+
+    /// Encode the next piece of data.
+    pub fn write(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        let encoder = match &mut self.encoder {
+            Some(encoder) => encoder,
+            None => return Err(anyhow::anyhow!("Encoder has already finished")),
+        };
+
+        // Make room by dropping output that has already been read
+        if self.output_start > 0 {
+            encoder.get_mut().drain(0..self.output_start);
+            self.output_start = 0;
+        }
+
+        for digest in self.digesters.iter_mut() {
+            digest.update(data)?;
+        }
+        encoder.write_all(data)?;
+        return Ok(())
+    }
+
+    /// The encoded data waiting to be read.
+    pub fn output(&self) -> &[u8] {
+        match &self.encoder {
+            Some(encoder) => &encoder.get_ref()[self.output_start..],
+            None => &self.finished[self.output_start..],
+        }
+    }
+
+    /// Mark the first bytes of the waiting output as read.
+    pub fn consume(&mut self, size: usize) {
+        let output = match &mut self.encoder {
+            Some(encoder) => encoder.get_mut(),
+            None => &mut self.finished,
+        };
+        self.output_start = (self.output_start + size).min(output.len());
+        if self.output_start == output.len() {
+            output.clear();
+            self.output_start = 0;
+        }
+    }
+
+    /// Copy out as much waiting output as fits, returning how many bytes were copied.
+    pub fn read_output(&mut self, buffer: &mut [u8]) -> usize {
+        let size = buffer.len().min(self.output().len());
+        buffer[0..size].copy_from_slice(&self.output()[0..size]);
+        self.consume(size);
+        return size
+    }
+
+    /// Complete the body and add the footer, including the digests, to the output.
+    ///
+    /// Output that hasn't been read yet is still available afterwards.
+    pub fn finish(&mut self, optional_footer: Option<JsonMap>) -> anyhow::Result<()> {
+        let mut encoder = match self.encoder.take() {
+            Some(encoder) => encoder,
+            None => return Err(anyhow::anyhow!("Encoder has already finished")),
+        };
+        let index = encoder.take_index();
+        let (body_len, mut output) = encoder.finish_output()?;
+        let optional_footer = add_index(finish_digests(optional_footer, &mut self.digesters), index);
+        pack_footer(&mut output, &self.rc4_key, self.header_len + body_len, optional_footer)?;
+        self.finished = output;
+        return Ok(())
+    }
+}
+
+
+/// Error returned by [CartDecoder::finish] when the data ended before the footer.
+#[derive(Debug)]
+pub struct DataIncomplete;
+
+impl std::fmt::Display for DataIncomplete {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Cart data ended before the footer")
+    }
+}
+
+impl std::error::Error for DataIncomplete {}
+
+/// Error returned by [CartDecoder::finish] when decoded output has to be read before the rest
+/// of the body can be decoded.
+#[derive(Debug)]
+pub struct OutputPending;
+
+impl std::fmt::Display for OutputPending {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Decoded output must be read before the decoder can finish")
+    }
+}
+
+impl std::error::Error for OutputPending {}
+
+
+/// Where a [CartDecoder] is in the cart data.
+enum DecoderState {
+    /// Collecting the header
+    Header,
+    /// Decoding the compressed body, `saved` is the key stream from the start of the last deciphered input
+    Body { rc4_key: Vec<u8>, cipher: Rc4Stream, saved: Rc4Stream },
+    /// Collecting the footers that follow the body
+    Trailer { rc4_key: Vec<u8> },
+    /// The footer has been decoded, or an error made the data unreadable
+    Done,
+}
+
+/// An incremental decoder for cart data.
+///
+/// Data is given to [feed](Self::feed) in pieces of any size. The header is available from
+/// [header](Self::header) as soon as it has been read, and decoded data is held until it
+/// is taken with [read_output](Self::read_output). Once all of the data has been given
+/// [finish](Self::finish) decodes the footer.
+///
+/// No more than [BLOCK_SIZE] of decoded data is held at once. Body data that would decode past
+/// that is kept and decoded as the output is taken, so a small piece of data that expands to
+/// much more can't make the decoder allocate it all in one call.
+pub struct CartDecoder {
+    rc4_key_override: Option<Vec<u8>>,
+    limits: UnpackOptions,
+    state: DecoderState,
+    decompress: Decompress,
+    optional_header: Option<Option<JsonMap>>,
+    /// The header or footers collected so far
+    pending: Vec<u8>,
+    /// Body data given but not yet decompressed. Everything from body_start up to deciphered
+    /// has been deciphered, deciphering started at batch_start, and the rest is still raw.
+    body: Vec<u8>,
+    body_start: usize,
+    deciphered: usize,
+    batch_start: usize,
+    /// Decoded data, of which everything from output_start on is yet to be read
+    output: Vec<u8>,
+    output_start: usize,
+    /// An error from decoding as output was taken, reported by the next call that can fail
+    error: Option<anyhow::Error>,
+}
+
+impl CartDecoder {
+    /// Create a decoder, optionally replacing the key recorded in the header.
+    pub fn new(rc4_key_override: Option<Vec<u8>>) -> Self {
+        Self {
+            rc4_key_override,
+            limits: UnpackOptions::default(),
+            state: DecoderState::Header,
+            decompress: Decompress::new(true),
+            optional_header: None,
+            pending: vec![],
+            body: vec![],
+            body_start: 0,
+            deciphered: 0,
+            batch_start: 0,
+            output: Vec::with_capacity(BLOCK_SIZE),
+            output_start: 0,
+            error: None,
+        }
+    }
+
+    /// Stop decoding with an [OutputLimitExceeded](crate::cart::OutputLimitExceeded) error if the
+    /// decoded data grows past the limits given.
+    pub fn with_limits(mut self, options: &UnpackOptions) -> Self {
+        self.limits = options.clone();
+        self
+    }
+
+    /// Decode the next piece of cart data.
+    ///
+    /// After an error the decoder refuses any further data.
+    pub fn feed(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        if let Some(err) = self.error.take() {
+            return Err(err)
+        }
+        let result = self.advance(data);
+        if result.is_err() {
+            self.state = DecoderState::Done;
+        }
+        return result
+    }
+
+    /// The optional header, once the whole header has been read.
+    pub fn header(&self) -> Option<&Option<JsonMap>> {
+        self.optional_header.as_ref()
+    }
+
+    /// True once the end of the compressed body has been decoded.
+    pub fn body_finished(&self) -> bool {
+        matches!(self.state, DecoderState::Trailer{..} | DecoderState::Done)
+    }
+
+    /// The decoded data waiting to be read.
+    pub fn output(&self) -> &[u8] {
+        &self.output[self.output_start..]
+    }
+
+    /// Mark the first bytes of the waiting output as read.
+    ///
+    /// Once all of it has been read, more of the body data already given is decoded.
+    /// An error doing so is returned by the next call to [feed](Self::feed) or [finish](Self::finish).
+    pub fn consume(&mut self, size: usize) {
+        self.output_start = (self.output_start + size).min(self.output.len());
+        if self.output_start == self.output.len() {
+            self.output.clear();
+            self.output_start = 0;
+            if let Err(err) = self.inflate() {
+                self.state = DecoderState::Done;
+                self.error = Some(err);
+            }
+        }
+    }
+
+    /// Copy out as much waiting output as fits, returning how many bytes were copied.
+    pub fn read_output(&mut self, buffer: &mut [u8]) -> usize {
+        let size = buffer.len().min(self.output().len());
+        buffer[0..size].copy_from_slice(&self.output()[0..size]);
+        self.consume(size);
+        return size
+    }
+
+    /// Check that all of the data was given and decode the optional footer.
+    ///
+    /// Body data still waiting to be decoded is decoded now, within the same limit on how
+    /// much output is held. If the output fills before the end of the body an [OutputPending]
+    /// error is returned, and finish should be called again once the output has been read.
+    /// Data that ends before the footer gives a [DataIncomplete] error. Output that hasn't
+    /// been read yet is still available afterwards.
+    pub fn finish(&mut self) -> anyhow::Result<Option<JsonMap>> {
+        if let Some(err) = self.error.take() {
+            return Err(err)
+        }
+        if let Err(err) = self.inflate() {
+            self.state = DecoderState::Done;
+            return Err(err)
+        }
+        if matches!(self.state, DecoderState::Body{..}) && self.output.len() == self.output.capacity() {
+            return Err(OutputPending.into())
+        }
+        let state = std::mem::replace(&mut self.state, DecoderState::Done);
+        match state {
+            DecoderState::Trailer { rc4_key } => unpack_trailer(&self.pending, &rc4_key),
+            DecoderState::Done => Err(anyhow::anyhow!("Decoder has already finished")),
+            _ => Err(DataIncomplete.into()),
+        }
+    }
+
+    fn advance(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        match &self.state {
+            DecoderState::Header => {
+                self.pending.extend_from_slice(data);
+                if self.pending.len() < MANDATORY_HEADER_SIZE {
+                    return Ok(())
+                }
+                let (_, opt_header_len, _) = unpack_required_header(&self.pending[..], self.rc4_key_override.clone())
+                    .context("Could not unpack header")?;
+                let header_len = (MANDATORY_HEADER_SIZE as u64).saturating_add(opt_header_len);
+                if (self.pending.len() as u64) < header_len {
+                    return Ok(())
+                }
+
+                let header_len = header_len as usize;
+                let (rc4_key, optional_header, _pos) = unpack_header(&self.pending[0..header_len], self.rc4_key_override.clone())
+                    .context("Could not unpack header")?;
+                let cipher = Rc4Stream::new(&rc4_key).context("Invalid rc4 key")?;
+                self.optional_header = Some(optional_header);
+                self.state = DecoderState::Body { rc4_key, saved: cipher.clone(), cipher };
+
+                // Anything after the header is the start of the body
+                let rest = self.pending.split_off(header_len);
+                self.pending.clear();
+                self.advance(&rest)
+            },
+            DecoderState::Body { .. } => self.decode_body(data),
+            DecoderState::Trailer { .. } => {
+                self.pending.extend_from_slice(data);
+                Ok(())
+            },
+            DecoderState::Done => Err(anyhow::anyhow!("Decoder has already finished")),
+        }
+    }
+
+    fn decode_body(&mut self, data: &[u8]) -> anyhow::Result<()> {
+        self.body.extend_from_slice(data);
+        self.inflate()
+    }
+
+    /// Decompress body data already given, stopping once the output is full.
+    fn inflate(&mut self) -> anyhow::Result<()> {
+        // Make room by dropping output that has already been read
+        if self.output_start > 0 {
+            self.output.drain(0..self.output_start);
+            self.output_start = 0;
+        }
+
+        loop {
+            let DecoderState::Body { cipher, saved, .. } = &mut self.state else {
+                return Ok(())
+            };
+
+            // Raw data is only deciphered once everything before it has been decompressed,
+            // so the end of the stream always falls within the batch deciphered last
+            if self.body_start == self.deciphered && self.deciphered < self.body.len() {
+                self.body.drain(0..self.body_start);
+                self.body_start = 0;
+                self.batch_start = 0;
+                saved.clone_from(cipher);
+                cipher.apply(&mut self.body);
+                self.deciphered = self.body.len();
+            }
+
+            if self.output.len() == self.output.capacity() {
+                break
+            }
+            let consumed = self.decompress.total_in();
+            let produced = self.decompress.total_out();
+            let output_len = self.output.len();
+            let status = self.decompress.decompress_vec(&self.body[self.body_start..self.deciphered], &mut self.output,
+                FlushDecompress::None).context("reading from compressed stream")?;
+            self.body_start += (self.decompress.total_in() - consumed) as usize;
+            if let Err(err) = self.limits.check(self.decompress.total_in(), self.decompress.total_out()) {
+                // Output past the limit is never handed out
+                self.output.truncate(output_len);
+                return Err(err.into())
+            }
+
+            if status == Status::StreamEnd {
+                // The data past the end of the body is the start of the footers, recover its raw form
+                let DecoderState::Body { rc4_key, saved, .. } = std::mem::replace(&mut self.state, DecoderState::Done) else {
+                    unreachable!()
+                };
+                let mut replay = saved;
+                replay.skip(self.body_start - self.batch_start);
+                replay.apply(&mut self.body[self.body_start..self.deciphered]);
+                self.pending.extend_from_slice(&self.body[self.body_start..]);
+                self.state = DecoderState::Trailer { rc4_key };
+                self.body = vec![];
+                self.body_start = 0;
+                self.deciphered = 0;
+                break
+            }
+
+            // With room left for output, the decompressor is waiting on more input
+            if self.decompress.total_in() == consumed && self.decompress.total_out() == produced {
+                if self.body_start < self.deciphered {
+                    return Err(anyhow::anyhow!("Corrupt cart: Compressed body could not be decoded"))
+                }
+                if self.deciphered == self.body.len() {
+                    break
+                }
+            }
+        }
+
+        if self.body_start == self.body.len() && self.body.capacity() > 4 * BLOCK_SIZE {
+            self.body = vec![];
+            self.body_start = 0;
+            self.deciphered = 0;
+        }
+        return Ok(())
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use crate::cart::{JsonMap, PackOptions, UnpackOptions, OutputLimitExceeded, BLOCK_SIZE, pack_stream, unpack_stream};
+    use crate::digesters::default_digesters;
+
+    use super::{CartDecoder, CartEncoder, DataIncomplete, OutputPending};
+
+    #[test]
+    fn encode_pieces() {
+        let raw_data = std::include_bytes!("push.rs");
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+        let mut footer = JsonMap::new();
+        footer.insert("source".to_owned(), serde_json::to_value("ring").unwrap());
+        let mut expected = vec![];
+        pack_stream(&raw_data[..], &mut expected, Some(original_header.clone()), Some(footer.clone()),
+            default_digesters(), None).unwrap();
+
+        for piece in [7, 1000, raw_data.len()] {
+            let mut encoder = CartEncoder::new(Some(original_header.clone()), default_digesters(), None,
+                &PackOptions::default()).unwrap();
+            assert!(!encoder.output().is_empty());
+            let mut output = vec![];
+            let mut buffer = [0u8; 333];
+            for data in raw_data.chunks(piece) {
+                encoder.write(data).unwrap();
+                loop {
+                    let size = encoder.read_output(&mut buffer);
+                    if size == 0 {
+                        break
+                    }
+                    output.extend_from_slice(&buffer[0..size]);
+                }
+            }
+            encoder.finish(Some(footer.clone())).unwrap();
+            output.extend_from_slice(encoder.output());
+            encoder.consume(encoder.output().len());
+            assert!(encoder.output().is_empty());
+            assert_eq!(output, expected);
+
+            assert!(encoder.write(b"more").is_err());
+            assert!(encoder.finish(None).is_err());
+        }
+
+        let options = PackOptions{compression_level: 100, ..Default::default()};
+        assert!(CartEncoder::new(None, default_digesters(), None, &options).is_err());
+    }
+
+    #[test]
+    fn decode_pieces() {
+        let raw_data = std::include_bytes!("push.rs");
+        let mut original_header = JsonMap::new();
+        original_header.insert("abc".to_owned(), serde_json::to_value("123").unwrap());
+        let mut packed = vec![];
+        pack_stream(&raw_data[..], &mut packed, Some(original_header.clone()), None, default_digesters(), None).unwrap();
+        let mut output = vec![];
+        let (_, expected_footer) = unpack_stream(packed.as_slice(), &mut output, None).unwrap();
+
+        for piece in [1, 7, 1000, packed.len()] {
+            let mut decoder = CartDecoder::new(None);
+            let mut output = vec![];
+            let mut buffer = [0u8; 333];
+            for data in packed.chunks(piece) {
+                decoder.feed(data).unwrap();
+                loop {
+                    let size = decoder.read_output(&mut buffer);
+                    if size == 0 {
+                        break
+                    }
+                    output.extend_from_slice(&buffer[0..size]);
+                }
+            }
+            assert!(decoder.body_finished());
+            assert_eq!(decoder.header(), Some(&Some(original_header.clone())));
+            assert_eq!(decoder.finish().unwrap(), expected_footer);
+            assert_eq!(output, raw_data);
+            assert!(decoder.finish().is_err());
+            assert!(decoder.feed(b"more").is_err());
+        }
+
+        // The header is available before the body
+        let mut decoder = CartDecoder::new(None);
+        decoder.feed(&packed[0..10]).unwrap();
+        assert_eq!(decoder.header(), None);
+        decoder.feed(&packed[10..100]).unwrap();
+        assert_eq!(decoder.header(), Some(&Some(original_header.clone())));
+
+        // Data that stops short can't be finished
+        decoder.feed(&packed[100..packed.len() - 10]).unwrap();
+        assert!(decoder.finish().is_err());
+
+        let mut decoder = CartDecoder::new(None);
+        decoder.feed(&packed[0..1000]).unwrap();
+        while !decoder.output().is_empty() {
+            decoder.consume(decoder.output().len());
+        }
+        let err = decoder.finish().unwrap_err();
+        assert!(err.downcast_ref::<DataIncomplete>().is_some());
+
+        let mut decoder = CartDecoder::new(None);
+        assert!(decoder.feed(&raw_data[0..100]).is_err());
+        assert!(decoder.feed(&packed).is_err());
+    }
+
+    #[test]
+    fn decode_bounded() {
+        let raw_data = vec![0u8; 64 * BLOCK_SIZE];
+        let mut packed = vec![];
+        pack_stream(raw_data.as_slice(), &mut packed, None, None, default_digesters(), None).unwrap();
+        let mut output = vec![];
+        let (_, expected_footer) = unpack_stream(packed.as_slice(), &mut output, None).unwrap();
+        assert!(packed.len() < BLOCK_SIZE);
+
+        // Only a block is decoded per call however much the data expands
+        for piece in [100, packed.len()] {
+            let mut decoder = CartDecoder::new(None);
+            let mut output = vec![];
+            for data in packed.chunks(piece) {
+                decoder.feed(data).unwrap();
+                assert!(decoder.output().len() <= BLOCK_SIZE);
+                while !decoder.output().is_empty() {
+                    output.extend_from_slice(decoder.output());
+                    decoder.consume(decoder.output().len());
+                    assert!(decoder.output().len() <= BLOCK_SIZE);
+                }
+            }
+            assert!(decoder.body_finished());
+            assert_eq!(decoder.finish().unwrap(), expected_footer);
+            assert!(output == raw_data);
+        }
+
+        // Data given while output is waiting is kept, and finishing waits for the rest to be read
+        let mut decoder = CartDecoder::new(None);
+        let mut output = vec![];
+        for data in packed.chunks(1000) {
+            decoder.feed(data).unwrap();
+            output.extend_from_slice(&decoder.output()[0..10]);
+            decoder.consume(10);
+        }
+        assert!(!decoder.body_finished());
+        let err = decoder.finish().unwrap_err();
+        assert!(err.downcast_ref::<OutputPending>().is_some());
+        assert!(decoder.output().len() <= BLOCK_SIZE);
+        while !decoder.output().is_empty() {
+            output.extend_from_slice(decoder.output());
+            decoder.consume(decoder.output().len());
+            assert!(decoder.output().len() <= BLOCK_SIZE);
+        }
+        assert_eq!(decoder.finish().unwrap(), expected_footer);
+        assert!(output == raw_data);
+
+        // Limits stop the decoding as the output is taken
+        let options = UnpackOptions { max_output_size: 4 * BLOCK_SIZE as u64, ..Default::default() };
+        let mut decoder = CartDecoder::new(None).with_limits(&options);
+        decoder.feed(&packed).unwrap();
+        let mut size = 0;
+        while !decoder.output().is_empty() {
+            size += decoder.output().len();
+            decoder.consume(decoder.output().len());
+        }
+        assert!(size <= 4 * BLOCK_SIZE);
+        let err = decoder.finish().unwrap_err();
+        assert!(err.downcast_ref::<OutputLimitExceeded>().is_some());
+        assert!(decoder.feed(b"more").is_err());
+    }
+}
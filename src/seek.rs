@@ -0,0 +1,631 @@
+//! Random access into cart data encoded with a seek index.
+//!
+//! When [PackOptions::index_interval](crate::cart::PackOptions) is set the compressor makes a
+//! full flush every interval of input. After a full flush the deflate stream is byte aligned
+//! and nothing later refers back to earlier data, so raw inflating can start there on its own.
+//! The body is still a single zlib stream under a single RC4 keystream, so readers that don't
+//! know about the index decode it as normal.
+//!
+//! Each flush point is recorded in the optional footer under [SEEK_INDEX_KEY] as a pair
+//! of the compressed offset from the start of the body and the decoded offset. Since the
+//! whole body is ciphered as one keystream the compressed offset is also how far the
+//! keystream has to be advanced to decipher from that point.
+//!
+//! The index also lets [unpack_stream_parallel] read and inflate the segments between points
+//! on several threads. The keystream can't be advanced without generating it, so finding where
+//! it stands at each point is still a single pass, but that is much cheaper than inflating.
+
+use std::io::{Read, Seek, SeekFrom};
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender};
+
+use anyhow::Context;
+use flate2::{Decompress, FlushDecompress, Status};
+use rc4::KeyInit;
+
+use crate::cart::{JsonMap, BLOCK_SIZE, LARGE_BLOCK_SIZE, unpack_header, unpack_footer_at_end, unpack_stream_seekable};
+use crate::cipher::{CipherPassthroughIn, Rc4, Rc4Stream, skip_keystream};
+use crate::deflate::{adler32, adler32_combine, MAX_DEFLATE_RATIO};
+use crate::pipeline::join_stage;
+
+
+/// The optional footer field holding the seek index.
+pub const SEEK_INDEX_KEY: &str = "seek_index";
+
+/// A point in the body where decoding can start.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct SeekPoint {
+    /// Offset from the start of the body, which is also the position in the keystream.
+    pub compressed: u64,
+    /// Offset in the decoded data.
+    pub decoded: u64,
+}
+
+/// Add a seek index to the optional footer, if one was made.
+pub (crate) fn add_index(optional_footer: Option<JsonMap>, index: Option<Vec<SeekPoint>>) -> Option<JsonMap> {
+    let index = match index {
+        Some(index) => index,
+        None => return optional_footer,
+    };
+    let points: Vec<[u64; 2]> = index.iter().map(|point| [point.compressed, point.decoded]).collect();
+    let mut footer = optional_footer.unwrap_or_default();
+    footer.insert(SEEK_INDEX_KEY.to_owned(), serde_json::json!(points));
+    Some(footer)
+}
+
+/// Read the seek index from an optional footer.
+///
+/// None is returned if there isn't one, or if it isn't well formed. The points
+/// are in order and neither offset decreases between them.
+pub fn read_index(footer: &JsonMap) -> Option<Vec<SeekPoint>> {
+    let points = footer.get(SEEK_INDEX_KEY)?.as_array()?;
+    let mut index: Vec<SeekPoint> = Vec::with_capacity(points.len());
+    for point in points {
+        let pair = point.as_array()?;
+        if pair.len() != 2 {
+            return None
+        }
+        let point = SeekPoint{compressed: pair[0].as_u64()?, decoded: pair[1].as_u64()?};
+        if let Some(last) = index.last() {
+            if point.compressed < last.compressed || point.decoded < last.decoded {
+                return None
+            }
+        }
+        index.push(point);
+    }
+    Some(index)
+}
+
+/// Decode part of the body of a seekable cart stream into a buffer provided by the caller.
+///
+/// The buffer is filled with decoded data starting from `offset`. If the footer has a seek
+/// index decoding starts from the last point at or before the offset, otherwise the body is
+/// decoded from the start and discarded up to the offset. Fewer bytes are written if the
+/// decoded data ends first. This returns how much of the buffer was filled along with the metadata.
+/// The decoded data can't be checked against the digests in the footer.
+pub fn unpack_range<IN: Read + Seek>(mut istream: IN, offset: u64, output: &mut [u8],
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(usize, Option<JsonMap>, Option<JsonMap>)>
+{
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut istream, rc4_key_override)
+        .context("Could not unpack header")?;
+    let body_start = istream.stream_position()?;
+    let (optional_footer, footer_start) = unpack_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+    let body_len = footer_start - body_start;
+
+    let point = optional_footer.as_ref()
+        .and_then(read_index)
+        .and_then(|index| index.into_iter().take_while(|point| point.decoded <= offset).last());
+
+    let mut cipher = Rc4::new_from_slice(&rc4_key).context("Invalid rc4 key")?;
+    let filled = match point {
+        Some(point) => {
+            if point.compressed > body_len {
+                return Err(anyhow::anyhow!("Corrupt cart: Seek index points past the body"))
+            }
+            skip_keystream(&mut cipher, point.compressed)?;
+            istream.seek(SeekFrom::Start(body_start + point.compressed))?;
+            let body = CipherPassthroughIn::new(istream.take(body_len - point.compressed), cipher);
+            let bz = flate2::read::DeflateDecoder::new_with_buf(body, vec![0u8; BLOCK_SIZE]);
+            read_range(bz, offset - point.decoded, output)?
+        },
+        None => {
+            istream.seek(SeekFrom::Start(body_start))?;
+            let body = CipherPassthroughIn::new(istream.take(body_len), cipher);
+            let bz = flate2::read::ZlibDecoder::new_with_buf(body, vec![0u8; BLOCK_SIZE]);
+            read_range(bz, offset, output)?
+        },
+    };
+    return Ok((filled, optional_header, optional_footer))
+}
+
+/// Discard decoded data up to the start of the range then fill the output.
+fn read_range<R: Read>(mut bz: R, skip: u64, output: &mut [u8]) -> anyhow::Result<usize> {
+    let skipped = std::io::copy(&mut bz.by_ref().take(skip), &mut std::io::sink())
+        .context("reading from compressed stream")?;
+    if skipped < skip {
+        return Ok(0)
+    }
+
+    let mut filled = 0;
+    while filled < output.len() {
+        let size = bz.read(&mut output[filled..]).context("reading from compressed stream")?;
+        if size == 0 {
+            break
+        }
+        filled += size;
+    }
+    return Ok(filled)
+}
+
+/// The marker a full flush ends with, an empty stored block.
+const FLUSH_MARKER: [u8; 4] = [0x00, 0x00, 0xff, 0xff];
+
+/// A segment of the body between two seek index points, queued for a worker to read and inflate.
+struct Segment {
+    /// Position of the segment in the body.
+    number: usize,
+    /// The range of the body holding the segment.
+    compressed: u64,
+    compressed_end: u64,
+    /// Where the decoded segment goes in the output.
+    decoded: u64,
+    /// The decoded size, None for the last segment which runs to the end of the stream.
+    decoded_len: Option<u64>,
+    /// Only the first segment starts with the zlib header.
+    zlib: bool,
+    /// The keystream positioned at the start of the segment.
+    cipher: Rc4Stream,
+}
+
+/// What a worker learned from inflating a segment.
+struct Inflated {
+    number: usize,
+    /// Adler-32 of the decoded segment.
+    adler: u32,
+    decoded_len: u64,
+    /// The zlib trailer, read from the end of the last segment.
+    trailer: Option<u32>,
+}
+
+/// Decode a seekable cart stream into a file, inflating the segments of an indexed body in parallel.
+///
+/// The body is split at the points of its seek index and each segment is inflated on one of
+/// `threads` worker threads, using all available cores if zero is given. Workers read and
+/// decipher their segments in blocks of at most a megabyte and write each decoded block
+/// straight to its place in the output file, so memory use doesn't depend on the size of
+/// the segments. The adler-32 checksums of the segments are combined to check the body as a
+/// whole. Cart data without a seek index, or a single thread, is decoded serially by
+/// [unpack_stream_seekable] instead.
+pub fn unpack_stream_parallel<IN: Read + Seek + Send>(mut istream: IN, output: &std::fs::File, threads: usize,
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<(Option<JsonMap>, Option<JsonMap>)>
+{
+    let threads = if threads == 0 {
+        std::thread::available_parallelism().map(|count| count.get()).unwrap_or(1)
+    } else {
+        threads
+    };
+
+    let (rc4_key, optional_header, _pos) = unpack_header(&mut istream, rc4_key_override.clone())
+        .context("Could not unpack header")?;
+    let body_start = istream.stream_position()?;
+    let (optional_footer, footer_start) = unpack_footer_at_end(&mut istream, &rc4_key)
+        .context("Could not unpack footer")?;
+    let body_len = footer_start - body_start;
+
+    let index = optional_footer.as_ref().and_then(read_index).unwrap_or_default();
+    if index.is_empty() || threads < 2 {
+        istream.seek(SeekFrom::Start(0))?;
+        let output = std::io::BufWriter::with_capacity(LARGE_BLOCK_SIZE, output);
+        return unpack_stream_seekable(istream, output, rc4_key_override)
+    }
+    check_index(&index, body_len)?;
+
+    let cipher = Rc4Stream::new(&rc4_key).context("Invalid rc4 key")?;
+    let body = Body { input: Mutex::new(istream), start: body_start };
+
+    // Enough segments are queued to keep every worker busy
+    let (send, recv) = sync_channel::<Segment>(threads);
+    let recv = Arc::new(Mutex::new(recv));
+    let mut inflated = std::thread::scope(|scope| -> anyhow::Result<Vec<Inflated>> {
+        let workers: Vec<_> = (0..threads).map(|_| {
+            let recv = recv.clone();
+            let body = &body;
+            scope.spawn(move || inflate_segments(recv, body, output))
+        }).collect();
+        // Once every worker has stopped the queue closes and queueing stops with it
+        drop(recv);
+
+        let queued = queue_segments(&index, body_len, cipher, send);
+        let inflated: Vec<_> = workers.into_iter().map(join_stage).collect();
+
+        // A failing worker will cause queueing to stop early, so report its error first.
+        let inflated = inflated.into_iter().collect::<anyhow::Result<Vec<_>>>()?;
+        queued?;
+        Ok(inflated.into_iter().flatten().collect())
+    })?;
+
+    // The segments are checksummed separately, so combine them in order to check the trailer
+    inflated.sort_by_key(|segment| segment.number);
+    let adler = inflated.iter()
+        .fold(1, |adler, segment| adler32_combine(adler, segment.adler, segment.decoded_len));
+    if inflated.last().and_then(|segment| segment.trailer) != Some(adler) {
+        return Err(anyhow::anyhow!("Corrupt cart: Body checksum does not match"))
+    }
+
+    return Ok((optional_header, optional_footer))
+}
+
+/// Check every segment of an index lies within the body and could inflate to the size it is given.
+///
+/// The index comes from the footer, so this keeps a corrupt one from sizing reads or
+/// allocations beyond what the body could hold.
+fn check_index(index: &[SeekPoint], body_len: u64) -> anyhow::Result<()> {
+    let mut last = SeekPoint{compressed: 0, decoded: 0};
+    for point in index {
+        if point.compressed > body_len {
+            return Err(anyhow::anyhow!("Corrupt cart: Seek index points past the body"))
+        }
+        if point.decoded - last.decoded > (point.compressed - last.compressed).saturating_mul(MAX_DEFLATE_RATIO) {
+            return Err(anyhow::anyhow!("Corrupt cart: Seek index does not match the body"))
+        }
+        last = *point;
+    }
+    return Ok(())
+}
+
+/// Queue each segment for a worker, along with the keystream advanced to where it starts.
+///
+/// The keystream can't be advanced without generating it, so this is the one serial pass
+/// over the body, but it is much cheaper than reading and inflating it.
+fn queue_segments(index: &[SeekPoint], body_len: u64, mut cipher: Rc4Stream, send: SyncSender<Segment>) -> anyhow::Result<()> {
+    let mut starts = vec![SeekPoint{compressed: 0, decoded: 0}];
+    starts.extend_from_slice(index);
+
+    for (number, point) in starts.iter().enumerate() {
+        let next = starts.get(number + 1);
+        let end = next.map_or(body_len, |next| next.compressed);
+        let segment = Segment {
+            number,
+            compressed: point.compressed,
+            compressed_end: end,
+            decoded: point.decoded,
+            decoded_len: next.map(|next| next.decoded - point.decoded),
+            zlib: number == 0,
+            cipher: cipher.clone(),
+        };
+        if send.send(segment).is_err() {
+            return Err(anyhow::anyhow!("Decoding stopped before the body was finished"))
+        }
+        cipher.skip((end - point.compressed) as usize);
+    }
+    return Ok(())
+}
+
+/// The input shared by the workers, each seeking to the part of the body it needs.
+struct Body<IN> {
+    input: Mutex<IN>,
+    /// Where the body starts in the input.
+    start: u64,
+}
+
+impl<IN: Read + Seek> Body<IN> {
+    /// Fill a buffer from a position in the body.
+    fn read_at(&self, buffer: &mut [u8], position: u64) -> anyhow::Result<()> {
+        let mut input = match self.input.lock() {
+            Ok(input) => input,
+            Err(_) => return Err(anyhow::anyhow!("Decoding worker failed")),
+        };
+        input.seek(SeekFrom::Start(self.start + position))?;
+        input.read_exact(buffer).context("reading compressed body")?;
+        return Ok(())
+    }
+}
+
+/// Inflate queued segments into their places in the output until the queue closes.
+fn inflate_segments<IN: Read + Seek>(recv: Arc<Mutex<Receiver<Segment>>>, body: &Body<IN>,
+    output: &std::fs::File) -> anyhow::Result<Vec<Inflated>>
+{
+    let mut reader = SegmentReader { data: vec![0u8; LARGE_BLOCK_SIZE], start: 0, end: 0, position: 0, tail: [0u8; 4] };
+    let mut buffer = vec![0u8; BLOCK_SIZE];
+    let mut inflated = vec![];
+    loop {
+        let segment = match recv.lock() {
+            Ok(recv) => match recv.recv() {
+                Ok(segment) => segment,
+                Err(_) => return Ok(inflated),
+            },
+            Err(_) => return Err(anyhow::anyhow!("Decoding worker failed")),
+        };
+        inflated.push(inflate_segment(segment, body, &mut reader, &mut buffer, output)?);
+    }
+}
+
+/// The deciphered part of a segment a worker holds while inflating it.
+struct SegmentReader {
+    data: Vec<u8>,
+    /// Everything from start up to end is yet to be inflated
+    start: usize,
+    end: usize,
+    /// Offset in the body of the next byte to read
+    position: u64,
+    /// The last four bytes read
+    tail: [u8; 4],
+}
+
+impl SegmentReader {
+    /// The deciphered input not yet inflated.
+    fn input(&self) -> &[u8] {
+        &self.data[self.start..self.end]
+    }
+
+    /// Read and decipher more of the segment after whatever input is left.
+    fn read_more<IN: Read + Seek>(&mut self, body: &Body<IN>, segment: &mut Segment) -> anyhow::Result<()> {
+        self.data.copy_within(self.start..self.end, 0);
+        self.end -= self.start;
+        self.start = 0;
+        let size = ((self.data.len() - self.end) as u64).min(segment.compressed_end - self.position) as usize;
+        if size == 0 {
+            return Err(anyhow::anyhow!("Corrupt cart: Could not inflate body"))
+        }
+
+        let fresh = &mut self.data[self.end..self.end + size];
+        body.read_at(fresh, self.position)?;
+        segment.cipher.apply(fresh);
+        for byte in fresh.iter().rev().take(4).rev() {
+            self.tail = [self.tail[1], self.tail[2], self.tail[3], *byte];
+        }
+        self.end += size;
+        self.position += size as u64;
+        return Ok(())
+    }
+}
+
+/// Read and inflate one segment a block at a time, writing each block to the output as it is decoded.
+///
+/// Every segment is inflated as raw deflate, so the zlib header and trailer are handled here.
+/// A segment must decode to exactly the size the index gives it. Every segment but the last
+/// must then end with the marker of a full flush, with nothing else left over, while the
+/// last must end the deflate stream followed only by the zlib trailer.
+fn inflate_segment<IN: Read + Seek>(mut segment: Segment, body: &Body<IN>, reader: &mut SegmentReader,
+    buffer: &mut [u8], output: &std::fs::File) -> anyhow::Result<Inflated>
+{
+    reader.start = 0;
+    reader.end = 0;
+    reader.position = segment.compressed;
+    reader.tail = [0u8; 4];
+    if segment.zlib {
+        reader.read_more(body, &mut segment)?;
+        let input = reader.input();
+        if input.len() < 2 || input[0] & 0x0f != 8 || input[1] & 0x20 != 0
+            || (input[0] as u16 * 256 + input[1] as u16) % 31 != 0
+        {
+            return Err(anyhow::anyhow!("Corrupt cart: Body does not start with a zlib header"))
+        }
+        reader.start += 2;
+    }
+
+    let mut bz = Decompress::new(false);
+    let mut adler = 1;
+    let mut written = 0u64;
+    let mut finished = false;
+    loop {
+        let (total_in, total_out) = (bz.total_in(), bz.total_out());
+        let status = bz.decompress(reader.input(), buffer, FlushDecompress::None)
+            .context("Corrupt cart: Could not inflate body")?;
+        reader.start += (bz.total_in() - total_in) as usize;
+        let size = (bz.total_out() - total_out) as usize;
+        if segment.decoded_len.map_or(false, |len| written + size as u64 > len) {
+            return Err(anyhow::anyhow!("Corrupt cart: Seek index does not match the body"))
+        }
+        adler = adler32(adler, &buffer[..size]);
+        write_at(output, &buffer[..size], segment.decoded + written).context("writing output")?;
+        written += size as u64;
+        if status == Status::StreamEnd {
+            finished = true;
+            break
+        }
+
+        // Once nothing more can be done with the input held, read more of the segment
+        if size == 0 && bz.total_in() == total_in {
+            if reader.position == segment.compressed_end {
+                break
+            }
+            reader.read_more(body, &mut segment)?;
+        }
+    }
+
+    let trailer = match segment.decoded_len {
+        Some(len) => {
+            // A full flush in the middle of the stream, with the point right after it
+            if finished || written != len || !reader.input().is_empty() || reader.tail != FLUSH_MARKER {
+                return Err(anyhow::anyhow!("Corrupt cart: Seek index does not match the body"))
+            }
+            None
+        },
+        None => {
+            // Only the trailer may follow the end of the deflate stream
+            let left = (reader.end - reader.start) as u64 + (segment.compressed_end - reader.position);
+            if !finished || left != 4 {
+                return Err(anyhow::anyhow!("Corrupt cart: Body does not end with the zlib stream"))
+            }
+            if reader.position < segment.compressed_end {
+                reader.read_more(body, &mut segment)?;
+            }
+            let input = reader.input();
+            Some(u32::from_be_bytes([input[0], input[1], input[2], input[3]]))
+        },
+    };
+    return Ok(Inflated{number: segment.number, adler, decoded_len: written, trailer})
+}
+
+/// Write all of a buffer at an offset in a file, without using the file's position.
+#[cfg(unix)]
+fn write_at(file: &std::fs::File, data: &[u8], offset: u64) -> std::io::Result<()> {
+    use std::os::unix::fs::FileExt;
+    file.write_all_at(data, offset)
+}
+
+/// Write all of a buffer at an offset in a file, without using the file's position.
+#[cfg(windows)]
+fn write_at(file: &std::fs::File, mut data: &[u8], mut offset: u64) -> std::io::Result<()> {
+    use std::os::windows::fs::FileExt;
+    while !data.is_empty() {
+        let written = file.seek_write(data, offset)?;
+        if written == 0 {
+            return Err(std::io::ErrorKind::WriteZero.into())
+        }
+        data = &data[written..];
+        offset += written as u64;
+    }
+    return Ok(())
+}
+
+
+#[cfg(test)]
+mod tests {
+    use crate::cart::{JsonMap, pack_stream, pack_stream_ex, repack_metadata, unpack_header, unpack_stream, PackOptions};
+    use crate::digesters::default_digesters;
+
+    use std::io::{Read, Seek, SeekFrom};
+
+    use super::{read_index, unpack_range, unpack_stream_parallel, SEEK_INDEX_KEY};
+
+    fn sample() -> Vec<u8> {
+        // Text that changes as it goes, so later parts can't be copied from earlier ones
+        let raw_data = std::include_bytes!("seek.rs");
+        let mut data = vec![];
+        for round in 0..20u8 {
+            data.extend(raw_data.iter().map(|byte| byte.wrapping_add(round)));
+        }
+        data
+    }
+
+    #[test]
+    fn indexed_range() {
+        let data = sample();
+        let interval = 10_000;
+        let options = PackOptions{index_interval: interval, ..Default::default()};
+        let mut buffer = vec![];
+        pack_stream_ex(data.as_slice(), &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+
+        // Readers that don't use the index still decode the whole body
+        let mut output = vec![];
+        let (_, footer) = unpack_stream(buffer.as_slice(), &mut output, None).unwrap();
+        assert_eq!(output, data);
+        let index = read_index(&footer.unwrap()).unwrap();
+        assert_eq!(index.len() as u64, (data.len() as u64 - 1) / interval);
+        for (number, point) in index.iter().enumerate() {
+            assert_eq!(point.decoded, (number as u64 + 1) * interval);
+        }
+
+        for (offset, length) in [(0, 100), (5, 20_000), (interval - 1, 2), (interval, 10), (3 * interval + 17, 50_000),
+            (data.len() as u64 - 10, 100), (data.len() as u64, 10), (data.len() as u64 + 10, 10)]
+        {
+            let start = (offset as usize).min(data.len());
+            let end = (start + length).min(data.len());
+            let mut output = vec![0u8; length];
+            let (filled, header, footer) = unpack_range(std::io::Cursor::new(&buffer), offset, &mut output, None).unwrap();
+            assert_eq!(&output[0..filled], &data[start..end]);
+            assert!(header.is_none());
+            assert!(footer.unwrap().contains_key(SEEK_INDEX_KEY));
+        }
+    }
+
+    #[test]
+    fn parallel() {
+        let data = sample();
+        let options = PackOptions{index_interval: 7000, ..Default::default()};
+        let mut indexed = vec![];
+        pack_stream_ex(data.as_slice(), &mut indexed, None, None, default_digesters(), None, &options).unwrap();
+        let mut plain = vec![];
+        pack_stream(data.as_slice(), &mut plain, None, None, default_digesters(), None).unwrap();
+
+        for (buffer, threads) in [(&indexed, 4), (&indexed, 1), (&plain, 4)] {
+            let mut output = tempfile::tempfile().unwrap();
+            let (_, footer) = unpack_stream_parallel(std::io::Cursor::new(buffer), &output, threads, None).unwrap();
+            assert!(footer.is_some());
+            let mut decoded = vec![];
+            output.seek(SeekFrom::Start(0)).unwrap();
+            output.read_to_end(&mut decoded).unwrap();
+            assert_eq!(decoded, data);
+        }
+
+        // An index that doesn't match the body is reported
+        let mut footer = JsonMap::new();
+        footer.insert(SEEK_INDEX_KEY.to_owned(), serde_json::json!([[100, 5000]]));
+        let mut corrupt = vec![];
+        pack_stream(data.as_slice(), &mut corrupt, None, Some(footer), default_digesters(), None).unwrap();
+        let output = tempfile::tempfile().unwrap();
+        assert!(unpack_stream_parallel(std::io::Cursor::new(&corrupt), &output, 4, None).is_err());
+
+        // As is one giving a segment more data than it could inflate to
+        let mut footer = JsonMap::new();
+        footer.insert(SEEK_INDEX_KEY.to_owned(), serde_json::json!([[100, 1u64 << 40]]));
+        let mut corrupt = vec![];
+        pack_stream(data.as_slice(), &mut corrupt, None, Some(footer), default_digesters(), None).unwrap();
+        let error = unpack_stream_parallel(std::io::Cursor::new(&corrupt), &output, 4, None).unwrap_err();
+        assert!(error.to_string().contains("Seek index does not match"));
+    }
+
+    #[test]
+    fn parallel_checksum() {
+        // Stored blocks, so a changed byte still inflates to the sizes in the index
+        let data = sample();
+        let options = PackOptions{index_interval: 7000, compression_level: 0, ..Default::default()};
+        let mut buffer = vec![];
+        pack_stream_ex(data.as_slice(), &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+        let (_, footer) = unpack_stream(buffer.as_slice(), &mut vec![], None).unwrap();
+        let index = read_index(&footer.unwrap()).unwrap();
+
+        let mut cursor = std::io::Cursor::new(&buffer);
+        unpack_header(&mut cursor, None).unwrap();
+        let body_start = cursor.stream_position().unwrap();
+        buffer[(body_start + index[1].compressed + 100) as usize] ^= 1;
+
+        for threads in [4, 1] {
+            let output = tempfile::tempfile().unwrap();
+            assert!(unpack_stream_parallel(std::io::Cursor::new(&buffer), &output, threads, None).is_err());
+        }
+    }
+
+    #[test]
+    fn parallel_large_segments() {
+        // Data that doesn't compress, with segments read over several blocks
+        let mut state = 12345u32;
+        let data: Vec<u8> = (0..3_500_000).map(|_| {
+            state = state.wrapping_mul(1103515245).wrapping_add(12345);
+            (state >> 16) as u8
+        }).collect();
+        let options = PackOptions{index_interval: 1_500_000, ..Default::default()};
+        let mut buffer = vec![];
+        pack_stream_ex(data.as_slice(), &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+
+        let mut output = tempfile::tempfile().unwrap();
+        unpack_stream_parallel(std::io::Cursor::new(&buffer), &output, 4, None).unwrap();
+        let mut decoded = vec![];
+        output.seek(SeekFrom::Start(0)).unwrap();
+        output.read_to_end(&mut decoded).unwrap();
+        assert!(decoded == data);
+    }
+
+    #[test]
+    fn parallel_misplaced_index() {
+        let data = sample();
+        let options = PackOptions{index_interval: 7000, ..Default::default()};
+        let mut buffer = vec![];
+        pack_stream_ex(data.as_slice(), &mut buffer, None, None, default_digesters(), None, &options).unwrap();
+        let (_, footer) = unpack_stream(buffer.as_slice(), &mut vec![], None).unwrap();
+        let footer = footer.unwrap();
+        let index = read_index(&footer).unwrap();
+
+        // A point that isn't right after a full flush leaves a segment with input to spare or cut short
+        for shift in [-2i64, 3] {
+            let mut points: Vec<[u64; 2]> = index.iter().map(|point| [point.compressed, point.decoded]).collect();
+            points[2][0] = (points[2][0] as i64 + shift) as u64;
+            let mut moved = footer.clone();
+            moved.insert(SEEK_INDEX_KEY.to_owned(), serde_json::json!(points));
+            let mut corrupt = vec![];
+            repack_metadata(std::io::Cursor::new(&buffer), &mut corrupt, None, Some(moved), None, None).unwrap();
+
+            let output = tempfile::tempfile().unwrap();
+            assert!(unpack_stream_parallel(std::io::Cursor::new(&corrupt), &output, 4, None).is_err());
+        }
+    }
+
+    #[test]
+    fn unindexed_range() {
+        let data = sample();
+        let mut buffer = vec![];
+        pack_stream(data.as_slice(), &mut buffer, None, None, default_digesters(), None).unwrap();
+
+        let mut output = vec![0u8; 1000];
+        let (filled, _, footer) = unpack_range(std::io::Cursor::new(&buffer), 12345, &mut output, None).unwrap();
+        assert_eq!(&output[0..filled], &data[12345..13345]);
+        assert!(read_index(&footer.unwrap()).is_none());
+
+        // The index can't be written by the threaded encoders
+        let options = PackOptions{index_interval: 1000, compress_threads: 2, ..Default::default()};
+        assert!(pack_stream_ex(data.as_slice(), &mut vec![], None, None, default_digesters(), None, &options).is_err());
+    }
+}
@@ -0,0 +1,236 @@
+//! Counters of the time and data spent in each stage of encoding and decoding.
+//!
+//! When built with the `stats` feature every stage records how long it ran and how many
+//! bytes it handled. Time spent in a stage running inside another, such as the input being
+//! read from inside the decompressor, only counts towards the inner stage, so the times of
+//! all stages add up to the time spent in all of them. Every stage adds to process wide
+//! counters, see [global], and the stages run by one call can be collected with [collect].
+//!
+//! Without the feature the stages run untimed and every counter stays at zero.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+#[cfg(feature = "stats")]
+use std::cell::{Cell, RefCell};
+#[cfg(feature = "stats")]
+use std::sync::Arc;
+
+
+/// A stage of encoding or decoding that is counted separately.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Stage {
+    /// Reading the input, or taking input that is already in memory.
+    Read,
+    Md5,
+    Sha1,
+    Sha256,
+    Sha512,
+    Length,
+    /// Compressing, counted against the bytes given to the compressor.
+    Deflate,
+    /// Decompressing, counted against the bytes produced.
+    Inflate,
+    /// Applying the RC4 keystream.
+    Cipher,
+    /// Writing the output, or handing back output held in memory.
+    Write,
+}
+
+/// The number of [Stage] variants.
+pub const STAGES: usize = 10;
+
+/// The nanoseconds spent and bytes handled in every stage, indexed by [Stage].
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Stats {
+    pub nanos: [u64; STAGES],
+    pub bytes: [u64; STAGES],
+}
+
+impl Stats {
+    pub fn nanos(&self, stage: Stage) -> u64 {
+        self.nanos[stage as usize]
+    }
+
+    pub fn bytes(&self, stage: Stage) -> u64 {
+        self.bytes[stage as usize]
+    }
+}
+
+/// Stage counters that any thread can add to.
+pub (crate) struct Counters {
+    nanos: [AtomicU64; STAGES],
+    bytes: [AtomicU64; STAGES],
+}
+
+#[allow(clippy::declare_interior_mutable_const)]
+const ZERO: AtomicU64 = AtomicU64::new(0);
+
+impl Counters {
+    const fn new() -> Self {
+        Self {
+            nanos: [ZERO; STAGES],
+            bytes: [ZERO; STAGES],
+        }
+    }
+
+    #[cfg(feature = "stats")]
+    fn add(&self, stage: Stage, nanos: u64, bytes: u64) {
+        self.nanos[stage as usize].fetch_add(nanos, Ordering::Relaxed);
+        self.bytes[stage as usize].fetch_add(bytes, Ordering::Relaxed);
+    }
+
+    fn load(&self) -> Stats {
+        let mut stats = Stats::default();
+        for index in 0..STAGES {
+            stats.nanos[index] = self.nanos[index].load(Ordering::Relaxed);
+            stats.bytes[index] = self.bytes[index].load(Ordering::Relaxed);
+        }
+        return stats
+    }
+}
+
+/// Everything recorded by this process.
+static GLOBAL: Counters = Counters::new();
+
+#[cfg(feature = "stats")]
+thread_local! {
+    /// Where the call running on this thread is being collected, if it is.
+    static SCOPE: RefCell<Option<Arc<Counters>>> = RefCell::new(None);
+    /// Time spent by the stages inside the one running on this thread.
+    static NESTED: Cell<u64> = Cell::new(0);
+}
+
+/// Get the totals recorded by every call in this process so far.
+pub fn global() -> Stats {
+    GLOBAL.load()
+}
+
+/// Collects the stages run on the calling thread, and on any threads encoding for it,
+/// from when it is created until it is finished or dropped.
+pub struct Collector {
+    #[cfg(feature = "stats")]
+    counters: Arc<Counters>,
+    #[cfg(feature = "stats")]
+    previous: Option<Arc<Counters>>,
+}
+
+/// Start collecting the stages run by a call on this thread.
+///
+/// Collectors can be nested, stages are only counted by the innermost one.
+pub fn collect() -> Collector {
+    #[cfg(feature = "stats")]
+    {
+        let counters = Arc::new(Counters::new());
+        let previous = SCOPE.with(|scope| scope.replace(Some(counters.clone())));
+        return Collector{counters, previous}
+    }
+    #[cfg(not(feature = "stats"))]
+    Collector{}
+}
+
+impl Collector {
+    /// Stop collecting and get what was recorded.
+    pub fn finish(self) -> Stats {
+        #[cfg(feature = "stats")]
+        return self.counters.load();
+        #[cfg(not(feature = "stats"))]
+        Stats::default()
+    }
+}
+
+impl Drop for Collector {
+    fn drop(&mut self) {
+        #[cfg(feature = "stats")]
+        SCOPE.with(|scope| scope.replace(self.previous.take()));
+    }
+}
+
+/// Where the call on this thread is being collected, to be passed to [attach] on the threads it starts.
+#[cfg(feature = "stats")]
+pub (crate) type Scope = Option<Arc<Counters>>;
+#[cfg(not(feature = "stats"))]
+pub (crate) type Scope = ();
+
+/// Get where the call on this thread is being collected.
+pub (crate) fn current() -> Scope {
+    #[cfg(feature = "stats")]
+    return SCOPE.with(|scope| scope.borrow().clone());
+}
+
+/// Collect the stages run on a thread started by a call into the same place as that call.
+pub (crate) fn attach(_scope: Scope) {
+    #[cfg(feature = "stats")]
+    SCOPE.with(|scope| scope.replace(_scope));
+}
+
+/// Add to the counters of a stage without timing anything, for input or output held in memory.
+#[inline(always)]
+pub (crate) fn count(_stage: Stage, _bytes: usize) {
+    #[cfg(feature = "stats")]
+    add(_stage, 0, _bytes as u64);
+}
+
+/// Run one stage of work, counting the time it takes and the bytes given.
+#[inline(always)]
+pub (crate) fn record<T>(stage: Stage, bytes: usize, work: impl FnOnce() -> T) -> T {
+    record_sized(stage, work, |_| bytes)
+}
+
+/// Run one stage of io, counting the time it takes and the bytes it reports.
+#[inline(always)]
+pub (crate) fn record_io(stage: Stage, work: impl FnOnce() -> std::io::Result<usize>) -> std::io::Result<usize> {
+    record_sized(stage, work, |result| *result.as_ref().unwrap_or(&0))
+}
+
+#[inline(always)]
+fn record_sized<T>(_stage: Stage, work: impl FnOnce() -> T, _size: impl FnOnce(&T) -> usize) -> T {
+    #[cfg(feature = "stats")]
+    {
+        let outer = NESTED.with(|nested| nested.replace(0));
+        let start = std::time::Instant::now();
+        let result = work();
+        let elapsed = start.elapsed().as_nanos() as u64;
+        let inner = NESTED.with(|nested| nested.replace(outer + elapsed));
+        add(_stage, elapsed.saturating_sub(inner), _size(&result) as u64);
+        return result
+    }
+    #[cfg(not(feature = "stats"))]
+    work()
+}
+
+#[cfg(feature = "stats")]
+fn add(stage: Stage, nanos: u64, bytes: u64) {
+    GLOBAL.add(stage, nanos, bytes);
+    SCOPE.with(|scope| {
+        if let Some(counters) = &*scope.borrow() {
+            counters.add(stage, nanos, bytes);
+        }
+    });
+}
+
+
+#[cfg(all(test, feature = "stats"))]
+mod tests {
+    use super::{collect, global, record, Stage};
+
+    #[test]
+    fn nested_stages() {
+        let before = global();
+        let collector = collect();
+        record(Stage::Inflate, 10, || {
+            std::thread::sleep(std::time::Duration::from_millis(5));
+            record(Stage::Read, 3, || std::thread::sleep(std::time::Duration::from_millis(20)));
+        });
+        let stats = collector.finish();
+
+        // The inner stage isn't counted again in the outer one
+        assert_eq!(stats.bytes(Stage::Inflate), 10);
+        assert_eq!(stats.bytes(Stage::Read), 3);
+        assert!(stats.nanos(Stage::Read) >= 20_000_000);
+        assert!(stats.nanos(Stage::Inflate) >= 5_000_000);
+        assert!(stats.nanos(Stage::Inflate) < stats.nanos(Stage::Read));
+        assert_eq!(stats.bytes(Stage::Cipher), 0);
+
+        // Other tests may be running, so the global counters only have to grow
+        assert!(global().bytes(Stage::Read) >= before.bytes(Stage::Read) + 3);
+    }
+}
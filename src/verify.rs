@@ -0,0 +1,142 @@
+//! Check cart data against the digests recorded in its footer without keeping the decoded output.
+//!
+//! The body is decoded and fed through the same [Digester] implementations used when
+//! encoding, then each digest is compared with the value stored under its name.
+
+use std::io::{Read, Seek};
+
+use anyhow::Context;
+
+use crate::cart::{JsonMap, LARGE_BLOCK_SIZE, open_body, unpack_stream};
+use crate::digesters::{Digester, DigestWriter, MAX_DIGEST_SIZE};
+
+
+/// The outcome of checking decoded data against the digests in its footer.
+#[derive(Debug, Default)]
+pub struct Verification {
+    pub optional_header: Option<JsonMap>,
+    pub optional_footer: Option<JsonMap>,
+    /// Names of the digests found in the footer that matched the decoded data.
+    pub matched: Vec<String>,
+    /// Names of the digests found in the footer that did not match the decoded data.
+    pub mismatched: Vec<String>,
+}
+
+impl Verification {
+    /// True if every digest that could be checked matched.
+    pub fn is_ok(&self) -> bool {
+        self.mismatched.is_empty()
+    }
+}
+
+/// Verify cart data read from a stream.
+///
+/// The footer is only available once the whole stream has been read,
+/// so every digest given is calculated and those found in the footer are compared.
+pub fn verify_stream<IN: Read>(istream: IN, mut digesters: Vec<Box<dyn Digester>>,
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<Verification>
+{
+    let (optional_header, optional_footer) = unpack_stream(istream,
+        DigestWriter::new(std::io::sink(), &mut digesters), rc4_key_override)?;
+    return Ok(check_digests(optional_header, optional_footer, &mut digesters))
+}
+
+/// Verify cart data read from a seekable stream.
+///
+/// The footer is read first, so only the digests that it records are calculated.
+pub fn verify_stream_seekable<IN: Read + Seek>(istream: IN, mut digesters: Vec<Box<dyn Digester>>,
+    rc4_key_override: Option<Vec<u8>>) -> anyhow::Result<Verification>
+{
+    let (optional_header, optional_footer, mut bz) = open_body(istream, rc4_key_override, LARGE_BLOCK_SIZE)?;
+    digesters.retain(|digest| {
+        optional_footer.as_ref().map_or(false, |footer| footer.contains_key(digest.name()))
+    });
+
+    let mut buffer = vec![0u8; LARGE_BLOCK_SIZE];
+    loop {
+        let size = bz.read(&mut buffer).context("reading from compressed stream")?;
+        if size == 0 {
+            break;
+        }
+        for digest in digesters.iter_mut() {
+            digest.update(&buffer[0..size])?;
+        }
+    }
+
+    return Ok(check_digests(optional_header, optional_footer, &mut digesters))
+}
+
+/// Compare the finished digests against the values stored in the footer.
+fn check_digests(optional_header: Option<JsonMap>, optional_footer: Option<JsonMap>,
+    digesters: &mut [Box<dyn Digester>]) -> Verification
+{
+    let mut verification = Verification::default();
+    if let Some(footer) = &optional_footer {
+        let mut raw = [0u8; MAX_DIGEST_SIZE];
+        for digest in digesters.iter_mut() {
+            let name = digest.name();
+            let size = digest.finish_into(&mut raw);
+            let matched = match footer.get(name) {
+                Some(serde_json::Value::String(expected)) => digest.matches(&raw[0..size], expected),
+                Some(serde_json::Value::Number(expected)) => digest.matches(&raw[0..size], &expected.to_string()),
+                Some(_) => false,
+                None => continue,
+            };
+
+            if matched {
+                verification.matched.push(name.to_owned());
+            } else {
+                verification.mismatched.push(name.to_owned());
+            }
+        }
+    }
+    verification.optional_header = optional_header;
+    verification.optional_footer = optional_footer;
+    return verification
+}
+
+
+#[cfg(test)]
+mod tests {
+    use crate::cart::{JsonMap, pack_stream};
+    use crate::digesters::default_digesters;
+
+    use super::{verify_stream, verify_stream_seekable};
+
+    #[test]
+    fn verify() {
+        let raw_data = std::include_bytes!("verify.rs");
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, None, default_digesters(), None).unwrap();
+
+        let result = verify_stream(buffer.as_slice(), default_digesters(), None).unwrap();
+        assert!(result.is_ok());
+        assert_eq!(result.matched, vec!["md5", "sha1", "sha256", "length"]);
+
+        let result = verify_stream_seekable(std::io::Cursor::new(&buffer), default_digesters(), None).unwrap();
+        assert!(result.is_ok());
+        assert_eq!(result.matched, vec!["md5", "sha1", "sha256", "length"]);
+        assert!(result.optional_header.is_none());
+    }
+
+    #[test]
+    fn mismatch() {
+        let raw_data = std::include_bytes!("verify.rs");
+
+        // Store a wrong value for one digest and leave out the others
+        let mut footer = JsonMap::new();
+        footer.insert("sha1".to_owned(), serde_json::to_value("0000").unwrap());
+        footer.insert("length".to_owned(), serde_json::to_value(raw_data.len()).unwrap());
+        let mut buffer = vec![];
+        pack_stream(&raw_data[..], &mut buffer, None, Some(footer), vec![], None).unwrap();
+
+        for result in [
+            verify_stream(buffer.as_slice(), default_digesters(), None).unwrap(),
+            verify_stream_seekable(std::io::Cursor::new(&buffer), default_digesters(), None).unwrap(),
+        ] {
+            assert!(!result.is_ok());
+            assert_eq!(result.matched, vec!["length"]);
+            assert_eq!(result.mismatched, vec!["sha1"]);
+        }
+    }
+}
@@ -0,0 +1,282 @@
+// Throughput of the c interface, without the overhead of a language binding.
+//
+// Times cart_pack_file_default, cart_unpack_file, and cart_unpack_data over
+// generated inputs of several sizes and kinds, split between one or more threads.
+// Prints a table and, with -o, writes the results as json in the same layout as
+// ../throughput.py so the two can be compared.
+//
+//     make throughput
+//     ./throughput -t 1 -t 8 -o throughput.json
+//
+// Peak RSS is for the whole process up to the end of each case, so it only grows.
+#include "cart.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MB (1 << 20)
+#define MAX_THREADS 256
+#define MAX_CALLS 1000
+
+static const struct { const char* label; size_t size; } SIZES[] = {
+    {"1KB", 1 << 10}, {"64KB", 64 << 10}, {"1MB", 1 << 20}, {"16MB", 16 << 20},
+};
+static const char* KINDS[] = {"text", "random", "zeros", "binary"};
+static const char* OPERATIONS[] = {"pack_file", "unpack_file", "unpack_data"};
+#define COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+// Everything one case needs, shared read only between its threads
+typedef struct {
+    int operation;
+    const char* input_path;
+    const char* packed_path;
+    const char* packed;
+    size_t packed_size;
+    int threads;
+    int calls;
+    double* latencies;
+} Case;
+
+typedef struct {
+    Case* test;
+    int thread;
+    int failed;
+} Worker;
+
+static double now(void) {
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + spec.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double left = *(const double*)a, right = *(const double*)b;
+    return (left > right) - (left < right);
+}
+
+static double percentile(const double* sorted, int count, double fraction) {
+    return sorted[(int)(fraction * (count - 1) + 0.5)];
+}
+
+static long peak_rss_bytes(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024L;
+#endif
+}
+
+// Read a whole file, repeating it to fill size bytes
+static int fill_from_file(const char* path, char* buffer, size_t size) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        return 0;
+    }
+    size_t filled = fread(buffer, 1, size, file);
+    fclose(file);
+    if(filled == 0) {
+        return 0;
+    }
+    for(size_t offset = filled; offset < size; offset += filled) {
+        memcpy(buffer + offset, buffer, offset + filled > size ? size - offset : filled);
+    }
+    return 1;
+}
+
+// Generate an input of the given kind, the same from one run to the next
+static char* make_input(int kind, size_t size, const char* program) {
+    char* buffer = malloc(size);
+    if(kind == 0) {
+        return fill_from_file("../../src/cart.rs", buffer, size) ? buffer : NULL;
+    } else if(kind == 1) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for(size_t offset = 0; offset < size; offset += 8) {
+            // xorshift64*
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            uint64_t value = state * 0x2545f4914f6cdd1dULL;
+            memcpy(buffer + offset, &value, size - offset < 8 ? size - offset : 8);
+        }
+    } else if(kind == 2) {
+        memset(buffer, 0, size);
+    } else {
+        // An executable, the kind of file cart is usually given
+        return fill_from_file(program, buffer, size) ? buffer : NULL;
+    }
+    return buffer;
+}
+
+static int call(Case* test, const char* output_path, double* latency) {
+    double start = now();
+    if(test->operation == 0) {
+        if(cart_pack_file_default(test->input_path, output_path, NULL) != CART_NO_ERROR) {
+            return 0;
+        }
+    } else if(test->operation == 1) {
+        CartUnpackResult result = cart_unpack_file(test->packed_path, output_path);
+        int error = result.error;
+        cart_free_unpack_result(result);
+        if(error != CART_NO_ERROR) {
+            return 0;
+        }
+    } else {
+        CartUnpackResult result = cart_unpack_data(test->packed, test->packed_size);
+        int error = result.error;
+        cart_free_unpack_result(result);
+        if(error != CART_NO_ERROR) {
+            return 0;
+        }
+    }
+    *latency = now() - start;
+    return 1;
+}
+
+// Each thread takes every nth call, and only writes to its own output file
+static void* work(void* argument) {
+    Worker* worker = argument;
+    Case* test = worker->test;
+    char output_path[64];
+    snprintf(output_path, sizeof(output_path), "./throughput-output-%d", worker->thread);
+    for(int index = worker->thread; index < test->calls; index += test->threads) {
+        if(!call(test, output_path, &test->latencies[index])) {
+            worker->failed = 1;
+            break;
+        }
+    }
+    unlink(output_path);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int threads[MAX_THREADS], thread_counts = 0;
+    size_t target = 64 * (size_t)MB;
+    const char* output_path = NULL;
+    int option;
+    while((option = getopt(argc, argv, "t:m:o:")) != -1) {
+        if(option == 't' && thread_counts < MAX_THREADS) {
+            threads[thread_counts++] = atoi(optarg);
+        } else if(option == 'm') {
+            target = atol(optarg) * (size_t)MB;
+        } else if(option == 'o') {
+            output_path = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-t threads]... [-m target MB] [-o output.json]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(thread_counts == 0) {
+        threads[thread_counts++] = 1;
+        threads[thread_counts++] = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    FILE* json = NULL;
+    if(output_path != NULL) {
+        json = fopen(output_path, "w");
+        if(json == NULL) {
+            return 2;
+        }
+        fprintf(json, "{\n  \"cpu_count\": %ld,\n  \"results\": [", sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    int first = 1;
+
+    printf("%-8s %-12s %-7s %6s %4s %10s %9s %9s %9s %8s\n",
+        "impl", "operation", "kind", "size", "thr", "MB/s", "p50 ms", "p90 ms", "p99 ms", "RSS MB");
+    for(size_t operation = 0; operation < COUNT(OPERATIONS); operation++) {
+        for(size_t kind = 0; kind < COUNT(KINDS); kind++) {
+            for(size_t size_index = 0; size_index < COUNT(SIZES); size_index++) {
+                size_t size = SIZES[size_index].size;
+                char* input = make_input(kind, size, argv[0]);
+                if(input == NULL) {
+                    return 3;
+                }
+                FILE* input_file = fopen("./throughput-input", "wb");
+                fwrite(input, 1, size, input_file);
+                fclose(input_file);
+                free(input);
+
+                if(cart_pack_file_default("./throughput-input", "./throughput-input.cart", NULL) != CART_NO_ERROR) {
+                    return 4;
+                }
+                FILE* packed_file = fopen("./throughput-input.cart", "rb");
+                fseek(packed_file, 0, SEEK_END);
+                size_t packed_size = ftell(packed_file);
+                rewind(packed_file);
+                char* packed_data = malloc(packed_size);
+                if(fread(packed_data, 1, packed_size, packed_file) != packed_size) {
+                    return 5;
+                }
+                fclose(packed_file);
+
+                size_t calls = target / size;
+                calls = calls < 5 ? 5 : calls > MAX_CALLS ? MAX_CALLS : calls;
+                for(int thread_index = 0; thread_index < thread_counts; thread_index++) {
+                    int thread_count = threads[thread_index];
+                    if(thread_count < 1 || thread_count > MAX_THREADS) {
+                        return 1;
+                    }
+                    double latencies[MAX_CALLS];
+                    Case test = {operation, "./throughput-input", "./throughput-input.cart",
+                        packed_data, packed_size, thread_count, (int)calls, latencies};
+
+                    // One call first so the timed calls don't include warming up
+                    call(&test, "./throughput-output-0", &latencies[0]);
+
+                    pthread_t handles[MAX_THREADS];
+                    Worker workers[MAX_THREADS];
+                    double start = now();
+                    for(int thread = 0; thread < thread_count; thread++) {
+                        workers[thread] = (Worker){&test, thread, 0};
+                        pthread_create(&handles[thread], NULL, work, &workers[thread]);
+                    }
+                    for(int thread = 0; thread < thread_count; thread++) {
+                        pthread_join(handles[thread], NULL);
+                        if(workers[thread].failed) {
+                            return 6;
+                        }
+                    }
+                    double elapsed = now() - start;
+
+                    qsort(latencies, calls, sizeof(double), compare_doubles);
+                    double rate = calls * (double)size / MB / elapsed;
+                    double p50 = percentile(latencies, calls, 0.5) * 1000;
+                    double p90 = percentile(latencies, calls, 0.9) * 1000;
+                    double p99 = percentile(latencies, calls, 0.99) * 1000;
+                    double max = latencies[calls - 1] * 1000;
+                    long rss = peak_rss_bytes();
+                    printf("%-8s %-12s %-7s %6s %4d %10.1f %9.3f %9.3f %9.3f %8.1f\n",
+                        "c", OPERATIONS[operation], KINDS[kind], SIZES[size_index].label, thread_count,
+                        rate, p50, p90, p99, rss / (double)MB);
+                    fflush(stdout);
+
+                    if(json != NULL) {
+                        fprintf(json, "%s\n    {\"implementation\": \"c\", \"operation\": \"%s\", \"kind\": \"%s\", "
+                            "\"size\": %zu, \"threads\": %d, \"calls\": %zu, \"seconds\": %f, \"mb_per_second\": %f, "
+                            "\"latency_ms\": {\"p50\": %f, \"p90\": %f, \"p99\": %f, \"max\": %f}, "
+                            "\"packed_size\": %zu, \"peak_rss_bytes\": %ld}",
+                            first ? "" : ",", OPERATIONS[operation], KINDS[kind], size, thread_count, calls,
+                            elapsed, rate, p50, p90, p99, max, packed_size, rss);
+                        first = 0;
+                    }
+                }
+
+                free(packed_data);
+                unlink("./throughput-input");
+                unlink("./throughput-input.cart");
+            }
+        }
+    }
+
+    if(json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    return 0;
+}
@@ -0,0 +1,248 @@
+"""Throughput comparison between libcart and the python cart package.
+
+Times cart_pack_file_default, cart_unpack_file, and cart_unpack_data against the
+matching functions of the python reference, over a corpus of generated files of
+several sizes and kinds. Each case runs in its own process so its peak RSS can be
+reported, with one thread or a pool of threads sharing the work.
+
+    cargo build --release
+    pip install cart
+    python test/throughput.py --threads 1 4 --output throughput.json
+
+Throughput is in MB/s of decoded data, latencies are per call in milliseconds.
+The python reference is skipped if the cart package isn't installed.
+"""
+import argparse
+import ctypes
+import io
+import json
+import os
+import os.path
+import platform
+import random
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_LIBRARY = os.path.join(HERE, "../target/release/libcart.so")
+MB = 1 << 20
+
+SIZES = {"1KB": 1 << 10, "64KB": 64 << 10, "1MB": 1 << 20, "16MB": 16 << 20}
+KINDS = ["text", "random", "zeros", "binary"]
+OPERATIONS = ["pack_file", "unpack_file", "unpack_data"]
+
+
+# The same layout as in compare.py, which can't be imported without the python package
+class CartUnpackResult(ctypes.Structure):
+    _fields_ = [
+        ("error", ctypes.c_uint32),
+        ("body", ctypes.POINTER(ctypes.c_uint8)),
+        ("body_size", ctypes.c_uint64),
+        ("header_json", ctypes.POINTER(ctypes.c_uint8)),
+        ("header_json_size", ctypes.c_uint64),
+        ("footer_json", ctypes.POINTER(ctypes.c_uint8)),
+        ("footer_json_size", ctypes.c_uint64),
+    ]
+
+
+def load_library(path):
+    lib = ctypes.cdll.LoadLibrary(path)
+    lib.cart_pack_file_default.restype = ctypes.c_uint32
+    lib.cart_unpack_file.restype = CartUnpackResult
+    lib.cart_unpack_data.restype = CartUnpackResult
+    lib.cart_unpack_data.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+    return lib
+
+
+def make_input(kind, size):
+    """Generate an input of the given kind, repeatable between runs."""
+    if kind == "text":
+        with open(os.path.join(HERE, "../src/cart.rs"), "rb") as handle:
+            source = handle.read()
+        return (source * (size // len(source) + 1))[:size]
+    if kind == "random":
+        return random.Random(size).randbytes(size)
+    if kind == "zeros":
+        return bytes(size)
+    # An executable, the kind of file cart is usually given
+    with open(sys.executable, "rb") as handle:
+        binary = handle.read()
+    return (binary * (size // len(binary) + 1))[:size]
+
+
+class Rust:
+    name = "libcart"
+
+    def __init__(self, library):
+        self.lib = load_library(library)
+
+    def pack_file(self, input_path, output_path):
+        assert self.lib.cart_pack_file_default(input_path.encode(), output_path.encode(), None) == 0
+
+    def unpack_file(self, input_path, output_path):
+        result = self.lib.cart_unpack_file(input_path.encode(), output_path.encode())
+        assert result.error == 0, result.error
+        self.lib.cart_free_unpack_result(result)
+
+    def unpack_data(self, data):
+        result = self.lib.cart_unpack_data(data, len(data))
+        assert result.error == 0, result.error
+        self.lib.cart_free_unpack_result(result)
+
+
+class Python:
+    name = "python"
+
+    def __init__(self):
+        import cart
+        self.cart = cart
+
+    def pack_file(self, input_path, output_path):
+        self.cart.pack_file(input_path, output_path)
+
+    def unpack_file(self, input_path, output_path):
+        self.cart.unpack_file(input_path, output_path)
+
+    def unpack_data(self, data):
+        self.cart.unpack_stream(io.BytesIO(data), io.BytesIO())
+
+
+def percentile(sorted_values, fraction):
+    index = min(len(sorted_values) - 1, int(round(fraction * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def run_case(args):
+    """Time one implementation and operation on one input, in this process."""
+    implementation = Rust(args.library) if args.implementation == "libcart" else Python()
+    size = SIZES[args.size]
+    workdir = tempfile.mkdtemp()
+    input_path = os.path.join(workdir, "input")
+    packed_path = os.path.join(workdir, "input.cart")
+    with open(input_path, "wb") as handle:
+        handle.write(make_input(args.kind, size))
+    Rust(args.library).pack_file(input_path, packed_path)
+    with open(packed_path, "rb") as handle:
+        packed = handle.read()
+
+    # Enough calls to time reliably, with an output file for each thread
+    calls = max(args.min_calls, min(1000, (args.target_mb * MB) // size))
+    outputs = [os.path.join(workdir, "output-%d" % index) for index in range(args.threads)]
+
+    def call(index):
+        output_path = outputs[index % args.threads]
+        start = time.perf_counter()
+        if args.operation == "pack_file":
+            implementation.pack_file(input_path, output_path)
+        elif args.operation == "unpack_file":
+            implementation.unpack_file(packed_path, output_path)
+        else:
+            implementation.unpack_data(packed)
+        return time.perf_counter() - start
+
+    call(0)
+    start = time.perf_counter()
+    if args.threads == 1:
+        latencies = [call(index) for index in range(calls)]
+    else:
+        # Each thread only writes to its own output file
+        with ThreadPoolExecutor(args.threads) as pool:
+            latencies = list(pool.map(lambda thread: [call(thread) for _ in range(thread, calls, args.threads)],
+                                      range(args.threads)))
+        latencies = [latency for thread in latencies for latency in thread]
+    elapsed = time.perf_counter() - start
+
+    for path in outputs + [input_path, packed_path]:
+        if os.path.exists(path):
+            os.unlink(path)
+    os.rmdir(workdir)
+
+    latencies.sort()
+    # ru_maxrss is in kilobytes on linux and bytes on macOS
+    peak_rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if platform.system() != "Darwin":
+        peak_rss *= 1024
+    return {
+        "implementation": args.implementation,
+        "operation": args.operation,
+        "kind": args.kind,
+        "size": size,
+        "threads": args.threads,
+        "calls": calls,
+        "seconds": elapsed,
+        "mb_per_second": calls * size / MB / elapsed,
+        "latency_ms": {name: percentile(latencies, fraction) * 1000
+                       for name, fraction in [("p50", 0.5), ("p90", 0.9), ("p99", 0.99), ("max", 1.0)]},
+        "packed_size": len(packed),
+        "peak_rss_bytes": peak_rss,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--library", default=DEFAULT_LIBRARY, help="path to libcart.so")
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, os.cpu_count() or 1])
+    parser.add_argument("--sizes", nargs="+", default=list(SIZES), choices=list(SIZES))
+    parser.add_argument("--kinds", nargs="+", default=KINDS, choices=KINDS)
+    parser.add_argument("--operations", nargs="+", default=OPERATIONS, choices=OPERATIONS)
+    parser.add_argument("--target-mb", type=int, default=64, help="data to process in each case")
+    parser.add_argument("--min-calls", type=int, default=5)
+    parser.add_argument("--output", help="write the results as json to this path")
+    # Used to run a single case in a child process
+    parser.add_argument("--case", action="store_true", help=argparse.SUPPRESS)
+    parser.add_argument("--implementation", help=argparse.SUPPRESS)
+    parser.add_argument("--operation", help=argparse.SUPPRESS)
+    parser.add_argument("--kind", help=argparse.SUPPRESS)
+    parser.add_argument("--size", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.case:
+        args.threads = args.threads[0]
+        json.dump(run_case(args), sys.stdout)
+        return
+
+    implementations = ["libcart"]
+    try:
+        import cart  # noqa: F401
+        implementations.append("python")
+    except ImportError:
+        print("python cart package not installed, skipping the reference", file=sys.stderr)
+
+    results = []
+    print("%-8s %-12s %-7s %6s %4s %10s %9s %9s %9s %8s" % (
+        "impl", "operation", "kind", "size", "thr", "MB/s", "p50 ms", "p90 ms", "p99 ms", "RSS MB"))
+    for operation in args.operations:
+        for kind in args.kinds:
+            for size in args.sizes:
+                for threads in args.threads:
+                    for implementation in implementations:
+                        command = [sys.executable, os.path.abspath(__file__), "--case",
+                                   "--library", args.library, "--threads", str(threads),
+                                   "--implementation", implementation, "--operation", operation,
+                                   "--kind", kind, "--size", size, "--target-mb", str(args.target_mb),
+                                   "--min-calls", str(args.min_calls)]
+                        result = json.loads(subprocess.run(command, check=True, stdout=subprocess.PIPE,
+                                                           cwd=HERE).stdout)
+                        results.append(result)
+                        latency = result["latency_ms"]
+                        print("%-8s %-12s %-7s %6s %4d %10.1f %9.3f %9.3f %9.3f %8.1f" % (
+                            implementation, operation, kind, size, threads, result["mb_per_second"],
+                            latency["p50"], latency["p90"], latency["p99"], result["peak_rss_bytes"] / MB))
+                        sys.stdout.flush()
+
+    if args.output:
+        with open(args.output, "w") as handle:
+            json.dump({
+                "platform": platform.platform(),
+                "python": platform.python_version(),
+                "cpu_count": os.cpu_count(),
+                "results": results,
+            }, handle, indent=2)
+
+
+if __name__ == "__main__":
+    main()